@@ -1,11 +1,18 @@
 #define BUILD_sqlite -DNDEBUG
+#include "sdkconfig.h"
+#ifdef CONFIG_SQLITE_DEFAULT_PAGE_SIZE
+#define SQLITE_DEFAULT_PAGE_SIZE  CONFIG_SQLITE_DEFAULT_PAGE_SIZE
+#else
+#define SQLITE_DEFAULT_PAGE_SIZE           512
+#endif
 #define SQLITE_CORE                          1
 #define SQLITE_NO_SYNC                       1
 #define YYSTACKDEPTH                        20
 #define SQLITE_TEMP_STORE                    1
 #define SQLITE_SYSTEM_MALLOC                 1
 #define SQLITE_OS_OTHER                      1
-#define SQLITE_THREADSAFE                    0
+#define SQLITE_THREADSAFE                    2
+#define HAVE_USLEEP                          1
 #define SQLITE_MUTEX_APPDEF                  1
 #define SQLITE_SECURE_DELETE                 0
 #define SQLITE_SMALL_STACK                   1
@@ -17,14 +24,18 @@
 #define SQLITE_DEFAULT_CACHE_SIZE           -1
 #define SQLITE_DEFAULT_FOREIGN_KEYS          0
 #define SQLITE_DEFAULT_MEMSTATUS             0
-#define SQLITE_DEFAULT_MMAP_SIZE             0
+#define SQLITE_DEFAULT_MMAP_SIZE       1048576
+#define SQLITE_MAX_MMAP_SIZE          16777216
 #define SQLITE_DEFAULT_LOCKING_MODE          1
 #define SQLITE_DEFAULT_LOOKASIDE       64,64
-#define SQLITE_DEFAULT_PAGE_SIZE          512
 #define SQLITE_DEFAULT_PCACHE_INITSZ         8
-#define SQLITE_MAX_DEFAULT_PAGE_SIZE     512
+#define SQLITE_MAX_DEFAULT_PAGE_SIZE    8192
 #define SQLITE_POWERSAFE_OVERWRITE           1
+#ifdef CONFIG_SQLITE_SORTER_PMASZ
+#define SQLITE_SORTER_PMASZ       CONFIG_SQLITE_SORTER_PMASZ
+#else
 #define SQLITE_SORTER_PMASZ                  4
+#endif
 #define SQLITE_MAX_EXPR_DEPTH                0
 #undef SQLITE_OMIT_ALTERTABLE
 #undef SQLITE_OMIT_ANALYZE
@@ -42,7 +53,7 @@
 #define SQLITE_OMIT_CAST                     1
 #define SQLITE_OMIT_CHECK                    1
 #define SQLITE_OMIT_COMPILEOPTION_DIAGS      1
-#define SQLITE_OMIT_COMPOUND_SELECT          1
+#undef SQLITE_OMIT_COMPOUND_SELECT
 #define SQLITE_OMIT_CONFLICT_CLAUSE          1
 #undef SQLITE_OMIT_CTE
 #define SQLITE_OMIT_DECLTYPE                 1
@@ -70,7 +81,7 @@
 #define SQLITE_OMIT_SCHEMA_VERSION_PRAGMAS   1
 #define SQLITE_OMIT_SHARED_CACHE             1
 #define SQLITE_OMIT_TCL_VARIABLE             1
-#define SQLITE_OMIT_TEMPDB                   1
+#undef SQLITE_OMIT_TEMPDB
 #define SQLITE_OMIT_TRACE                    1
 #undef SQLITE_OMIT_TRIGGER
 #define SQLITE_OMIT_TRUNCATE_OPTIMIZATION    1
@@ -78,7 +89,7 @@
 #undef SQLITE_OMIT_VACUUM
 #undef SQLITE_OMIT_VIEW
 #undef SQLITE_OMIT_VIRTUALTABLE
-#define SQLITE_OMIT_WAL                      1
+#undef SQLITE_OMIT_WAL
 #undef SQLITE_OMIT_WSD
 #define SQLITE_OMIT_XFER_OPT                 1
 #define SQLITE_PERFORMANCE_TRACE             1
@@ -19,14 +19,34 @@
 #include <rom/ets_sys.h>
 #include <sys/stat.h>
 #include <esp_random.h>
+#include <sdkconfig.h>
+#include <esp_heap_caps.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <esp_timer.h>
 #include "lfs.h"
 #include "shox96_0_2.h"
 #include "lfs_port.h"
-
- #define dbg_printf(...) printf(__VA_ARGS__)
+#include "esp32_vfs.h"
+#include "esp32_trace.h"
+#include "esp32_zip.h"
+#include "esp32_crypt.h"
+#include "esp32_chunk.h"
+#include "esp32_blob.h"
+#include "esp32_temp.h"
+#include "esp32_profile.h"
+#include "esp32_io_stats.h"
+#include "esp32_logtab.h"
 
 #define CACHEBLOCKSZ 64
+#define MIRRORREGIONSZ 4096
+#define PRELOADCHUNKSZ 65536
 #define esp32_DEFAULT_MAXNAMESIZE 100
+#ifdef CONFIG_SQLITE_VFS_CHUNK_SIZE
+#define esp32_DEFAULT_CHUNKSIZE CONFIG_SQLITE_VFS_CHUNK_SIZE
+#else
+#define esp32_DEFAULT_CHUNKSIZE 0
+#endif
 
 // From https://stackoverflow.com/questions/19758270/read-varint-from-linux-sockets#19760246
 // Encode an unsigned 64-bit varint.  Returns number of encoded bytes.
@@ -84,6 +104,23 @@ int esp32mem_Read(sqlite3_file*, void*, int, sqlite3_int64);
 int esp32mem_Write(sqlite3_file*, const void*, int, sqlite3_int64);
 int esp32mem_FileSize(sqlite3_file*, sqlite3_int64*);
 int esp32mem_Sync(sqlite3_file*, int);
+int esp32mem_Truncate(sqlite3_file*, sqlite3_int64);
+int esp32_Fetch(sqlite3_file*, sqlite3_int64, int, void**);
+int esp32_Unfetch(sqlite3_file*, sqlite3_int64, void*);
+int esp32_CurrentTimeInt64(sqlite3_vfs*, sqlite3_int64*);
+int esp32_ShmMap(sqlite3_file*, int, int, int, void volatile**);
+int esp32_ShmLock(sqlite3_file*, int, int, int);
+void esp32_ShmBarrier(sqlite3_file*);
+int esp32_ShmUnmap(sqlite3_file*, int);
+
+int esp32preload_Close(sqlite3_file*);
+int esp32preload_Read(sqlite3_file*, void*, int, sqlite3_int64);
+int esp32preload_Write(sqlite3_file*, const void*, int, sqlite3_int64);
+int esp32preload_Truncate(sqlite3_file*, sqlite3_int64);
+int esp32preload_FileSize(sqlite3_file*, sqlite3_int64*);
+int esp32preload_DeviceCharacteristics(sqlite3_file*);
+int esp32preload_Fetch(sqlite3_file*, sqlite3_int64, int, void**);
+int esp32preload_Unfetch(sqlite3_file*, sqlite3_int64, void*);
 
 typedef struct st_linkedlist {
     uint16_t blockid;
@@ -96,16 +133,72 @@ typedef struct st_filecache {
     linkedlist_t *list;
 } filecache_t, *pFileCache_t;
 
+/* PSRAM image of the database served through xFetch, filled per region */
+typedef struct st_mirror {
+    uint8_t *image;
+    uint32_t *filled;
+    uint32_t size;
+    sqlite3_int64 limit;
+    int fetch_out;
+} mirror_t;
+
+/* wal-index shared by the connections of one database, kept in memory */
+typedef struct st_shm {
+    int region_size;
+    int region_count;
+    uint8_t **regions;
+    int refs;
+    int shared[SQLITE_SHM_NLOCK];
+    struct esp32_file *exclusive[SQLITE_SHM_NLOCK];
+} shm_t;
+
+/* one littlefs handle per path, shared by every connection that opens it.
+ * littlefs does not refresh other handles of a file when one of them is
+ * synced, separate handles would go on reading blocks that were freed. The
+ * node also carries the lock state and the wal-index of a database. */
+typedef struct st_node {
+    struct st_node *next;
+    char name[esp32_DEFAULT_MAXNAMESIZE];
+    int refs;
+    lfs_file_t handle;
+    mirror_t mirror;
+    int shared_locks;
+    struct esp32_file *reserved;
+    struct esp32_file *pending;
+    int exclusive;
+    shm_t *shm;
+} node_t;
+
 typedef struct esp32_file {
     sqlite3_file base;
     lfs_file_t *fd;
+    lfs_file_t handle;
     int file_descriptor;
     filecache_t *cache;
+    node_t *node;
+    mirror_t *mirror;
+    mirror_t image;
+    int lock;
+    uint8_t shm_mapped;
+    uint16_t shm_shared;
+    uint16_t shm_exclusive;
+    int chunk_size;
+    uint16_t trace_id;
+    esp32_file_stats_t stats;
+    /* end of the last read and write, to tell sequential from random access */
+    sqlite3_int64 read_end;
+    sqlite3_int64 write_end;
     char name[esp32_DEFAULT_MAXNAMESIZE];
 } esp32_file;
 
+/* temp files are opened in the esp32_file sqlite allocated, see esp32_temp_open */
+_Static_assert(sizeof(esp32_file) >= ESP32_TEMP_FILE_SIZE, "esp32_file must hold a temp file");
+
+static uint16_t esp32_trace_ids;
+static node_t *esp32_nodes;
+
 sqlite3_vfs  esp32Vfs = {
-        1,			// iVersion
+        2,			// iVersion
         sizeof(esp32_file),	// szOsFile
         101,	// mxPathname
         NULL,			// pNext
@@ -122,11 +215,36 @@ sqlite3_vfs  esp32Vfs = {
         esp32_Randomness,	// xRandomness
         esp32_Sleep,		// xSleep
         esp32_CurrentTime,	// xCurrentTime
-        0			// xGetLastError
+        0,			// xGetLastError
+        esp32_CurrentTimeInt64	// xCurrentTimeInt64
+};
+
+/* same VFS, but main databases are loaded into PSRAM at open and served
+ * read-only from there; pAppData marks it */
+sqlite3_vfs  esp32PreloadVfs = {
+        2,			// iVersion
+        sizeof(esp32_file),	// szOsFile
+        101,	// mxPathname
+        NULL,			// pNext
+        "esp32-preload",	// name
+        &esp32PreloadVfs,	// pAppData
+        esp32_Open,		// xOpen
+        esp32_Delete,		// xDelete
+        esp32_Access,		// xAccess
+        esp32_FullPathname,	// xFullPathname
+        esp32_DlOpen,		// xDlOpen
+        esp32_DlError,	// xDlError
+        esp32_DlSym,		// xDlSym
+        esp32_DlClose,	// xDlClose
+        esp32_Randomness,	// xRandomness
+        esp32_Sleep,		// xSleep
+        esp32_CurrentTime,	// xCurrentTime
+        0,			// xGetLastError
+        esp32_CurrentTimeInt64	// xCurrentTimeInt64
 };
 
 const sqlite3_io_methods esp32IoMethods = {
-        1,
+        3,
         esp32_Close,
         esp32_Read,
         esp32_Write,
@@ -138,7 +256,35 @@ const sqlite3_io_methods esp32IoMethods = {
         esp32_CheckReservedLock,
         esp32_FileControl,
         esp32_SectorSize,
-        esp32_DeviceCharacteristics
+        esp32_DeviceCharacteristics,
+        esp32_ShmMap,
+        esp32_ShmLock,
+        esp32_ShmBarrier,
+        esp32_ShmUnmap,
+        esp32_Fetch,
+        esp32_Unfetch
+};
+
+const sqlite3_io_methods esp32PreloadMethods = {
+        3,
+        esp32preload_Close,
+        esp32preload_Read,
+        esp32preload_Write,
+        esp32preload_Truncate,
+        esp32mem_Sync,
+        esp32preload_FileSize,
+        esp32_Lock,
+        esp32_Unlock,
+        esp32_CheckReservedLock,
+        esp32_FileControl,
+        esp32_SectorSize,
+        esp32preload_DeviceCharacteristics,
+        0,
+        0,
+        0,
+        0,
+        esp32preload_Fetch,
+        esp32preload_Unfetch
 };
 
 const sqlite3_io_methods esp32MemMethods = {
@@ -146,7 +292,7 @@ const sqlite3_io_methods esp32MemMethods = {
         esp32mem_Close,
         esp32mem_Read,
         esp32mem_Write,
-        esp32_Truncate,
+        esp32mem_Truncate,
         esp32mem_Sync,
         esp32mem_FileSize,
         esp32_Lock,
@@ -162,10 +308,11 @@ uint32_t linkedlist_store (linkedlist_t **leaf, uint32_t offset, uint32_t len, c
     uint16_t blockid = offset/CACHEBLOCKSZ;
     linkedlist_t *block;
 
-    if (!memcmp(data, blank, CACHEBLOCKSZ))
+    block = *leaf;
+    /* zeros need no block, unless they overwrite one; data holds len bytes */
+    if ((!block || block->blockid != blockid) && !memcmp(data, blank, len))
         return len;
 
-    block = *leaf;
     if (!block || ( block->blockid != blockid ) ) {
         block = (linkedlist_t *) sqlite3_malloc ( sizeof( linkedlist_t ) );
         if (!block)
@@ -299,6 +446,217 @@ void filecache_free (pFileCache_t cache) {
     }
 }
 
+/**
+ * Make the mirror large enough for need bytes, capped by the mmap limit.
+ * The image can only move while no page is fetched out.
+ * @param file esp32 file
+ * @param need bytes that must be covered
+ * @return SQLITE_OK on success
+ */
+static int mirror_grow(esp32_file *file, uint32_t need)
+{
+    mirror_t *m = file->mirror;
+    uint32_t size, words, oldwords;
+    uint8_t *image;
+    uint32_t *filled;
+
+    if (m->fetch_out)
+        return SQLITE_BUSY;
+
+    size = m->size ? m->size * 2 : MIRRORREGIONSZ * 16;
+    if (size < need)
+        size = need;
+    size = ((size + MIRRORREGIONSZ - 1) / MIRRORREGIONSZ) * MIRRORREGIONSZ;
+    if (size > m->limit)
+        size = (uint32_t) m->limit;
+    if (size < need)
+        return SQLITE_FULL;
+
+    image = (uint8_t *) heap_caps_realloc(m->image, size, MALLOC_CAP_SPIRAM);
+    if (!image)
+        return SQLITE_NOMEM;
+    m->image = image;
+
+    oldwords = (m->size / MIRRORREGIONSZ + 31) / 32;
+    words = (size / MIRRORREGIONSZ + 31) / 32;
+    filled = (uint32_t *) sqlite3_realloc(m->filled, words * sizeof(uint32_t));
+    if (!filled)
+        return SQLITE_NOMEM;
+    memset(filled + oldwords, 0, (words - oldwords) * sizeof(uint32_t));
+    m->filled = filled;
+    m->size = size;
+
+    ESP32_TRACE_I(ESP32_TRACE_FETCH, file->trace_id, -1, size);
+    return SQLITE_OK;
+}
+
+/**
+ * Read one region from littlefs into the mirror, the part past the end of
+ * file is zeroed
+ * @param file esp32 file
+ * @param region region index
+ * @param filesize current file size
+ * @return SQLITE_OK on success
+ */
+static int mirror_fill(esp32_file *file, uint32_t region, uint32_t filesize)
+{
+    mirror_t *m = file->mirror;
+    uint32_t start = region * MIRRORREGIONSZ;
+    uint32_t len = filesize > start ? filesize - start : 0;
+
+    if (len > MIRRORREGIONSZ)
+        len = MIRRORREGIONSZ;
+    if (len) {
+        if (lfs_file_seek(&lfs_filesystem, file->fd, start, LFS_SEEK_SET) != (lfs_soff_t) start)
+            return SQLITE_IOERR_SEEK;
+        if (lfs_file_read(&lfs_filesystem, file->fd, m->image + start, len) != (lfs_ssize_t) len)
+            return SQLITE_IOERR_READ;
+    }
+    memset(m->image + start + len, 0, MIRRORREGIONSZ - len);
+    m->filled[region / 32] |= 1u << (region % 32);
+
+    ESP32_TRACE_D(ESP32_TRACE_FETCH, file->trace_id, start, len);
+    return SQLITE_OK;
+}
+
+/**
+ * Keep filled regions coherent with data written through esp32_Write
+ */
+static void mirror_update(esp32_file *file, uint32_t offset, uint32_t len, const uint8_t *data)
+{
+    mirror_t *m = file->mirror;
+    uint32_t end = offset + len, region;
+
+    if (!m->image || offset >= m->size)
+        return;
+    if (end > m->size)
+        end = m->size;
+
+    for (region = offset / MIRRORREGIONSZ; region * MIRRORREGIONSZ < end; region++) {
+        uint32_t from = region * MIRRORREGIONSZ, to = from + MIRRORREGIONSZ;
+
+        if (!(m->filled[region / 32] & (1u << (region % 32))))
+            continue;
+        if (from < offset)
+            from = offset;
+        if (to > end)
+            to = end;
+        memcpy(m->image + from, data + (from - offset), to - from);
+    }
+}
+
+/**
+ * Forget mirrored regions from offset on, they are refilled on next touch
+ */
+static void mirror_invalidate(esp32_file *file, uint32_t offset)
+{
+    mirror_t *m = file->mirror;
+    uint32_t region;
+
+    for (region = offset / MIRRORREGIONSZ; region * MIRRORREGIONSZ < m->size; region++)
+        m->filled[region / 32] &= ~(1u << (region % 32));
+}
+
+static void mirror_free(esp32_file *file)
+{
+    mirror_t *m = file->mirror;
+
+    heap_caps_free(m->image);
+    sqlite3_free(m->filled);
+    m->image = NULL;
+    m->filled = NULL;
+    m->size = 0;
+}
+
+/**
+ * Attach a file to the node of path, opening the littlefs handle when the
+ * path is not open yet. Called with the littlefs lock held.
+ * @param file esp32 file
+ * @param path file path
+ * @param open_flag littlefs open flags
+ * @return littlefs result, negative on error
+ */
+static int node_acquire(esp32_file *file, const char *path, int open_flag)
+{
+    node_t *node;
+    int rc;
+
+    for (node = esp32_nodes; node; node = node->next) {
+        if (!strcmp(node->name, path))
+            break;
+    }
+    if (!node) {
+        node = (node_t *) sqlite3_malloc(sizeof(node_t));
+        if (!node)
+            return LFS_ERR_NOMEM;
+        memset(node, 0, sizeof(node_t));
+        strncpy(node->name, path, esp32_DEFAULT_MAXNAMESIZE);
+        node->name[esp32_DEFAULT_MAXNAMESIZE-1] = '\0';
+
+        /* always read-write, a later connection may want to write */
+        rc = lfs_file_open(&lfs_filesystem, &node->handle, path, open_flag | LFS_O_RDWR);
+        if (rc < 0) {
+            sqlite3_free(node);
+            return rc;
+        }
+        node->next = esp32_nodes;
+        esp32_nodes = node;
+    }
+
+    node->refs++;
+    file->node = node;
+    file->fd = &node->handle;
+    file->mirror = &node->mirror;
+    return LFS_ERR_OK;
+}
+
+/**
+ * Detach a file from its node, the last one closes the littlefs handle.
+ * Called with the littlefs lock held.
+ * @param file esp32 file
+ * @return littlefs result of the close or sync
+ */
+static int node_release(esp32_file *file)
+{
+    node_t *node = file->node, **link;
+    int rc;
+
+    file->node = NULL;
+    if (--node->refs > 0)
+        return lfs_file_sync(&lfs_filesystem, &node->handle);
+
+    for (link = &esp32_nodes; *link != node; link = &(*link)->next)
+        ;
+    *link = node->next;
+
+    mirror_free(file);
+    rc = lfs_file_close(&lfs_filesystem, &node->handle);
+    sqlite3_free(node);
+    return rc;
+}
+
+/**
+ * Count a read of amount bytes at offset that started at start_us
+ */
+static void esp32_stats_read(esp32_file *file, sqlite3_int64 offset, int amount, int64_t start_us, int short_read)
+{
+    file->stats.reads++;
+    file->stats.short_reads += short_read;
+    file->stats.seq_reads += offset == file->read_end;
+    file->stats.read_bytes += amount;
+    file->stats.read_us += esp_timer_get_time() - start_us;
+    file->read_end = offset + amount;
+}
+
+static void esp32_stats_write(esp32_file *file, sqlite3_int64 offset, int amount, int64_t start_us)
+{
+    file->stats.writes++;
+    file->stats.seq_writes += offset == file->write_end;
+    file->stats.write_bytes += amount;
+    file->stats.write_us += esp_timer_get_time() - start_us;
+    file->write_end = offset + amount;
+}
+
 int esp32mem_Close(sqlite3_file *id)
 {
     esp32_file *file = (esp32_file*) id;
@@ -306,7 +664,7 @@ int esp32mem_Close(sqlite3_file *id)
     filecache_free(file->cache);
     sqlite3_free (file->cache);
 
-    dbg_printf("esp32mem_Close: %s OK\n", file->name);
+    ESP32_TRACE_I(ESP32_TRACE_CLOSE, file->trace_id, 0, SQLITE_OK);
     return SQLITE_OK;
 }
 
@@ -314,11 +672,13 @@ int esp32mem_Read(sqlite3_file *id, void *buffer, int amount, sqlite3_int64 offs
 {
     int32_t ofst;
     esp32_file *file = (esp32_file*) id;
+    int64_t start = esp_timer_get_time();
     ofst = (int32_t)(offset & 0x7FFFFFFF);
 
     filecache_pull (file->cache, ofst, amount, (uint8_t *) buffer);
+    esp32_stats_read(file, ofst, amount, start, 0);
 
-    dbg_printf("esp32mem_Read: %s [%d] [%d] OK\n", file->name, ofst, amount);
+    ESP32_TRACE_D(ESP32_TRACE_READ, file->trace_id, ofst, amount);
     return SQLITE_OK;
 }
 
@@ -326,41 +686,199 @@ int esp32mem_Write(sqlite3_file *id, const void *buffer, int amount, sqlite3_int
 {
     int32_t ofst;
     esp32_file *file = (esp32_file*) id;
+    int64_t start = esp_timer_get_time();
 
     ofst = (int32_t)(offset & 0x7FFFFFFF);
 
     filecache_push (file->cache, ofst, amount, (const uint8_t *) buffer);
+    esp32_stats_write(file, ofst, amount, start);
 
-    dbg_printf("esp32mem_Write: %s [%d] [%d] OK\n", file->name, ofst, amount);
+    ESP32_TRACE_D(ESP32_TRACE_WRITE, file->trace_id, ofst, amount);
     return SQLITE_OK;
 }
 
 int esp32mem_Sync(sqlite3_file *id, int flags)
 {
     esp32_file *file = (esp32_file*) id;
-    dbg_printf("esp32mem_Sync: %s OK\n", file->name);
+    ESP32_TRACE_D(ESP32_TRACE_SYNC, file->trace_id, flags, SQLITE_OK);
     return  SQLITE_OK;
 }
 
+int esp32mem_Truncate(sqlite3_file *id, sqlite3_int64 bytes)
+{
+    esp32_file *file = (esp32_file*) id;
+    uint32_t size = (uint32_t)(bytes & 0x7FFFFFFF);
+    pLinkedList_t *link = &file->cache->list, ll;
+
+    /* drop whole blocks past the new end, clear the tail of the last one */
+    while ((ll = *link) != NULL) {
+        uint32_t start = ll->blockid * CACHEBLOCKSZ;
+        if (start >= size) {
+            *link = ll->next;
+            sqlite3_free(ll);
+            continue;
+        }
+        if (start + CACHEBLOCKSZ > size)
+            memset(ll->data + (size - start), 0, start + CACHEBLOCKSZ - size);
+        link = &ll->next;
+    }
+    file->cache->size = size;
+
+    ESP32_TRACE_I(ESP32_TRACE_TRUNCATE, file->trace_id, size, SQLITE_OK);
+    return SQLITE_OK;
+}
+
 int esp32mem_FileSize(sqlite3_file *id, sqlite3_int64 *size)
 {
     esp32_file *file = (esp32_file*) id;
 
     *size = 0LL | file->cache->size;
-    dbg_printf("esp32mem_FileSize: %s [%d] OK\n", file->name, file->cache->size);
+    ESP32_TRACE_D(ESP32_TRACE_FILESIZE, file->trace_id, file->cache->size, SQLITE_OK);
     return SQLITE_OK;
 }
 
-int esp32_Open( sqlite3_vfs * vfs, const char * path, sqlite3_file * file, int flags, int * outflags )
+int esp32preload_Close(sqlite3_file *id)
 {
+    esp32_file *file = (esp32_file*) id;
+
+    mirror_free(file);
+    ESP32_TRACE_I(ESP32_TRACE_CLOSE, file->trace_id, 0, SQLITE_OK);
+    return SQLITE_OK;
+}
+
+int esp32preload_Read(sqlite3_file *id, void *buffer, int amount, sqlite3_int64 offset)
+{
+    esp32_file *file = (esp32_file*) id;
+    uint32_t ofst = (uint32_t)(offset & 0x7FFFFFFF);
+    uint32_t avail = ofst < file->mirror->size ? file->mirror->size - ofst : 0;
+    int64_t start = esp_timer_get_time();
+
+    ESP32_TRACE_D(ESP32_TRACE_READ, file->trace_id, ofst, amount);
+    if (avail >= (uint32_t) amount) {
+        memcpy(buffer, file->mirror->image + ofst, amount);
+        esp32_stats_read(file, ofst, amount, start, 0);
+        return SQLITE_OK;
+    }
+    memcpy(buffer, file->mirror->image + ofst, avail);
+    memset((uint8_t *) buffer + avail, 0, amount - avail);
+    esp32_stats_read(file, ofst, amount, start, 1);
+    return SQLITE_IOERR_SHORT_READ;
+}
+
+int esp32preload_Write(sqlite3_file *id, const void *buffer, int amount, sqlite3_int64 offset)
+{
+    return SQLITE_READONLY;
+}
+
+int esp32preload_Truncate(sqlite3_file *id, sqlite3_int64 bytes)
+{
+    return SQLITE_READONLY;
+}
+
+int esp32preload_FileSize(sqlite3_file *id, sqlite3_int64 *size)
+{
+    esp32_file *file = (esp32_file*) id;
+
+    *size = file->mirror->size;
+    return SQLITE_OK;
+}
+
+int esp32preload_DeviceCharacteristics(sqlite3_file *id)
+{
+    /* the image never changes, sqlite skips locks and journals */
+    return SQLITE_IOCAP_IMMUTABLE | SQLITE_IOCAP_POWERSAFE_OVERWRITE;
+}
+
+int esp32preload_Fetch(sqlite3_file *id, sqlite3_int64 offset, int amount, void **pp)
+{
+    esp32_file *file = (esp32_file*) id;
+    uint32_t ofst = (uint32_t)(offset & 0x7FFFFFFF);
+
+    *pp = (ofst + amount <= file->mirror->size) ? file->mirror->image + ofst : NULL;
+    return SQLITE_OK;
+}
+
+int esp32preload_Unfetch(sqlite3_file *id, sqlite3_int64 offset, void *p)
+{
+    return SQLITE_OK;
+}
+
+/**
+ * Stream a whole database into PSRAM with large sequential reads and close
+ * the littlefs file again; every later access is served from memory
+ * @param p esp32 file, zeroed
+ * @param path database path
+ * @param flags sqlite open flags
+ * @param outflags receives SQLITE_OPEN_READONLY
+ * @return SQLITE_OK on success
+ */
+static int esp32_OpenPreload(esp32_file *p, const char *path, int flags, int *outflags)
+{
+    mirror_t *m = &p->image;
+    lfs_soff_t size;
+    uint32_t done = 0;
     int rc;
+
+    rc = lfs_file_open(&lfs_filesystem, &p->handle, path, LFS_O_RDONLY);
+    if (rc < 0) {
+        ESP32_TRACE_E(ESP32_TRACE_OPEN, p->trace_id, flags, rc);
+        return SQLITE_CANTOPEN;
+    }
+
+    size = lfs_file_size(&lfs_filesystem, &p->handle);
+    m->image = size > 0 ? (uint8_t *) heap_caps_malloc(size, MALLOC_CAP_SPIRAM) : NULL;
+    if (!m->image) {
+        lfs_file_close(&lfs_filesystem, &p->handle);
+        ESP32_TRACE_E(ESP32_TRACE_OPEN, p->trace_id, flags, size);
+        return size > 0 ? SQLITE_NOMEM : SQLITE_CANTOPEN;
+    }
+
+    while (done < (uint32_t) size) {
+        lfs_size_t n = (uint32_t) size - done;
+        if (n > PRELOADCHUNKSZ)
+            n = PRELOADCHUNKSZ;
+        if (lfs_file_read(&lfs_filesystem, &p->handle, m->image + done, n) != (lfs_ssize_t) n)
+            break;
+        done += n;
+    }
+    lfs_file_close(&lfs_filesystem, &p->handle);
+    if (done != (uint32_t) size) {
+        mirror_free(p);
+        ESP32_TRACE_E(ESP32_TRACE_OPEN, p->trace_id, flags, done);
+        return SQLITE_IOERR_READ;
+    }
+
+    m->size = done;
+    m->limit = done;
+    p->base.pMethods = &esp32PreloadMethods;
+    if (outflags)
+        *outflags = SQLITE_OPEN_READONLY;
+    ESP32_TRACE_I(ESP32_TRACE_OPEN, p->trace_id, flags, done);
+    return SQLITE_OK;
+}
+
+int esp32_Open( sqlite3_vfs * vfs, const char * path, sqlite3_file * file, int flags, int * outflags )
+{
     char mode[5];
     esp32_file *p = (esp32_file*) file;
 
     int open_flag = 0;
     strcpy(mode, "r");
-    if ( path == NULL ) return SQLITE_IOERR;
-    dbg_printf("esp32_Open: 0o %s %s\n", path, mode);
+    /* sorter runs, statement journals: PSRAM first, spilled to the card */
+    if ( path == NULL ) return esp32_temp_open(vfs, file, flags, outflags);
+
+    /* "esp32-preload" VFS or file:name.db?preload=1 */
+    if( (flags&SQLITE_OPEN_MAIN_DB) &&
+        (vfs->pAppData == &esp32PreloadVfs || sqlite3_uri_boolean(path, "preload", 0)) ) {
+        memset (p, 0, sizeof(esp32_file));
+        lfs_port_lock();
+        p->trace_id = ++esp32_trace_ids & ~ESP32_TRACE_MEMFILE;
+        lfs_port_unlock();
+        p->mirror = &p->image;
+        strncpy (p->name, path, esp32_DEFAULT_MAXNAMESIZE);
+        p->name[esp32_DEFAULT_MAXNAMESIZE-1] = '\0';
+        return esp32_OpenPreload(p, path, flags, outflags);
+    }
     if( flags&SQLITE_OPEN_READONLY ){
         open_flag |= LFS_O_RDONLY;
         strcpy(mode, "r");
@@ -383,12 +901,18 @@ int esp32_Open( sqlite3_vfs * vfs, const char * path, sqlite3_file * file, int f
 
     }
 
-    dbg_printf("esp32_Open: 1o %s %s\n", path, mode);
     memset (p, 0, sizeof(esp32_file));
+    lfs_port_lock();
+    p->trace_id = ++esp32_trace_ids & ~ESP32_TRACE_MEMFILE;
+    lfs_port_unlock();
 
     strncpy (p->name, path, esp32_DEFAULT_MAXNAMESIZE);
     p->name[esp32_DEFAULT_MAXNAMESIZE-1] = '\0';
 
+    /* page by page unless configured, see CONFIG_SQLITE_VFS_CHUNK_SIZE */
+    if( flags&SQLITE_OPEN_MAIN_DB )
+        p->chunk_size = esp32_DEFAULT_CHUNKSIZE;
+
     if( flags&SQLITE_OPEN_MAIN_JOURNAL ) {
         p->fd = 0;
         p->cache = (filecache_t *) sqlite3_malloc(sizeof (filecache_t));
@@ -397,23 +921,24 @@ int esp32_Open( sqlite3_vfs * vfs, const char * path, sqlite3_file * file, int f
         memset (p->cache, 0, sizeof(filecache_t));
 
         p->base.pMethods = &esp32MemMethods;
-        dbg_printf("esp32_Open: 2o %s MEM OK\n", p->name);
+        p->trace_id |= ESP32_TRACE_MEMFILE;
+        ESP32_TRACE_I(ESP32_TRACE_OPEN, p->trace_id, flags, SQLITE_OK);
         return SQLITE_OK;
     }
 
-    dbg_printf("[SQLite3]Opening file %s, with flag %d\n", p->name, open_flag);
-    /* try to open file over littlefs */
-    p->file_descriptor = lfs_file_open(&lfs_filesystem, &lfs_file, path, open_flag);
-    /* check fd val, on error print debug message */
+    /* connections to the same file (main db, -wal) share one littlefs handle */
+    lfs_port_lock();
+    p->file_descriptor = node_acquire(p, path, open_flag);
+    lfs_port_unlock();
+    /* check fd val, on error trace it */
     if ( p->file_descriptor < 0 ) {
-        dbg_printf("[SQLite3]Cannot open file %s, err %d\n", p->name, p->file_descriptor);
+        ESP32_TRACE_E(ESP32_TRACE_OPEN, p->trace_id, flags, p->file_descriptor);
         return SQLITE_CANTOPEN;
     }
     /* set sqlite3 io methods */
     p->base.pMethods = &esp32IoMethods;
-    /* print debug message */
-    dbg_printf("[SQLite3]:File %s opened successfully,fd %d\n",
-                                                    p->name, p->file_descriptor);
+    /* trace the open, flags and littlefs result */
+    ESP32_TRACE_I(ESP32_TRACE_OPEN, p->trace_id, flags, p->file_descriptor);
     /* return ok */
     return SQLITE_OK;
 }
@@ -421,10 +946,14 @@ int esp32_Open( sqlite3_vfs * vfs, const char * path, sqlite3_file * file, int f
 int esp32_Close(sqlite3_file *id)
 {
     esp32_file *file = (esp32_file*) id;
+    int rc;
 
-
-    int rc = lfs_file_close(&lfs_filesystem, file->fd);
-    dbg_printf("esp32_Close: %s %d\n", file->name, rc);
+    lfs_port_lock();
+    esp32_ShmUnmap(id, 0);
+    esp32_Unlock(id, SQLITE_LOCK_NONE);
+    rc = node_release(file);
+    lfs_port_unlock();
+    ESP32_TRACE_I(ESP32_TRACE_CLOSE, file->trace_id, 0, rc);
     return rc ? SQLITE_IOERR_CLOSE : SQLITE_OK;
 }
 
@@ -433,37 +962,39 @@ int esp32_Read(sqlite3_file *id, void *buffer, int amount, sqlite3_int64 offset)
     size_t nRead;
     int32_t ofst, iofst;
     esp32_file *file = (esp32_file*) id;
+    int64_t start = esp_timer_get_time();
 
     iofst = (int32_t)(offset & 0x7FFFFFFF);
 
-    dbg_printf("esp32_Read: 1r %s %d %lld[%d] \n", file->name, amount, offset, iofst);
+    /* the handle is shared, seek and read must not interleave */
+    lfs_port_lock();
+    ofst = lfs_file_seek(&lfs_filesystem, file->fd, iofst, LFS_SEEK_SET);
 
-    ofst = lfs_file_seek(&lfs_filesystem, &lfs_file, iofst, LFS_SEEK_SET);
-
-    if(ofst == iofst){
-        dbg_printf("[SQLite3]File position set ok, pos %d\n", ofst);
-    }else  {
+    if(ofst != iofst){
         if (iofst != 0 ) {
-            dbg_printf("esp32_Read: 2r %d != %d FAIL\n", ofst, iofst);
+            lfs_port_unlock();
+            ESP32_TRACE_E(ESP32_TRACE_READ, file->trace_id, iofst, ofst);
             return SQLITE_IOERR_SHORT_READ /* SQLITE_IOERR_SEEK */;
         }
     }
 
-    dbg_printf("[SQLite3]Current offset %d, required amount %d\n", ofst, amount);
-
-    lfs_size_t read_size = lfs_file_read(&lfs_filesystem, &lfs_file, buffer, amount);
-    dbg_printf("[SQLite3]Readed %u bytes\n", read_size );
+    lfs_ssize_t read_size = lfs_file_read(&lfs_filesystem, file->fd, buffer, amount);
+    lfs_port_unlock();
     nRead = read_size;
+    ESP32_PROFILE_READ(amount);
+    esp32_stats_read(file, iofst, amount, start, read_size != amount);
 
     if ( (int)read_size == amount ) {
-        dbg_printf("esp32_Read: 3r %s %u %d OK\n", file->name, nRead, amount);
+        ESP32_TRACE_D(ESP32_TRACE_READ, file->trace_id, iofst, amount);
         return SQLITE_OK;
     } else if ( read_size >= 0 ) {
-        dbg_printf("esp32_Read: 3r %s %u %d FAIL\n", file->name, nRead, amount);
+        ESP32_TRACE_I(ESP32_TRACE_READ, file->trace_id, iofst, nRead);
+        /* sqlite expects the unread tail to be zero filled */
+        memset((uint8_t *) buffer + read_size, 0, amount - read_size);
         return SQLITE_IOERR_SHORT_READ;
     }
 
-    dbg_printf("esp32_Read: 4r %s FAIL\n", file->name);
+    ESP32_TRACE_E(ESP32_TRACE_READ, file->trace_id, iofst, read_size);
     return SQLITE_IOERR_READ;
 }
 
@@ -471,66 +1002,147 @@ int esp32_Write(sqlite3_file *id, const void *buffer, int amount, sqlite3_int64
 {
     size_t nWrite;
     int32_t ofst, iofst;
+    int64_t start;
     esp32_file *file = (esp32_file*) id;
 
+    /* past LFS_FILE_MAX the masked offset would overwrite the start, see esp32-chunk */
+    if (offset + amount > LFS_FILE_MAX) {
+        ESP32_TRACE_E(ESP32_TRACE_WRITE, file->trace_id, (uint32_t) (offset >> 31), amount);
+        return SQLITE_FULL;
+    }
     iofst = (int32_t)(offset & 0x7FFFFFFF);
 
-    dbg_printf("esp32_Write: 1w %s %d %lld[%d] \n", file->name, amount, offset, iofst);
-
+    start = esp_timer_get_time();
+    lfs_port_lock();
     ofst = lfs_file_seek(&lfs_filesystem,file->fd, iofst, LFS_SEEK_SET);
-    if (ofst != 0) {
+    if (ofst != iofst) {
+        lfs_port_unlock();
+        ESP32_TRACE_E(ESP32_TRACE_WRITE, file->trace_id, iofst, ofst);
         return SQLITE_IOERR_SEEK;
     }
 
     nWrite = lfs_file_write(&lfs_filesystem, file->fd, buffer, amount);
     if ( nWrite != amount ) {
-        dbg_printf("esp32_Write: 2w %s %u %d\n", file->name, nWrite, amount);
+        lfs_port_unlock();
+        ESP32_TRACE_E(ESP32_TRACE_WRITE, file->trace_id, iofst, nWrite);
         return SQLITE_IOERR_WRITE;
     }
+    mirror_update(file, iofst, amount, (const uint8_t *) buffer);
+    lfs_port_unlock();
+    ESP32_PROFILE_WRITE(amount);
+    esp32_stats_write(file, iofst, amount, start);
 
-    dbg_printf("esp32_Write: 3w %s OK\n", file->name);
+    ESP32_TRACE_D(ESP32_TRACE_WRITE, file->trace_id, iofst, amount);
     return SQLITE_OK;
 }
 
+/**
+ * Extend a file with zeros up to size, written in sector sized pieces.
+ * Only for files that asked for chunks: on littlefs a later page write
+ * into the zeros is a write inside the file, measure before using it
+ * @param file esp32 file
+ * @param size new file size, nothing is done if the file is larger already
+ * @return SQLITE_OK on success
+ */
+static int esp32_Preallocate(esp32_file *file, lfs_off_t size)
+{
+    static const uint8_t zeros[512] = { 0 };
+    lfs_soff_t end;
+    int rc = SQLITE_OK;
+
+    lfs_port_lock();
+    end = lfs_file_size(&lfs_filesystem, file->fd);
+    if (end < 0)
+        rc = SQLITE_IOERR_FSTAT;
+    else if ((lfs_off_t) end < size && lfs_file_seek(&lfs_filesystem, file->fd, end, LFS_SEEK_SET) != end)
+        rc = SQLITE_IOERR_SEEK;
+
+    while (rc == SQLITE_OK && (lfs_off_t) end < size) {
+        lfs_size_t n = size - end;
+        if (n > sizeof(zeros))
+            n = sizeof(zeros);
+        if (lfs_file_write(&lfs_filesystem, file->fd, zeros, n) != (lfs_ssize_t) n) {
+            ESP32_TRACE_E(ESP32_TRACE_PREALLOCATE, file->trace_id, end, size);
+            rc = SQLITE_IOERR_WRITE;
+        }
+        end += n;
+    }
+    lfs_port_unlock();
+
+    if (rc == SQLITE_OK)
+        ESP32_TRACE_I(ESP32_TRACE_PREALLOCATE, file->trace_id, size, SQLITE_OK);
+    return rc;
+}
+
 int esp32_Truncate(sqlite3_file *id, sqlite3_int64 bytes)
 {
+    int rc;
+    lfs_soff_t filesize;
     esp32_file *file = (esp32_file*) id;
-    //int fno = fileno(file->fd);
-    //if (fno == -1)
-    //	return SQLITE_IOERR_TRUNCATE;
-    //if (ftruncate(fno, 0))
-    //	return SQLITE_IOERR_TRUNCATE;
+    lfs_off_t size = (lfs_off_t)(bytes & 0x7FFFFFFF);
 
-    dbg_printf("esp32_Truncate:\n");
-    return SQLITE_OK;
+    /* like the unix VFS, never cut into the current chunk */
+    if (file->chunk_size > 0)
+        size = ((size + file->chunk_size - 1) / file->chunk_size) * file->chunk_size;
+
+    lfs_port_lock();
+    filesize = lfs_file_size(&lfs_filesystem, file->fd);
+    if (filesize < 0) {
+        lfs_port_unlock();
+        return SQLITE_IOERR_FSTAT;
+    }
+    if ((lfs_off_t) filesize < size) {
+        rc = esp32_Preallocate(file, size);
+        lfs_port_unlock();
+        return rc == SQLITE_OK ? SQLITE_OK : SQLITE_IOERR_TRUNCATE;
+    }
+
+    rc = lfs_file_truncate(&lfs_filesystem, file->fd, size);
+    if (file->mirror->image)
+        mirror_invalidate(file, size);
+    lfs_port_unlock();
+    ESP32_TRACE_I(ESP32_TRACE_TRUNCATE, file->trace_id, size, rc);
+    return rc ? SQLITE_IOERR_TRUNCATE : SQLITE_OK;
 }
 
 int esp32_Delete( sqlite3_vfs * vfs, const char * path, int syncDir )
 {
     int32_t rc = lfs_remove(&lfs_filesystem, path);
-    dbg_printf("esp32_Delete: %s OK\n", path);
+    ESP32_TRACE_I(ESP32_TRACE_DELETE, 0, syncDir, rc);
     return SQLITE_OK;
 }
 
 int esp32_FileSize(sqlite3_file *id, sqlite3_int64 *size)
 {
     esp32_file *file = (esp32_file*) id;
-    lfs_soff_t filesize = lfs_file_size(&lfs_filesystem, &lfs_file);
+    lfs_soff_t filesize;
 
-    dbg_printf("[SQLite3]Get size of File: %s, size %d: ", file->name, filesize);
+    /* the handle is shared, like in read and write */
+    lfs_port_lock();
+    filesize = lfs_file_size(&lfs_filesystem, file->fd);
+    lfs_port_unlock();
+
+    ESP32_TRACE_D(ESP32_TRACE_FILESIZE, file->trace_id, filesize, 0);
     if(filesize < 0)
         return SQLITE_IOERR_FSTAT;
 
     *size = filesize;
-    dbg_printf("size: %d]\n", *size);
     return SQLITE_OK;
 }
 
 int esp32_Sync(sqlite3_file *id, int flags)
 {
     esp32_file *file = (esp32_file*) id;
-    int rc = lfs_file_sync(&lfs_filesystem, file->fd);
-    dbg_printf("esp32_Sync( %s: ): %d \n",file->name, rc);
+    int64_t start = esp_timer_get_time();
+    int rc;
+
+    lfs_port_lock();
+    rc = lfs_file_sync(&lfs_filesystem, file->fd);
+    lfs_port_unlock();
+
+    file->stats.syncs++;
+    file->stats.sync_us += esp_timer_get_time() - start;
+    ESP32_TRACE_I(ESP32_TRACE_SYNC, file->trace_id, flags, rc);
     return rc ? SQLITE_IOERR_FSYNC : SQLITE_OK;
 }
 
@@ -548,7 +1160,8 @@ int esp32_Access( sqlite3_vfs * vfs, const char * path, int flags, int * result
     struct lfs_info st;
     memset(&st, 0, sizeof(struct lfs_info));
     rc = lfs_stat(&lfs_filesystem, path, &st);
-    *result = ( rc != -1 );
+    /* lfs_stat returns LFS_ERR_NOENT for missing files, e.g. no -wal yet */
+    *result = ( rc == LFS_ERR_OK );
     return SQLITE_OK;
 }
 
@@ -567,33 +1180,103 @@ int esp32_FullPathname( sqlite3_vfs * vfs, const char * path, int len, char * fu
     strncpy( fullpath, path, len );
     fullpath[ len - 1 ] = '\0';
 
-    dbg_printf("esp32_FullPathname: %s\n", fullpath);
+    ESP32_TRACE_D(ESP32_TRACE_SYSCALL, 0, 0, len);
     return SQLITE_OK;
 }
 
+/**
+ * Database locks between the connections of this process, kept in the node
+ * of the file the way the unix VFS keeps them per inode. Only connections
+ * of this firmware share the card, so no byte range locks are needed.
+ * Memory and preloaded files have no node and are never contended.
+ */
 int esp32_Lock(sqlite3_file *id, int lock_type)
 {
     esp32_file *file = (esp32_file*) id;
+    node_t *node = file->node;
+    int rc = SQLITE_OK;
 
-    dbg_printf("esp32_Lock:Not locked\n");
-    return SQLITE_OK;
+    if (!node || file->lock >= lock_type) {
+        ESP32_TRACE_D(ESP32_TRACE_LOCK, file->trace_id, lock_type, SQLITE_OK);
+        return SQLITE_OK;
+    }
+
+    lfs_port_lock();
+    switch (lock_type) {
+        case SQLITE_LOCK_SHARED:
+            /* a pending writer keeps new readers out */
+            if (node->pending || node->exclusive)
+                rc = SQLITE_BUSY;
+            else
+                node->shared_locks++;
+            break;
+        case SQLITE_LOCK_RESERVED:
+            if (node->reserved)
+                rc = SQLITE_BUSY;
+            else
+                node->reserved = file;
+            break;
+        case SQLITE_LOCK_EXCLUSIVE:
+            if (node->pending && node->pending != file) {
+                rc = SQLITE_BUSY;
+                break;
+            }
+            /* stay pending until the other readers are gone */
+            node->pending = file;
+            file->lock = SQLITE_LOCK_PENDING;
+            if (node->shared_locks > 1)
+                rc = SQLITE_BUSY;
+            else
+                node->exclusive = 1;
+            break;
+        default:
+            rc = SQLITE_MISUSE;
+            break;
+    }
+    if (rc == SQLITE_OK)
+        file->lock = lock_type;
+    lfs_port_unlock();
+
+    ESP32_TRACE_D(ESP32_TRACE_LOCK, file->trace_id, lock_type, rc);
+    return rc;
 }
 
 int esp32_Unlock(sqlite3_file *id, int lock_type)
 {
     esp32_file *file = (esp32_file*) id;
+    node_t *node = file->node;
+
+    if (node && file->lock > lock_type) {
+        lfs_port_lock();
+        if (node->reserved == file)
+            node->reserved = NULL;
+        if (node->pending == file)
+            node->pending = NULL;
+        if (file->lock == SQLITE_LOCK_EXCLUSIVE)
+            node->exclusive = 0;
+        if (lock_type == SQLITE_LOCK_NONE)
+            node->shared_locks--;
+        file->lock = lock_type;
+        lfs_port_unlock();
+    }
 
-    dbg_printf("esp32_Unlock:\n");
+    ESP32_TRACE_D(ESP32_TRACE_UNLOCK, file->trace_id, lock_type, SQLITE_OK);
     return SQLITE_OK;
 }
 
 int esp32_CheckReservedLock(sqlite3_file *id, int *result)
 {
     esp32_file *file = (esp32_file*) id;
+    node_t *node = file->node;
 
     *result = 0;
+    if (node) {
+        lfs_port_lock();
+        *result = node->reserved != NULL || node->pending != NULL || node->exclusive;
+        lfs_port_unlock();
+    }
 
-    dbg_printf("esp32_CheckReservedLock:\n");
+    ESP32_TRACE_D(ESP32_TRACE_CHECKLOCK, file->trace_id, *result, SQLITE_OK);
     return SQLITE_OK;
 }
 
@@ -601,47 +1284,315 @@ int esp32_FileControl(sqlite3_file *id, int op, void *arg)
 {
     esp32_file *file = (esp32_file*) id;
 
-    dbg_printf("esp32_FileControl:\n");
-    return SQLITE_OK;
+    ESP32_TRACE_D(ESP32_TRACE_FILECONTROL, file->trace_id, op, 0);
+    switch (op) {
+        case SQLITE_FCNTL_CHUNK_SIZE:
+            file->chunk_size = *(int *) arg;
+            return SQLITE_OK;
+        case SQLITE_FCNTL_SIZE_HINT:
+            /* only preallocate littlefs files that asked for chunks */
+            if (file->fd && file->chunk_size > 0) {
+                lfs_off_t size = (lfs_off_t)(*(sqlite3_int64 *) arg & 0x7FFFFFFF);
+                size = ((size + file->chunk_size - 1) / file->chunk_size) * file->chunk_size;
+                return esp32_Preallocate(file, size);
+            }
+            return SQLITE_OK;
+        case SQLITE_FCNTL_MMAP_SIZE: {
+            /* bytes of the database mirrored in PSRAM for xFetch */
+            sqlite3_int64 limit = *(sqlite3_int64 *) arg;
+            if (limit > 0)
+                limit &= 0x7FFFFFFF;
+            /* in-memory journals have no mirror */
+            if (!file->mirror) {
+                *(sqlite3_int64 *) arg = 0;
+                return SQLITE_OK;
+            }
+            *(sqlite3_int64 *) arg = file->mirror->limit;
+            /* a preloaded image is the file itself, it is never dropped */
+            if (file->base.pMethods == &esp32PreloadMethods)
+                return SQLITE_OK;
+            lfs_port_lock();
+            if (limit >= 0 && limit != file->mirror->limit && !file->mirror->fetch_out) {
+                mirror_free(file);
+                file->mirror->limit = limit;
+            }
+            lfs_port_unlock();
+            return SQLITE_OK;
+        }
+        case ESP32_FCNTL_IO_STATS:
+            *(esp32_file_stats_t *) arg = file->stats;
+            return SQLITE_OK;
+        case ESP32_FCNTL_IO_STATS_RESET:
+            if (arg)
+                *(esp32_file_stats_t *) arg = file->stats;
+            memset(&file->stats, 0, sizeof(esp32_file_stats_t));
+            return SQLITE_OK;
+        default:
+            break;
+    }
+    /* anything else, SQLITE_FCNTL_PRAGMA included, is left to sqlite */
+    return SQLITE_NOTFOUND;
 }
 
 int esp32_SectorSize(sqlite3_file *id)
 {
     esp32_file *file = (esp32_file*) id;
 
-    dbg_printf("esp32_SectorSize:\n");
+    ESP32_TRACE_D(ESP32_TRACE_SECTORSIZE, file->trace_id, 0, 0);
+    /* smallest unit littlefs programs, one SD sector with the sdspi port */
+    if (lfs_filesystem.cfg)
+        return (int) lfs_filesystem.cfg->prog_size;
     return 512;
 }
 
+/**
+ * littlefs is copy-on-write: file data goes to fresh blocks and only becomes
+ * visible when the metadata commit in lfs_file_sync succeeds. So a write can
+ * never damage bytes around it (powersafe overwrite), a file never grows
+ * before its data is there (safe append), writes reach the card in issue
+ * order as far as a reader after power loss can tell (sequential) and a
+ * block sized write lands completely or not at all (atomic).
+ * @param id sqlite3 file
+ * @return SQLITE_IOCAP_* flags
+ */
 int esp32_DeviceCharacteristics(sqlite3_file *id)
 {
+    static int iocap = -1;
     esp32_file *file = (esp32_file*) id;
 
-    dbg_printf("esp32_DeviceCharacteristics:\n");
-    return 0;
+    ESP32_TRACE_D(ESP32_TRACE_DEVCHAR, file->trace_id, iocap, 0);
+    if (iocap < 0 && lfs_filesystem.cfg) {
+        lfs_size_t size = 512;
+        int atomic = 0, flag;
+
+        /* sqlite tests the ATOMICnnn bit matching its page size */
+        for (flag = SQLITE_IOCAP_ATOMIC512; flag <= SQLITE_IOCAP_ATOMIC64K; flag <<= 1) {
+            if (size > lfs_filesystem.cfg->block_size)
+                break;
+            atomic |= flag;
+            size <<= 1;
+        }
+
+        iocap = atomic | SQLITE_IOCAP_SAFE_APPEND | SQLITE_IOCAP_SEQUENTIAL |
+                SQLITE_IOCAP_POWERSAFE_OVERWRITE;
+    }
+    return iocap < 0 ? 0 : iocap;
+}
+
+/**
+ * Hand out a pointer into the PSRAM mirror instead of copying through
+ * lfs_file_read. Regions are read from littlefs on first touch; *pp stays
+ * NULL, so sqlite falls back to xRead, when the range is past the end of
+ * file or the mmap limit, or PSRAM is not available.
+ */
+int esp32_Fetch(sqlite3_file *id, sqlite3_int64 offset, int amount, void **pp)
+{
+    esp32_file *file = (esp32_file*) id;
+    mirror_t *m = file->mirror;
+    uint32_t ofst = (uint32_t)(offset & 0x7FFFFFFF);
+    uint32_t end = ofst + amount, region;
+    lfs_soff_t filesize;
+
+    *pp = NULL;
+    if (!file->fd || end > m->limit)
+        return SQLITE_OK;
+
+    /* the mirror is shared by all connections of the file */
+    lfs_port_lock();
+    filesize = lfs_file_size(&lfs_filesystem, file->fd);
+    if (filesize < 0 || end > (uint32_t) filesize)
+        goto out;
+    if (end > m->size && mirror_grow(file, end) != SQLITE_OK)
+        goto out;
+
+    for (region = ofst / MIRRORREGIONSZ; region * MIRRORREGIONSZ < end; region++) {
+        if (m->filled[region / 32] & (1u << (region % 32)))
+            continue;
+        if (mirror_fill(file, region, (uint32_t) filesize) != SQLITE_OK)
+            goto out;
+    }
+
+    m->fetch_out++;
+    *pp = m->image + ofst;
+out:
+    lfs_port_unlock();
+    return SQLITE_OK;
+}
+
+int esp32_Unfetch(sqlite3_file *id, sqlite3_int64 offset, void *p)
+{
+    esp32_file *file = (esp32_file*) id;
+
+    /* p == NULL asks to drop the whole mapping, nothing is fetched then */
+    lfs_port_lock();
+    if (p)
+        file->mirror->fetch_out--;
+    else if (file->mirror->image)
+        mirror_invalidate(file, 0);
+    lfs_port_unlock();
+    return SQLITE_OK;
+}
+
+/**
+ * Map one wal-index region. The wal-index never goes to the card: with a
+ * single littlefs handle per file there is nothing a file backed index
+ * could add over memory shared through the node. Regions come from
+ * internal RAM first, the hash lookups hit them on every page read.
+ */
+int esp32_ShmMap(sqlite3_file *id, int region, int size, int extend, void volatile **pp)
+{
+    esp32_file *file = (esp32_file*) id;
+    node_t *node = file->node;
+    shm_t *shm;
+    int rc = SQLITE_OK;
+
+    *pp = NULL;
+    lfs_port_lock();
+    shm = node->shm;
+    if (!shm) {
+        shm = (shm_t *) sqlite3_malloc(sizeof(shm_t));
+        if (!shm) {
+            lfs_port_unlock();
+            return SQLITE_NOMEM;
+        }
+        memset(shm, 0, sizeof(shm_t));
+        shm->region_size = size;
+        node->shm = shm;
+    }
+    if (!file->shm_mapped) {
+        file->shm_mapped = 1;
+        shm->refs++;
+    }
+
+    if (region >= shm->region_count && extend) {
+        uint8_t **regions = (uint8_t **) sqlite3_realloc(shm->regions, (region + 1) * sizeof(uint8_t *));
+        if (!regions)
+            rc = SQLITE_NOMEM;
+        else
+            shm->regions = regions;
+        while (rc == SQLITE_OK && shm->region_count <= region) {
+            uint8_t *r = (uint8_t *) heap_caps_calloc(1, size, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+            if (!r)
+                r = (uint8_t *) heap_caps_calloc(1, size, MALLOC_CAP_SPIRAM);
+            if (!r)
+                rc = SQLITE_IOERR_SHMMAP;
+            else
+                shm->regions[shm->region_count++] = r;
+        }
+    }
+    if (region < shm->region_count)
+        *pp = shm->regions[region];
+    lfs_port_unlock();
+
+    ESP32_TRACE_D(ESP32_TRACE_SHM, file->trace_id, region, rc);
+    return rc;
+}
+
+int esp32_ShmLock(sqlite3_file *id, int offset, int n, int flags)
+{
+    esp32_file *file = (esp32_file*) id;
+    shm_t *shm;
+    uint16_t mask = (uint16_t) ((1 << (offset + n)) - (1 << offset));
+    int rc = SQLITE_OK, i;
+
+    lfs_port_lock();
+    shm = file->node ? file->node->shm : NULL;
+    if (!shm) {
+        /* nothing mapped, so nothing is held either */
+        file->shm_shared = file->shm_exclusive = 0;
+        lfs_port_unlock();
+        return (flags & SQLITE_SHM_UNLOCK) ? SQLITE_OK : SQLITE_IOERR_SHMLOCK;
+    }
+    if (flags & SQLITE_SHM_UNLOCK) {
+        for (i = offset; i < offset + n; i++) {
+            if (file->shm_shared & (1 << i))
+                shm->shared[i]--;
+            if (file->shm_exclusive & (1 << i))
+                shm->exclusive[i] = NULL;
+        }
+        file->shm_shared &= ~mask;
+        file->shm_exclusive &= ~mask;
+    } else if (flags & SQLITE_SHM_SHARED) {
+        /* sqlite takes shared locks one slot at a time */
+        if (!(file->shm_shared & mask)) {
+            if (shm->exclusive[offset] && shm->exclusive[offset] != file)
+                rc = SQLITE_BUSY;
+            else {
+                shm->shared[offset]++;
+                file->shm_shared |= mask;
+            }
+        }
+    } else {
+        for (i = offset; i < offset + n && rc == SQLITE_OK; i++) {
+            int own = (file->shm_shared >> i) & 1;
+            if ((shm->exclusive[i] && shm->exclusive[i] != file) || shm->shared[i] > own)
+                rc = SQLITE_BUSY;
+        }
+        if (rc == SQLITE_OK) {
+            for (i = offset; i < offset + n; i++)
+                shm->exclusive[i] = file;
+            file->shm_exclusive |= mask;
+        }
+    }
+    lfs_port_unlock();
+
+    ESP32_TRACE_D(ESP32_TRACE_SHM, file->trace_id, (offset << 8) | flags, rc);
+    return rc;
+}
+
+void esp32_ShmBarrier(sqlite3_file *id)
+{
+    /* the other core may read the wal-index header next */
+    __sync_synchronize();
+}
+
+int esp32_ShmUnmap(sqlite3_file *id, int deleteFlag)
+{
+    esp32_file *file = (esp32_file*) id;
+    node_t *node = file->node;
+    shm_t *shm;
+
+    if (!file->shm_mapped)
+        return SQLITE_OK;
+
+    lfs_port_lock();
+    esp32_ShmLock(id, 0, SQLITE_SHM_NLOCK, SQLITE_SHM_UNLOCK | SQLITE_SHM_SHARED);
+    file->shm_mapped = 0;
+    shm = node ? node->shm : NULL;
+    if (shm && --shm->refs == 0) {
+        for (int i = 0; i < shm->region_count; i++)
+            heap_caps_free(shm->regions[i]);
+        sqlite3_free(shm->regions);
+        sqlite3_free(shm);
+        node->shm = NULL;
+    }
+    lfs_port_unlock();
+
+    ESP32_TRACE_D(ESP32_TRACE_SHM, file->trace_id, deleteFlag, SQLITE_OK);
+    return SQLITE_OK;
 }
 
 void * esp32_DlOpen( sqlite3_vfs * vfs, const char * path )
 {
-    dbg_printf("esp32_DlOpen:\n");
+    ESP32_TRACE_D(ESP32_TRACE_SYSCALL, 0, 1, 0);
     return NULL;
 }
 
 void esp32_DlError( sqlite3_vfs * vfs, int len, char * errmsg )
 {
-    dbg_printf("esp32_DlError:\n");
+    ESP32_TRACE_D(ESP32_TRACE_SYSCALL, 0, 2, 0);
     return;
 }
 
 void ( * esp32_DlSym ( sqlite3_vfs * vfs, void * handle, const char * symbol ) ) ( void )
 {
-    dbg_printf("esp32_DlSym:\n");
+    ESP32_TRACE_D(ESP32_TRACE_SYSCALL, 0, 3, 0);
     return NULL;
 }
 
 void esp32_DlClose( sqlite3_vfs * vfs, void * handle )
 {
-    dbg_printf("esp32_DlClose:\n");
+    ESP32_TRACE_D(ESP32_TRACE_SYSCALL, 0, 4, 0);
     return;
 }
 
@@ -655,14 +1606,20 @@ int esp32_Randomness( sqlite3_vfs * vfs, int len, char * buffer )
         memcpy(a_rdm + sz * sizeof(long), &rdm, sizeof(long));
     }
     memcpy(buffer, a_rdm, len);
-    dbg_printf("esp32_Randomness\n");
+    ESP32_TRACE_D(ESP32_TRACE_SYSCALL, 0, 5, len);
     return SQLITE_OK;
 }
 
 int esp32_Sleep( sqlite3_vfs * vfs, int microseconds )
 {
-    ets_delay_us(microseconds);
-    dbg_printf("esp32_Sleep:\n");
+    /* a busy wait would keep the task holding the lock off this core */
+    TickType_t ticks = pdMS_TO_TICKS(microseconds / 1000);
+
+    if (ticks > 0)
+        vTaskDelay(ticks);
+    else
+        ets_delay_us(microseconds);
+    ESP32_TRACE_D(ESP32_TRACE_SYSCALL, 0, 6, microseconds);
     return SQLITE_OK;
 }
 
@@ -673,7 +1630,14 @@ int esp32_CurrentTime( sqlite3_vfs * vfs, double * result )
     // This is stubbed out until we have a working RTCTIME solution;
     // as it stood, this would always have returned the UNIX epoch.
     //*result = 2440587.5;
-    dbg_printf("esp32_CurrentTime: %g\n", *result);
+    ESP32_TRACE_D(ESP32_TRACE_SYSCALL, 0, 7, t);
+    return SQLITE_OK;
+}
+
+int esp32_CurrentTimeInt64( sqlite3_vfs * vfs, sqlite3_int64 * result )
+{
+    /* julian day in milliseconds, as the unix VFS reports it */
+    *result = (sqlite3_int64) time(NULL) * 1000 + 210866760000000LL;
     return SQLITE_OK;
 }
 
@@ -698,7 +1662,7 @@ static void shox96_0_2c(sqlite3_context *context, int argc, sqlite3_value **argv
 }
 
 static void shox96_0_2d(sqlite3_context *context, int argc, sqlite3_value **argv) {
-    unsigned int nIn, nOut, rc;
+    unsigned int nIn, nOut;
     const unsigned char *inBuf;
     unsigned char *outBuf;
     long int nOut2;
@@ -718,8 +1682,16 @@ static void shox96_0_2d(sqlite3_context *context, int argc, sqlite3_value **argv
     inBufLen64 = decode_unsigned_varint(inBuf, &vIntLen);
     nOut = (unsigned int) inBufLen64;
     outBuf = (unsigned char *) malloc( nOut );
-    //nOut2 = (long int)nOut;
-    nOut2 = shox96_0_2_decompress((const char *) (inBuf + vIntLen), nIn - vIntLen, (char *) outBuf, NULL);
+    if (!outBuf) {
+        sqlite3_result_error_nomem(context);
+        return;
+    }
+    nOut2 = shox96_0_2_decompress_n((const char *) (inBuf + vIntLen), nIn - vIntLen, (char *) outBuf, (int) nOut, NULL);
+    if (nOut2 < 0) {
+        free(outBuf);
+        sqlite3_result_error_code(context, SQLITE_CORRUPT);
+        return;
+    }
     //if( rc!=Z_OK ){
     //  free(outBuf);
     //}else{
@@ -733,9 +1705,130 @@ int registerShox96_0_2(sqlite3 *db, const char **pzErrMsg, const struct sqlite3_
     return SQLITE_OK;
 }
 
+/**
+ * Switch to WAL after the locking mode was set
+ * @param db database connection
+ * @param autocheckpoint wal_autocheckpoint pages
+ * @return SQLITE_OK on success
+ */
+static int esp32_wal_switch(sqlite3 *db, int autocheckpoint)
+{
+    int rc;
+    char sql[48];
+    sqlite3_stmt *stmt;
+
+    rc = sqlite3_prepare_v2(db, "PRAGMA journal_mode=WAL", -1, &stmt, NULL);
+    if (rc != SQLITE_OK)
+        return rc;
+    rc = sqlite3_step(stmt);
+    if (rc == SQLITE_ROW && !sqlite3_stricmp((const char *) sqlite3_column_text(stmt, 0), "wal"))
+        rc = SQLITE_OK;
+    else if (rc == SQLITE_ROW || rc == SQLITE_DONE)
+        rc = SQLITE_ERROR;
+    sqlite3_finalize(stmt);
+    if (rc != SQLITE_OK) {
+        ESP32_TRACE_E(ESP32_TRACE_WAL, 0, 0, rc);
+        return rc;
+    }
+
+    /* frames are appended in order, a commit only needs the WAL synced */
+    snprintf(sql, sizeof(sql), "PRAGMA synchronous=NORMAL;"
+                               "PRAGMA wal_autocheckpoint=%d", autocheckpoint);
+    rc = sqlite3_exec(db, sql, NULL, NULL, NULL);
+    ESP32_TRACE_I(ESP32_TRACE_WAL, 0, autocheckpoint, rc);
+    return rc;
+}
+
+int esp32_vfs_wal_enable(sqlite3 *db, int autocheckpoint)
+{
+    int rc;
+
+    /* heap wal-index needs exclusive locking before the WAL is opened */
+    rc = sqlite3_exec(db, "PRAGMA locking_mode=EXCLUSIVE", NULL, NULL, NULL);
+    if (rc != SQLITE_OK)
+        return rc;
+    return esp32_wal_switch(db, autocheckpoint);
+}
+
+int esp32_vfs_wal_enable_shared(sqlite3 *db, int autocheckpoint, int busy_ms)
+{
+    int rc;
+
+    /* readers and the writer meet in the wal-index of the file node */
+    rc = sqlite3_exec(db, "PRAGMA locking_mode=NORMAL", NULL, NULL, NULL);
+    if (rc != SQLITE_OK)
+        return rc;
+    rc = sqlite3_busy_timeout(db, busy_ms);
+    if (rc != SQLITE_OK)
+        return rc;
+    return esp32_wal_switch(db, autocheckpoint);
+}
+
+/**
+ * Page size of the main database as stored, not a pending PRAGMA page_size
+ */
+static int esp32_page_size(sqlite3 *db, int *page_size)
+{
+    sqlite3_stmt *stmt;
+    int rc = sqlite3_prepare_v2(db, "PRAGMA page_size", -1, &stmt, NULL);
+
+    if (rc != SQLITE_OK)
+        return rc;
+    if (sqlite3_step(stmt) == SQLITE_ROW)
+        *page_size = sqlite3_column_int(stmt, 0);
+    return sqlite3_finalize(stmt);
+}
+
+int esp32_vfs_set_page_size(sqlite3 *db, int page_size)
+{
+    int rc, current = 0;
+    char sql[32];
+
+    if (page_size < 512 || page_size > 65536 || (page_size & (page_size - 1)))
+        return SQLITE_MISUSE;
+
+    snprintf(sql, sizeof(sql), "PRAGMA page_size=%d", page_size);
+    rc = sqlite3_exec(db, sql, NULL, NULL, NULL);
+    if (rc != SQLITE_OK)
+        return rc;
+
+    /* an existing database only takes the new size when it is rebuilt; VACUUM
+     * copies it through a temp database, served by esp32_temp.c */
+    rc = esp32_page_size(db, &current);
+    if (rc == SQLITE_OK && current != page_size) {
+        rc = sqlite3_exec(db, "VACUUM", NULL, NULL, NULL);
+        if (rc == SQLITE_OK)
+            rc = esp32_page_size(db, &current);
+        /* in WAL mode VACUUM succeeds and keeps the old size */
+        if (rc == SQLITE_OK && current != page_size)
+            rc = SQLITE_ERROR;
+    }
+
+    ESP32_TRACE_I(ESP32_TRACE_SYSCALL, 0, page_size, rc);
+    return rc;
+}
+
+int esp32_vfs_wal_checkpoint(sqlite3 *db, int *frames_left)
+{
+    int log = 0, ckpt = 0;
+    int rc = sqlite3_wal_checkpoint_v2(db, NULL, SQLITE_CHECKPOINT_PASSIVE, &log, &ckpt);
+
+    if (frames_left)
+        *frames_left = (rc == SQLITE_OK && log > ckpt) ? log - ckpt : 0;
+    ESP32_TRACE_I(ESP32_TRACE_WAL, 0, log - ckpt, rc);
+    return rc;
+}
+
 int sqlite3_os_init(void){
     sqlite3_vfs_register(&esp32Vfs, 1);
+    sqlite3_vfs_register(&esp32PreloadVfs, 0);
+    esp32_zip_register(&esp32Vfs);
+    esp32_crypt_register(&esp32Vfs);
+    esp32_chunk_register(&esp32Vfs);
     sqlite3_auto_extension((void (*)())registerShox96_0_2);
+    sqlite3_auto_extension((void (*)())esp32_blob_register);
+    sqlite3_auto_extension((void (*)())esp32_io_stats_register);
+    sqlite3_auto_extension((void (*)())esp32_logtab_register);
     return SQLITE_OK;
 }
 
@@ -0,0 +1,479 @@
+/*
+ * esp32_blob.c
+ *
+ * Large blobs in their own littlefs files. sqlite stores a big value as a
+ * chain of overflow pages and, with SQLITE_OMIT_INCRBLOB, reads and writes
+ * it whole. A waveform capture or an image goes to a file under
+ * ESP32_BLOB_DIR instead, the row keeps its 64 bit id. The file is written
+ * and read in pieces straight from and into the caller's buffers, so the
+ * database stays small and its page cache is not flushed by blob pages.
+ *
+ * A blob file exists before the row that refers to it is committed, so
+ * esp32_blob_gc must not take every file without a row for an orphan.
+ * Each handle is tracked by id from before its file is opened until a
+ * grace period after it is closed, under SQLITE_MUTEX_STATIC_VFS3; the
+ * collector skips tracked ids. littlefs keeps no file times, after a
+ * restart nothing is tracked and every file without a row is an orphan.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sdkconfig.h>
+#include <esp_timer.h>
+#include "sqlite3.h"
+#include "lfs.h"
+#include "lfs_port.h"
+#include "esp32_blob.h"
+
+/* "blobs/" and 16 hex digits */
+#define BLOB_NAME_MAX 32
+#ifdef CONFIG_SQLITE_BLOB_GC_GRACE_S
+#define BLOB_GC_GRACE_US (CONFIG_SQLITE_BLOB_GC_GRACE_S * 1000000LL)
+#else
+#define BLOB_GC_GRACE_US (60 * 1000000LL)
+#endif
+
+struct esp32_blob {
+    lfs_file_t file;
+    sqlite3_int64 id;
+    int writing;
+};
+
+/* a blob with open handles or closed within the grace period */
+typedef struct blob_live {
+    sqlite3_int64 id;
+    int handles;
+    int64_t closed_us;
+} blob_live;
+
+static blob_live *blob_lives;
+static int blob_nlives, blob_alives;
+
+static void blob_name(sqlite3_int64 id, char name[BLOB_NAME_MAX])
+{
+    snprintf(name, BLOB_NAME_MAX, ESP32_BLOB_DIR "/%016llx", (unsigned long long) id);
+}
+
+static int blob_error(int err)
+{
+    switch (err) {
+        case LFS_ERR_NOENT:
+            return SQLITE_NOTFOUND;
+        case LFS_ERR_NOSPC:
+            return SQLITE_FULL;
+        case LFS_ERR_NOMEM:
+            return SQLITE_NOMEM;
+        default:
+            return SQLITE_IOERR;
+    }
+}
+
+static sqlite3_mutex *blob_mutex(void)
+{
+    return sqlite3_mutex_alloc(SQLITE_MUTEX_STATIC_VFS3);
+}
+
+/**
+ * Drop the ids whose last handle was closed before the grace period, with blob_mutex held
+ */
+static void blob_expire(int64_t now)
+{
+    int n = 0;
+
+    for (int i = 0; i < blob_nlives; i++) {
+        if (blob_lives[i].handles || now - blob_lives[i].closed_us < BLOB_GC_GRACE_US)
+            blob_lives[n++] = blob_lives[i];
+    }
+    blob_nlives = n;
+}
+
+static blob_live *blob_find(sqlite3_int64 id)
+{
+    for (int i = 0; i < blob_nlives; i++) {
+        if (blob_lives[i].id == id)
+            return &blob_lives[i];
+    }
+    return NULL;
+}
+
+/**
+ * Count a handle of a blob, before its file is opened
+ */
+static int blob_track(sqlite3_int64 id)
+{
+    sqlite3_mutex *mutex = blob_mutex();
+    blob_live *live;
+    int rc = SQLITE_OK;
+
+    sqlite3_mutex_enter(mutex);
+    blob_expire(esp_timer_get_time());
+    live = blob_find(id);
+    if (!live) {
+        if (blob_nlives == blob_alives) {
+            int size = blob_alives ? blob_alives * 2 : 8;
+            blob_live *grown = (blob_live *) sqlite3_realloc64(blob_lives, size * sizeof(blob_live));
+
+            if (grown) {
+                blob_lives = grown;
+                blob_alives = size;
+            }
+        }
+        if (blob_nlives < blob_alives) {
+            live = &blob_lives[blob_nlives++];
+            live->id = id;
+            live->handles = 0;
+        } else {
+            rc = SQLITE_NOMEM;
+        }
+    }
+    if (live)
+        live->handles++;
+    sqlite3_mutex_leave(mutex);
+    return rc;
+}
+
+/**
+ * Release a handle counted by blob_track, the grace period starts with the last one
+ */
+static void blob_untrack(sqlite3_int64 id)
+{
+    sqlite3_mutex *mutex = blob_mutex();
+    blob_live *live;
+
+    sqlite3_mutex_enter(mutex);
+    live = blob_find(id);
+    if (live && live->handles > 0 && --live->handles == 0)
+        live->closed_us = esp_timer_get_time();
+    sqlite3_mutex_leave(mutex);
+}
+
+/**
+ * A blob esp32_blob_gc must keep even without a row, with blob_mutex held
+ */
+static int blob_busy(sqlite3_int64 id, int64_t now)
+{
+    blob_live *live = blob_find(id);
+    return live && (live->handles || now - live->closed_us < BLOB_GC_GRACE_US);
+}
+
+int esp32_blob_create(sqlite3_int64 *id, esp32_blob_t **out)
+{
+    char name[BLOB_NAME_MAX];
+    esp32_blob_t *blob;
+    int err;
+
+    *out = NULL;
+    blob = (esp32_blob_t *) sqlite3_malloc(sizeof(esp32_blob_t));
+    if (!blob)
+        return SQLITE_NOMEM;
+    memset(blob, 0, sizeof(esp32_blob_t));
+
+    err = lfs_mkdir(&lfs_filesystem, ESP32_BLOB_DIR);
+    if (err && err != LFS_ERR_EXIST) {
+        sqlite3_free(blob);
+        return blob_error(err);
+    }
+    /* random ids need no counter on the card, a collision just draws again */
+    do {
+        sqlite3_randomness(sizeof(*id), id);
+        *id &= 0x7FFFFFFFFFFFFFFFLL;
+        if (!*id) {
+            err = LFS_ERR_EXIST;
+            continue;
+        }
+        /* tracked before the file exists, so esp32_blob_gc never sees it untracked */
+        if (blob_track(*id) != SQLITE_OK) {
+            sqlite3_free(blob);
+            return SQLITE_NOMEM;
+        }
+        blob_name(*id, name);
+        err = lfs_file_open(&lfs_filesystem, &blob->file, name, LFS_O_WRONLY | LFS_O_CREAT | LFS_O_EXCL);
+        if (err)
+            blob_untrack(*id);
+    } while (err == LFS_ERR_EXIST);
+    if (err) {
+        sqlite3_free(blob);
+        return blob_error(err);
+    }
+    blob->id = *id;
+    blob->writing = 1;
+    *out = blob;
+    return SQLITE_OK;
+}
+
+int esp32_blob_open(sqlite3_int64 id, esp32_blob_t **out)
+{
+    char name[BLOB_NAME_MAX];
+    esp32_blob_t *blob;
+    int err;
+
+    *out = NULL;
+    blob = (esp32_blob_t *) sqlite3_malloc(sizeof(esp32_blob_t));
+    if (!blob)
+        return SQLITE_NOMEM;
+    memset(blob, 0, sizeof(esp32_blob_t));
+    if (blob_track(id) != SQLITE_OK) {
+        sqlite3_free(blob);
+        return SQLITE_NOMEM;
+    }
+    blob_name(id, name);
+    err = lfs_file_open(&lfs_filesystem, &blob->file, name, LFS_O_RDONLY);
+    if (err) {
+        blob_untrack(id);
+        sqlite3_free(blob);
+        return blob_error(err);
+    }
+    blob->id = id;
+    *out = blob;
+    return SQLITE_OK;
+}
+
+int esp32_blob_write(esp32_blob_t *blob, const void *data, int amount)
+{
+    lfs_ssize_t n;
+
+    if (!blob->writing || amount < 0)
+        return SQLITE_MISUSE;
+    n = lfs_file_write(&lfs_filesystem, &blob->file, data, amount);
+    if (n < 0)
+        return blob_error(n);
+    return n == amount ? SQLITE_OK : SQLITE_FULL;
+}
+
+int esp32_blob_read(esp32_blob_t *blob, void *buffer, int amount, sqlite3_int64 offset)
+{
+    lfs_soff_t pos;
+    lfs_ssize_t n;
+
+    if (blob->writing || amount < 0 || offset < 0 || offset > LFS_FILE_MAX)
+        return -SQLITE_MISUSE;
+    pos = lfs_file_seek(&lfs_filesystem, &blob->file, (lfs_soff_t) offset, LFS_SEEK_SET);
+    if (pos < 0)
+        return -blob_error(pos);
+    n = lfs_file_read(&lfs_filesystem, &blob->file, buffer, amount);
+    return n < 0 ? -blob_error(n) : (int) n;
+}
+
+sqlite3_int64 esp32_blob_size(esp32_blob_t *blob)
+{
+    lfs_soff_t size = lfs_file_size(&lfs_filesystem, &blob->file);
+    return size < 0 ? -blob_error(size) : size;
+}
+
+int esp32_blob_close(esp32_blob_t *blob)
+{
+    int err;
+
+    if (!blob)
+        return SQLITE_OK;
+    err = lfs_file_close(&lfs_filesystem, &blob->file);
+    blob_untrack(blob->id);
+    sqlite3_free(blob);
+    return err ? blob_error(err) : SQLITE_OK;
+}
+
+int esp32_blob_remove(sqlite3_int64 id)
+{
+    char name[BLOB_NAME_MAX];
+    int err;
+
+    blob_name(id, name);
+    err = lfs_remove(&lfs_filesystem, name);
+    return err ? blob_error(err) : SQLITE_OK;
+}
+
+static int blob_compare(const void *a, const void *b)
+{
+    sqlite3_int64 x = *(const sqlite3_int64 *) a, y = *(const sqlite3_int64 *) b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Append an id to a growing array
+ */
+static int blob_push(sqlite3_int64 **ids, int *count, int *alloc, sqlite3_int64 id)
+{
+    if (*count == *alloc) {
+        int size = *alloc ? *alloc * 2 : 64;
+        sqlite3_int64 *grown = (sqlite3_int64 *) sqlite3_realloc64(*ids, size * sizeof(sqlite3_int64));
+
+        if (!grown)
+            return SQLITE_NOMEM;
+        *ids = grown;
+        *alloc = size;
+    }
+    (*ids)[(*count)++] = id;
+    return SQLITE_OK;
+}
+
+int esp32_blob_gc(sqlite3 *db, const char *sql, int *removed)
+{
+    sqlite3_stmt *stmt;
+    sqlite3_int64 *used = NULL, *orphans = NULL;
+    int nused = 0, aused = 0, norphans = 0, aorphans = 0;
+    sqlite3_mutex *mutex;
+    int64_t now;
+    lfs_dir_t dir;
+    struct lfs_info info;
+    int rc, err;
+
+    if (removed)
+        *removed = 0;
+    rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+    if (rc != SQLITE_OK)
+        return rc;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        if (sqlite3_column_type(stmt, 0) == SQLITE_INTEGER &&
+            (rc = blob_push(&used, &nused, &aused, sqlite3_column_int64(stmt, 0))) != SQLITE_OK)
+            break;
+    }
+    sqlite3_finalize(stmt);
+    if (rc != SQLITE_DONE) {
+        sqlite3_free(used);
+        return rc;
+    }
+    rc = SQLITE_OK;
+    if (nused)
+        qsort(used, nused, sizeof(sqlite3_int64), blob_compare);
+
+    err = lfs_dir_open(&lfs_filesystem, &dir, ESP32_BLOB_DIR);
+    if (err) {
+        sqlite3_free(used);
+        return err == LFS_ERR_NOENT ? SQLITE_OK : blob_error(err);
+    }
+    while (rc == SQLITE_OK && lfs_dir_read(&lfs_filesystem, &dir, &info) > 0) {
+        char *end;
+        sqlite3_int64 id;
+
+        if (info.type != LFS_TYPE_REG)
+            continue;
+        id = (sqlite3_int64) strtoull(info.name, &end, 16);
+        if (*end || end == info.name || (nused && bsearch(&id, used, nused, sizeof(sqlite3_int64), blob_compare)))
+            continue;
+        rc = blob_push(&orphans, &norphans, &aorphans, id);
+    }
+    lfs_dir_close(&lfs_filesystem, &dir);
+
+    /* removed after the directory is closed; blobs being written or just
+     * written may not have their row committed yet and are kept */
+    mutex = blob_mutex();
+    sqlite3_mutex_enter(mutex);
+    now = esp_timer_get_time();
+    for (int i = 0; rc == SQLITE_OK && i < norphans; i++) {
+        if (!blob_busy(orphans[i], now) && esp32_blob_remove(orphans[i]) == SQLITE_OK && removed)
+            (*removed)++;
+    }
+    sqlite3_mutex_leave(mutex);
+    sqlite3_free(used);
+    sqlite3_free(orphans);
+    return rc;
+}
+
+static void blob_put(sqlite3_context *context, int argc, sqlite3_value **argv)
+{
+    esp32_blob_t *blob;
+    sqlite3_int64 id;
+    const void *data = sqlite3_value_blob(argv[0]);
+    int amount = sqlite3_value_bytes(argv[0]);
+    int rc;
+
+    if (sqlite3_value_type(argv[0]) == SQLITE_NULL)
+        return;
+    rc = esp32_blob_create(&id, &blob);
+    if (rc == SQLITE_OK) {
+        rc = esp32_blob_write(blob, data, amount);
+        if (esp32_blob_close(blob) != SQLITE_OK && rc == SQLITE_OK)
+            rc = SQLITE_IOERR;
+        if (rc != SQLITE_OK)
+            esp32_blob_remove(id);
+    }
+    if (rc != SQLITE_OK)
+        sqlite3_result_error_code(context, rc);
+    else
+        sqlite3_result_int64(context, id);
+}
+
+static void blob_get(sqlite3_context *context, int argc, sqlite3_value **argv)
+{
+    esp32_blob_t *blob;
+    sqlite3_int64 size, offset = argc > 1 ? sqlite3_value_int64(argv[1]) : 0;
+    sqlite3_int64 length = argc > 2 ? sqlite3_value_int64(argv[2]) : -1;
+    void *buffer;
+    int rc, n;
+
+    rc = esp32_blob_open(sqlite3_value_int64(argv[0]), &blob);
+    if (rc == SQLITE_NOTFOUND)
+        return;
+    if (rc != SQLITE_OK) {
+        sqlite3_result_error_code(context, rc);
+        return;
+    }
+    size = esp32_blob_size(blob);
+    if (offset < 0)
+        offset = 0;
+    if (size < offset)
+        size = offset;
+    if (length < 0 || length > size - offset)
+        length = size - offset;
+    if (length > sqlite3_limit(sqlite3_context_db_handle(context), SQLITE_LIMIT_LENGTH, -1)) {
+        esp32_blob_close(blob);
+        sqlite3_result_error_toobig(context);
+        return;
+    }
+    buffer = sqlite3_malloc64(length ? length : 1);
+    if (!buffer) {
+        esp32_blob_close(blob);
+        sqlite3_result_error_nomem(context);
+        return;
+    }
+    n = esp32_blob_read(blob, buffer, (int) length, offset);
+    esp32_blob_close(blob);
+    if (n < 0) {
+        sqlite3_free(buffer);
+        sqlite3_result_error_code(context, -n);
+        return;
+    }
+    sqlite3_result_blob(context, buffer, n, sqlite3_free);
+}
+
+static void blob_size(sqlite3_context *context, int argc, sqlite3_value **argv)
+{
+    esp32_blob_t *blob;
+    sqlite3_int64 size;
+    int rc = esp32_blob_open(sqlite3_value_int64(argv[0]), &blob);
+
+    if (rc == SQLITE_NOTFOUND)
+        return;
+    if (rc != SQLITE_OK) {
+        sqlite3_result_error_code(context, rc);
+        return;
+    }
+    size = esp32_blob_size(blob);
+    esp32_blob_close(blob);
+    if (size < 0)
+        sqlite3_result_error_code(context, (int) -size);
+    else
+        sqlite3_result_int64(context, size);
+}
+
+static void blob_remove(sqlite3_context *context, int argc, sqlite3_value **argv)
+{
+    int rc = esp32_blob_remove(sqlite3_value_int64(argv[0]));
+
+    if (rc == SQLITE_OK || rc == SQLITE_NOTFOUND)
+        sqlite3_result_int(context, rc == SQLITE_OK);
+    else
+        sqlite3_result_error_code(context, rc);
+}
+
+int esp32_blob_register(sqlite3 *db, const char **errmsg, const struct sqlite3_api_routines *api)
+{
+    sqlite3_create_function(db, "blob_put", 1, SQLITE_UTF8, 0, blob_put, 0, 0);
+    sqlite3_create_function(db, "blob_get", 1, SQLITE_UTF8, 0, blob_get, 0, 0);
+    sqlite3_create_function(db, "blob_get", 2, SQLITE_UTF8, 0, blob_get, 0, 0);
+    sqlite3_create_function(db, "blob_get", 3, SQLITE_UTF8, 0, blob_get, 0, 0);
+    sqlite3_create_function(db, "blob_size", 1, SQLITE_UTF8, 0, blob_size, 0, 0);
+    sqlite3_create_function(db, "blob_remove", 1, SQLITE_UTF8, 0, blob_remove, 0, 0);
+    return SQLITE_OK;
+}
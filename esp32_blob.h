@@ -0,0 +1,110 @@
+//
+// Large blobs in littlefs files outside the database (esp32_blob.c)
+//
+
+#ifndef SD_CARD_ESP32_BLOB_H
+#define SD_CARD_ESP32_BLOB_H
+
+#include "sqlite3.h"
+
+/**
+ * Directory of the blob files, one file per blob named by its id in hex
+ */
+#define ESP32_BLOB_DIR "blobs"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct esp32_blob esp32_blob_t;
+
+/**
+ * Create a new blob and open it for writing. The row that refers to the
+ * blob stores the id, the file is only readable after esp32_blob_close.
+ * @param id receives the id of the blob, positive
+ * @param out receives the handle
+ * @return SQLITE_OK on success
+ */
+extern int esp32_blob_create(sqlite3_int64 *id, esp32_blob_t **out);
+
+/**
+ * Open a blob for reading
+ * @param id blob id
+ * @param out receives the handle
+ * @return SQLITE_OK on success, SQLITE_NOTFOUND if there is no such blob
+ */
+extern int esp32_blob_open(sqlite3_int64 id, esp32_blob_t **out);
+
+/**
+ * Append to a blob opened with esp32_blob_create. The data goes from the
+ * caller's buffer to littlefs without a copy, call it once per capture
+ * buffer to stream a blob of any size.
+ * @param blob handle
+ * @param data bytes to append
+ * @param amount number of bytes
+ * @return SQLITE_OK on success, SQLITE_FULL when the card is full
+ */
+extern int esp32_blob_write(esp32_blob_t *blob, const void *data, int amount);
+
+/**
+ * Read part of a blob into the caller's buffer
+ * @param blob handle
+ * @param buffer destination
+ * @param amount bytes wanted
+ * @param offset position in the blob
+ * @return bytes read, less than amount at the end of the blob, negative SQLite error code on failure
+ */
+extern int esp32_blob_read(esp32_blob_t *blob, void *buffer, int amount, sqlite3_int64 offset);
+
+/**
+ * Size of a blob in bytes, of the part written so far while creating it
+ * @param blob handle
+ * @return size, negative SQLite error code on failure
+ */
+extern sqlite3_int64 esp32_blob_size(esp32_blob_t *blob);
+
+/**
+ * Close a blob. A new blob is committed to the card here: after a power
+ * loss before the close it is empty.
+ * @param blob handle, may be NULL
+ * @return SQLITE_OK on success
+ */
+extern int esp32_blob_close(esp32_blob_t *blob);
+
+/**
+ * Remove a blob file. Remove it after the transaction that deleted its row
+ * committed, so a rollback never leaves a row without its blob.
+ * @param id blob id
+ * @return SQLITE_OK on success, SQLITE_NOTFOUND if there is no such blob
+ */
+extern int esp32_blob_remove(sqlite3_int64 id);
+
+/**
+ * Remove the blob files no row refers to, left by rolled back inserts or a
+ * power loss between a commit and esp32_blob_remove. A blob that is open,
+ * or was created or last closed less than CONFIG_SQLITE_BLOB_GC_GRACE_S
+ * seconds ago, is kept: its row may not be committed yet. Commit the row
+ * within that time, a blob whose row comes later can be removed under it.
+ * @param db database connection
+ * @param sql query returning the ids in use, e.g. "SELECT capture FROM waveforms"
+ * @param removed receives the number of files removed, may be NULL
+ * @return SQLITE_OK on success
+ */
+extern int esp32_blob_gc(sqlite3 *db, const char *sql, int *removed);
+
+/**
+ * Register the SQL functions on a connection, done for every connection by
+ * sqlite3_os_init:
+ *   blob_put(data)                  store data in a new blob file, return its id
+ *   blob_get(id [, offset, length]) the blob or a slice of it
+ *   blob_size(id)                   size of the blob, NULL if there is none
+ *   blob_remove(id)                 remove the blob file, 1 if it existed
+ * blob_get with a slice keeps the memory use bounded for blobs of any size.
+ */
+extern int esp32_blob_register(sqlite3 *db, const char **errmsg, const struct sqlite3_api_routines *api);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //SD_CARD_ESP32_BLOB_H
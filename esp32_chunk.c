@@ -0,0 +1,617 @@
+/*
+ * esp32_chunk.c
+ *
+ * Chunked VFS shim. The "esp32-chunk" VFS stripes the main database over
+ * chunk files of CHUNK_BYTES each: chunk 0 is the database path itself,
+ * chunk n is "<path>.nnn". littlefs files stop at LFS_FILE_MAX (2 GiB) and
+ * the esp32 VFS addresses them with 31 bit offsets, the chunks keep every
+ * file well below that, so one database can fill most of the card. Each
+ * chunk also has a short CTZ skip list, a seek walks a few blocks of one
+ * chunk instead of the whole database.
+ *
+ * Locks, the WAL index and device characteristics belong to chunk 0, all
+ * other files (journals, WAL, temp files) are passed through as they are.
+ * A commit that spans chunks is no longer one littlefs metadata commit, use
+ * WAL mode: the WAL is a single file and checkpoints are repeated from it
+ * after a power loss.
+ *
+ * Only CONFIG_SQLITE_CHUNK_OPEN_FILES chunk files stay open per database, the
+ * least recently used one is closed (and so synced) when another is needed.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sdkconfig.h>
+#include "sqlite3.h"
+#include "esp32_vfs.h"
+#include "esp32_chunk.h"
+#include "esp32_trace.h"
+
+#ifdef CONFIG_SQLITE_CHUNK_FILE_MB
+#define CHUNK_BYTES ((sqlite3_int64) CONFIG_SQLITE_CHUNK_FILE_MB << 20)
+#else
+#define CHUNK_BYTES ((sqlite3_int64) 256 << 20)
+#endif
+#ifdef CONFIG_SQLITE_CHUNK_OPEN_FILES
+#define CHUNK_OPEN_MAX CONFIG_SQLITE_CHUNK_OPEN_FILES
+#else
+#define CHUNK_OPEN_MAX 4
+#endif
+/* "<path>.nnn" framed by NULs, see chunk_name */
+#define CHUNK_NAME_MAX 112
+
+typedef struct chunk_slot {
+    sqlite3_file *file;
+    unsigned used;
+    int dirty;
+} chunk_slot;
+
+typedef struct chunk_file {
+    sqlite3_file base;
+    /* chunk 0, or the whole file if it is not striped */
+    sqlite3_file *real;
+    int striped;
+    int flags;
+    char path[CHUNK_NAME_MAX];
+    /* chunk files on the card */
+    int count;
+    int slots;
+    chunk_slot *chunk;
+    int open;
+    unsigned tick;
+    /* I/O counters of chunk files closed since */
+    esp32_file_stats_t closed;
+} chunk_file;
+
+static sqlite3_vfs *chunk_base;
+static sqlite3_vfs chunk_vfs;
+
+/**
+ * Name of chunk n, framed like a filename sqlite passes to xOpen: four
+ * NULs before it (newer sqlite walks back to them from URI parameter
+ * lookups) and two after it, so it has no URI parameters
+ * @return the name inside buf
+ */
+static const char *chunk_name(const char *path, int n, char buf[CHUNK_NAME_MAX])
+{
+    char *name = buf + 4;
+
+    memset(buf, 0, CHUNK_NAME_MAX);
+    if (n == 0)
+        snprintf(name, CHUNK_NAME_MAX - 6, "%s", path);
+    else
+        snprintf(name, CHUNK_NAME_MAX - 6, "%s.%03d", path, n);
+    return name;
+}
+
+static int chunk_exists(const char *path, int n)
+{
+    char buf[CHUNK_NAME_MAX];
+    int result = 0;
+
+    chunk_base->xAccess(chunk_base, chunk_name(path, n, buf), SQLITE_ACCESS_EXISTS, &result);
+    return result;
+}
+
+static void chunk_stats_add(esp32_file_stats_t *to, sqlite3_file *file)
+{
+    esp32_file_stats_t s;
+
+    if (file->pMethods->xFileControl(file, ESP32_FCNTL_IO_STATS, &s) != SQLITE_OK)
+        return;
+    to->reads += s.reads;
+    to->short_reads += s.short_reads;
+    to->seq_reads += s.seq_reads;
+    to->writes += s.writes;
+    to->seq_writes += s.seq_writes;
+    to->syncs += s.syncs;
+    to->read_bytes += s.read_bytes;
+    to->write_bytes += s.write_bytes;
+    to->read_us += s.read_us;
+    to->write_us += s.write_us;
+    to->sync_us += s.sync_us;
+}
+
+static void chunk_close(chunk_file *p, int n)
+{
+    chunk_slot *slot = &p->chunk[n];
+
+    if (n == 0 || !slot->file)
+        return;
+    chunk_stats_add(&p->closed, slot->file);
+    slot->file->pMethods->xClose(slot->file);
+    sqlite3_free(slot->file);
+    slot->file = NULL;
+    slot->dirty = 0;
+    p->open--;
+}
+
+/**
+ * Count the chunk files on the card. Another connection may have grown or
+ * truncated the database since, chunks that went away are closed.
+ */
+static void chunk_count(chunk_file *p)
+{
+    while (chunk_exists(p->path, p->count))
+        p->count++;
+    while (p->count > 1 && !chunk_exists(p->path, p->count - 1))
+        p->count--;
+    for (int n = p->count; n < p->slots; n++)
+        chunk_close(p, n);
+}
+
+/**
+ * Open chunk n, creating it if create is set and the chunk is past the end.
+ * A chunk past the known end is looked for on the card first: a connection
+ * holding SHARED for good in shared WAL mode misses chunks that another
+ * connection's checkpoint added.
+ * @return file or NULL with *rc set, SQLITE_IOERR_SHORT_READ if the chunk does not exist
+ */
+static sqlite3_file *chunk_get(chunk_file *p, int n, int create, int *rc)
+{
+    char buf[CHUNK_NAME_MAX];
+    sqlite3_file *file;
+    int victim = 0;
+
+    *rc = SQLITE_OK;
+    if (n < p->slots && p->chunk[n].file) {
+        p->chunk[n].used = ++p->tick;
+        return p->chunk[n].file;
+    }
+    if (n >= p->count && !create) {
+        chunk_count(p);
+        if (n >= p->count) {
+            *rc = SQLITE_IOERR_SHORT_READ;
+            return NULL;
+        }
+    }
+
+    if (n >= p->slots) {
+        int slots = n + 8;
+        chunk_slot *chunk = (chunk_slot *) sqlite3_realloc(p->chunk, slots * sizeof(chunk_slot));
+
+        if (!chunk) {
+            *rc = SQLITE_NOMEM;
+            return NULL;
+        }
+        memset(chunk + p->slots, 0, (slots - p->slots) * sizeof(chunk_slot));
+        p->chunk = chunk;
+        p->slots = slots;
+    }
+
+    /* chunk 0 is always open and does not count */
+    if (p->open >= CHUNK_OPEN_MAX) {
+        for (int i = 1; i < p->slots; i++) {
+            if (p->chunk[i].file && (!victim || p->chunk[i].used < p->chunk[victim].used))
+                victim = i;
+        }
+        chunk_close(p, victim);
+    }
+
+    file = (sqlite3_file *) sqlite3_malloc(chunk_base->szOsFile);
+    if (!file) {
+        *rc = SQLITE_NOMEM;
+        return NULL;
+    }
+    memset(file, 0, chunk_base->szOsFile);
+    *rc = chunk_base->xOpen(chunk_base, chunk_name(p->path, n, buf), file, p->flags | SQLITE_OPEN_CREATE, NULL);
+    if (*rc != SQLITE_OK) {
+        ESP32_TRACE_E(ESP32_TRACE_OPEN, 0, n, *rc);
+        sqlite3_free(file);
+        return NULL;
+    }
+    p->chunk[n].file = file;
+    p->chunk[n].used = ++p->tick;
+    p->open++;
+    if (n >= p->count)
+        p->count = n + 1;
+    return file;
+}
+
+/**
+ * Make chunk n the last one. Chunks before it must be full or the
+ * database size would not add up, they are filled with zeros.
+ */
+static int chunk_extend(chunk_file *p, int n)
+{
+    sqlite3_file *file;
+    int rc = SQLITE_OK;
+
+    for (int i = p->count - 1; i < n && rc == SQLITE_OK; i++) {
+        file = chunk_get(p, i, 1, &rc);
+        if (file) {
+            rc = file->pMethods->xTruncate(file, CHUNK_BYTES);
+            p->chunk[i].dirty = 1;
+        }
+    }
+    if (rc == SQLITE_OK)
+        chunk_get(p, n, 1, &rc);
+    return rc;
+}
+
+static int chunk_Close(sqlite3_file *id)
+{
+    chunk_file *p = (chunk_file *) id;
+
+    for (int n = 1; n < p->slots; n++)
+        chunk_close(p, n);
+    sqlite3_free(p->chunk);
+    return p->real->pMethods->xClose(p->real);
+}
+
+static int chunk_Read(sqlite3_file *id, void *buffer, int amount, sqlite3_int64 offset)
+{
+    chunk_file *p = (chunk_file *) id;
+    uint8_t *buf = (uint8_t *) buffer;
+    int rc;
+
+    if (!p->striped)
+        return p->real->pMethods->xRead(p->real, buffer, amount, offset);
+
+    while (amount > 0) {
+        int n = (int) (offset / CHUNK_BYTES);
+        sqlite3_int64 ofst = offset % CHUNK_BYTES;
+        int len = CHUNK_BYTES - ofst < amount ? (int) (CHUNK_BYTES - ofst) : amount;
+        sqlite3_file *file = chunk_get(p, n, 0, &rc);
+
+        if (file)
+            rc = file->pMethods->xRead(file, buf, len, ofst);
+        if (rc == SQLITE_IOERR_SHORT_READ) {
+            /* the chunk zero filled its own part, the rest is past the end */
+            memset(buf + len, 0, amount - len);
+            if (!file)
+                memset(buf, 0, len);
+            return rc;
+        }
+        if (rc != SQLITE_OK)
+            return rc;
+        buf += len;
+        offset += len;
+        amount -= len;
+    }
+    return SQLITE_OK;
+}
+
+static int chunk_Write(sqlite3_file *id, const void *buffer, int amount, sqlite3_int64 offset)
+{
+    chunk_file *p = (chunk_file *) id;
+    const uint8_t *buf = (const uint8_t *) buffer;
+    int rc = SQLITE_OK;
+
+    if (!p->striped)
+        return p->real->pMethods->xWrite(p->real, buffer, amount, offset);
+
+    while (amount > 0) {
+        int n = (int) (offset / CHUNK_BYTES);
+        sqlite3_int64 ofst = offset % CHUNK_BYTES;
+        int len = CHUNK_BYTES - ofst < amount ? (int) (CHUNK_BYTES - ofst) : amount;
+        sqlite3_file *file;
+
+        if (n >= p->count)
+            rc = chunk_extend(p, n);
+        file = rc == SQLITE_OK ? chunk_get(p, n, 1, &rc) : NULL;
+        if (file)
+            rc = file->pMethods->xWrite(file, buf, len, ofst);
+        if (rc != SQLITE_OK) {
+            ESP32_TRACE_E(ESP32_TRACE_WRITE, 0, (uint32_t) ofst, rc);
+            return rc;
+        }
+        p->chunk[n].dirty = 1;
+        buf += len;
+        offset += len;
+        amount -= len;
+    }
+    return SQLITE_OK;
+}
+
+static int chunk_Truncate(sqlite3_file *id, sqlite3_int64 size)
+{
+    chunk_file *p = (chunk_file *) id;
+    char buf[CHUNK_NAME_MAX];
+    sqlite3_file *file;
+    int n, rc = SQLITE_OK;
+
+    if (!p->striped)
+        return p->real->pMethods->xTruncate(p->real, size);
+
+    n = size > 0 ? (int) ((size - 1) / CHUNK_BYTES) : 0;
+    if (n >= p->count)
+        rc = chunk_extend(p, n);
+    file = rc == SQLITE_OK ? chunk_get(p, n, 1, &rc) : NULL;
+    if (file)
+        rc = file->pMethods->xTruncate(file, size - (sqlite3_int64) n * CHUNK_BYTES);
+    if (rc != SQLITE_OK)
+        return rc;
+    p->chunk[n].dirty = 1;
+
+    /* whole chunks past the new end go with one remove each */
+    for (int i = p->count - 1; i > n; i--) {
+        if (i < p->slots)
+            chunk_close(p, i);
+        chunk_base->xDelete(chunk_base, chunk_name(p->path, i, buf), 0);
+    }
+    p->count = n + 1;
+    return SQLITE_OK;
+}
+
+static int chunk_Sync(sqlite3_file *id, int flags)
+{
+    chunk_file *p = (chunk_file *) id;
+    int rc = SQLITE_OK;
+
+    /* closed chunks were synced when they were closed */
+    for (int n = 1; n < p->slots && rc == SQLITE_OK; n++) {
+        if (p->chunk[n].file && p->chunk[n].dirty) {
+            rc = p->chunk[n].file->pMethods->xSync(p->chunk[n].file, flags);
+            p->chunk[n].dirty = 0;
+        }
+    }
+    if (rc == SQLITE_OK)
+        rc = p->real->pMethods->xSync(p->real, flags);
+    if (p->striped)
+        p->chunk[0].dirty = 0;
+    return rc;
+}
+
+static int chunk_FileSize(sqlite3_file *id, sqlite3_int64 *size)
+{
+    chunk_file *p = (chunk_file *) id;
+    sqlite3_file *file;
+    int rc;
+
+    /* the size is read at the start of each read transaction, which takes
+     * no lock of its own in shared WAL mode */
+    if (p->striped)
+        chunk_count(p);
+    if (!p->striped || p->count == 1)
+        return p->real->pMethods->xFileSize(p->real, size);
+
+    file = chunk_get(p, p->count - 1, 0, &rc);
+    if (!file)
+        return rc == SQLITE_IOERR_SHORT_READ ? SQLITE_IOERR_FSTAT : rc;
+    rc = file->pMethods->xFileSize(file, size);
+    *size += (sqlite3_int64) (p->count - 1) * CHUNK_BYTES;
+    return rc;
+}
+
+static int chunk_Lock(sqlite3_file *id, int lock)
+{
+    chunk_file *p = (chunk_file *) id;
+    int rc = p->real->pMethods->xLock(p->real, lock);
+
+    /* other connections may have grown or cut the database meanwhile */
+    if (rc == SQLITE_OK && p->striped && lock == SQLITE_LOCK_SHARED)
+        chunk_count(p);
+    return rc;
+}
+
+static int chunk_Unlock(sqlite3_file *id, int lock)
+{
+    chunk_file *p = (chunk_file *) id;
+    return p->real->pMethods->xUnlock(p->real, lock);
+}
+
+static int chunk_CheckReservedLock(sqlite3_file *id, int *result)
+{
+    chunk_file *p = (chunk_file *) id;
+    return p->real->pMethods->xCheckReservedLock(p->real, result);
+}
+
+static int chunk_FileControl(sqlite3_file *id, int op, void *arg)
+{
+    chunk_file *p = (chunk_file *) id;
+
+    if (p->striped) {
+        switch (op) {
+            case SQLITE_FCNTL_SIZE_HINT: {
+                /* preallocate within the last chunk, new chunks grow on write */
+                sqlite3_int64 hint = *(sqlite3_int64 *) arg - (sqlite3_int64) (p->count - 1) * CHUNK_BYTES;
+                sqlite3_file *file;
+                int rc;
+
+                if (hint <= 0)
+                    return SQLITE_OK;
+                if (hint > CHUNK_BYTES)
+                    hint = CHUNK_BYTES;
+                file = chunk_get(p, p->count - 1, 0, &rc);
+                if (!file)
+                    return rc;
+                return file->pMethods->xFileControl(file, op, &hint);
+            }
+            case SQLITE_FCNTL_CHUNK_SIZE:
+                for (int n = 1; n < p->slots; n++) {
+                    if (p->chunk[n].file)
+                        p->chunk[n].file->pMethods->xFileControl(p->chunk[n].file, op, arg);
+                }
+                break;
+            case SQLITE_FCNTL_MMAP_SIZE:
+                /* a mirror of chunk 0 alone is no mapping of the database */
+                *(sqlite3_int64 *) arg = 0;
+                return SQLITE_OK;
+            case ESP32_FCNTL_IO_STATS:
+            case ESP32_FCNTL_IO_STATS_RESET: {
+                /* all chunks together, as one file */
+                esp32_file_stats_t sum = p->closed;
+
+                chunk_stats_add(&sum, p->real);
+                for (int n = 1; n < p->slots; n++) {
+                    if (p->chunk[n].file)
+                        chunk_stats_add(&sum, p->chunk[n].file);
+                }
+                if (op == ESP32_FCNTL_IO_STATS_RESET) {
+                    memset(&p->closed, 0, sizeof(esp32_file_stats_t));
+                    p->real->pMethods->xFileControl(p->real, op, NULL);
+                    for (int n = 1; n < p->slots; n++) {
+                        if (p->chunk[n].file)
+                            p->chunk[n].file->pMethods->xFileControl(p->chunk[n].file, op, NULL);
+                    }
+                }
+                if (arg)
+                    *(esp32_file_stats_t *) arg = sum;
+                return SQLITE_OK;
+            }
+            default:
+                break;
+        }
+    }
+    return p->real->pMethods->xFileControl(p->real, op, arg);
+}
+
+static int chunk_SectorSize(sqlite3_file *id)
+{
+    chunk_file *p = (chunk_file *) id;
+    return p->real->pMethods->xSectorSize(p->real);
+}
+
+static int chunk_DeviceCharacteristics(sqlite3_file *id)
+{
+    chunk_file *p = (chunk_file *) id;
+    return p->real->pMethods->xDeviceCharacteristics(p->real);
+}
+
+static int chunk_ShmMap(sqlite3_file *id, int region, int size, int extend, void volatile **pp)
+{
+    chunk_file *p = (chunk_file *) id;
+    return p->real->pMethods->xShmMap(p->real, region, size, extend, pp);
+}
+
+static int chunk_ShmLock(sqlite3_file *id, int offset, int n, int flags)
+{
+    chunk_file *p = (chunk_file *) id;
+    return p->real->pMethods->xShmLock(p->real, offset, n, flags);
+}
+
+static void chunk_ShmBarrier(sqlite3_file *id)
+{
+    chunk_file *p = (chunk_file *) id;
+    p->real->pMethods->xShmBarrier(p->real);
+}
+
+static int chunk_ShmUnmap(sqlite3_file *id, int delete_flag)
+{
+    chunk_file *p = (chunk_file *) id;
+    return p->real->pMethods->xShmUnmap(p->real, delete_flag);
+}
+
+/* version 2: WAL index through chunk 0, no xFetch across chunk files */
+static const sqlite3_io_methods chunk_io_methods = {
+        2,
+        chunk_Close,
+        chunk_Read,
+        chunk_Write,
+        chunk_Truncate,
+        chunk_Sync,
+        chunk_FileSize,
+        chunk_Lock,
+        chunk_Unlock,
+        chunk_CheckReservedLock,
+        chunk_FileControl,
+        chunk_SectorSize,
+        chunk_DeviceCharacteristics,
+        chunk_ShmMap,
+        chunk_ShmLock,
+        chunk_ShmBarrier,
+        chunk_ShmUnmap
+};
+
+static int chunk_Open(sqlite3_vfs *vfs, const char *path, sqlite3_file *file, int flags, int *outflags)
+{
+    chunk_file *p = (chunk_file *) file;
+    int rc;
+
+    memset(p, 0, sizeof(chunk_file));
+    p->real = (sqlite3_file *) &p[1];
+    p->striped = path && (flags & SQLITE_OPEN_MAIN_DB);
+    p->flags = flags & ~(SQLITE_OPEN_CREATE | SQLITE_OPEN_EXCLUSIVE | SQLITE_OPEN_DELETEONCLOSE);
+    if (p->striped && strlen(path) > (size_t) chunk_vfs.mxPathname) {
+        ESP32_TRACE_E(ESP32_TRACE_OPEN, 0, flags, SQLITE_CANTOPEN);
+        return SQLITE_CANTOPEN;
+    }
+
+    rc = chunk_base->xOpen(chunk_base, path, p->real, flags, outflags);
+    if (rc != SQLITE_OK)
+        return rc;
+    if (p->striped) {
+        strcpy(p->path, path);
+        p->chunk = (chunk_slot *) sqlite3_malloc(8 * sizeof(chunk_slot));
+        if (!p->chunk) {
+            p->real->pMethods->xClose(p->real);
+            return SQLITE_NOMEM;
+        }
+        memset(p->chunk, 0, 8 * sizeof(chunk_slot));
+        p->slots = 8;
+        p->chunk[0].file = p->real;
+        p->count = 1;
+        chunk_count(p);
+    }
+    p->base.pMethods = &chunk_io_methods;
+    return SQLITE_OK;
+}
+
+static int chunk_Delete(sqlite3_vfs *vfs, const char *path, int syncDir)
+{
+    char buf[CHUNK_NAME_MAX];
+    int rc = chunk_base->xDelete(chunk_base, path, syncDir);
+
+    /* journals and WAL files have no chunks, this costs them one stat */
+    for (int n = 1; rc == SQLITE_OK && chunk_exists(path, n); n++) {
+        rc = chunk_base->xDelete(chunk_base, chunk_name(path, n, buf), syncDir);
+    }
+    return rc;
+}
+
+static int chunk_Access(sqlite3_vfs *vfs, const char *path, int flags, int *result)
+{
+    return chunk_base->xAccess(chunk_base, path, flags, result);
+}
+
+static int chunk_FullPathname(sqlite3_vfs *vfs, const char *path, int len, char *fullpath)
+{
+    return chunk_base->xFullPathname(chunk_base, path, len, fullpath);
+}
+
+static int chunk_Randomness(sqlite3_vfs *vfs, int len, char *buffer)
+{
+    return chunk_base->xRandomness(chunk_base, len, buffer);
+}
+
+static int chunk_Sleep(sqlite3_vfs *vfs, int microseconds)
+{
+    return chunk_base->xSleep(chunk_base, microseconds);
+}
+
+static int chunk_CurrentTime(sqlite3_vfs *vfs, double *result)
+{
+    return chunk_base->xCurrentTime(chunk_base, result);
+}
+
+static sqlite3_vfs chunk_vfs = {
+        1,			// iVersion
+        0,			// szOsFile, set on register
+        0,			// mxPathname, set on register
+        NULL,			// pNext
+        "esp32-chunk",		// name
+        NULL,			// pAppData
+        chunk_Open,		// xOpen
+        chunk_Delete,		// xDelete
+        chunk_Access,		// xAccess
+        chunk_FullPathname,	// xFullPathname
+        NULL,			// xDlOpen
+        NULL,			// xDlError
+        NULL,			// xDlSym
+        NULL,			// xDlClose
+        chunk_Randomness,	// xRandomness
+        chunk_Sleep,		// xSleep
+        chunk_CurrentTime,	// xCurrentTime
+        NULL			// xGetLastError
+};
+
+int esp32_chunk_register(sqlite3_vfs *base)
+{
+    chunk_base = base;
+    chunk_vfs.szOsFile = sizeof(chunk_file) + base->szOsFile;
+    /* room for the ".nnn" of the chunk names within the esp32 name limit */
+    chunk_vfs.mxPathname = base->mxPathname - 6;
+    return sqlite3_vfs_register(&chunk_vfs, 0);
+}
@@ -0,0 +1,600 @@
+/*
+ * esp32_crypt.c
+ *
+ * Encrypting VFS shim. The "esp32-crypt" VFS encrypts the main and temp
+ * databases with AES-XTS in 512 byte data units, the unit number is the
+ * tweak, and journals, WAL and other temp files with AES-CTR keyed by file
+ * offset. All cipher work goes through mbedtls, which uses the ESP32 AES
+ * peripheral when CONFIG_MBEDTLS_HARDWARE_AES is set.
+ *
+ * The CTR files are rewritten from the start over and over: a WAL after
+ * every checkpoint restart, a persistent journal for every transaction. So
+ * the counter does not repeat, an 8 byte random salt in front of the file
+ * is the nonce, and a new salt starts a new generation whenever the file is
+ * truncated to zero or its header at offset 0 is written again. What was
+ * written under the old salt is stale by then and is never read back.
+ *
+ * Reads are decrypted in place in the caller's buffer. Writes are encrypted
+ * into a per-file buffer sized on the first write: sqlite keeps using the
+ * page after xWrite, so encrypting it in place would cost a second pass to
+ * restore it.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "mbedtls/aes.h"
+#include "sqlite3.h"
+#include "esp32_vfs.h"
+#include "esp32_crypt.h"
+#include "esp32_trace.h"
+
+#if !defined(MBEDTLS_CIPHER_MODE_XTS) || !defined(MBEDTLS_CIPHER_MODE_CTR)
+#error "esp32_crypt.c needs MBEDTLS_CIPHER_MODE_XTS and MBEDTLS_CIPHER_MODE_CTR"
+#endif
+
+#define CRYPT_UNIT 512
+#define CRYPT_UNIT_SHIFT 9
+/* salt in front of a CTR file */
+#define CRYPT_SALT 8
+/* a write of at least a journal header at offset 0, the WAL header is 32 */
+#define CRYPT_NEW_GENERATION 28
+
+typedef struct crypt_file crypt_file;
+struct crypt_file {
+    sqlite3_file base;
+    sqlite3_file *real;
+    int is_main;
+    /* page files in XTS data units, else CTR behind a salt */
+    int xts;
+    /* CTR file without a salt yet, one is written before the next write */
+    int fresh;
+    const char *path;
+    crypt_file *next_main;
+    uint8_t key[64];
+    int key_len;
+    mbedtls_aes_xts_context xts_enc;
+    mbedtls_aes_xts_context xts_dec;
+    mbedtls_aes_context ctr;
+    uint8_t ctr_nonce[8];
+    uint8_t *out;
+    int out_size;
+    uint8_t unit[CRYPT_UNIT];
+};
+
+static sqlite3_vfs *crypt_base;
+static crypt_file *crypt_mains;
+static uint8_t crypt_key[64];
+static int crypt_key_len;
+
+static void crypt_tweak(uint8_t tweak[16], sqlite3_int64 unit)
+{
+    memset(tweak, 0, 16);
+    for (int i = 0; i < 8; i++)
+        tweak[i] = (uint8_t) (unit >> (8 * i));
+}
+
+/**
+ * XTS over whole data units starting at a unit aligned offset
+ */
+static int crypt_xts(crypt_file *p, int mode, const uint8_t *in, uint8_t *out, int amount, sqlite3_int64 offset)
+{
+    mbedtls_aes_xts_context *ctx = mode == MBEDTLS_AES_ENCRYPT ? &p->xts_enc : &p->xts_dec;
+    sqlite3_int64 unit = offset >> CRYPT_UNIT_SHIFT;
+    uint8_t tweak[16];
+
+    for (int done = 0; done < amount; done += CRYPT_UNIT, unit++) {
+        crypt_tweak(tweak, unit);
+        if (mbedtls_aes_crypt_xts(ctx, mode, CRYPT_UNIT, tweak, in + done, out + done))
+            return SQLITE_IOERR;
+    }
+    return SQLITE_OK;
+}
+
+/**
+ * CTR keystream for an arbitrary byte range, the counter is the salt and
+ * the 16 byte block index of the file offset
+ */
+static int crypt_ctr(crypt_file *p, const uint8_t *in, uint8_t *out, int amount, sqlite3_int64 offset)
+{
+    uint8_t counter[16], stream[16];
+    uint64_t block = (uint64_t) offset >> 4;
+    size_t off = offset & 15;
+
+    memcpy(counter, p->ctr_nonce, 8);
+    for (int i = 0; i < 8; i++)
+        counter[15 - i] = (uint8_t) (block >> (8 * i));
+
+    /* start in the middle of a block: precompute its keystream and step on */
+    if (off) {
+        if (mbedtls_aes_crypt_ecb(&p->ctr, MBEDTLS_AES_ENCRYPT, counter, stream))
+            return SQLITE_IOERR;
+        for (int i = 15; i >= 8 && ++counter[i] == 0; i--)
+            ;
+    }
+    if (mbedtls_aes_crypt_ctr(&p->ctr, amount, &off, counter, stream, in, out))
+        return SQLITE_IOERR;
+    return SQLITE_OK;
+}
+
+static int crypt_reserve(crypt_file *p, int amount)
+{
+    uint8_t *out;
+
+    if (amount <= p->out_size)
+        return SQLITE_OK;
+    out = (uint8_t *) sqlite3_realloc(p->out, amount);
+    if (!out)
+        return SQLITE_NOMEM;
+    p->out = out;
+    p->out_size = amount;
+    return SQLITE_OK;
+}
+
+/**
+ * Start a new generation of a CTR file under a fresh random salt
+ */
+static int crypt_generation(crypt_file *p)
+{
+    int rc;
+
+    crypt_base->xRandomness(crypt_base, CRYPT_SALT, (char *) p->ctr_nonce);
+    rc = p->real->pMethods->xWrite(p->real, p->ctr_nonce, CRYPT_SALT, 0);
+    if (rc == SQLITE_OK)
+        p->fresh = 0;
+    return rc;
+}
+
+/**
+ * Bytes of a short read that really came from the file, the VFS zero fills
+ * the rest and that must stay zero
+ */
+static int crypt_valid_bytes(crypt_file *p, int amount, sqlite3_int64 offset)
+{
+    sqlite3_int64 size = 0;
+
+    if (p->real->pMethods->xFileSize(p->real, &size) != SQLITE_OK || size <= offset)
+        return 0;
+    return size - offset < amount ? (int) (size - offset) : amount;
+}
+
+/**
+ * Read-modify-write or partial read of a single main database data unit
+ */
+static int crypt_unit_load(crypt_file *p, sqlite3_int64 unit)
+{
+    int rc = p->real->pMethods->xRead(p->real, p->unit, CRYPT_UNIT, unit << CRYPT_UNIT_SHIFT);
+
+    if (rc == SQLITE_IOERR_SHORT_READ) {
+        /* past the end of file the plaintext is zeros */
+        memset(p->unit, 0, CRYPT_UNIT);
+        return rc;
+    }
+    if (rc != SQLITE_OK)
+        return rc;
+    return crypt_xts(p, MBEDTLS_AES_DECRYPT, p->unit, p->unit, CRYPT_UNIT, unit << CRYPT_UNIT_SHIFT);
+}
+
+static int crypt_Close(sqlite3_file *id)
+{
+    crypt_file *p = (crypt_file *) id;
+    int rc = p->real->pMethods->xClose(p->real);
+    sqlite3_mutex *mutex = sqlite3_mutex_alloc(SQLITE_MUTEX_STATIC_VFS1);
+
+    sqlite3_mutex_enter(mutex);
+    for (crypt_file **link = &crypt_mains; *link; link = &(*link)->next_main) {
+        if (*link == p) {
+            *link = p->next_main;
+            break;
+        }
+    }
+    sqlite3_mutex_leave(mutex);
+    mbedtls_aes_xts_free(&p->xts_enc);
+    mbedtls_aes_xts_free(&p->xts_dec);
+    mbedtls_aes_free(&p->ctr);
+    if (p->out)
+        memset(p->out, 0, p->out_size);
+    sqlite3_free(p->out);
+    memset(p->unit, 0, sizeof(p->unit));
+    memset(p->key, 0, sizeof(p->key));
+    return rc;
+}
+
+static int crypt_Read(sqlite3_file *id, void *buffer, int amount, sqlite3_int64 offset)
+{
+    crypt_file *p = (crypt_file *) id;
+    uint8_t *buf = (uint8_t *) buffer;
+    int rc, valid, ret;
+
+    if (!p->xts || ((offset | amount) & (CRYPT_UNIT - 1))) {
+        if (p->xts) {
+            /* database header and other sub-unit reads */
+            ret = SQLITE_OK;
+            while (amount > 0) {
+                sqlite3_int64 unit = offset >> CRYPT_UNIT_SHIFT;
+                int skip = (int) (offset & (CRYPT_UNIT - 1));
+                int n = CRYPT_UNIT - skip < amount ? CRYPT_UNIT - skip : amount;
+
+                rc = crypt_unit_load(p, unit);
+                if (rc == SQLITE_IOERR_SHORT_READ)
+                    ret = rc;
+                else if (rc != SQLITE_OK)
+                    return rc;
+                memcpy(buf, p->unit + skip, n);
+                buf += n;
+                offset += n;
+                amount -= n;
+            }
+            return ret;
+        }
+
+        rc = p->real->pMethods->xRead(p->real, buffer, amount, offset + CRYPT_SALT);
+        valid = rc == SQLITE_IOERR_SHORT_READ ? crypt_valid_bytes(p, amount, offset + CRYPT_SALT) : amount;
+        if ((rc == SQLITE_OK || rc == SQLITE_IOERR_SHORT_READ) && valid > 0) {
+            ret = crypt_ctr(p, buf, buf, valid, offset);
+            if (ret != SQLITE_OK)
+                return ret;
+        }
+        return rc;
+    }
+
+    rc = p->real->pMethods->xRead(p->real, buffer, amount, offset);
+    valid = amount;
+    if (rc == SQLITE_IOERR_SHORT_READ)
+        valid = crypt_valid_bytes(p, amount, offset) & ~(CRYPT_UNIT - 1);
+    else if (rc != SQLITE_OK)
+        return rc;
+    if (valid > 0) {
+        ret = crypt_xts(p, MBEDTLS_AES_DECRYPT, buf, buf, valid, offset);
+        if (ret != SQLITE_OK)
+            return ret;
+    }
+    return rc;
+}
+
+static int crypt_Write(sqlite3_file *id, const void *buffer, int amount, sqlite3_int64 offset)
+{
+    crypt_file *p = (crypt_file *) id;
+    const uint8_t *buf = (const uint8_t *) buffer;
+    int rc;
+
+    if (p->xts && ((offset | amount) & (CRYPT_UNIT - 1))) {
+        while (amount > 0) {
+            sqlite3_int64 unit = offset >> CRYPT_UNIT_SHIFT;
+            int skip = (int) (offset & (CRYPT_UNIT - 1));
+            int n = CRYPT_UNIT - skip < amount ? CRYPT_UNIT - skip : amount;
+
+            rc = crypt_unit_load(p, unit);
+            if (rc != SQLITE_OK && rc != SQLITE_IOERR_SHORT_READ)
+                return rc;
+            memcpy(p->unit + skip, buf, n);
+            rc = crypt_xts(p, MBEDTLS_AES_ENCRYPT, p->unit, p->unit, CRYPT_UNIT, unit << CRYPT_UNIT_SHIFT);
+            if (rc == SQLITE_OK)
+                rc = p->real->pMethods->xWrite(p->real, p->unit, CRYPT_UNIT, unit << CRYPT_UNIT_SHIFT);
+            if (rc != SQLITE_OK)
+                return rc;
+            buf += n;
+            offset += n;
+            amount -= n;
+        }
+        return SQLITE_OK;
+    }
+
+    rc = crypt_reserve(p, amount);
+    if (rc != SQLITE_OK)
+        return rc;
+    if (p->xts) {
+        rc = crypt_xts(p, MBEDTLS_AES_ENCRYPT, buf, p->out, amount, offset);
+    } else {
+        if (p->fresh || (offset == 0 && amount >= CRYPT_NEW_GENERATION))
+            rc = crypt_generation(p);
+        if (rc == SQLITE_OK)
+            rc = crypt_ctr(p, buf, p->out, amount, offset);
+    }
+    if (rc != SQLITE_OK) {
+        ESP32_TRACE_E(ESP32_TRACE_WRITE, 0, (uint32_t) offset, rc);
+        return rc;
+    }
+    return p->real->pMethods->xWrite(p->real, p->out, amount, p->xts ? offset : offset + CRYPT_SALT);
+}
+
+static int crypt_Truncate(sqlite3_file *id, sqlite3_int64 size)
+{
+    crypt_file *p = (crypt_file *) id;
+
+    if (p->xts)
+        return p->real->pMethods->xTruncate(p->real, size);
+    /* an emptied file starts over under a new salt */
+    if (size == 0)
+        p->fresh = 1;
+    return p->real->pMethods->xTruncate(p->real, size ? size + CRYPT_SALT : 0);
+}
+
+static int crypt_Sync(sqlite3_file *id, int flags)
+{
+    crypt_file *p = (crypt_file *) id;
+    return p->real->pMethods->xSync(p->real, flags);
+}
+
+static int crypt_FileSize(sqlite3_file *id, sqlite3_int64 *size)
+{
+    crypt_file *p = (crypt_file *) id;
+    int rc = p->real->pMethods->xFileSize(p->real, size);
+
+    if (rc == SQLITE_OK && !p->xts)
+        *size = *size > CRYPT_SALT ? *size - CRYPT_SALT : 0;
+    return rc;
+}
+
+static int crypt_Lock(sqlite3_file *id, int lock)
+{
+    crypt_file *p = (crypt_file *) id;
+    return p->real->pMethods->xLock(p->real, lock);
+}
+
+static int crypt_Unlock(sqlite3_file *id, int lock)
+{
+    crypt_file *p = (crypt_file *) id;
+    return p->real->pMethods->xUnlock(p->real, lock);
+}
+
+static int crypt_CheckReservedLock(sqlite3_file *id, int *result)
+{
+    crypt_file *p = (crypt_file *) id;
+    return p->real->pMethods->xCheckReservedLock(p->real, result);
+}
+
+static int crypt_FileControl(sqlite3_file *id, int op, void *arg)
+{
+    crypt_file *p = (crypt_file *) id;
+    return p->real->pMethods->xFileControl(p->real, op, arg);
+}
+
+static int crypt_SectorSize(sqlite3_file *id)
+{
+    crypt_file *p = (crypt_file *) id;
+    int size = p->real->pMethods->xSectorSize(p->real);
+
+    /* sqlite must never rewrite less than one data unit */
+    return size < CRYPT_UNIT ? CRYPT_UNIT : size;
+}
+
+static int crypt_DeviceCharacteristics(sqlite3_file *id)
+{
+    crypt_file *p = (crypt_file *) id;
+    return p->real->pMethods->xDeviceCharacteristics(p->real);
+}
+
+/* version 1: ciphertext cannot be handed out by xFetch, so no mmap */
+static const sqlite3_io_methods crypt_io_methods = {
+        1,
+        crypt_Close,
+        crypt_Read,
+        crypt_Write,
+        crypt_Truncate,
+        crypt_Sync,
+        crypt_FileSize,
+        crypt_Lock,
+        crypt_Unlock,
+        crypt_CheckReservedLock,
+        crypt_FileControl,
+        crypt_SectorSize,
+        crypt_DeviceCharacteristics
+};
+
+static int crypt_hex(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+/**
+ * Key for a file. A main database takes the hexkey URI parameter, else the
+ * key set with esp32_vfs_crypt_key. Journals and WAL files take the key of
+ * their open main database, temp files a random one.
+ * @return key length in bytes, 0 if there is none
+ */
+static int crypt_file_key(const char *path, int flags, uint8_t key[64])
+{
+    const char *hex;
+    int len;
+
+    if (!path) {
+        crypt_base->xRandomness(crypt_base, 32, (char *) key);
+        return 32;
+    }
+    if (!(flags & SQLITE_OPEN_MAIN_DB)) {
+        /* mains of other connections come and go from other tasks */
+        sqlite3_mutex *mutex = sqlite3_mutex_alloc(SQLITE_MUTEX_STATIC_VFS1);
+
+        sqlite3_mutex_enter(mutex);
+        for (crypt_file *m = crypt_mains; m; m = m->next_main) {
+            len = strlen(m->path);
+            if (!strncmp(path, m->path, len) && path[len] == '-') {
+                memcpy(key, m->key, m->key_len);
+                sqlite3_mutex_leave(mutex);
+                return m->key_len;
+            }
+        }
+        sqlite3_mutex_leave(mutex);
+        memcpy(key, crypt_key, crypt_key_len);
+        return crypt_key_len;
+    }
+
+    hex = sqlite3_uri_parameter(path, "hexkey");
+    if (!hex) {
+        memcpy(key, crypt_key, crypt_key_len);
+        return crypt_key_len;
+    }
+    len = strlen(hex);
+    if (len != 64 && len != 128)
+        return 0;
+    for (int i = 0; i < len / 2; i++) {
+        int hi = crypt_hex(hex[2 * i]), lo = crypt_hex(hex[2 * i + 1]);
+        if (hi < 0 || lo < 0)
+            return 0;
+        key[i] = (uint8_t) (hi << 4 | lo);
+    }
+    return len / 2;
+}
+
+static int crypt_setup(crypt_file *p, const uint8_t *key, int key_len)
+{
+    uint8_t ctr_key[32], block[16];
+    int bits = key_len * 4;
+    int rc = 0;
+
+    mbedtls_aes_xts_init(&p->xts_enc);
+    mbedtls_aes_xts_init(&p->xts_dec);
+    mbedtls_aes_init(&p->ctr);
+
+    rc |= mbedtls_aes_xts_setkey_enc(&p->xts_enc, key, key_len * 8);
+    rc |= mbedtls_aes_xts_setkey_dec(&p->xts_dec, key, key_len * 8);
+
+    /* derive the CTR key instead of reusing the XTS data key */
+    rc |= mbedtls_aes_setkey_enc(&p->ctr, key, bits);
+    for (int i = 0; i < bits / 128 && !rc; i++) {
+        memset(block, 0, sizeof(block));
+        memcpy(block, "esp32-crypt-ctr", 15);
+        block[15] = (uint8_t) i;
+        rc |= mbedtls_aes_crypt_ecb(&p->ctr, MBEDTLS_AES_ENCRYPT, block, ctr_key + 16 * i);
+    }
+    rc |= mbedtls_aes_setkey_enc(&p->ctr, ctr_key, bits);
+    memset(ctr_key, 0, sizeof(ctr_key));
+
+    return rc ? SQLITE_CANTOPEN : SQLITE_OK;
+}
+
+/**
+ * Read the salt of an existing CTR file, a new or empty one gets its salt
+ * with the first write
+ */
+static int crypt_load_salt(crypt_file *p)
+{
+    int rc = p->real->pMethods->xRead(p->real, p->ctr_nonce, CRYPT_SALT, 0);
+
+    if (rc == SQLITE_IOERR_SHORT_READ) {
+        p->fresh = 1;
+        return SQLITE_OK;
+    }
+    return rc;
+}
+
+static int crypt_Open(sqlite3_vfs *vfs, const char *path, sqlite3_file *file, int flags, int *outflags)
+{
+    crypt_file *p = (crypt_file *) file;
+    int rc;
+
+    memset(p, 0, sizeof(crypt_file));
+    p->real = (sqlite3_file *) &p[1];
+    p->is_main = (flags & SQLITE_OPEN_MAIN_DB) != 0;
+    /* temp databases rewrite pages in place like the main one */
+    p->xts = (flags & (SQLITE_OPEN_MAIN_DB | SQLITE_OPEN_TEMP_DB | SQLITE_OPEN_TRANSIENT_DB)) != 0;
+
+    p->key_len = crypt_file_key(path, flags, p->key);
+    if (p->key_len != 32 && p->key_len != 64) {
+        ESP32_TRACE_E(ESP32_TRACE_OPEN, 0, flags, SQLITE_AUTH);
+        return SQLITE_AUTH;
+    }
+    rc = crypt_setup(p, p->key, p->key_len);
+    if (rc == SQLITE_OK)
+        rc = crypt_base->xOpen(crypt_base, path, p->real, flags, outflags);
+    if (rc == SQLITE_OK && !p->xts) {
+        rc = crypt_load_salt(p);
+        if (rc != SQLITE_OK)
+            p->real->pMethods->xClose(p->real);
+    }
+    if (rc != SQLITE_OK) {
+        mbedtls_aes_xts_free(&p->xts_enc);
+        mbedtls_aes_xts_free(&p->xts_dec);
+        mbedtls_aes_free(&p->ctr);
+        memset(p->key, 0, sizeof(p->key));
+        return rc;
+    }
+    if (p->is_main) {
+        sqlite3_mutex *mutex = sqlite3_mutex_alloc(SQLITE_MUTEX_STATIC_VFS1);
+
+        p->path = path;
+        sqlite3_mutex_enter(mutex);
+        p->next_main = crypt_mains;
+        crypt_mains = p;
+        sqlite3_mutex_leave(mutex);
+    }
+    p->base.pMethods = &crypt_io_methods;
+    return SQLITE_OK;
+}
+
+static int crypt_Delete(sqlite3_vfs *vfs, const char *path, int syncDir)
+{
+    return crypt_base->xDelete(crypt_base, path, syncDir);
+}
+
+static int crypt_Access(sqlite3_vfs *vfs, const char *path, int flags, int *result)
+{
+    return crypt_base->xAccess(crypt_base, path, flags, result);
+}
+
+static int crypt_FullPathname(sqlite3_vfs *vfs, const char *path, int len, char *fullpath)
+{
+    return crypt_base->xFullPathname(crypt_base, path, len, fullpath);
+}
+
+static int crypt_Randomness(sqlite3_vfs *vfs, int len, char *buffer)
+{
+    return crypt_base->xRandomness(crypt_base, len, buffer);
+}
+
+static int crypt_Sleep(sqlite3_vfs *vfs, int microseconds)
+{
+    return crypt_base->xSleep(crypt_base, microseconds);
+}
+
+static int crypt_CurrentTime(sqlite3_vfs *vfs, double *result)
+{
+    return crypt_base->xCurrentTime(crypt_base, result);
+}
+
+static sqlite3_vfs crypt_vfs = {
+        1,			// iVersion
+        0,			// szOsFile, set on register
+        0,			// mxPathname, set on register
+        NULL,			// pNext
+        "esp32-crypt",		// name
+        NULL,			// pAppData
+        crypt_Open,		// xOpen
+        crypt_Delete,		// xDelete
+        crypt_Access,		// xAccess
+        crypt_FullPathname,	// xFullPathname
+        NULL,			// xDlOpen
+        NULL,			// xDlError
+        NULL,			// xDlSym
+        NULL,			// xDlClose
+        crypt_Randomness,	// xRandomness
+        crypt_Sleep,		// xSleep
+        crypt_CurrentTime,	// xCurrentTime
+        NULL			// xGetLastError
+};
+
+int esp32_vfs_crypt_key(const void *key, int len)
+{
+    if (len != 0 && len != 32 && len != 64)
+        return SQLITE_MISUSE;
+    memset(crypt_key, 0, sizeof(crypt_key));
+    if (len)
+        memcpy(crypt_key, key, len);
+    crypt_key_len = len;
+    return SQLITE_OK;
+}
+
+int esp32_crypt_register(sqlite3_vfs *base)
+{
+    crypt_base = base;
+    crypt_vfs.szOsFile = sizeof(crypt_file) + base->szOsFile;
+    crypt_vfs.mxPathname = base->mxPathname;
+    return sqlite3_vfs_register(&crypt_vfs, 0);
+}
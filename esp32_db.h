@@ -0,0 +1,314 @@
+//
+// Header-only C++ wrapper for sqlite3 connections and statements
+//
+// Database and Statement own their handles and are move-only. Rows are read
+// through a range-for over the statement, column accessors return the
+// native type or a view into sqlite's own buffer, valid until the next
+// step, reset or finalize. Nothing is converted to text unless asked for.
+// Errors are status codes as in the C API, C++ exceptions are off in
+// ESP-IDF by default.
+//
+//     esp32db::Database db("data/log.db");
+//     esp32db::Statement stmt = db.prepare("SELECT ts, value FROM samples WHERE ts > ?1");
+//     stmt.bind(1, since);
+//     for (esp32db::Row row : stmt)
+//         total += row.real(1);
+//     if (stmt.rc() != SQLITE_DONE)
+//         printf("%s\n", db.errmsg());
+//
+
+#ifndef SD_CARD_ESP32_DB_H
+#define SD_CARD_ESP32_DB_H
+
+#include <stddef.h>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include "sqlite3.h"
+#include "esp32_stmt_cache.h"
+#include "esp32_profile.h"
+
+namespace esp32db {
+
+/**
+ * Blob column or parameter, a view of bytes owned by someone else
+ */
+struct Blob {
+    const void *data;
+    size_t size;
+};
+
+/**
+ * One result row, a view of the statement's current row
+ */
+class Row {
+public:
+    explicit Row(sqlite3_stmt *stmt) : stmt_(stmt) {}
+
+    int count() const { return sqlite3_column_count(stmt_); }
+    int type(int col) const { return sqlite3_column_type(stmt_, col); }
+    bool is_null(int col) const { return type(col) == SQLITE_NULL; }
+    const char *name(int col) const { return sqlite3_column_name(stmt_, col); }
+
+    int integer(int col) const { return sqlite3_column_int(stmt_, col); }
+    sqlite3_int64 int64(int col) const { return sqlite3_column_int64(stmt_, col); }
+    double real(int col) const { return sqlite3_column_double(stmt_, col); }
+
+    /**
+     * Text of a column, converted by sqlite only if it is stored as a number
+     */
+    std::string_view text(int col) const
+    {
+        const char *data = (const char *) sqlite3_column_text(stmt_, col);
+        return data ? std::string_view(data, sqlite3_column_bytes(stmt_, col)) : std::string_view();
+    }
+
+    Blob blob(int col) const
+    {
+        const void *data = sqlite3_column_blob(stmt_, col);
+        return Blob{data, data ? (size_t) sqlite3_column_bytes(stmt_, col) : 0};
+    }
+
+    sqlite3_stmt *handle() const { return stmt_; }
+
+private:
+    sqlite3_stmt *stmt_;
+};
+
+/**
+ * Input iterator stepping a statement, equal to end() once step stops
+ * returning SQLITE_ROW
+ */
+class RowIterator {
+public:
+    RowIterator(sqlite3_stmt *stmt, int *rc) : stmt_(stmt), rc_(rc) { step(); }
+    RowIterator() : stmt_(nullptr), rc_(nullptr) {}
+
+    Row operator*() const { return Row(stmt_); }
+    RowIterator &operator++()
+    {
+        step();
+        return *this;
+    }
+    bool operator==(const RowIterator &other) const { return stmt_ == other.stmt_; }
+    bool operator!=(const RowIterator &other) const { return stmt_ != other.stmt_; }
+
+private:
+    void step()
+    {
+        *rc_ = esp32_profile_step(stmt_);
+        if (*rc_ != SQLITE_ROW)
+            stmt_ = nullptr;
+    }
+
+    sqlite3_stmt *stmt_;
+    int *rc_;
+};
+
+/**
+ * Prepared statement, finalized by the destructor or returned to the
+ * statement cache it came from
+ */
+class Statement {
+public:
+    Statement() = default;
+    Statement(sqlite3 *db, const char *sql) { rc_ = sqlite3_prepare_v2(db, sql, -1, &stmt_, nullptr); }
+    /** Take the statement out of a cache, see esp32_stmt_cache_get */
+    Statement(esp32_stmt_cache_t *cache, const char *sql) : cache_(cache)
+    {
+        rc_ = esp32_stmt_cache_get(cache, sql, &stmt_);
+    }
+    /** Take over a statement prepared elsewhere */
+    explicit Statement(sqlite3_stmt *stmt) : stmt_(stmt) {}
+    ~Statement() { drop(); }
+
+    Statement(const Statement &) = delete;
+    Statement &operator=(const Statement &) = delete;
+    Statement(Statement &&other) noexcept : stmt_(other.stmt_), cache_(other.cache_), rc_(other.rc_)
+    {
+        other.stmt_ = nullptr;
+    }
+    Statement &operator=(Statement &&other) noexcept
+    {
+        if (this != &other) {
+            drop();
+            stmt_ = other.stmt_;
+            cache_ = other.cache_;
+            rc_ = other.rc_;
+            other.stmt_ = nullptr;
+        }
+        return *this;
+    }
+
+    /** Prepared without error */
+    bool ok() const { return stmt_ != nullptr; }
+    /** Result of the prepare or of the last step */
+    int rc() const { return rc_; }
+    sqlite3_stmt *handle() const { return stmt_; }
+    /** Give up ownership, the caller finalizes */
+    sqlite3_stmt *release()
+    {
+        sqlite3_stmt *stmt = stmt_;
+        stmt_ = nullptr;
+        return stmt;
+    }
+
+    /**
+     * Any integer or enum: int32_t is long on Xtensa, so int and
+     * sqlite3_int64 overloads alone would leave it and unsigned ambiguous.
+     * Types that fit an int go to sqlite3_bind_int, the rest, unsigned int
+     * included, to sqlite3_bind_int64; a uint64_t above INT64_MAX wraps.
+     */
+    template<typename T, typename std::enable_if<std::is_integral<T>::value || std::is_enum<T>::value, int>::type = 0>
+    int bind(int idx, T value)
+    {
+        using U = typename std::conditional<std::is_enum<T>::value, std::underlying_type<T>,
+                                            std::common_type<T>>::type::type;
+
+        if constexpr (sizeof(U) < sizeof(int) || (sizeof(U) == sizeof(int) && std::is_signed<U>::value))
+            return sqlite3_bind_int(stmt_, idx, (int) value);
+        else
+            return sqlite3_bind_int64(stmt_, idx, (sqlite3_int64) value);
+    }
+    int bind(int idx, double value) { return sqlite3_bind_double(stmt_, idx, value); }
+    int bind(int idx, std::nullptr_t) { return sqlite3_bind_null(stmt_, idx); }
+    /** Text and blobs are not copied, they must outlive the step */
+    int bind(int idx, const char *value) { return sqlite3_bind_text(stmt_, idx, value, -1, SQLITE_STATIC); }
+    int bind(int idx, std::string_view value)
+    {
+        return sqlite3_bind_text(stmt_, idx, value.data(), (int) value.size(), SQLITE_STATIC);
+    }
+    int bind(int idx, Blob value) { return sqlite3_bind_blob(stmt_, idx, value.data, (int) value.size, SQLITE_STATIC); }
+
+    /**
+     * Bind all parameters from ?1 on
+     * @return SQLITE_OK or the first bind error
+     */
+    template<typename... Args>
+    int bind_all(Args &&... args)
+    {
+        int idx = 0, rc = SQLITE_OK;
+        ((rc = rc == SQLITE_OK ? bind(++idx, std::forward<Args>(args)) : rc), ...);
+        return rc;
+    }
+
+    /** One step, SQLITE_ROW, SQLITE_DONE or an error */
+    int step() { return rc_ = esp32_profile_step(stmt_); }
+    /** Current row after step() returned SQLITE_ROW */
+    Row row() const { return Row(stmt_); }
+
+    /**
+     * Run a statement without result rows and reset it for the next use
+     * @return SQLITE_DONE on success
+     */
+    int exec()
+    {
+        step();
+        esp32_profile_reset(stmt_);
+        return rc_;
+    }
+
+    int reset() { return esp32_profile_reset(stmt_); }
+    int clear_bindings() { return sqlite3_clear_bindings(stmt_); }
+
+    /**
+     * Resets and steps the statement, rc() tells SQLITE_DONE from an error
+     * afterwards. The reset is needed with SQLITE_OMIT_AUTORESET, a second
+     * loop over a finished statement would otherwise get SQLITE_MISUSE.
+     * Bindings are kept.
+     */
+    RowIterator begin()
+    {
+        if (!stmt_)
+            return RowIterator();
+        esp32_profile_reset(stmt_);
+        return RowIterator(stmt_, &rc_);
+    }
+    RowIterator end() { return RowIterator(); }
+
+private:
+    void drop()
+    {
+        if (cache_)
+            esp32_stmt_cache_put(cache_, stmt_);
+        else
+            sqlite3_finalize(stmt_);
+    }
+
+    sqlite3_stmt *stmt_ = nullptr;
+    esp32_stmt_cache_t *cache_ = nullptr;
+    int rc_ = SQLITE_OK;
+};
+
+/**
+ * Database connection, closed by the destructor
+ */
+class Database {
+public:
+    Database() = default;
+    explicit Database(const char *path, int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE,
+                      const char *vfs = nullptr)
+    {
+        open(path, flags, vfs);
+    }
+    /** Take over a connection opened elsewhere */
+    explicit Database(sqlite3 *db) : db_(db) {}
+    ~Database() { close(); }
+
+    Database(const Database &) = delete;
+    Database &operator=(const Database &) = delete;
+    Database(Database &&other) noexcept : db_(other.db_), rc_(other.rc_) { other.db_ = nullptr; }
+    Database &operator=(Database &&other) noexcept
+    {
+        if (this != &other) {
+            close();
+            db_ = other.db_;
+            rc_ = other.rc_;
+            other.db_ = nullptr;
+        }
+        return *this;
+    }
+
+    int open(const char *path, int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, const char *vfs = nullptr)
+    {
+        close();
+        rc_ = sqlite3_open_v2(path, &db_, flags, vfs);
+        if (rc_ != SQLITE_OK) {
+            sqlite3_close(db_);
+            db_ = nullptr;
+        }
+        return rc_;
+    }
+
+    /** Statements still alive keep the connection open until they are finalized */
+    int close()
+    {
+        int rc = sqlite3_close_v2(db_);
+        db_ = nullptr;
+        return rc;
+    }
+
+    bool ok() const { return db_ != nullptr; }
+    /** Result of the open */
+    int rc() const { return rc_; }
+    const char *errmsg() const { return db_ ? sqlite3_errmsg(db_) : sqlite3_errstr(rc_); }
+    sqlite3 *handle() const { return db_; }
+    sqlite3_int64 last_insert_rowid() const { return sqlite3_last_insert_rowid(db_); }
+    int changes() const { return sqlite3_changes(db_); }
+
+    Statement prepare(const char *sql) const { return Statement(db_, sql); }
+
+    /**
+     * Run statements without result rows, e.g. DDL or BEGIN/COMMIT
+     * @return SQLITE_OK on success
+     */
+    int exec(const char *sql) const { return sqlite3_exec(db_, sql, nullptr, nullptr, nullptr); }
+
+private:
+    sqlite3 *db_ = nullptr;
+    int rc_ = SQLITE_OK;
+};
+
+} // namespace esp32db
+
+#endif //SD_CARD_ESP32_DB_H
@@ -0,0 +1,285 @@
+/*
+ * esp32_ingest.c
+ *
+ * High rate ingest: producers copy fixed size records into a single
+ * producer, single consumer ring in internal RAM, a writer task drains it
+ * through one prepared INSERT with an explicit transaction per batch. A
+ * batch is committed when batch_rows records are queued or flush_ms after
+ * the last one, so one commit serves hundreds of rows instead of one
+ * autocommit transaction per row.
+ *
+ * The ring indices run freely and are masked on use. The producer owns
+ * head, the writer owns tail, each publishes its index with a release
+ * store after the slot is filled or consumed, so no lock is taken on
+ * either side and a push from an interrupt handler never waits. The
+ * writer publishes tail only after the batch is committed, a batch that
+ * is rolled back is still queued and written again.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <esp_attr.h>
+#include <esp_timer.h>
+#include <esp_heap_caps.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include "sqlite3.h"
+#include "esp32_ingest.h"
+#include "esp32_profile.h"
+
+#define INGEST_STACK 6144
+/* a batch that finds the database busy is tried again this often, this far apart */
+#define INGEST_BUSY_RETRIES 5
+#define INGEST_BUSY_MS 20
+
+struct esp32_ingest {
+    esp32_ingest_config_t config;
+    sqlite3_stmt *insert;
+    uint8_t *ring;
+    uint32_t mask;
+    /* written by the producer only */
+    volatile uint32_t head;
+    volatile uint32_t dropped;
+    /* written by the writer only */
+    volatile uint32_t tail;
+    volatile int stop;
+    TaskHandle_t task;
+    TaskHandle_t stopper;
+    portMUX_TYPE lock;
+    esp32_ingest_stats_t stats;
+};
+
+/**
+ * Copy a record into the ring
+ * @return queued records including this one, 0 if the ring is full
+ */
+static inline IRAM_ATTR uint32_t ingest_put(esp32_ingest_t *p, const void *record)
+{
+    uint32_t head = p->head;
+    uint32_t tail = __atomic_load_n(&p->tail, __ATOMIC_ACQUIRE);
+
+    if (head - tail > p->mask) {
+        __atomic_add_fetch(&p->dropped, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    memcpy(p->ring + (size_t) (head & p->mask) * p->config.record_size, record, p->config.record_size);
+    __atomic_store_n(&p->head, head + 1, __ATOMIC_RELEASE);
+    return head + 1 - tail;
+}
+
+int esp32_ingest_push(esp32_ingest_t *p, const void *record)
+{
+    uint32_t queued = ingest_put(p, record);
+
+    /* one wakeup per batch, not per record */
+    if (queued == p->config.batch_rows)
+        xTaskNotifyGive(p->task);
+    return queued != 0;
+}
+
+int IRAM_ATTR esp32_ingest_push_from_isr(esp32_ingest_t *p, const void *record, int *woken)
+{
+    uint32_t queued = ingest_put(p, record);
+    BaseType_t higher = pdFALSE;
+
+    if (queued == p->config.batch_rows)
+        vTaskNotifyGiveFromISR(p->task, &higher);
+    if (woken)
+        *woken = higher == pdTRUE;
+    return queued != 0;
+}
+
+/**
+ * Insert records in one transaction and commit it
+ * @param failed receives the records the INSERT rejected, e.g. for a constraint
+ * @param commit_us receives the time the COMMIT took
+ * @return SQLITE_OK once committed, else the error the transaction was rolled back for
+ */
+static int ingest_write(esp32_ingest_t *p, uint32_t tail, uint32_t n, uint32_t *failed, int64_t *commit_us)
+{
+    int64_t start;
+    int rc;
+
+    *failed = 0;
+    *commit_us = 0;
+    rc = sqlite3_exec(p->config.db, "BEGIN", NULL, NULL, NULL);
+    for (uint32_t i = 0; i < n && rc == SQLITE_OK; i++) {
+        const uint8_t *slot = p->ring + (size_t) ((tail + i) & p->mask) * p->config.record_size;
+        int step = p->config.bind(p->insert, slot);
+
+        if (step == SQLITE_OK)
+            step = esp32_profile_step(p->insert);
+        sqlite3_reset(p->insert);
+        sqlite3_clear_bindings(p->insert);
+        if (step == SQLITE_DONE)
+            continue;
+        if (step == SQLITE_CONSTRAINT || step == SQLITE_MISMATCH || step == SQLITE_RANGE) {
+            (*failed)++;
+            p->stats.last_error = step;
+        } else {
+            rc = step;
+        }
+    }
+    if (rc == SQLITE_OK) {
+        start = esp_timer_get_time();
+        rc = sqlite3_exec(p->config.db, "COMMIT", NULL, NULL, NULL);
+        *commit_us = esp_timer_get_time() - start;
+    }
+    if (rc != SQLITE_OK && sqlite3_get_autocommit(p->config.db) == 0)
+        sqlite3_exec(p->config.db, "ROLLBACK", NULL, NULL, NULL);
+    return rc;
+}
+
+/**
+ * Write one batch of at most batch_rows queued records in one transaction.
+ * The records leave the ring only once the COMMIT succeeded; a busy
+ * database is retried, after any other error the batch stays queued for
+ * the next wakeup.
+ * @return records taken from the ring
+ */
+static uint32_t ingest_batch(esp32_ingest_t *p)
+{
+    uint32_t tail = p->tail;
+    uint32_t queued = __atomic_load_n(&p->head, __ATOMIC_ACQUIRE) - tail;
+    uint32_t n = queued < p->config.batch_rows ? queued : p->config.batch_rows;
+    uint32_t failed = 0;
+    int64_t commit_us = 0;
+    int rc;
+
+    if (!n)
+        return 0;
+    for (int attempt = 0;; attempt++) {
+        rc = ingest_write(p, tail, n, &failed, &commit_us);
+        if (rc != SQLITE_BUSY || attempt == INGEST_BUSY_RETRIES)
+            break;
+        vTaskDelay(pdMS_TO_TICKS(INGEST_BUSY_MS));
+    }
+    if (rc == SQLITE_OK) {
+        /* committed, the slots can be reused */
+        __atomic_store_n(&p->tail, tail + n, __ATOMIC_RELEASE);
+    } else {
+        p->stats.last_error = rc;
+        n = failed = 0;
+    }
+
+    portENTER_CRITICAL(&p->lock);
+    p->stats.rows += n - failed;
+    p->stats.batches += n != failed;
+    p->stats.failed += failed;
+    if (queued > p->stats.queued_high)
+        p->stats.queued_high = queued;
+    if (commit_us > p->stats.commit_us_max)
+        p->stats.commit_us_max = (unsigned) commit_us;
+    portEXIT_CRITICAL(&p->lock);
+    return n;
+}
+
+static void ingest_task(void *arg)
+{
+    esp32_ingest_t *p = (esp32_ingest_t *) arg;
+    TickType_t wait = pdMS_TO_TICKS(p->config.flush_ms);
+    int stop;
+
+    if (!wait)
+        wait = 1;
+    do {
+        ulTaskNotifyTake(pdTRUE, wait);
+        stop = __atomic_load_n(&p->stop, __ATOMIC_ACQUIRE);
+        /* full batches back to back, then the remainder */
+        while (ingest_batch(p))
+            ;
+    } while (!stop);
+
+    /* left by a commit that failed at the end */
+    portENTER_CRITICAL(&p->lock);
+    p->stats.failed += __atomic_load_n(&p->head, __ATOMIC_ACQUIRE) - p->tail;
+    portEXIT_CRITICAL(&p->lock);
+
+    xTaskNotifyGive(p->stopper);
+    vTaskDelete(NULL);
+}
+
+int esp32_ingest_start(const esp32_ingest_config_t *config, esp32_ingest_t **out)
+{
+    esp32_ingest_t *p;
+    int rc;
+
+    *out = NULL;
+    if (!config->db || !config->insert_sql || !config->bind || !config->record_size ||
+        (config->capacity & (config->capacity - 1)))
+        return SQLITE_MISUSE;
+
+    /* read by esp32_ingest_push_from_isr like the ring */
+    p = (esp32_ingest_t *) heap_caps_malloc(sizeof(esp32_ingest_t), MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    if (!p)
+        return SQLITE_NOMEM;
+    memset(p, 0, sizeof(esp32_ingest_t));
+    p->config = *config;
+    if (!p->config.capacity)
+        p->config.capacity = 4096;
+    if (!p->config.batch_rows || p->config.batch_rows > p->config.capacity)
+        p->config.batch_rows = p->config.capacity < 512 ? p->config.capacity : 512;
+    if (!p->config.flush_ms)
+        p->config.flush_ms = 1000;
+    if (p->config.core < 0)
+        p->config.core = tskNO_AFFINITY;
+    if (!p->config.priority)
+        p->config.priority = 5;
+    p->mask = p->config.capacity - 1;
+    p->lock = (portMUX_TYPE) portMUX_INITIALIZER_UNLOCKED;
+
+    /* pushes from interrupt handlers must not touch PSRAM */
+    p->ring = (uint8_t *) heap_caps_malloc((size_t) p->config.capacity * p->config.record_size,
+                                           MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    if (!p->ring) {
+        heap_caps_free(p);
+        return SQLITE_NOMEM;
+    }
+    rc = sqlite3_prepare_v2(p->config.db, p->config.insert_sql, -1, &p->insert, NULL);
+    if (rc == SQLITE_OK && xTaskCreatePinnedToCore(ingest_task, "sqlite_ingest", INGEST_STACK, p,
+                                                   p->config.priority, &p->task, p->config.core) != pdPASS)
+        rc = SQLITE_NOMEM;
+    if (rc != SQLITE_OK) {
+        sqlite3_finalize(p->insert);
+        heap_caps_free(p->ring);
+        heap_caps_free(p);
+        return rc;
+    }
+    *out = p;
+    return SQLITE_OK;
+}
+
+void esp32_ingest_stats(esp32_ingest_t *p, esp32_ingest_stats_t *stats, int reset)
+{
+    uint32_t tail = __atomic_load_n(&p->tail, __ATOMIC_ACQUIRE);
+
+    portENTER_CRITICAL(&p->lock);
+    *stats = p->stats;
+    if (reset) {
+        p->stats.rows = p->stats.batches = 0;
+        p->stats.failed = p->stats.queued_high = p->stats.commit_us_max = 0;
+        p->stats.last_error = SQLITE_OK;
+    }
+    portEXIT_CRITICAL(&p->lock);
+    stats->dropped = reset ? __atomic_exchange_n(&p->dropped, 0, __ATOMIC_RELAXED) : p->dropped;
+    stats->queued = __atomic_load_n(&p->head, __ATOMIC_ACQUIRE) - tail;
+}
+
+int esp32_ingest_stop(esp32_ingest_t *p)
+{
+    int rc;
+
+    if (!p)
+        return SQLITE_OK;
+    p->stopper = xTaskGetCurrentTaskHandle();
+    __atomic_store_n(&p->stop, 1, __ATOMIC_RELEASE);
+    xTaskNotifyGive(p->task);
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+    rc = p->stats.last_error;
+    sqlite3_finalize(p->insert);
+    heap_caps_free(p->ring);
+    heap_caps_free(p);
+    return rc;
+}
@@ -0,0 +1,107 @@
+//
+// Ring buffer to batching sqlite writer for sensor data (esp32_ingest.c)
+//
+
+#ifndef SD_CARD_ESP32_INGEST_H
+#define SD_CARD_ESP32_INGEST_H
+
+#include <stddef.h>
+#include "sqlite3.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Ingest pipeline settings, zero fields take the defaults except core
+ */
+typedef struct esp32_ingest_config {
+    /* connection of the writer task, no other task may use it while it runs */
+    sqlite3 *db;
+    /* INSERT with parameters, prepared once and reused for every row */
+    const char *insert_sql;
+    /* bind one record to the INSERT, return SQLITE_OK; blobs and text may be SQLITE_STATIC */
+    int (*bind)(sqlite3_stmt *stmt, const void *record);
+    /* bytes per record, copied into the ring by esp32_ingest_push */
+    size_t record_size;
+    /* records the ring holds, a power of two, default 4096 */
+    unsigned capacity;
+    /* rows per transaction, the writer is woken when this many are queued, default 512 */
+    unsigned batch_rows;
+    /* longest time a record waits for its commit in milliseconds, default 1000 */
+    unsigned flush_ms;
+    /* core of the writer task, -1 for either; put it on the core the producers do not use */
+    int core;
+    /* priority of the writer task, default 5 */
+    unsigned priority;
+} esp32_ingest_config_t;
+
+/**
+ * Counters of an ingest pipeline, see esp32_ingest_stats()
+ */
+typedef struct esp32_ingest_stats {
+    sqlite3_uint64 rows;
+    sqlite3_uint64 batches;
+    /* records pushed into a full ring */
+    unsigned dropped;
+    /* rows rejected by the INSERT, e.g. for a constraint, or still queued
+     * when esp32_ingest_stop found the database failing; a failed COMMIT
+     * keeps its rows queued and writes them again */
+    unsigned failed;
+    unsigned queued;
+    unsigned queued_high;
+    unsigned commit_us_max;
+    int last_error;
+} esp32_ingest_stats_t;
+
+typedef struct esp32_ingest esp32_ingest_t;
+
+/**
+ * Prepare the INSERT, allocate the ring in internal RAM and start the
+ * writer task
+ * @param config settings, copied
+ * @param out receives the pipeline
+ * @return SQLITE_OK on success
+ */
+extern int esp32_ingest_start(const esp32_ingest_config_t *config, esp32_ingest_t **out);
+
+/**
+ * Queue one record. Lock-free and wait-free for a single producer, several
+ * producer tasks must serialize their pushes or run a pipeline each.
+ * @param ingest pipeline
+ * @param record record_size bytes
+ * @return 1 if queued, 0 if the ring was full and the record was dropped
+ */
+extern int esp32_ingest_push(esp32_ingest_t *ingest, const void *record);
+
+/**
+ * esp32_ingest_push for interrupt handlers, in IRAM
+ * @param ingest pipeline
+ * @param record record_size bytes
+ * @param woken set to nonzero if the writer task needs portYIELD_FROM_ISR
+ * @return 1 if queued, 0 if the ring was full and the record was dropped
+ */
+extern int esp32_ingest_push_from_isr(esp32_ingest_t *ingest, const void *record, int *woken);
+
+/**
+ * Read the counters
+ * @param ingest pipeline
+ * @param stats receives the counters
+ * @param reset clear the counters and high water marks after reading
+ */
+extern void esp32_ingest_stats(esp32_ingest_t *ingest, esp32_ingest_stats_t *stats, int reset);
+
+/**
+ * Commit everything queued, stop the writer task and free the pipeline.
+ * Records a failing COMMIT leaves queued are counted as failed. The
+ * connection stays open and belongs to the caller again.
+ * @param ingest pipeline, may be NULL
+ * @return SQLITE_OK, or the last error of the writer
+ */
+extern int esp32_ingest_stop(esp32_ingest_t *ingest);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //SD_CARD_ESP32_INGEST_H
@@ -0,0 +1,294 @@
+/*
+ * esp32_io_stats.c
+ *
+ * The I/O counters every esp32 VFS file keeps, read through the
+ * ESP32_FCNTL_IO_STATS file control. esp32_io_stats is an eponymous virtual
+ * table with one row per open database and journal file of the connection:
+ *
+ *   SELECT schema, file, reads, seq_reads, read_us, writes, write_us, sync_us
+ *     FROM esp32_io_stats;
+ *
+ * shows whether a slow query waits on the database, its journal or a temp
+ * database, and seq_reads against reads whether it scans or seeks.
+ *
+ * PRAGMA database_list is compiled out with SQLITE_OMIT_SCHEMA_PRAGMAS and
+ * sqlite has no other way to list the schemas of a connection, so the
+ * table lists "main" and "temp"; an attached schema is probed by name
+ * through its file pointer when the query asks for it:
+ *
+ *   SELECT * FROM esp32_io_stats WHERE schema IN ('main', 'hot');
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sqlite3.h"
+#include "esp32_vfs.h"
+#include "esp32_io_stats.h"
+
+enum {
+    IO_COL_SCHEMA = 0,
+    IO_COL_FILE,
+    IO_COL_READS,
+    IO_COL_SHORT_READS,
+    IO_COL_SEQ_READS,
+    IO_COL_READ_BYTES,
+    IO_COL_READ_US,
+    IO_COL_WRITES,
+    IO_COL_SEQ_WRITES,
+    IO_COL_WRITE_BYTES,
+    IO_COL_WRITE_US,
+    IO_COL_SYNCS,
+    IO_COL_SYNC_US
+};
+
+typedef struct io_row {
+    char *schema;
+    const char *file;
+    esp32_file_stats_t stats;
+} io_row;
+
+typedef struct io_cursor {
+    sqlite3_vtab_cursor base;
+    io_row *rows;
+    int count;
+    int at;
+} io_cursor;
+
+typedef struct io_vtab {
+    sqlite3_vtab base;
+    sqlite3 *db;
+} io_vtab;
+
+int esp32_vfs_file_stats(sqlite3 *db, const char *schema, int journal, esp32_file_stats_t *stats, int reset)
+{
+    int op = reset ? ESP32_FCNTL_IO_STATS_RESET : ESP32_FCNTL_IO_STATS;
+    sqlite3_file *file = NULL;
+    int rc;
+
+    if (!journal)
+        return sqlite3_file_control(db, schema, op, stats);
+
+    /* the journal is not reachable by name, only through its pager */
+    sqlite3_mutex_enter(sqlite3_db_mutex(db));
+    rc = sqlite3_file_control(db, schema, SQLITE_FCNTL_JOURNAL_POINTER, &file);
+    if (rc == SQLITE_OK && file && file->pMethods)
+        rc = file->pMethods->xFileControl(file, op, stats);
+    else
+        rc = SQLITE_NOTFOUND;
+    sqlite3_mutex_leave(sqlite3_db_mutex(db));
+    return rc;
+}
+
+static int io_connect(sqlite3 *db, void *aux, int argc, const char *const *argv, sqlite3_vtab **out, char **err)
+{
+    io_vtab *vtab;
+    int rc;
+
+    rc = sqlite3_declare_vtab(db, "CREATE TABLE x(schema TEXT, file TEXT, reads INTEGER, short_reads INTEGER, "
+                                  "seq_reads INTEGER, read_bytes INTEGER, read_us INTEGER, writes INTEGER, "
+                                  "seq_writes INTEGER, write_bytes INTEGER, write_us INTEGER, syncs INTEGER, "
+                                  "sync_us INTEGER)");
+    if (rc != SQLITE_OK)
+        return rc;
+    vtab = (io_vtab *) sqlite3_malloc(sizeof(io_vtab));
+    if (!vtab)
+        return SQLITE_NOMEM;
+    memset(vtab, 0, sizeof(io_vtab));
+    vtab->db = db;
+    *out = &vtab->base;
+    return SQLITE_OK;
+}
+
+static int io_disconnect(sqlite3_vtab *vtab)
+{
+    sqlite3_free(vtab);
+    return SQLITE_OK;
+}
+
+static int io_best_index(sqlite3_vtab *vtab, sqlite3_index_info *info)
+{
+    /* schema = ? names the one schema to probe, IN repeats that per name */
+    for (int i = 0; i < info->nConstraint; i++) {
+        if (info->aConstraint[i].usable && info->aConstraint[i].iColumn == IO_COL_SCHEMA &&
+            info->aConstraint[i].op == SQLITE_INDEX_CONSTRAINT_EQ) {
+            info->aConstraintUsage[i].argvIndex = 1;
+            info->aConstraintUsage[i].omit = 1;
+            info->idxNum = 1;
+            info->estimatedCost = 1;
+            info->estimatedRows = 2;
+            return SQLITE_OK;
+        }
+    }
+    /* a couple of rows, nothing worth an index */
+    info->estimatedCost = 10;
+    info->estimatedRows = 10;
+    return SQLITE_OK;
+}
+
+static int io_open(sqlite3_vtab *vtab, sqlite3_vtab_cursor **out)
+{
+    io_cursor *cur = (io_cursor *) sqlite3_malloc(sizeof(io_cursor));
+
+    if (!cur)
+        return SQLITE_NOMEM;
+    memset(cur, 0, sizeof(io_cursor));
+    *out = &cur->base;
+    return SQLITE_OK;
+}
+
+static void io_clear(io_cursor *cur)
+{
+    for (int i = 0; i < cur->count; i++)
+        sqlite3_free(cur->rows[i].schema);
+    sqlite3_free(cur->rows);
+    cur->rows = NULL;
+    cur->count = cur->at = 0;
+}
+
+static int io_close(sqlite3_vtab_cursor *base)
+{
+    io_clear((io_cursor *) base);
+    sqlite3_free(base);
+    return SQLITE_OK;
+}
+
+/**
+ * Add the database and journal file of a schema, nothing for a schema
+ * that does not exist or is not on the esp32 VFS
+ */
+static int io_add(io_cursor *cur, int *slots, sqlite3 *db, const char *schema)
+{
+    for (int journal = 0; journal < 2; journal++) {
+        esp32_file_stats_t stats;
+
+        if (esp32_vfs_file_stats(db, schema, journal, &stats, 0) != SQLITE_OK)
+            continue;
+        if (cur->count == *slots) {
+            io_row *rows = (io_row *) sqlite3_realloc(cur->rows, (*slots + 8) * sizeof(io_row));
+
+            if (!rows)
+                return SQLITE_NOMEM;
+            cur->rows = rows;
+            *slots += 8;
+        }
+        cur->rows[cur->count].schema = sqlite3_mprintf("%s", schema);
+        if (!cur->rows[cur->count].schema)
+            return SQLITE_NOMEM;
+        cur->rows[cur->count].file = journal ? "journal" : "db";
+        cur->rows[cur->count].stats = stats;
+        cur->count++;
+    }
+    return SQLITE_OK;
+}
+
+/**
+ * Take a snapshot of the counters of every file, two rows per schema at
+ * most: of main and temp, or of the schema named by the constraint
+ */
+static int io_filter(sqlite3_vtab_cursor *base, int idx, const char *idx_str, int argc, sqlite3_value **argv)
+{
+    io_cursor *cur = (io_cursor *) base;
+    sqlite3 *db = ((io_vtab *) base->pVtab)->db;
+    const char *schema;
+    int rc, slots = 0;
+
+    io_clear(cur);
+    if (idx == 1) {
+        schema = (const char *) sqlite3_value_text(argv[0]);
+        return schema ? io_add(cur, &slots, db, schema) : SQLITE_OK;
+    }
+    rc = io_add(cur, &slots, db, "main");
+    if (rc == SQLITE_OK)
+        rc = io_add(cur, &slots, db, "temp");
+    return rc;
+}
+
+static int io_next(sqlite3_vtab_cursor *base)
+{
+    ((io_cursor *) base)->at++;
+    return SQLITE_OK;
+}
+
+static int io_eof(sqlite3_vtab_cursor *base)
+{
+    io_cursor *cur = (io_cursor *) base;
+    return cur->at >= cur->count;
+}
+
+static int io_column(sqlite3_vtab_cursor *base, sqlite3_context *ctx, int col)
+{
+    io_row *row = &((io_cursor *) base)->rows[((io_cursor *) base)->at];
+    const esp32_file_stats_t *s = &row->stats;
+
+    switch (col) {
+        case IO_COL_SCHEMA:
+            sqlite3_result_text(ctx, row->schema, -1, SQLITE_TRANSIENT);
+            break;
+        case IO_COL_FILE:
+            sqlite3_result_text(ctx, row->file, -1, SQLITE_STATIC);
+            break;
+        case IO_COL_READS:
+            sqlite3_result_int64(ctx, s->reads);
+            break;
+        case IO_COL_SHORT_READS:
+            sqlite3_result_int64(ctx, s->short_reads);
+            break;
+        case IO_COL_SEQ_READS:
+            sqlite3_result_int64(ctx, s->seq_reads);
+            break;
+        case IO_COL_READ_BYTES:
+            sqlite3_result_int64(ctx, (sqlite3_int64) s->read_bytes);
+            break;
+        case IO_COL_READ_US:
+            sqlite3_result_int64(ctx, (sqlite3_int64) s->read_us);
+            break;
+        case IO_COL_WRITES:
+            sqlite3_result_int64(ctx, s->writes);
+            break;
+        case IO_COL_SEQ_WRITES:
+            sqlite3_result_int64(ctx, s->seq_writes);
+            break;
+        case IO_COL_WRITE_BYTES:
+            sqlite3_result_int64(ctx, (sqlite3_int64) s->write_bytes);
+            break;
+        case IO_COL_WRITE_US:
+            sqlite3_result_int64(ctx, (sqlite3_int64) s->write_us);
+            break;
+        case IO_COL_SYNCS:
+            sqlite3_result_int64(ctx, s->syncs);
+            break;
+        case IO_COL_SYNC_US:
+            sqlite3_result_int64(ctx, (sqlite3_int64) s->sync_us);
+            break;
+        default:
+            break;
+    }
+    return SQLITE_OK;
+}
+
+static int io_rowid(sqlite3_vtab_cursor *base, sqlite3_int64 *rowid)
+{
+    *rowid = ((io_cursor *) base)->at;
+    return SQLITE_OK;
+}
+
+static sqlite3_module io_module = {
+        0,                  // iVersion
+        0,                  // xCreate, eponymous only
+        io_connect,
+        io_best_index,
+        io_disconnect,
+        0,                  // xDestroy
+        io_open,
+        io_close,
+        io_filter,
+        io_next,
+        io_eof,
+        io_column,
+        io_rowid,
+};
+
+int esp32_io_stats_register(sqlite3 *db, const char **errmsg, const struct sqlite3_api_routines *api)
+{
+    return sqlite3_create_module(db, "esp32_io_stats", &io_module, 0);
+}
@@ -0,0 +1,278 @@
+/*
+ * esp32_logfile.c
+ *
+ * Open file cache for append logging. Opening a littlefs file walks the
+ * path and may have to make the filesystem consistent first, closing it
+ * commits its metadata; a logger that opens, appends and closes for every
+ * line pays both each time. Here up to LOG_OPEN_MAX files stay open with a
+ * statically allocated cache of one block each, an append is a copy into
+ * that cache and the metadata is committed by the sync policy: every
+ * LOG_SYNC_BYTES pending bytes, when pending data gets LOG_SYNC_MS old, on
+ * eviction and in esp32_logfile_close. A reset loses at most what the
+ * policy leaves pending, littlefs keeps the file as of its last sync.
+ *
+ * The slots are guarded by the littlefs lock, taken once per call around
+ * the lookup and the littlefs calls.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sdkconfig.h>
+#include <esp_timer.h>
+#include "sqlite3.h"
+#include "lfs.h"
+#include "lfs_port.h"
+#include "esp32_logfile.h"
+
+#ifdef CONFIG_LITTLEFS_LOG_OPEN_FILES
+#define LOG_OPEN_MAX CONFIG_LITTLEFS_LOG_OPEN_FILES
+#else
+#define LOG_OPEN_MAX 4
+#endif
+#ifdef CONFIG_LITTLEFS_LOG_SYNC_KB
+#define LOG_SYNC_BYTES (CONFIG_LITTLEFS_LOG_SYNC_KB * 1024)
+#else
+#define LOG_SYNC_BYTES (16 * 1024)
+#endif
+#ifdef CONFIG_LITTLEFS_LOG_SYNC_MS
+#define LOG_SYNC_MS CONFIG_LITTLEFS_LOG_SYNC_MS
+#else
+#define LOG_SYNC_MS 5000
+#endif
+#define LOG_PATH_MAX 64
+
+typedef struct log_slot {
+    lfs_file_t file;
+    struct lfs_file_config config;
+    char path[LOG_PATH_MAX];
+    int open;
+    unsigned used;
+    /* bytes appended since the last sync and when the first of them came */
+    unsigned pending;
+    int64_t pending_since;
+} log_slot;
+
+static log_slot log_slots[LOG_OPEN_MAX];
+static uint8_t log_buffers[LOG_OPEN_MAX][LFS_SD_BLOCK_SIZE];
+static unsigned log_tick;
+static unsigned log_sync_bytes = LOG_SYNC_BYTES;
+static unsigned log_sync_ms = LOG_SYNC_MS;
+static esp32_logfile_stats_t log_stats;
+
+static int log_error(int err)
+{
+    switch (err) {
+        case LFS_ERR_NOENT:
+            return SQLITE_NOTFOUND;
+        case LFS_ERR_NOSPC:
+            return SQLITE_FULL;
+        case LFS_ERR_NOMEM:
+            return SQLITE_NOMEM;
+        default:
+            return SQLITE_IOERR;
+    }
+}
+
+static log_slot *log_find(const char *path)
+{
+    for (int i = 0; i < LOG_OPEN_MAX; i++) {
+        if (log_slots[i].open && strcmp(log_slots[i].path, path) == 0)
+            return &log_slots[i];
+    }
+    return NULL;
+}
+
+static int log_sync(log_slot *slot)
+{
+    int err;
+
+    if (!slot->pending)
+        return SQLITE_OK;
+    err = lfs_file_sync(&lfs_filesystem, &slot->file);
+    slot->pending = 0;
+    log_stats.syncs++;
+    return err < 0 ? log_error(err) : SQLITE_OK;
+}
+
+static int log_close(log_slot *slot)
+{
+    int err;
+
+    if (slot->pending)
+        log_stats.syncs++;
+    err = lfs_file_close(&lfs_filesystem, &slot->file);
+    slot->open = 0;
+    slot->pending = 0;
+    log_stats.open_files--;
+    return err < 0 ? log_error(err) : SQLITE_OK;
+}
+
+/**
+ * Open a file in a free slot or in the least recently used one
+ */
+static int log_open(const char *path, log_slot **out)
+{
+    log_slot *slot = &log_slots[0];
+    int err;
+
+    for (int i = 0; i < LOG_OPEN_MAX; i++) {
+        if (!log_slots[i].open) {
+            slot = &log_slots[i];
+            break;
+        }
+        if (log_slots[i].used < slot->used)
+            slot = &log_slots[i];
+    }
+    if (slot->open) {
+        log_close(slot);
+        log_stats.evictions++;
+    }
+
+    memset(&slot->config, 0, sizeof(slot->config));
+    slot->config.buffer = log_buffers[slot - log_slots];
+    err = lfs_file_opencfg(&lfs_filesystem, &slot->file, path, LFS_O_WRONLY | LFS_O_CREAT | LFS_O_APPEND,
+                           &slot->config);
+    if (err < 0)
+        return log_error(err);
+    strcpy(slot->path, path);
+    slot->open = 1;
+    slot->pending = 0;
+    log_stats.opens++;
+    log_stats.open_files++;
+    *out = slot;
+    return SQLITE_OK;
+}
+
+static int log_due(const log_slot *slot, int64_t now)
+{
+    if (!slot->pending)
+        return 0;
+    if (log_sync_bytes && slot->pending >= log_sync_bytes)
+        return 1;
+    return log_sync_ms && now - slot->pending_since >= (int64_t) log_sync_ms * 1000;
+}
+
+int esp32_logfile_append(const char *path, const void *data, size_t size)
+{
+    log_slot *slot;
+    lfs_ssize_t written;
+    int64_t now;
+    int rc = SQLITE_OK;
+
+    if (strlen(path) >= LOG_PATH_MAX)
+        return SQLITE_TOOBIG;
+    lfs_port_lock();
+    slot = log_find(path);
+    if (!slot)
+        rc = log_open(path, &slot);
+    if (rc == SQLITE_OK) {
+        slot->used = ++log_tick;
+        written = lfs_file_write(&lfs_filesystem, &slot->file, data, size);
+        if (written < 0 || (size_t) written != size) {
+            /* littlefs does not sync a file after a failed write, it stays as of its last sync */
+            rc = written < 0 ? log_error(written) : SQLITE_FULL;
+            log_close(slot);
+        } else {
+            now = esp_timer_get_time();
+            if (!slot->pending)
+                slot->pending_since = now;
+            slot->pending += size;
+            log_stats.appends++;
+            log_stats.bytes += size;
+            if (log_due(slot, now))
+                rc = log_sync(slot);
+        }
+    }
+    lfs_port_unlock();
+    return rc;
+}
+
+int esp32_logfile_size(const char *path, sqlite3_int64 *size)
+{
+    struct lfs_info info;
+    log_slot *slot;
+    int err, rc = SQLITE_OK;
+
+    lfs_port_lock();
+    slot = log_find(path);
+    if (slot) {
+        *size = lfs_file_size(&lfs_filesystem, &slot->file);
+    } else if ((err = lfs_stat(&lfs_filesystem, path, &info)) < 0) {
+        rc = log_error(err);
+    } else {
+        *size = info.size;
+    }
+    lfs_port_unlock();
+    return rc;
+}
+
+void esp32_logfile_policy(unsigned sync_bytes, unsigned sync_ms)
+{
+    lfs_port_lock();
+    log_sync_bytes = sync_bytes;
+    log_sync_ms = sync_ms;
+    lfs_port_unlock();
+}
+
+int esp32_logfile_poll(void)
+{
+    int64_t now = esp_timer_get_time();
+    int rc = SQLITE_OK;
+
+    lfs_port_lock();
+    for (int i = 0; i < LOG_OPEN_MAX; i++) {
+        if (log_slots[i].open && log_due(&log_slots[i], now)) {
+            int err = log_sync(&log_slots[i]);
+            if (rc == SQLITE_OK)
+                rc = err;
+        }
+    }
+    lfs_port_unlock();
+    return rc;
+}
+
+int esp32_logfile_sync(const char *path)
+{
+    int rc = SQLITE_OK;
+
+    lfs_port_lock();
+    for (int i = 0; i < LOG_OPEN_MAX; i++) {
+        if (log_slots[i].open && (!path || strcmp(log_slots[i].path, path) == 0)) {
+            int err = log_sync(&log_slots[i]);
+            if (rc == SQLITE_OK)
+                rc = err;
+        }
+    }
+    lfs_port_unlock();
+    return rc;
+}
+
+int esp32_logfile_close(const char *path)
+{
+    int rc = SQLITE_OK;
+
+    lfs_port_lock();
+    for (int i = 0; i < LOG_OPEN_MAX; i++) {
+        if (log_slots[i].open && (!path || strcmp(log_slots[i].path, path) == 0)) {
+            int err = log_close(&log_slots[i]);
+            if (rc == SQLITE_OK)
+                rc = err;
+        }
+    }
+    lfs_port_unlock();
+    return rc;
+}
+
+void esp32_logfile_stats(esp32_logfile_stats_t *stats, int reset)
+{
+    lfs_port_lock();
+    *stats = log_stats;
+    if (reset) {
+        unsigned open_files = log_stats.open_files;
+
+        memset(&log_stats, 0, sizeof(log_stats));
+        log_stats.open_files = open_files;
+    }
+    lfs_port_unlock();
+}
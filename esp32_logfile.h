@@ -0,0 +1,94 @@
+//
+// Cache of open littlefs files for append logging (esp32_logfile.c)
+//
+
+#ifndef SD_CARD_ESP32_LOGFILE_H
+#define SD_CARD_ESP32_LOGFILE_H
+
+#include <stddef.h>
+#include "sqlite3.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Counters of the log file cache, see esp32_logfile_stats()
+ */
+typedef struct esp32_logfile_stats {
+    unsigned appends;
+    /* appends to a file that had to be opened */
+    unsigned opens;
+    /* files closed to make room for another */
+    unsigned evictions;
+    unsigned syncs;
+    unsigned open_files;
+    sqlite3_uint64 bytes;
+} esp32_logfile_stats_t;
+
+/**
+ * Append to a file, created if it does not exist. The file stays open in
+ * one of CONFIG_LITTLEFS_LOG_OPEN_FILES slots, so an append is a copy into
+ * its littlefs cache; it is synced once CONFIG_LITTLEFS_LOG_SYNC_KB are
+ * pending or the oldest pending byte is CONFIG_LITTLEFS_LOG_SYNC_MS old.
+ * Other readers of the file see the data after the sync. Close a file
+ * with esp32_logfile_close before removing or renaming it.
+ * @param path file path
+ * @param data bytes to append
+ * @param size number of bytes
+ * @return SQLITE_OK on success, SQLITE_FULL when the card is full,
+ *         SQLITE_TOOBIG for a path longer than the slots hold
+ */
+extern int esp32_logfile_append(const char *path, const void *data, size_t size);
+
+/**
+ * Size of a file including appends not yet synced
+ * @param path file path
+ * @param size receives the size in bytes
+ * @return SQLITE_OK on success, SQLITE_NOTFOUND if there is no such file
+ */
+extern int esp32_logfile_size(const char *path, sqlite3_int64 *size);
+
+/**
+ * Change the sync policy at runtime, both limits 0 syncs only in
+ * esp32_logfile_sync, esp32_logfile_close and on eviction
+ * @param sync_bytes sync a file once this many bytes are pending, 0 for no limit
+ * @param sync_ms sync a file once its oldest pending byte is this old, 0 for no limit
+ */
+extern void esp32_logfile_policy(unsigned sync_bytes, unsigned sync_ms);
+
+/**
+ * Sync the files whose pending data is older than the sync interval. The
+ * interval is otherwise only checked on append; call this from an idle
+ * loop if a logger may stop appending for a while.
+ * @return SQLITE_OK on success
+ */
+extern int esp32_logfile_poll(void);
+
+/**
+ * Sync an open file, or all of them
+ * @param path file path, NULL for every open file
+ * @return SQLITE_OK on success, also if the file is not open
+ */
+extern int esp32_logfile_sync(const char *path);
+
+/**
+ * Sync and close an open file, or all of them before unmounting or a
+ * shutdown
+ * @param path file path, NULL for every open file
+ * @return SQLITE_OK on success, also if the file is not open
+ */
+extern int esp32_logfile_close(const char *path);
+
+/**
+ * Read the cache counters
+ * @param stats receives appends, opens, evictions, syncs, open files and bytes
+ * @param reset start the counters over
+ */
+extern void esp32_logfile_stats(esp32_logfile_stats_t *stats, int reset);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //SD_CARD_ESP32_LOGFILE_H
@@ -0,0 +1,306 @@
+/*
+ * esp32_logring.c
+ *
+ * Rotating log segments. A log appended to one ever growing file gets a
+ * longer CTZ skip list with every block, and removing old data means
+ * removing whole files. Here a directory holds at most a fixed number of
+ * segments of a fixed size, named by a sequence number:
+ *
+ *   logs/00000007.log  oldest
+ *   logs/00000008.log
+ *   logs/00000009.log  newest, appended to
+ *
+ * When the newest segment is full the oldest one is renamed to the next
+ * sequence number and truncated, so the directory never grows and no file
+ * is removed. The manifest <dir>.manifest holds the geometry and the
+ * oldest and newest sequence number; it is rewritten once per rotation,
+ * a littlefs file commit, so opening the ring reads one small file
+ * instead of listing the directory.
+ *
+ * Segments are not pre-extended with filler: littlefs is copy-on-write
+ * and a write inside an existing file copies the rest of it on the next
+ * sync, so filler would be rewritten by every sync of a segment.
+ *
+ * A rotation renames, truncates and then writes the manifest. If a reset
+ * comes in between, the renamed segment is found on open, one past the
+ * newest of the manifest, and the rotation is finished.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <esp_timer.h>
+#include "sqlite3.h"
+#include "lfs.h"
+#include "lfs_port.h"
+#include "esp32_logfile.h"
+#include "esp32_logring.h"
+
+#define RING_MAGIC 0x474E524Cu    /* "LRNG" */
+/* segment paths are appended to through esp32_logfile, which takes them below 64 bytes */
+#define RING_PATH_MAX 64
+/* "/" and "%08u.log" */
+#define RING_NAME_LEN 13
+
+typedef struct ring_manifest {
+    uint32_t magic;
+    uint32_t segments;
+    uint32_t segment_bytes;
+    uint32_t first_seq;
+    uint32_t last_seq;
+} ring_manifest;
+
+struct esp32_logring {
+    char dir[RING_PATH_MAX];
+    char head[RING_PATH_MAX];
+    ring_manifest manifest;
+    unsigned head_bytes;
+    unsigned rotations;
+    sqlite3_uint64 rotate_us;
+};
+
+static int ring_error(int err)
+{
+    switch (err) {
+        case LFS_ERR_NOENT:
+            return SQLITE_NOTFOUND;
+        case LFS_ERR_NOSPC:
+            return SQLITE_FULL;
+        case LFS_ERR_NOMEM:
+            return SQLITE_NOMEM;
+        default:
+            return SQLITE_IOERR;
+    }
+}
+
+static void ring_name(const esp32_logring_t *ring, uint32_t seq, char path[RING_PATH_MAX])
+{
+    snprintf(path, RING_PATH_MAX, "%s/%08u.log", ring->dir, (unsigned) seq);
+}
+
+static int ring_exists(const char *path)
+{
+    struct lfs_info info;
+    return lfs_stat(&lfs_filesystem, path, &info) >= 0;
+}
+
+static int ring_read_manifest(const esp32_logring_t *ring, ring_manifest *manifest)
+{
+    char path[RING_PATH_MAX + 16];
+    lfs_file_t file;
+    lfs_ssize_t got;
+    int err;
+
+    snprintf(path, sizeof(path), "%s.manifest", ring->dir);
+    err = lfs_file_open(&lfs_filesystem, &file, path, LFS_O_RDONLY);
+    if (err < 0)
+        return ring_error(err);
+    got = lfs_file_read(&lfs_filesystem, &file, manifest, sizeof(ring_manifest));
+    lfs_file_close(&lfs_filesystem, &file);
+    if (got < 0)
+        return ring_error(got);
+    if (got != sizeof(ring_manifest) || manifest->magic != RING_MAGIC || !manifest->segments ||
+        manifest->first_seq > manifest->last_seq)
+        return SQLITE_CORRUPT;
+    return SQLITE_OK;
+}
+
+/**
+ * Replace the manifest, written and committed by one close
+ */
+static int ring_write_manifest(const esp32_logring_t *ring)
+{
+    char path[RING_PATH_MAX + 16];
+    lfs_file_t file;
+    lfs_ssize_t written;
+    int err;
+
+    snprintf(path, sizeof(path), "%s.manifest", ring->dir);
+    err = lfs_file_open(&lfs_filesystem, &file, path, LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC);
+    if (err < 0)
+        return ring_error(err);
+    written = lfs_file_write(&lfs_filesystem, &file, &ring->manifest, sizeof(ring_manifest));
+    err = lfs_file_close(&lfs_filesystem, &file);
+    if (written < 0)
+        return ring_error(written);
+    return err < 0 ? ring_error(err) : SQLITE_OK;
+}
+
+static int ring_truncate(const char *path)
+{
+    lfs_file_t file;
+    int err;
+
+    err = lfs_file_open(&lfs_filesystem, &file, path, LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC);
+    if (err < 0)
+        return ring_error(err);
+    err = lfs_file_close(&lfs_filesystem, &file);
+    return err < 0 ? ring_error(err) : SQLITE_OK;
+}
+
+/**
+ * Finish a rotation cut short by a reset: the oldest segment was renamed
+ * to the next sequence number but the manifest was not written
+ */
+static int ring_recover(esp32_logring_t *ring)
+{
+    ring_manifest *m = &ring->manifest;
+    char path[RING_PATH_MAX];
+    int rc;
+
+    ring_name(ring, m->last_seq + 1, path);
+    if (!ring_exists(path))
+        return SQLITE_OK;
+    rc = ring_truncate(path);
+    if (rc != SQLITE_OK)
+        return rc;
+    ring_name(ring, m->first_seq, path);
+    if (m->first_seq < m->last_seq + 1 && !ring_exists(path))
+        m->first_seq++;
+    m->last_seq++;
+    return ring_write_manifest(ring);
+}
+
+int esp32_logring_open(const char *dir, int segments, unsigned segment_bytes, esp32_logring_t **out)
+{
+    esp32_logring_t *ring;
+    sqlite3_int64 size;
+    int err, rc;
+
+    *out = NULL;
+    if (strlen(dir) + RING_NAME_LEN >= RING_PATH_MAX)
+        return SQLITE_TOOBIG;
+    if (segments < 2 || !segment_bytes)
+        return SQLITE_RANGE;
+    ring = (esp32_logring_t *) sqlite3_malloc(sizeof(esp32_logring_t));
+    if (!ring)
+        return SQLITE_NOMEM;
+    memset(ring, 0, sizeof(esp32_logring_t));
+    strcpy(ring->dir, dir);
+
+    err = lfs_mkdir(&lfs_filesystem, dir);
+    if (err && err != LFS_ERR_EXIST) {
+        sqlite3_free(ring);
+        return ring_error(err);
+    }
+    rc = ring_read_manifest(ring, &ring->manifest);
+    if (rc == SQLITE_NOTFOUND) {
+        ring->manifest.magic = RING_MAGIC;
+        ring->manifest.segments = (uint32_t) segments;
+        ring->manifest.segment_bytes = segment_bytes;
+        ring->manifest.first_seq = 1;
+        ring->manifest.last_seq = 1;
+        rc = ring_write_manifest(ring);
+    } else if (rc == SQLITE_OK) {
+        if (ring->manifest.segments != (uint32_t) segments || ring->manifest.segment_bytes != segment_bytes)
+            rc = SQLITE_MISMATCH;
+        else
+            rc = ring_recover(ring);
+    }
+    if (rc != SQLITE_OK) {
+        sqlite3_free(ring);
+        return rc;
+    }
+
+    ring_name(ring, ring->manifest.last_seq, ring->head);
+    if (esp32_logfile_size(ring->head, &size) == SQLITE_OK)
+        ring->head_bytes = (unsigned) size;
+    *out = ring;
+    return SQLITE_OK;
+}
+
+int esp32_logring_rotate(esp32_logring_t *ring)
+{
+    ring_manifest *m = &ring->manifest;
+    char oldest[RING_PATH_MAX], next[RING_PATH_MAX];
+    int64_t start;
+    int err, rc;
+
+    if (!ring->head_bytes)
+        return SQLITE_OK;
+    start = esp_timer_get_time();
+    rc = esp32_logfile_close(ring->head);
+    if (rc != SQLITE_OK)
+        return rc;
+
+    ring_name(ring, m->last_seq + 1, next);
+    if (m->last_seq - m->first_seq + 1 >= m->segments) {
+        /* reuse the oldest segment under the next name */
+        ring_name(ring, m->first_seq, oldest);
+        esp32_logfile_close(oldest);
+        err = lfs_rename(&lfs_filesystem, oldest, next);
+        if (err < 0)
+            return ring_error(err);
+        rc = ring_truncate(next);
+        if (rc == SQLITE_OK)
+            m->first_seq++;
+    }
+    if (rc == SQLITE_OK) {
+        m->last_seq++;
+        rc = ring_write_manifest(ring);
+    } else {
+        /* renamed but not emptied, finish it the way open does */
+        rc = ring_recover(ring);
+        if (rc != SQLITE_OK)
+            return rc;
+    }
+    strcpy(ring->head, next);
+    ring->head_bytes = 0;
+
+    ring->rotations++;
+    ring->rotate_us += esp_timer_get_time() - start;
+    return rc;
+}
+
+int esp32_logring_append(esp32_logring_t *ring, const void *data, size_t size)
+{
+    int rc;
+
+    if (size > ring->manifest.segment_bytes)
+        return SQLITE_TOOBIG;
+    if (ring->head_bytes + size > ring->manifest.segment_bytes) {
+        rc = esp32_logring_rotate(ring);
+        if (rc != SQLITE_OK)
+            return rc;
+    }
+    rc = esp32_logfile_append(ring->head, data, size);
+    if (rc == SQLITE_OK)
+        ring->head_bytes += (unsigned) size;
+    return rc;
+}
+
+int esp32_logring_path(esp32_logring_t *ring, int age, char *path, size_t size)
+{
+    const ring_manifest *m = &ring->manifest;
+
+    if (age < 0 || (unsigned) age > m->last_seq - m->first_seq)
+        return SQLITE_RANGE;
+    snprintf(path, size, "%s/%08u.log", ring->dir, (unsigned) (m->first_seq + age));
+    return SQLITE_OK;
+}
+
+void esp32_logring_info(esp32_logring_t *ring, esp32_logring_info_t *info)
+{
+    const ring_manifest *m = &ring->manifest;
+
+    memset(info, 0, sizeof(esp32_logring_info_t));
+    info->segments = (int) m->segments;
+    info->segment_bytes = m->segment_bytes;
+    info->live = (int) (m->last_seq - m->first_seq + 1);
+    info->first_seq = m->first_seq;
+    info->last_seq = m->last_seq;
+    info->head_bytes = ring->head_bytes;
+    info->rotations = ring->rotations;
+    info->rotate_us = ring->rotate_us;
+}
+
+int esp32_logring_close(esp32_logring_t *ring)
+{
+    int rc;
+
+    if (!ring)
+        return SQLITE_OK;
+    rc = esp32_logfile_close(ring->head);
+    sqlite3_free(ring);
+    return rc;
+}
@@ -0,0 +1,95 @@
+//
+// Ring of fixed size log segments on littlefs (esp32_logring.c)
+//
+
+#ifndef SD_CARD_ESP32_LOGRING_H
+#define SD_CARD_ESP32_LOGRING_H
+
+#include <stddef.h>
+#include "sqlite3.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct esp32_logring esp32_logring_t;
+
+/**
+ * State of a ring, see esp32_logring_info()
+ */
+typedef struct esp32_logring_info {
+    int segments;
+    unsigned segment_bytes;
+    /* segments holding data, oldest and newest sequence number */
+    int live;
+    unsigned first_seq;
+    unsigned last_seq;
+    /* bytes in the newest segment */
+    unsigned head_bytes;
+    /* rotations since the ring was opened and the time they took */
+    unsigned rotations;
+    sqlite3_uint64 rotate_us;
+} esp32_logring_info_t;
+
+/**
+ * Open a ring of log segments in a directory, created with its manifest
+ * <dir>.manifest if it does not exist. Segments are named by sequence
+ * number, <dir>/00000001.log and up, so name order is time order and the
+ * directory can be read with the esp32_log virtual table.
+ * @param dir directory of the segments
+ * @param segments segments kept, the oldest is reused when all are full
+ * @param segment_bytes size of a full segment
+ * @param out receives the ring
+ * @return SQLITE_OK on success, SQLITE_MISMATCH if the manifest has another
+ *         geometry, SQLITE_TOOBIG if the directory name is too long
+ */
+extern int esp32_logring_open(const char *dir, int segments, unsigned segment_bytes, esp32_logring_t **out);
+
+/**
+ * Append a record to the newest segment through esp32_logfile_append and
+ * its sync policy. A record that does not fit rotates the ring first,
+ * records are never split over two segments.
+ * @param ring log ring
+ * @param data record, e.g. one text line with its newline
+ * @param size bytes in the record, at most segment_bytes
+ * @return SQLITE_OK on success, SQLITE_TOOBIG for a record longer than a segment
+ */
+extern int esp32_logring_append(esp32_logring_t *ring, const void *data, size_t size);
+
+/**
+ * Start a new segment, e.g. at midnight. Does nothing if the newest
+ * segment is still empty.
+ * @param ring log ring
+ * @return SQLITE_OK on success
+ */
+extern int esp32_logring_rotate(esp32_logring_t *ring);
+
+/**
+ * Path of a segment
+ * @param ring log ring
+ * @param age 0 for the oldest segment, live - 1 for the newest
+ * @param path receives the path
+ * @param size size of path
+ * @return SQLITE_OK on success, SQLITE_RANGE if there is no such segment
+ */
+extern int esp32_logring_path(esp32_logring_t *ring, int age, char *path, size_t size);
+
+/**
+ * Describe the ring
+ * @param ring log ring
+ * @param info receives geometry, live segments and rotation counters
+ */
+extern void esp32_logring_info(esp32_logring_t *ring, esp32_logring_info_t *info);
+
+/**
+ * Sync and close the newest segment and free the ring
+ * @param ring log ring, may be NULL
+ * @return SQLITE_OK on success
+ */
+extern int esp32_logring_close(esp32_logring_t *ring);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //SD_CARD_ESP32_LOGRING_H
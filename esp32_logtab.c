@@ -0,0 +1,635 @@
+/*
+ * esp32_logtab.c
+ *
+ * Virtual table over append-only text logs on littlefs, the kind written
+ * with Application_Append_File_Text: one record per line, fields separated
+ * by commas, an integer timestamp first. Lines are appended in time order,
+ * so a time range is found by bisecting the file offsets instead of
+ * reading from the start, and rows are parsed from the file as the query
+ * steps without ever being inserted anywhere.
+ *
+ *   CREATE VIRTUAL TABLE temp.climate USING esp32_log('logs', ts INTEGER, temp REAL, hum REAL);
+ *   SELECT avg(temp) FROM climate WHERE ts BETWEEN 1650000000 AND 1650086400;
+ *
+ * The path is a file or a directory. The files of a directory are read in
+ * name order and must follow each other in time, e.g. one per day named
+ * by date. Columns are declared like table columns, the first one is the
+ * timestamp; INT and REAL types are parsed, anything else is text. Lines
+ * whose first field is no number are skipped, so is a last line without
+ * its newline, which is still being appended.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include "sqlite3.h"
+#include "lfs.h"
+#include "lfs_port.h"
+#include "esp32_logtab.h"
+
+#define LOG_COLUMNS_MAX 32
+#define LOG_LINE_MAX 512
+#define LOG_BUFFER 2048
+#define LOG_FILES_MAX 1024
+
+enum {
+    LOG_TYPE_TEXT = 0,
+    LOG_TYPE_INTEGER,
+    LOG_TYPE_REAL
+};
+
+typedef struct log_vtab {
+    sqlite3_vtab base;
+    char *path;
+    int columns;
+    uint8_t type[LOG_COLUMNS_MAX];
+} log_vtab;
+
+/**
+ * Buffered forward reader over one log file
+ */
+typedef struct log_reader {
+    lfs_file_t file;
+    int open;
+    /* file offset of buf[0] */
+    lfs_soff_t base;
+    int pos;
+    int len;
+    uint8_t buf[LOG_BUFFER];
+} log_reader;
+
+typedef struct log_cursor {
+    sqlite3_vtab_cursor base;
+    log_reader reader;
+    char **files;
+    int nfiles;
+    int file;
+    sqlite3_int64 lo, hi;
+    int eof;
+    /* current line, split into fields in place */
+    sqlite3_int64 ts;
+    lfs_soff_t offset;
+    char line[LOG_LINE_MAX];
+    int nfields;
+    char *field[LOG_COLUMNS_MAX];
+} log_cursor;
+
+static int log_reader_open(log_reader *r, const char *name)
+{
+    if (lfs_file_open(&lfs_filesystem, &r->file, name, LFS_O_RDONLY) < 0)
+        return SQLITE_CANTOPEN;
+    r->open = 1;
+    r->base = 0;
+    r->pos = r->len = 0;
+    return SQLITE_OK;
+}
+
+static void log_reader_close(log_reader *r)
+{
+    if (r->open)
+        lfs_file_close(&lfs_filesystem, &r->file);
+    r->open = 0;
+}
+
+static int log_reader_seek(log_reader *r, lfs_soff_t offset)
+{
+    if (offset >= r->base && offset <= r->base + r->len) {
+        r->pos = (int) (offset - r->base);
+        return SQLITE_OK;
+    }
+    if (lfs_file_seek(&lfs_filesystem, &r->file, offset, LFS_SEEK_SET) != offset)
+        return SQLITE_IOERR_SEEK;
+    r->base = offset;
+    r->pos = r->len = 0;
+    return SQLITE_OK;
+}
+
+/**
+ * Read the next complete line, without its newline. Longer lines are cut
+ * to LOG_LINE_MAX - 1 bytes.
+ * @param offset receives the file offset of the line
+ * @return length of the line, -1 at the end of the file, or before a last
+ *         line without newline
+ */
+static int log_reader_line(log_reader *r, char line[LOG_LINE_MAX], lfs_soff_t *offset)
+{
+    int n = 0;
+
+    *offset = r->base + r->pos;
+    for (;;) {
+        uint8_t *nl;
+        int take;
+
+        if (r->pos == r->len) {
+            lfs_ssize_t got;
+
+            r->base += r->len;
+            r->pos = r->len = 0;
+            got = lfs_file_read(&lfs_filesystem, &r->file, r->buf, LOG_BUFFER);
+            if (got <= 0)
+                return -1;
+            r->len = (int) got;
+        }
+        nl = (uint8_t *) memchr(r->buf + r->pos, '\n', r->len - r->pos);
+        take = (nl ? (int) (nl - r->buf) : r->len) - r->pos;
+        if (n + take > LOG_LINE_MAX - 1) {
+            memcpy(line + n, r->buf + r->pos, LOG_LINE_MAX - 1 - n);
+            n = LOG_LINE_MAX - 1;
+        } else {
+            memcpy(line + n, r->buf + r->pos, take);
+            n += take;
+        }
+        r->pos += take;
+        if (nl) {
+            r->pos++;
+            if (n && line[n - 1] == '\r')
+                n--;
+            line[n] = '\0';
+            return n;
+        }
+    }
+}
+
+/**
+ * Timestamp of a line
+ * @return 1 if the line starts with a number
+ */
+static int log_parse_ts(const char *line, sqlite3_int64 *ts)
+{
+    char *end;
+
+    while (*line == ' ' || *line == '\t')
+        line++;
+    *ts = strtoll(line, &end, 10);
+    return end != line;
+}
+
+/**
+ * Move to the first line at or after offset that has a timestamp. A
+ * nonzero offset is taken as inside a line, which is skipped.
+ * @return 1 if there is one, 0 at the end of the file
+ */
+static int log_seek_line(log_cursor *cur, lfs_soff_t offset)
+{
+    if (log_reader_seek(&cur->reader, offset ? offset - 1 : 0) != SQLITE_OK)
+        return 0;
+    if (offset && log_reader_line(&cur->reader, cur->line, &cur->offset) < 0)
+        return 0;
+    while (log_reader_line(&cur->reader, cur->line, &cur->offset) >= 0) {
+        if (log_parse_ts(cur->line, &cur->ts))
+            return 1;
+    }
+    return 0;
+}
+
+/**
+ * Position the reader on the first line of the open file with a timestamp
+ * of at least lo, by bisecting the file offsets
+ * @return 1 if there is one, 0 if all lines are older
+ */
+static int log_seek_time(log_cursor *cur, sqlite3_int64 lo)
+{
+    lfs_soff_t left = 0, right = lfs_file_size(&lfs_filesystem, &cur->reader.file);
+
+    if (right < 0)
+        return 0;
+    if (lo != INT64_MIN) {
+        while (left < right) {
+            lfs_soff_t mid = left + (right - left) / 2;
+
+            if (!log_seek_line(cur, mid) || cur->ts >= lo)
+                right = mid;
+            else
+                left = mid + 1;
+        }
+    }
+    while (log_seek_line(cur, left)) {
+        /* only lines out of order are still older */
+        if (cur->ts >= lo)
+            return 1;
+        left = cur->reader.base + cur->reader.pos;
+    }
+    return 0;
+}
+
+/**
+ * Timestamp of the first line of a file
+ * @return 1 if it has one
+ */
+static int log_first_ts(log_cursor *cur, int file, sqlite3_int64 *ts)
+{
+    int found;
+
+    if (log_reader_open(&cur->reader, cur->files[file]) != SQLITE_OK)
+        return 0;
+    found = log_seek_line(cur, 0);
+    *ts = cur->ts;
+    log_reader_close(&cur->reader);
+    return found;
+}
+
+static int log_name_compare(const void *a, const void *b)
+{
+    return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+static void log_files_free(log_cursor *cur)
+{
+    for (int i = 0; i < cur->nfiles; i++)
+        sqlite3_free(cur->files[i]);
+    sqlite3_free(cur->files);
+    cur->files = NULL;
+    cur->nfiles = 0;
+}
+
+/**
+ * List the log files, the path itself or the files of the directory in
+ * name order. Listed again for every scan, the logger adds files.
+ */
+static int log_files_list(log_cursor *cur, const char *path)
+{
+    struct lfs_info info;
+    lfs_dir_t dir;
+    int slots = 0;
+
+    log_files_free(cur);
+    if (lfs_stat(&lfs_filesystem, path, &info) < 0)
+        return SQLITE_OK;
+    if (info.type == LFS_TYPE_REG) {
+        cur->files = (char **) sqlite3_malloc(sizeof(char *));
+        if (!cur->files || !(cur->files[0] = sqlite3_mprintf("%s", path)))
+            return SQLITE_NOMEM;
+        cur->nfiles = 1;
+        return SQLITE_OK;
+    }
+    if (lfs_dir_open(&lfs_filesystem, &dir, path) < 0)
+        return SQLITE_CANTOPEN;
+    while (lfs_dir_read(&lfs_filesystem, &dir, &info) > 0 && cur->nfiles < LOG_FILES_MAX) {
+        if (info.type != LFS_TYPE_REG)
+            continue;
+        if (cur->nfiles == slots) {
+            char **files = (char **) sqlite3_realloc(cur->files, (slots + 32) * sizeof(char *));
+
+            if (!files)
+                break;
+            cur->files = files;
+            slots += 32;
+        }
+        if (!(cur->files[cur->nfiles] = sqlite3_mprintf("%s/%s", path, info.name)))
+            break;
+        cur->nfiles++;
+    }
+    lfs_dir_close(&lfs_filesystem, &dir);
+    if (cur->nfiles)
+        qsort(cur->files, cur->nfiles, sizeof(char *), log_name_compare);
+    return SQLITE_OK;
+}
+
+static void log_split(log_cursor *cur)
+{
+    char *p = cur->line;
+
+    cur->nfields = 0;
+    while (cur->nfields < LOG_COLUMNS_MAX) {
+        char *comma = strchr(p, ',');
+
+        cur->field[cur->nfields++] = p;
+        if (!comma)
+            break;
+        *comma = '\0';
+        p = comma + 1;
+    }
+}
+
+/**
+ * Open the next file that can hold rows of the range, positioned on its
+ * first row in the range
+ * @return 1 if there is a row
+ */
+static int log_next_file(log_cursor *cur)
+{
+    while (++cur->file < cur->nfiles) {
+        log_reader_close(&cur->reader);
+        if (log_reader_open(&cur->reader, cur->files[cur->file]) != SQLITE_OK)
+            continue;
+        if (log_seek_time(cur, cur->lo))
+            return 1;
+    }
+    return 0;
+}
+
+static int log_step(log_cursor *cur, int first)
+{
+    if (!first) {
+        int found = 0;
+
+        while (!found && log_reader_line(&cur->reader, cur->line, &cur->offset) >= 0)
+            found = log_parse_ts(cur->line, &cur->ts);
+        if (!found)
+            found = log_next_file(cur);
+        if (!found) {
+            cur->eof = 1;
+            return SQLITE_OK;
+        }
+    }
+    /* lines are in time order, nothing past hi can follow */
+    if (cur->ts > cur->hi) {
+        cur->eof = 1;
+        return SQLITE_OK;
+    }
+    log_split(cur);
+    return SQLITE_OK;
+}
+
+/**
+ * Type of a column from its declaration, the way sqlite derives affinity
+ */
+static int log_type(const char *decl)
+{
+    for (; *decl; decl++) {
+        if (sqlite3_strnicmp(decl, "INT", 3) == 0)
+            return LOG_TYPE_INTEGER;
+        if (sqlite3_strnicmp(decl, "REAL", 4) == 0 || sqlite3_strnicmp(decl, "FLOA", 4) == 0 ||
+            sqlite3_strnicmp(decl, "DOUB", 4) == 0)
+            return LOG_TYPE_REAL;
+    }
+    return LOG_TYPE_TEXT;
+}
+
+static int log_connect(sqlite3 *db, void *aux, int argc, const char *const *argv, sqlite3_vtab **out, char **err)
+{
+    log_vtab *vtab;
+    const char *path;
+    size_t len;
+    char *sql;
+    int rc;
+
+    /* argv[3] is only there with a path */
+    if (argc < 5 || argc - 4 > LOG_COLUMNS_MAX) {
+        *err = sqlite3_mprintf("esp32_log: expected a path and 1 to %d columns", LOG_COLUMNS_MAX);
+        return SQLITE_ERROR;
+    }
+    path = argv[3];
+    len = strlen(path);
+    vtab = (log_vtab *) sqlite3_malloc(sizeof(log_vtab));
+    if (!vtab)
+        return SQLITE_NOMEM;
+    memset(vtab, 0, sizeof(log_vtab));
+
+    /* 'path' as written in CREATE VIRTUAL TABLE */
+    if (len >= 2 && (path[0] == '\'' || path[0] == '"') && path[len - 1] == path[0])
+        vtab->path = sqlite3_mprintf("%.*s", (int) len - 2, path + 1);
+    else
+        vtab->path = sqlite3_mprintf("%s", path);
+    vtab->columns = argc - 4;
+
+    sql = sqlite3_mprintf("CREATE TABLE x(");
+    for (int i = 0; i < vtab->columns && sql; i++) {
+        vtab->type[i] = (uint8_t) log_type(argv[4 + i]);
+        sql = sqlite3_mprintf("%z%s%s", sql, i ? ", " : "", argv[4 + i]);
+    }
+    sql = sqlite3_mprintf("%z)", sql);
+    if (!sql || !vtab->path) {
+        sqlite3_free(sql);
+        sqlite3_free(vtab->path);
+        sqlite3_free(vtab);
+        return SQLITE_NOMEM;
+    }
+    rc = sqlite3_declare_vtab(db, sql);
+    sqlite3_free(sql);
+    if (rc != SQLITE_OK) {
+        *err = sqlite3_mprintf("esp32_log: bad column list");
+        sqlite3_free(vtab->path);
+        sqlite3_free(vtab);
+        return rc;
+    }
+    *out = &vtab->base;
+    return SQLITE_OK;
+}
+
+static int log_disconnect(sqlite3_vtab *base)
+{
+    log_vtab *vtab = (log_vtab *) base;
+
+    sqlite3_free(vtab->path);
+    sqlite3_free(vtab);
+    return SQLITE_OK;
+}
+
+/**
+ * Pass every usable bound on the timestamp column to xFilter, idxStr holds
+ * one operator character per argument: = > G(>=) < L(<=)
+ */
+static int log_best_index(sqlite3_vtab *base, sqlite3_index_info *info)
+{
+    char ops[16];
+    int n = 0, lower = 0, upper = 0;
+
+    for (int i = 0; i < info->nConstraint && n < (int) sizeof(ops) - 1; i++) {
+        const struct sqlite3_index_constraint *c = &info->aConstraint[i];
+        char op;
+
+        if (!c->usable || c->iColumn != 0)
+            continue;
+        switch (c->op) {
+            case SQLITE_INDEX_CONSTRAINT_EQ: op = '='; lower = upper = 1; break;
+            case SQLITE_INDEX_CONSTRAINT_GT: op = '>'; lower = 1; break;
+            case SQLITE_INDEX_CONSTRAINT_GE: op = 'G'; lower = 1; break;
+            case SQLITE_INDEX_CONSTRAINT_LT: op = '<'; upper = 1; break;
+            case SQLITE_INDEX_CONSTRAINT_LE: op = 'L'; upper = 1; break;
+            default: continue;
+        }
+        ops[n++] = op;
+        /* sqlite checks again, a bound that is no number is not applied here */
+        info->aConstraintUsage[i].argvIndex = n;
+        info->aConstraintUsage[i].omit = 0;
+    }
+    ops[n] = '\0';
+    if (n) {
+        info->idxStr = sqlite3_mprintf("%s", ops);
+        if (!info->idxStr)
+            return SQLITE_NOMEM;
+        info->needToFreeIdxStr = 1;
+    }
+    info->idxNum = n;
+    /* a bisection per bound against a scan of all files */
+    info->estimatedCost = lower && upper ? 100 : lower || upper ? 10000 : 1000000;
+    info->estimatedRows = lower && upper ? 100 : lower || upper ? 10000 : 1000000;
+    if (info->nOrderBy == 1 && info->aOrderBy[0].iColumn == 0 && !info->aOrderBy[0].desc)
+        info->orderByConsumed = 1;
+    return SQLITE_OK;
+}
+
+static int log_open(sqlite3_vtab *base, sqlite3_vtab_cursor **out)
+{
+    log_cursor *cur = (log_cursor *) sqlite3_malloc(sizeof(log_cursor));
+
+    if (!cur)
+        return SQLITE_NOMEM;
+    memset(cur, 0, sizeof(log_cursor));
+    cur->eof = 1;
+    *out = &cur->base;
+    return SQLITE_OK;
+}
+
+static int log_close(sqlite3_vtab_cursor *base)
+{
+    log_cursor *cur = (log_cursor *) base;
+
+    log_reader_close(&cur->reader);
+    log_files_free(cur);
+    sqlite3_free(cur);
+    return SQLITE_OK;
+}
+
+/**
+ * Narrow [lo, hi] by one bound, rounded inwards for a fractional value
+ */
+static void log_bound(log_cursor *cur, char op, sqlite3_value *value)
+{
+    sqlite3_int64 lo = INT64_MIN, hi = INT64_MAX;
+
+    if (sqlite3_value_type(value) == SQLITE_INTEGER) {
+        sqlite3_int64 v = sqlite3_value_int64(value);
+
+        switch (op) {
+            case '=': lo = hi = v; break;
+            case '>': lo = v == INT64_MAX ? v : v + 1; if (v == INT64_MAX) hi = INT64_MIN; break;
+            case 'G': lo = v; break;
+            case '<': hi = v == INT64_MIN ? v : v - 1; if (v == INT64_MIN) lo = INT64_MAX; break;
+            case 'L': hi = v; break;
+        }
+    } else if (sqlite3_value_type(value) == SQLITE_FLOAT) {
+        double v = sqlite3_value_double(value);
+
+        /* beyond +-2^62 the bound is left to sqlite */
+        if (v > -4.6e18 && v < 4.6e18) {
+            switch (op) {
+                case '=': lo = (sqlite3_int64) ceil(v); hi = (sqlite3_int64) floor(v); break;
+                case '>': lo = (sqlite3_int64) floor(v) + 1; break;
+                case 'G': lo = (sqlite3_int64) ceil(v); break;
+                case '<': hi = (sqlite3_int64) ceil(v) - 1; break;
+                case 'L': hi = (sqlite3_int64) floor(v); break;
+            }
+        }
+    }
+    if (lo > cur->lo)
+        cur->lo = lo;
+    if (hi < cur->hi)
+        cur->hi = hi;
+}
+
+static int log_filter(sqlite3_vtab_cursor *base, int idx, const char *idx_str, int argc, sqlite3_value **argv)
+{
+    log_cursor *cur = (log_cursor *) base;
+    log_vtab *vtab = (log_vtab *) base->pVtab;
+    int rc, left, right;
+
+    log_reader_close(&cur->reader);
+    cur->lo = INT64_MIN;
+    cur->hi = INT64_MAX;
+    cur->eof = 1;
+    for (int i = 0; i < argc && idx_str && idx_str[i]; i++)
+        log_bound(cur, idx_str[i], argv[i]);
+    if (cur->lo > cur->hi)
+        return SQLITE_OK;
+
+    rc = log_files_list(cur, vtab->path);
+    if (rc != SQLITE_OK)
+        return rc;
+
+    /* start in the last file that begins before lo, files follow each other in time */
+    left = 0;
+    right = cur->nfiles;
+    if (cur->lo != INT64_MIN) {
+        while (left + 1 < right) {
+            int mid = left + (right - left) / 2;
+            sqlite3_int64 ts;
+
+            if (log_first_ts(cur, mid, &ts) && ts < cur->lo)
+                left = mid;
+            else
+                right = mid;
+        }
+    }
+    cur->file = left - 1;
+    if (!log_next_file(cur))
+        return SQLITE_OK;
+    cur->eof = 0;
+    return log_step(cur, 1);
+}
+
+static int log_next(sqlite3_vtab_cursor *base)
+{
+    return log_step((log_cursor *) base, 0);
+}
+
+static int log_eof(sqlite3_vtab_cursor *base)
+{
+    return ((log_cursor *) base)->eof;
+}
+
+static int log_column(sqlite3_vtab_cursor *base, sqlite3_context *ctx, int col)
+{
+    log_cursor *cur = (log_cursor *) base;
+    log_vtab *vtab = (log_vtab *) base->pVtab;
+    const char *field;
+    char *end;
+
+    if (col == 0) {
+        sqlite3_result_int64(ctx, cur->ts);
+        return SQLITE_OK;
+    }
+    if (col >= cur->nfields)
+        return SQLITE_OK;
+    field = cur->field[col];
+    switch (vtab->type[col]) {
+        case LOG_TYPE_INTEGER: {
+            sqlite3_int64 v = strtoll(field, &end, 10);
+            if (end != field)
+                sqlite3_result_int64(ctx, v);
+            break;
+        }
+        case LOG_TYPE_REAL: {
+            double v = strtod(field, &end);
+            if (end != field)
+                sqlite3_result_double(ctx, v);
+            break;
+        }
+        default:
+            sqlite3_result_text(ctx, field, -1, SQLITE_TRANSIENT);
+            break;
+    }
+    return SQLITE_OK;
+}
+
+static int log_rowid(sqlite3_vtab_cursor *base, sqlite3_int64 *rowid)
+{
+    log_cursor *cur = (log_cursor *) base;
+
+    /* file number and line offset, littlefs files stay below 2 GiB */
+    *rowid = ((sqlite3_int64) cur->file << 31) | cur->offset;
+    return SQLITE_OK;
+}
+
+static sqlite3_module log_module = {
+        0,                  // iVersion
+        log_connect,        // xCreate, nothing to create besides the schema
+        log_connect,
+        log_best_index,
+        log_disconnect,
+        log_disconnect,     // xDestroy, the log files are not ours to remove
+        log_open,
+        log_close,
+        log_filter,
+        log_next,
+        log_eof,
+        log_column,
+        log_rowid,
+};
+
+int esp32_logtab_register(sqlite3 *db, const char **errmsg, const struct sqlite3_api_routines *api)
+{
+    return sqlite3_create_module(db, "esp32_log", &log_module, 0);
+}
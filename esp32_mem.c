@@ -0,0 +1,301 @@
+/*
+ * esp32_mem.c
+ *
+ * sqlite3 memory allocator on a dedicated arena. The arena is cut into
+ * 4 KiB slabs; a slab is given to one size class, carved into equal slots
+ * and handed back once all its slots are free, so memory moves between
+ * size classes without fragmenting. Requests above the largest class, or
+ * when the arena is full, go to the ESP-IDF heap with an 8 byte size
+ * header like the default system allocator.
+ *
+ * With SQLITE_DEFAULT_MEMSTATUS 0 sqlite calls in here without a mutex of
+ * its own, so the slab lists are guarded by a spinlock; the ESP-IDF heap
+ * locks itself and is always called outside of it.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sdkconfig.h>
+#include <esp_heap_caps.h>
+#include <freertos/FreeRTOS.h>
+#include "sqlite3.h"
+#include "esp32_vfs.h"
+
+#ifdef CONFIG_SQLITE_MEM_ARENA_KB
+#define MEM_ARENA_SIZE (CONFIG_SQLITE_MEM_ARENA_KB * 1024)
+#else
+#define MEM_ARENA_SIZE (192 * 1024)
+#endif
+
+#ifdef CONFIG_SQLITE_MEM_ARENA_PSRAM
+#define MEM_ARENA_CAPS MALLOC_CAP_SPIRAM
+#else
+#define MEM_ARENA_CAPS (MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT)
+#endif
+
+#define MEM_SLAB_SIZE 4096
+#define MEM_CLASSES 16
+#define MEM_ROUND8(n) (((n) + 7) & ~7)
+
+typedef struct mem_slot {
+    struct mem_slot *next;
+} mem_slot;
+
+typedef struct mem_slab {
+    int16_t cls;
+    int16_t next;
+    uint16_t used;
+    mem_slot *free;
+} mem_slab;
+
+/* roughly 1.5x apart, so at most a third of a slot is wasted */
+static const int mem_class_size[MEM_CLASSES] = {
+        16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048, 3072, 4096
+};
+
+static struct {
+    void *block;
+    uint8_t *arena;
+    uint8_t *arena_end;
+    mem_slab *slabs;
+    int slab_count;
+    int16_t slab_free;
+    int16_t partial[MEM_CLASSES];
+    esp32_mem_stats_t stats;
+} mem_global;
+
+static portMUX_TYPE mem_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static int mem_class(int n)
+{
+    for (int i = 0; i < MEM_CLASSES; i++) {
+        if (n <= mem_class_size[i])
+            return i;
+    }
+    return -1;
+}
+
+static void mem_account(int bytes)
+{
+    mem_global.stats.bytes_used += bytes;
+    if (mem_global.stats.bytes_used > mem_global.stats.bytes_used_high)
+        mem_global.stats.bytes_used_high = mem_global.stats.bytes_used;
+}
+
+static int mem_slab_carve(int cls)
+{
+    int index = mem_global.slab_free, size = mem_class_size[cls];
+    mem_slab *slab;
+    uint8_t *base;
+
+    if (index < 0)
+        return -1;
+    slab = &mem_global.slabs[index];
+    mem_global.slab_free = slab->next;
+
+    slab->cls = cls;
+    slab->used = 0;
+    slab->free = NULL;
+    base = mem_global.arena + (size_t) index * MEM_SLAB_SIZE;
+    for (int off = MEM_SLAB_SIZE / size * size - size; off >= 0; off -= size) {
+        mem_slot *slot = (mem_slot *) (base + off);
+        slot->next = slab->free;
+        slab->free = slot;
+    }
+    slab->next = mem_global.partial[cls];
+    mem_global.partial[cls] = index;
+
+    if (++mem_global.stats.slabs_used > mem_global.stats.slabs_used_high)
+        mem_global.stats.slabs_used_high = mem_global.stats.slabs_used;
+    return index;
+}
+
+static void *mem_heap_malloc(int n)
+{
+    sqlite3_int64 *p = (sqlite3_int64 *) heap_caps_malloc(n + 8, MALLOC_CAP_8BIT);
+
+    if (!p)
+        return NULL;
+    p[0] = n;
+    portENTER_CRITICAL(&mem_lock);
+    mem_global.stats.heap_allocs++;
+    mem_account(n);
+    portEXIT_CRITICAL(&mem_lock);
+    return &p[1];
+}
+
+static void *mem_Malloc(int n)
+{
+    int cls = mem_class(n), index;
+    mem_slab *slab;
+    mem_slot *slot;
+
+    if (cls < 0)
+        return mem_heap_malloc(n);
+    portENTER_CRITICAL(&mem_lock);
+    index = mem_global.partial[cls];
+    if (index < 0)
+        index = mem_slab_carve(cls);
+    if (index < 0) {
+        mem_global.stats.arena_full++;
+        portEXIT_CRITICAL(&mem_lock);
+        return mem_heap_malloc(n);
+    }
+
+    slab = &mem_global.slabs[index];
+    slot = slab->free;
+    slab->free = slot->next;
+    slab->used++;
+    if (!slab->free)
+        mem_global.partial[cls] = slab->next;
+    mem_account(mem_class_size[cls]);
+    portEXIT_CRITICAL(&mem_lock);
+    return slot;
+}
+
+static int mem_in_arena(const void *p)
+{
+    return (const uint8_t *) p >= mem_global.arena && (const uint8_t *) p < mem_global.arena_end;
+}
+
+static void mem_Free(void *p)
+{
+    int index, cls;
+    mem_slab *slab;
+    mem_slot *slot = (mem_slot *) p;
+
+    if (!mem_in_arena(p)) {
+        sqlite3_int64 *h = (sqlite3_int64 *) p - 1;
+        portENTER_CRITICAL(&mem_lock);
+        mem_global.stats.bytes_used -= (int) h[0];
+        mem_global.stats.heap_allocs--;
+        portEXIT_CRITICAL(&mem_lock);
+        heap_caps_free(h);
+        return;
+    }
+
+    index = ((uint8_t *) p - mem_global.arena) / MEM_SLAB_SIZE;
+    slab = &mem_global.slabs[index];
+    portENTER_CRITICAL(&mem_lock);
+    cls = slab->cls;
+    mem_global.stats.bytes_used -= mem_class_size[cls];
+
+    if (!slab->free) {
+        slab->next = mem_global.partial[cls];
+        mem_global.partial[cls] = index;
+    }
+    slot->next = slab->free;
+    slab->free = slot;
+
+    if (--slab->used == 0) {
+        for (int16_t *link = &mem_global.partial[cls]; *link >= 0; link = &mem_global.slabs[*link].next) {
+            if (*link == index) {
+                *link = slab->next;
+                break;
+            }
+        }
+        slab->next = mem_global.slab_free;
+        mem_global.slab_free = index;
+        mem_global.stats.slabs_used--;
+    }
+    portEXIT_CRITICAL(&mem_lock);
+}
+
+static int mem_Size(void *p)
+{
+    if (!p)
+        return 0;
+    if (!mem_in_arena(p))
+        return (int) ((sqlite3_int64 *) p)[-1];
+    return mem_class_size[mem_global.slabs[((uint8_t *) p - mem_global.arena) / MEM_SLAB_SIZE].cls];
+}
+
+static void *mem_Realloc(void *p, int n)
+{
+    int old = mem_Size(p);
+    void *q;
+
+    /* keep the slot when shrinking by less than half */
+    if (mem_in_arena(p) && n <= old && n > old / 2)
+        return p;
+
+    q = mem_Malloc(n);
+    if (!q)
+        return NULL;
+    memcpy(q, p, old < n ? old : n);
+    mem_Free(p);
+    return q;
+}
+
+static int mem_Roundup(int n)
+{
+    int cls = mem_class(n);
+    return cls < 0 ? MEM_ROUND8(n) : mem_class_size[cls];
+}
+
+static int mem_Init(void *arg)
+{
+    int count = MEM_ARENA_SIZE / MEM_SLAB_SIZE;
+
+    memset(&mem_global, 0, sizeof(mem_global));
+    /* room to align the arena to 8 bytes */
+    mem_global.block = heap_caps_malloc((size_t) count * MEM_SLAB_SIZE + 8, MEM_ARENA_CAPS);
+    mem_global.slabs = (mem_slab *) heap_caps_malloc(count * sizeof(mem_slab), MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    if (!mem_global.block || !mem_global.slabs) {
+        heap_caps_free(mem_global.block);
+        heap_caps_free(mem_global.slabs);
+        memset(&mem_global, 0, sizeof(mem_global));
+        return SQLITE_NOMEM;
+    }
+
+    mem_global.arena = (uint8_t *) MEM_ROUND8((uintptr_t) mem_global.block);
+    mem_global.arena_end = mem_global.arena + (size_t) count * MEM_SLAB_SIZE;
+    for (int i = 0; i < count; i++)
+        mem_global.slabs[i].next = i + 1 < count ? i + 1 : -1;
+    for (int i = 0; i < MEM_CLASSES; i++)
+        mem_global.partial[i] = -1;
+    mem_global.slab_count = count;
+    mem_global.slab_free = 0;
+    return SQLITE_OK;
+}
+
+static void mem_Shutdown(void *arg)
+{
+    heap_caps_free(mem_global.block);
+    heap_caps_free(mem_global.slabs);
+    memset(&mem_global, 0, sizeof(mem_global));
+}
+
+static const sqlite3_mem_methods mem_methods = {
+        mem_Malloc,		// xMalloc
+        mem_Free,		// xFree
+        mem_Realloc,		// xRealloc
+        mem_Size,		// xSize
+        mem_Roundup,		// xRoundup
+        mem_Init,		// xInit
+        mem_Shutdown,		// xShutdown
+        NULL			// pAppData
+};
+
+int esp32_vfs_mem_install(void)
+{
+    /* checked here, a failing xInit would fail sqlite3_initialize */
+    if (heap_caps_get_largest_free_block(MEM_ARENA_CAPS) < MEM_ARENA_SIZE / MEM_SLAB_SIZE * MEM_SLAB_SIZE + 8)
+        return SQLITE_NOMEM;
+    return sqlite3_config(SQLITE_CONFIG_MALLOC, &mem_methods);
+}
+
+void esp32_vfs_mem_stats(esp32_mem_stats_t *stats, int reset)
+{
+    portENTER_CRITICAL(&mem_lock);
+    mem_global.stats.slabs_total = mem_global.slab_count;
+    mem_global.stats.slab_size = MEM_SLAB_SIZE;
+    *stats = mem_global.stats;
+    if (reset) {
+        mem_global.stats.bytes_used_high = mem_global.stats.bytes_used;
+        mem_global.stats.slabs_used_high = mem_global.stats.slabs_used;
+        mem_global.stats.arena_full = 0;
+    }
+    portEXIT_CRITICAL(&mem_lock);
+}
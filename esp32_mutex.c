@@ -0,0 +1,138 @@
+/*
+ * esp32_mutex.c
+ *
+ * sqlite3 mutexes on FreeRTOS semaphores. config_ext.h sets
+ * SQLITE_MUTEX_APPDEF, so sqlite takes its mutex methods from
+ * sqlite3DefaultMutex() below. SQLITE_MUTEX_FAST maps to a plain FreeRTOS
+ * mutex, SQLITE_MUTEX_RECURSIVE to a recursive one. The semaphore storage
+ * lives inside the sqlite3_mutex, so static mutexes need no allocation at
+ * all and dynamic ones a single sqlite3_malloc.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include "sqlite3.h"
+
+#define ESP32_MUTEX_STATICS (SQLITE_MUTEX_STATIC_VFS3 - SQLITE_MUTEX_STATIC_MASTER + 1)
+
+struct sqlite3_mutex {
+    SemaphoreHandle_t handle;
+    StaticSemaphore_t buffer;
+    int id;
+};
+
+static sqlite3_mutex esp32_static_mutexes[ESP32_MUTEX_STATICS];
+
+static void esp32_mutex_create(sqlite3_mutex *m, int id)
+{
+    m->id = id;
+    if (id == SQLITE_MUTEX_RECURSIVE)
+        m->handle = xSemaphoreCreateRecursiveMutexStatic(&m->buffer);
+    else
+        m->handle = xSemaphoreCreateMutexStatic(&m->buffer);
+}
+
+static int esp32_mutex_Init(void)
+{
+    for (int i = 0; i < ESP32_MUTEX_STATICS; i++) {
+        if (!esp32_static_mutexes[i].handle)
+            esp32_mutex_create(&esp32_static_mutexes[i], SQLITE_MUTEX_STATIC_MASTER + i);
+    }
+    return SQLITE_OK;
+}
+
+static int esp32_mutex_End(void)
+{
+    for (int i = 0; i < ESP32_MUTEX_STATICS; i++) {
+        if (esp32_static_mutexes[i].handle)
+            vSemaphoreDelete(esp32_static_mutexes[i].handle);
+        esp32_static_mutexes[i].handle = NULL;
+    }
+    return SQLITE_OK;
+}
+
+static sqlite3_mutex *esp32_mutex_Alloc(int id)
+{
+    sqlite3_mutex *m;
+
+    if (id >= SQLITE_MUTEX_STATIC_MASTER) {
+        if (id - SQLITE_MUTEX_STATIC_MASTER >= ESP32_MUTEX_STATICS)
+            return NULL;
+        return &esp32_static_mutexes[id - SQLITE_MUTEX_STATIC_MASTER];
+    }
+
+    m = (sqlite3_mutex *) sqlite3_malloc(sizeof(sqlite3_mutex));
+    if (!m)
+        return NULL;
+    esp32_mutex_create(m, id);
+    if (!m->handle) {
+        sqlite3_free(m);
+        return NULL;
+    }
+    return m;
+}
+
+static void esp32_mutex_Free(sqlite3_mutex *m)
+{
+    /* static mutexes are never freed */
+    if (m->id >= SQLITE_MUTEX_STATIC_MASTER)
+        return;
+    vSemaphoreDelete(m->handle);
+    sqlite3_free(m);
+}
+
+static void esp32_mutex_Enter(sqlite3_mutex *m)
+{
+    if (m->id == SQLITE_MUTEX_RECURSIVE)
+        xSemaphoreTakeRecursive(m->handle, portMAX_DELAY);
+    else
+        xSemaphoreTake(m->handle, portMAX_DELAY);
+}
+
+static int esp32_mutex_Try(sqlite3_mutex *m)
+{
+    BaseType_t taken;
+
+    if (m->id == SQLITE_MUTEX_RECURSIVE)
+        taken = xSemaphoreTakeRecursive(m->handle, 0);
+    else
+        taken = xSemaphoreTake(m->handle, 0);
+    return taken == pdTRUE ? SQLITE_OK : SQLITE_BUSY;
+}
+
+static void esp32_mutex_Leave(sqlite3_mutex *m)
+{
+    if (m->id == SQLITE_MUTEX_RECURSIVE)
+        xSemaphoreGiveRecursive(m->handle);
+    else
+        xSemaphoreGive(m->handle);
+}
+
+/* only used by assert() in SQLITE_DEBUG builds */
+static int esp32_mutex_Held(sqlite3_mutex *m)
+{
+    return m == NULL || xSemaphoreGetMutexHolder(m->handle) == xTaskGetCurrentTaskHandle();
+}
+
+static int esp32_mutex_NotHeld(sqlite3_mutex *m)
+{
+    return m == NULL || xSemaphoreGetMutexHolder(m->handle) != xTaskGetCurrentTaskHandle();
+}
+
+sqlite3_mutex_methods const *sqlite3DefaultMutex(void)
+{
+    static const sqlite3_mutex_methods methods = {
+            esp32_mutex_Init,		// xMutexInit
+            esp32_mutex_End,		// xMutexEnd
+            esp32_mutex_Alloc,		// xMutexAlloc
+            esp32_mutex_Free,		// xMutexFree
+            esp32_mutex_Enter,		// xMutexEnter
+            esp32_mutex_Try,		// xMutexTry
+            esp32_mutex_Leave,		// xMutexLeave
+            esp32_mutex_Held,		// xMutexHeld
+            esp32_mutex_NotHeld		// xMutexNotHeld
+    };
+    return &methods;
+}
@@ -0,0 +1,276 @@
+/*
+ * esp32_partition.c
+ *
+ * Time partitioned tables. Every period of a table lives in its own
+ * database file, so inserts only touch the small file of the current
+ * period and retention is removing whole files: one lfs_remove frees all
+ * blocks of an expired period, where a DELETE would rewrite B-tree pages
+ * all over one big CTZ file.
+ *
+ * One connection with an in-memory main database attaches the current
+ * partition as "hot" and the older ones in the retention window as
+ * p<period start>. A TEMP view named like the table unions them.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "sqlite3.h"
+#include "lfs.h"
+#include "lfs_port.h"
+#include "esp32_partition.h"
+
+/* SQLITE_MAX_ATTACHED */
+#define PART_MAX 10
+
+struct esp32_partition {
+    sqlite3 *db;
+    char *dir;
+    char *base;
+    char *table;
+    char *columns;
+    char *index;
+    int period_s;
+    int retain;
+    /* start of the period attached as hot, -1 before the first rotate */
+    sqlite3_int64 current;
+    int count;
+    sqlite3_int64 attached[PART_MAX];
+};
+
+static int part_exec(esp32_partition_t *p, char *sql)
+{
+    int rc;
+
+    if (!sql)
+        return SQLITE_NOMEM;
+    rc = sqlite3_exec(p->db, sql, NULL, NULL, NULL);
+    sqlite3_free(sql);
+    return rc;
+}
+
+static char *part_path(esp32_partition_t *p, sqlite3_int64 start)
+{
+    return sqlite3_mprintf("%s%s%s_%lld.db", p->dir, *p->dir ? "/" : "", p->base, start);
+}
+
+/**
+ * Period start of a partition file name, -1 if the name is not one of ours
+ */
+static sqlite3_int64 part_parse(esp32_partition_t *p, const char *name)
+{
+    size_t len = strlen(p->base);
+    char *end;
+    sqlite3_int64 start;
+
+    if (strncmp(name, p->base, len) || name[len] != '_' || name[len + 1] < '0' || name[len + 1] > '9')
+        return -1;
+    start = strtoll(name + len + 1, &end, 10);
+    return strcmp(end, ".db") ? -1 : start;
+}
+
+static int part_attach(esp32_partition_t *p, sqlite3_int64 start, int hot)
+{
+    char *path = part_path(p, start);
+    int rc;
+
+    if (!path)
+        return SQLITE_NOMEM;
+    if (hot)
+        rc = part_exec(p, sqlite3_mprintf("ATTACH %Q AS " ESP32_PARTITION_HOT, path));
+    else
+        rc = part_exec(p, sqlite3_mprintf("ATTACH %Q AS \"p%lld\"", path, start));
+    sqlite3_free(path);
+    return rc;
+}
+
+static void part_remove(esp32_partition_t *p, sqlite3_int64 start)
+{
+    static const char *const sides[] = {"-wal", "-journal"};
+    char *path = part_path(p, start);
+
+    if (!path)
+        return;
+    lfs_remove(&lfs_filesystem, path);
+    for (size_t i = 0; i < sizeof(sides) / sizeof(sides[0]); i++) {
+        char *side = sqlite3_mprintf("%s%s", path, sides[i]);
+
+        if (side)
+            lfs_remove(&lfs_filesystem, side);
+        sqlite3_free(side);
+    }
+    sqlite3_free(path);
+}
+
+static int part_attached(esp32_partition_t *p, sqlite3_int64 start)
+{
+    for (int i = 0; i < p->count; i++) {
+        if (p->attached[i] == start)
+            return 1;
+    }
+    return 0;
+}
+
+/**
+ * Remove expired files and attach the files of the window that are not
+ * attached yet, which after a reboot are all of them
+ */
+static int part_scan(esp32_partition_t *p, sqlite3_int64 oldest, sqlite3_int64 start)
+{
+    lfs_dir_t dir;
+    struct lfs_info info;
+    sqlite3_int64 expired[PART_MAX], window[PART_MAX];
+    int nexpired = 0, nwindow = 0, rc = SQLITE_OK;
+
+    if (lfs_dir_open(&lfs_filesystem, &dir, *p->dir ? p->dir : "/") < 0)
+        return SQLITE_CANTOPEN;
+    while (lfs_dir_read(&lfs_filesystem, &dir, &info) > 0) {
+        sqlite3_int64 at;
+
+        if (info.type != LFS_TYPE_REG || (at = part_parse(p, info.name)) < 0)
+            continue;
+        /* files ahead of the clock are left alone, extra expired ones go next rotation */
+        if (at < oldest && nexpired < PART_MAX)
+            expired[nexpired++] = at;
+        else if (at >= oldest && at < start && !part_attached(p, at) && nwindow < PART_MAX)
+            window[nwindow++] = at;
+    }
+    lfs_dir_close(&lfs_filesystem, &dir);
+
+    for (int i = 0; i < nexpired; i++)
+        part_remove(p, expired[i]);
+    /* one slot stays free for hot */
+    for (int i = 0; rc == SQLITE_OK && i < nwindow && p->count < PART_MAX - 1; i++) {
+        if ((rc = part_attach(p, window[i], 0)) == SQLITE_OK)
+            p->attached[p->count++] = window[i];
+    }
+    return rc;
+}
+
+static int part_compare(const void *a, const void *b)
+{
+    sqlite3_int64 x = *(const sqlite3_int64 *) a, y = *(const sqlite3_int64 *) b;
+    return x < y ? -1 : x > y;
+}
+
+static int part_view(esp32_partition_t *p)
+{
+    char *sql = NULL;
+
+    for (int i = 0; i < p->count; i++)
+        sql = sqlite3_mprintf("%z%sSELECT * FROM \"p%lld\".\"%w\"", sql, sql ? " UNION ALL " : "",
+                              p->attached[i], p->table);
+    sql = sqlite3_mprintf("CREATE TEMP VIEW \"%w\" AS %z%sSELECT * FROM " ESP32_PARTITION_HOT ".\"%w\"",
+                          p->table, sql, sql ? " UNION ALL " : "", p->table);
+    return part_exec(p, sql);
+}
+
+int esp32_partition_rotate(esp32_partition_t *p, sqlite3_int64 now)
+{
+    sqlite3_int64 start = now - now % p->period_s;
+    sqlite3_int64 oldest = start - (sqlite3_int64) (p->retain - 1) * p->period_s;
+    int rc, kept = 0;
+
+    if (start == p->current)
+        return SQLITE_OK;
+
+    /* the view refers to every attached partition */
+    rc = part_exec(p, sqlite3_mprintf("DROP VIEW IF EXISTS temp.\"%w\"", p->table));
+
+    /* last period's hot partition stays in the window under its own name */
+    if (rc == SQLITE_OK && p->current >= 0) {
+        rc = part_exec(p, sqlite3_mprintf("DETACH " ESP32_PARTITION_HOT));
+        if (rc == SQLITE_OK && p->current >= oldest && p->current < start &&
+            (rc = part_attach(p, p->current, 0)) == SQLITE_OK)
+            p->attached[p->count++] = p->current;
+        p->current = -1;
+    }
+
+    for (int i = 0; rc == SQLITE_OK && i < p->count; i++) {
+        if (p->attached[i] >= oldest && p->attached[i] < start)
+            p->attached[kept++] = p->attached[i];
+        else if ((rc = part_exec(p, sqlite3_mprintf("DETACH \"p%lld\"", p->attached[i]))) != SQLITE_OK)
+            p->attached[kept++] = p->attached[i];
+    }
+    if (rc == SQLITE_OK)
+        p->count = kept;
+
+    if (rc == SQLITE_OK)
+        rc = part_scan(p, oldest, start);
+    if (rc == SQLITE_OK)
+        rc = part_attach(p, start, 1);
+    if (rc == SQLITE_OK) {
+        p->current = start;
+        rc = part_exec(p, sqlite3_mprintf("CREATE TABLE IF NOT EXISTS " ESP32_PARTITION_HOT ".\"%w\"(%s)",
+                                          p->table, p->columns));
+    }
+    if (rc == SQLITE_OK && p->index)
+        rc = part_exec(p, sqlite3_mprintf("CREATE INDEX IF NOT EXISTS " ESP32_PARTITION_HOT ".\"%w_idx\" ON \"%w\"(%s)",
+                                          p->table, p->table, p->index));
+
+    qsort(p->attached, p->count, sizeof(sqlite3_int64), part_compare);
+    if (rc == SQLITE_OK)
+        rc = part_view(p);
+    return rc;
+}
+
+int esp32_partition_open(const esp32_partition_config_t *config, sqlite3_int64 now, esp32_partition_t **out)
+{
+    esp32_partition_t *p;
+    const char *slash;
+    int rc;
+
+    *out = NULL;
+    if (!config->prefix || !config->table || !config->columns || config->period_s <= 0 ||
+        config->retain < 1 || config->retain > PART_MAX)
+        return SQLITE_MISUSE;
+
+    p = (esp32_partition_t *) sqlite3_malloc(sizeof(esp32_partition_t));
+    if (!p)
+        return SQLITE_NOMEM;
+    memset(p, 0, sizeof(esp32_partition_t));
+    slash = strrchr(config->prefix, '/');
+    p->dir = slash ? sqlite3_mprintf("%.*s", (int) (slash - config->prefix), config->prefix) : sqlite3_mprintf("");
+    p->base = sqlite3_mprintf("%s", slash ? slash + 1 : config->prefix);
+    p->table = sqlite3_mprintf("%s", config->table);
+    p->columns = sqlite3_mprintf("%s", config->columns);
+    p->index = config->index ? sqlite3_mprintf("%s", config->index) : NULL;
+    p->period_s = config->period_s;
+    p->retain = config->retain;
+    p->current = -1;
+    if (!p->dir || !p->base || !p->table || !p->columns || (config->index && !p->index)) {
+        esp32_partition_close(p);
+        return SQLITE_NOMEM;
+    }
+
+    rc = sqlite3_open(":memory:", &p->db);
+    if (rc == SQLITE_OK)
+        rc = esp32_partition_rotate(p, now);
+    if (rc != SQLITE_OK) {
+        esp32_partition_close(p);
+        return rc;
+    }
+    *out = p;
+    return SQLITE_OK;
+}
+
+sqlite3 *esp32_partition_db(esp32_partition_t *p)
+{
+    return p->db;
+}
+
+int esp32_partition_close(esp32_partition_t *p)
+{
+    int rc;
+
+    if (!p)
+        return SQLITE_OK;
+    rc = sqlite3_close(p->db);
+    sqlite3_free(p->dir);
+    sqlite3_free(p->base);
+    sqlite3_free(p->table);
+    sqlite3_free(p->columns);
+    sqlite3_free(p->index);
+    sqlite3_free(p);
+    return rc;
+}
@@ -0,0 +1,84 @@
+//
+// Time partitioned tables over the esp32 VFS (esp32_partition.c)
+//
+
+#ifndef SD_CARD_ESP32_PARTITION_H
+#define SD_CARD_ESP32_PARTITION_H
+
+#include "sqlite3.h"
+
+/**
+ * Schema name the current partition is attached as. Inserts go to
+ * hot.<table>; a statement prepared with sqlite3_prepare_v2 follows the
+ * rotation to the next partition by itself.
+ */
+#define ESP32_PARTITION_HOT "hot"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Layout of a partitioned table. Every period gets its own database file
+ * <prefix>_<period start>.db holding one table of the given columns.
+ */
+typedef struct esp32_partition_config {
+    /* file name prefix, e.g. "data/sensor" */
+    const char *prefix;
+    /* table name, in every partition and of the unified view */
+    const char *table;
+    /* column definitions, e.g. "ts INTEGER NOT NULL, value REAL" */
+    const char *columns;
+    /* optional column list indexed in every partition, e.g. "ts", or NULL */
+    const char *index;
+    /* seconds per partition, 86400 for one file per day */
+    int period_s;
+    /* partitions kept including the current one, 1 to 10 (SQLITE_MAX_ATTACHED) */
+    int retain;
+} esp32_partition_config_t;
+
+typedef struct esp32_partition esp32_partition_t;
+
+/**
+ * Open a partitioned table. The connection has an in-memory main database,
+ * the current partition is attached as ESP32_PARTITION_HOT, the older ones
+ * in the retention window as p<period start>, and a TEMP view named like
+ * the table unions them all in time order.
+ * @param config layout, the strings are copied
+ * @param now current time in seconds, selects the current partition
+ * @param out receives the handle, free with esp32_partition_close
+ * @return SQLITE_OK on success
+ */
+extern int esp32_partition_open(const esp32_partition_config_t *config, sqlite3_int64 now, esp32_partition_t **out);
+
+/**
+ * Connection to query the view and to insert into hot.<table>
+ * @param part partition handle
+ * @return sqlite3 connection owned by the handle
+ */
+extern sqlite3 *esp32_partition_db(esp32_partition_t *part);
+
+/**
+ * Move to the partition of now if its period started. Partitions older
+ * than the retention window are detached and removed from the card with
+ * one lfs_remove each and the view is rebuilt. Cheap when the period did
+ * not change, call it before every insert batch. Must not run while
+ * statements of the connection are active.
+ * @param part partition handle
+ * @param now current time in seconds
+ * @return SQLITE_OK on success
+ */
+extern int esp32_partition_rotate(esp32_partition_t *part, sqlite3_int64 now);
+
+/**
+ * Close the connection and free the handle
+ * @param part partition handle, may be NULL
+ * @return result of sqlite3_close
+ */
+extern int esp32_partition_close(esp32_partition_t *part);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //SD_CARD_ESP32_PARTITION_H
@@ -0,0 +1,615 @@
+/*
+ * esp32_pcache.c
+ *
+ * sqlite3 page cache on a PSRAM arena. At sqlite3_initialize one block of
+ * CONFIG_SQLITE_PCACHE_ARENA_KB is taken from PSRAM and cut into 64 KiB
+ * slabs; a slab is handed to the first cache that needs slots of its size
+ * and carved into fixed size page slots, and goes back to the arena once
+ * all its slots are free. Every cache evicts with the clock algorithm: a
+ * hit sets the page's reference bit, the hand clears bits until it finds
+ * an unpinned page that was not used since the last sweep.
+ *
+ * Pages whose slot is larger than a slab, 64 KiB pages, are allocated
+ * from the heap like the overflow of a full arena, and such a cache holds
+ * only PRAGMA cache_size pages.
+ *
+ * Purgeable caches hold at least esp32_vfs_pcache_set_pages() pages, PRAGMA
+ * cache_size can raise that per connection. The default cache size from
+ * config_ext.h is only a couple of pages.
+ *
+ * A cache belongs to one connection and sqlite serializes the calls on it,
+ * but the arena and the counters are shared by all connections and are
+ * guarded by a spinlock. Heap slots are freed outside of it.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sdkconfig.h>
+#include <esp_heap_caps.h>
+#include <freertos/FreeRTOS.h>
+#include "sqlite3.h"
+#include "esp32_vfs.h"
+
+#ifdef CONFIG_SQLITE_PCACHE_ARENA_KB
+#define PCACHE_ARENA_SIZE (CONFIG_SQLITE_PCACHE_ARENA_KB * 1024)
+#else
+#define PCACHE_ARENA_SIZE (2048 * 1024)
+#endif
+
+#ifdef CONFIG_SQLITE_PCACHE_PAGES
+#define PCACHE_DEFAULT_PAGES CONFIG_SQLITE_PCACHE_PAGES
+#else
+#define PCACHE_DEFAULT_PAGES 256
+#endif
+
+#define PCACHE_SLAB_SIZE 65536
+#define PCACHE_CLASSES 8
+#define PCACHE_ALIGN(n) (((n) + 7) & ~7)
+#define PCACHE_HEAP_SLAB 0xFFFF
+
+typedef struct pcache_page pcache_page;
+typedef struct pcache_slot pcache_slot;
+
+struct pcache_page {
+    sqlite3_pcache_page base;
+    unsigned key;
+    uint8_t pinned;
+    uint8_t ref;
+    uint16_t slab;
+    pcache_page *hash_next;
+    pcache_page *ring_prev;
+    pcache_page *ring_next;
+};
+
+struct pcache_slot {
+    pcache_slot *next;
+};
+
+typedef struct pcache_slab {
+    int cls;
+    int used;
+    pcache_slot *free;
+    int next;
+} pcache_slab;
+
+/* slabs of one slot size, partial is a list of slabs with free slots */
+typedef struct pcache_class {
+    int slot_size;
+    int partial;
+} pcache_class;
+
+typedef struct pcache {
+    int page_size;
+    int extra_size;
+    int slot_size;
+    int purgeable;
+    unsigned max;
+    unsigned count;
+    unsigned pinned;
+    unsigned hash_size;
+    pcache_page **hash;
+    pcache_page *hand;
+} pcache;
+
+static struct {
+    uint8_t *arena;
+    pcache_slab *slabs;
+    int slab_count;
+    int slab_free;
+    int slabs_used;
+    int slabs_used_high;
+    pcache_class classes[PCACHE_CLASSES];
+    unsigned pages;
+    unsigned pages_high;
+    unsigned heap_slots;
+    esp32_pcache_stats_t stats;
+} pcache_global;
+
+/* outside pcache_global, it may be set before sqlite3_initialize */
+static int pcache_min_pages = PCACHE_DEFAULT_PAGES;
+
+static portMUX_TYPE pcache_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static int pcache_class_find(int slot_size)
+{
+    for (int i = 0; i < PCACHE_CLASSES; i++) {
+        if (pcache_global.classes[i].slot_size == slot_size)
+            return i;
+        if (pcache_global.classes[i].slot_size == 0) {
+            pcache_global.classes[i].slot_size = slot_size;
+            pcache_global.classes[i].partial = -1;
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Take a free slab from the arena and carve it into slots of a class
+ */
+static int pcache_slab_carve(int cls)
+{
+    int index = pcache_global.slab_free, slot_size = pcache_global.classes[cls].slot_size;
+    pcache_slab *slab;
+    uint8_t *base;
+
+    if (index < 0)
+        return -1;
+    slab = &pcache_global.slabs[index];
+    pcache_global.slab_free = slab->next;
+
+    slab->cls = cls;
+    slab->used = 0;
+    slab->free = NULL;
+    base = pcache_global.arena + (size_t) index * PCACHE_SLAB_SIZE;
+    for (int off = PCACHE_SLAB_SIZE / slot_size * slot_size - slot_size; off >= 0; off -= slot_size) {
+        pcache_slot *slot = (pcache_slot *) (base + off);
+        slot->next = slab->free;
+        slab->free = slot;
+    }
+    slab->next = pcache_global.classes[cls].partial;
+    pcache_global.classes[cls].partial = index;
+
+    if (++pcache_global.slabs_used > pcache_global.slabs_used_high)
+        pcache_global.slabs_used_high = pcache_global.slabs_used;
+    return index;
+}
+
+static void *pcache_slot_alloc(int slot_size, uint16_t *slab_index)
+{
+    int cls, index;
+    pcache_slab *slab;
+    pcache_slot *slot = NULL;
+
+    /* a 64 KiB page does not fit a slab with its header, it goes to the heap */
+    if (slot_size > PCACHE_SLAB_SIZE)
+        return NULL;
+    portENTER_CRITICAL(&pcache_lock);
+    cls = pcache_class_find(slot_size);
+    index = cls < 0 ? -1 : pcache_global.classes[cls].partial;
+    if (cls >= 0 && index < 0)
+        index = pcache_slab_carve(cls);
+    if (index >= 0) {
+        slab = &pcache_global.slabs[index];
+        slot = slab->free;
+        slab->free = slot->next;
+        slab->used++;
+        if (!slab->free)
+            pcache_global.classes[cls].partial = slab->next;
+        *slab_index = index;
+    }
+    portEXIT_CRITICAL(&pcache_lock);
+    return slot;
+}
+
+static void pcache_slot_free(void *ptr, int index)
+{
+    pcache_slab *slab;
+    pcache_class *cls;
+    pcache_slot *slot = (pcache_slot *) ptr;
+    int was_full;
+
+    if (index == PCACHE_HEAP_SLAB) {
+        portENTER_CRITICAL(&pcache_lock);
+        pcache_global.heap_slots--;
+        portEXIT_CRITICAL(&pcache_lock);
+        sqlite3_free(ptr);
+        return;
+    }
+    portENTER_CRITICAL(&pcache_lock);
+    slab = &pcache_global.slabs[index];
+    cls = &pcache_global.classes[slab->cls];
+    was_full = slab->free == NULL;
+
+    slot->next = slab->free;
+    slab->free = slot;
+    slab->used--;
+
+    if (was_full) {
+        slab->next = cls->partial;
+        cls->partial = index;
+    }
+    if (slab->used == 0) {
+        /* unlink from the partial list and give the slab back */
+        for (int *link = &cls->partial; *link >= 0; link = &pcache_global.slabs[*link].next) {
+            if (*link == index) {
+                *link = slab->next;
+                break;
+            }
+        }
+        slab->next = pcache_global.slab_free;
+        pcache_global.slab_free = index;
+        pcache_global.slabs_used--;
+    }
+    portEXIT_CRITICAL(&pcache_lock);
+}
+
+static unsigned pcache_limit(pcache *c)
+{
+    if (!c->purgeable)
+        return UINT32_MAX;
+    /* the minimum is sized for the arena, heap pages only get cache_size */
+    if (c->slot_size > PCACHE_SLAB_SIZE)
+        return c->max;
+    return c->max > (unsigned) pcache_min_pages ? c->max : (unsigned) pcache_min_pages;
+}
+
+static pcache_page **pcache_hash_slot(pcache *c, unsigned key)
+{
+    return &c->hash[key & (c->hash_size - 1)];
+}
+
+static int pcache_hash_grow(pcache *c)
+{
+    unsigned size = c->hash_size ? c->hash_size * 2 : 64;
+    pcache_page **hash = (pcache_page **) sqlite3_malloc(size * sizeof(pcache_page *));
+
+    if (!hash)
+        return SQLITE_NOMEM;
+    memset(hash, 0, size * sizeof(pcache_page *));
+    for (unsigned i = 0; i < c->hash_size; i++) {
+        pcache_page *page = c->hash[i];
+        while (page) {
+            pcache_page *next = page->hash_next;
+            page->hash_next = hash[page->key & (size - 1)];
+            hash[page->key & (size - 1)] = page;
+            page = next;
+        }
+    }
+    sqlite3_free(c->hash);
+    c->hash = hash;
+    c->hash_size = size;
+    return SQLITE_OK;
+}
+
+static void pcache_hash_remove(pcache *c, pcache_page *page)
+{
+    for (pcache_page **link = pcache_hash_slot(c, page->key); *link; link = &(*link)->hash_next) {
+        if (*link == page) {
+            *link = page->hash_next;
+            return;
+        }
+    }
+}
+
+static void pcache_ring_insert(pcache *c, pcache_page *page)
+{
+    if (!c->hand) {
+        page->ring_prev = page->ring_next = page;
+        c->hand = page;
+        return;
+    }
+    /* new pages go just behind the hand, the last place it looks */
+    page->ring_next = c->hand;
+    page->ring_prev = c->hand->ring_prev;
+    c->hand->ring_prev->ring_next = page;
+    c->hand->ring_prev = page;
+}
+
+static void pcache_ring_remove(pcache *c, pcache_page *page)
+{
+    if (page->ring_next == page) {
+        c->hand = NULL;
+        return;
+    }
+    if (c->hand == page)
+        c->hand = page->ring_next;
+    page->ring_prev->ring_next = page->ring_next;
+    page->ring_next->ring_prev = page->ring_prev;
+}
+
+/**
+ * Unlink a page from hash and ring, the slot stays allocated
+ */
+static void pcache_detach(pcache *c, pcache_page *page)
+{
+    pcache_hash_remove(c, page);
+    pcache_ring_remove(c, page);
+    if (page->pinned)
+        c->pinned--;
+    c->count--;
+    portENTER_CRITICAL(&pcache_lock);
+    pcache_global.pages--;
+    portEXIT_CRITICAL(&pcache_lock);
+}
+
+static void pcache_discard(pcache *c, pcache_page *page)
+{
+    pcache_detach(c, page);
+    pcache_slot_free(page, page->slab);
+}
+
+/**
+ * Advance the clock hand to an unpinned page that was not referenced since
+ * the hand last passed it
+ * @return victim, still attached, or NULL if every page is pinned
+ */
+static pcache_page *pcache_clock(pcache *c)
+{
+    for (unsigned steps = 0; c->hand && steps < 2 * c->count; steps++) {
+        pcache_page *page = c->hand;
+
+        c->hand = page->ring_next;
+        if (page->pinned)
+            continue;
+        if (page->ref) {
+            page->ref = 0;
+            continue;
+        }
+        return page;
+    }
+    return NULL;
+}
+
+static int pcache_Init(void *arg)
+{
+    int count = PCACHE_ARENA_SIZE / PCACHE_SLAB_SIZE;
+
+    memset(&pcache_global, 0, sizeof(pcache_global));
+    pcache_global.arena = (uint8_t *) heap_caps_malloc((size_t) count * PCACHE_SLAB_SIZE, MALLOC_CAP_SPIRAM);
+    pcache_global.slabs = (pcache_slab *) malloc(count * sizeof(pcache_slab));
+    if (!pcache_global.arena || !pcache_global.slabs) {
+        heap_caps_free(pcache_global.arena);
+        free(pcache_global.slabs);
+        pcache_global.arena = NULL;
+        pcache_global.slabs = NULL;
+        return SQLITE_NOMEM;
+    }
+
+    for (int i = 0; i < count; i++)
+        pcache_global.slabs[i].next = i + 1 < count ? i + 1 : -1;
+    pcache_global.slab_count = count;
+    pcache_global.slab_free = 0;
+    return SQLITE_OK;
+}
+
+static void pcache_Shutdown(void *arg)
+{
+    heap_caps_free(pcache_global.arena);
+    free(pcache_global.slabs);
+    pcache_global.arena = NULL;
+    pcache_global.slabs = NULL;
+}
+
+static sqlite3_pcache *pcache_Create(int page_size, int extra_size, int purgeable)
+{
+    pcache *c = (pcache *) sqlite3_malloc(sizeof(pcache));
+    int slot_size = PCACHE_ALIGN(sizeof(pcache_page)) + PCACHE_ALIGN(page_size) + PCACHE_ALIGN(extra_size);
+
+    if (!c)
+        return NULL;
+    memset(c, 0, sizeof(pcache));
+    c->page_size = page_size;
+    c->extra_size = extra_size;
+    c->slot_size = slot_size;
+    c->purgeable = purgeable;
+    c->max = 10;
+    if (pcache_hash_grow(c) != SQLITE_OK) {
+        sqlite3_free(c);
+        return NULL;
+    }
+    return (sqlite3_pcache *) c;
+}
+
+static void pcache_Cachesize(sqlite3_pcache *cache, int max)
+{
+    pcache *c = (pcache *) cache;
+    pcache_page *victim;
+
+    c->max = max > 0 ? max : 1;
+    while (c->count > pcache_limit(c) && (victim = pcache_clock(c)) != NULL) {
+        pcache_discard(c, victim);
+        portENTER_CRITICAL(&pcache_lock);
+        pcache_global.stats.evictions++;
+        portEXIT_CRITICAL(&pcache_lock);
+    }
+}
+
+static int pcache_Pagecount(sqlite3_pcache *cache)
+{
+    return ((pcache *) cache)->count;
+}
+
+static sqlite3_pcache_page *pcache_Fetch(sqlite3_pcache *cache, unsigned key, int create)
+{
+    pcache *c = (pcache *) cache;
+    pcache_page *page, *victim = NULL;
+    uint16_t slab;
+    uint8_t *slot;
+
+    for (page = *pcache_hash_slot(c, key); page; page = page->hash_next) {
+        if (page->key == key) {
+            if (!page->pinned) {
+                page->pinned = 1;
+                c->pinned++;
+            }
+            page->ref = 1;
+            portENTER_CRITICAL(&pcache_lock);
+            pcache_global.stats.hits++;
+            portEXIT_CRITICAL(&pcache_lock);
+            return &page->base;
+        }
+    }
+    portENTER_CRITICAL(&pcache_lock);
+    pcache_global.stats.misses++;
+    portEXIT_CRITICAL(&pcache_lock);
+    if (!create)
+        return NULL;
+
+    /* at the limit reuse the clock victim's slot, create 1 gives up when
+     * that would mean going over */
+    if (c->count >= pcache_limit(c)) {
+        victim = pcache_clock(c);
+        if (!victim && create == 1)
+            return NULL;
+    }
+    if (victim) {
+        pcache_detach(c, victim);
+        portENTER_CRITICAL(&pcache_lock);
+        pcache_global.stats.evictions++;
+        portEXIT_CRITICAL(&pcache_lock);
+        slot = (uint8_t *) victim;
+        slab = victim->slab;
+    } else {
+        slot = (uint8_t *) pcache_slot_alloc(c->slot_size, &slab);
+        if (!slot && (victim = pcache_clock(c)) != NULL) {
+            /* arena exhausted, take a page from this cache instead */
+            pcache_detach(c, victim);
+            portENTER_CRITICAL(&pcache_lock);
+            pcache_global.stats.evictions++;
+            portEXIT_CRITICAL(&pcache_lock);
+            slot = (uint8_t *) victim;
+            slab = victim->slab;
+        }
+        if (!slot && (slot = (uint8_t *) sqlite3_malloc(c->slot_size)) != NULL) {
+            /* nothing to evict, e.g. a memory database: overflow to the heap */
+            slab = PCACHE_HEAP_SLAB;
+            portENTER_CRITICAL(&pcache_lock);
+            pcache_global.heap_slots++;
+            portEXIT_CRITICAL(&pcache_lock);
+        }
+        if (!slot)
+            return NULL;
+    }
+
+    if (c->count + 1 > c->hash_size)
+        pcache_hash_grow(c);
+
+    page = (pcache_page *) slot;
+    page->base.pBuf = slot + PCACHE_ALIGN(sizeof(pcache_page));
+    page->base.pExtra = slot + PCACHE_ALIGN(sizeof(pcache_page)) + PCACHE_ALIGN(c->page_size);
+    /* the pager expects the first pointer of a new page's extra area zeroed */
+    memset(page->base.pExtra, 0, c->extra_size < 8 ? c->extra_size : 8);
+    page->key = key;
+    page->pinned = 1;
+    page->ref = 1;
+    page->slab = slab;
+    page->hash_next = *pcache_hash_slot(c, key);
+    *pcache_hash_slot(c, key) = page;
+    pcache_ring_insert(c, page);
+    c->count++;
+    c->pinned++;
+
+    portENTER_CRITICAL(&pcache_lock);
+    if (++pcache_global.pages > pcache_global.pages_high)
+        pcache_global.pages_high = pcache_global.pages;
+    portEXIT_CRITICAL(&pcache_lock);
+    return &page->base;
+}
+
+static void pcache_Unpin(sqlite3_pcache *cache, sqlite3_pcache_page *base, int discard)
+{
+    pcache *c = (pcache *) cache;
+    pcache_page *page = (pcache_page *) base;
+
+    if (page->pinned) {
+        page->pinned = 0;
+        c->pinned--;
+    }
+    if (discard || c->count > pcache_limit(c))
+        pcache_discard(c, page);
+}
+
+static void pcache_Rekey(sqlite3_pcache *cache, sqlite3_pcache_page *base, unsigned old_key, unsigned new_key)
+{
+    pcache *c = (pcache *) cache;
+    pcache_page *page = (pcache_page *) base;
+
+    /* a stale page already under the new key would shadow this one */
+    for (pcache_page *other = *pcache_hash_slot(c, new_key); other; other = other->hash_next) {
+        if (other->key == new_key && other != page) {
+            pcache_discard(c, other);
+            break;
+        }
+    }
+    pcache_hash_remove(c, page);
+    page->key = new_key;
+    page->hash_next = *pcache_hash_slot(c, new_key);
+    *pcache_hash_slot(c, new_key) = page;
+}
+
+static void pcache_Truncate(sqlite3_pcache *cache, unsigned limit)
+{
+    pcache *c = (pcache *) cache;
+
+    for (unsigned i = 0; i < c->hash_size; i++) {
+        pcache_page *page = c->hash[i];
+        while (page) {
+            pcache_page *next = page->hash_next;
+            if (page->key >= limit)
+                pcache_discard(c, page);
+            page = next;
+        }
+    }
+}
+
+static void pcache_Destroy(sqlite3_pcache *cache)
+{
+    pcache *c = (pcache *) cache;
+
+    while (c->hand)
+        pcache_discard(c, c->hand);
+    sqlite3_free(c->hash);
+    sqlite3_free(c);
+}
+
+static void pcache_Shrink(sqlite3_pcache *cache)
+{
+    pcache *c = (pcache *) cache;
+    pcache_page *victim;
+
+    while ((victim = pcache_clock(c)) != NULL)
+        pcache_discard(c, victim);
+}
+
+static const sqlite3_pcache_methods2 pcache_methods = {
+        1,			// iVersion
+        NULL,			// pArg
+        pcache_Init,		// xInit
+        pcache_Shutdown,	// xShutdown
+        pcache_Create,		// xCreate
+        pcache_Cachesize,	// xCachesize
+        pcache_Pagecount,	// xPagecount
+        pcache_Fetch,		// xFetch
+        pcache_Unpin,		// xUnpin
+        pcache_Rekey,		// xRekey
+        pcache_Truncate,	// xTruncate
+        pcache_Destroy,		// xDestroy
+        pcache_Shrink		// xShrink
+};
+
+int esp32_vfs_pcache_install(void)
+{
+    /* checked here, a failing xInit would fail sqlite3_initialize */
+    if (heap_caps_get_largest_free_block(MALLOC_CAP_SPIRAM) < PCACHE_ARENA_SIZE / PCACHE_SLAB_SIZE * PCACHE_SLAB_SIZE)
+        return SQLITE_NOMEM;
+    return sqlite3_config(SQLITE_CONFIG_PCACHE2, &pcache_methods);
+}
+
+int esp32_vfs_pcache_set_pages(int pages)
+{
+    int old = pcache_min_pages;
+
+    pcache_min_pages = pages > 0 ? pages : 0;
+    return old;
+}
+
+void esp32_vfs_pcache_stats(esp32_pcache_stats_t *stats, int reset)
+{
+    portENTER_CRITICAL(&pcache_lock);
+    pcache_global.stats.pages = pcache_global.pages;
+    pcache_global.stats.pages_high = pcache_global.pages_high;
+    pcache_global.stats.heap_slots = pcache_global.heap_slots;
+    pcache_global.stats.slabs_used = pcache_global.slabs_used;
+    pcache_global.stats.slabs_used_high = pcache_global.slabs_used_high;
+    pcache_global.stats.slabs_total = pcache_global.slab_count;
+    pcache_global.stats.slab_size = PCACHE_SLAB_SIZE;
+    *stats = pcache_global.stats;
+    if (reset) {
+        memset(&pcache_global.stats, 0, sizeof(pcache_global.stats));
+        pcache_global.pages_high = pcache_global.pages;
+        pcache_global.slabs_used_high = pcache_global.slabs_used;
+    }
+    portEXIT_CRITICAL(&pcache_lock);
+}
@@ -0,0 +1,257 @@
+/*
+ * esp32_profile.c
+ *
+ * Statement profile behind esp32_profile_step/esp32_profile_reset. The
+ * trace and profile hooks of sqlite are omitted from this build, so the
+ * wrappers measure each call themselves: wall time from esp_timer, card
+ * I/O from per task counters bumped by the esp32 VFS, page cache misses
+ * from sqlite3_db_status. Whatever the VFS did between the two readings
+ * ran on the calling task inside the statement, so it is the statement's.
+ *
+ * Totals are kept per SQL text in a fixed table. When it is full the entry
+ * with the least time makes room, the slow statements stay. The entry of a
+ * statement handle is remembered in a direct mapped table keyed by the
+ * handle and its SQL pointer, so the text is hashed and the table searched
+ * once per statement, not once per step; the lock only covers the lookup
+ * and the counter updates.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include "esp32_profile.h"
+
+#ifdef CONFIG_SQLITE_STMT_PROFILE
+
+__thread uint32_t esp32_profile_reads, esp32_profile_writes;
+__thread uint64_t esp32_profile_read_bytes, esp32_profile_write_bytes;
+
+/* statement handles remembered, a handle whose place is taken is looked up again */
+#define PROFILE_STMTS (ESP32_PROFILE_SLOTS * 2)
+
+typedef struct profile_slot {
+    uint32_t hash;
+    /* changes whenever the slot is given to another statement */
+    uint32_t id;
+    esp32_profile_entry_t entry;
+} profile_slot;
+
+/**
+ * Slot of a statement handle; a finalized handle whose memory comes back
+ * for other SQL has another SQL pointer
+ */
+typedef struct profile_stmt {
+    sqlite3_stmt *stmt;
+    const char *sql;
+    int slot;
+    uint32_t id;
+} profile_stmt;
+
+static profile_slot profile_slots[ESP32_PROFILE_SLOTS];
+static int profile_count;
+static uint32_t profile_ids;
+static profile_stmt profile_stmts[PROFILE_STMTS];
+static portMUX_TYPE profile_lock = portMUX_INITIALIZER_UNLOCKED;
+
+/**
+ * Counters read before and after a call
+ */
+typedef struct profile_sample {
+    int64_t time_us;
+    uint32_t reads;
+    uint32_t writes;
+    uint64_t read_bytes;
+    uint64_t write_bytes;
+    int cache_misses;
+} profile_sample;
+
+static void profile_read(sqlite3_stmt *stmt, profile_sample *s)
+{
+    int high;
+
+    s->reads = esp32_profile_reads;
+    s->writes = esp32_profile_writes;
+    s->read_bytes = esp32_profile_read_bytes;
+    s->write_bytes = esp32_profile_write_bytes;
+    s->cache_misses = 0;
+    sqlite3_db_status(sqlite3_db_handle(stmt), SQLITE_DBSTATUS_CACHE_MISS, &s->cache_misses, &high, 0);
+    s->time_us = esp_timer_get_time();
+}
+
+/**
+ * FNV-1a of the SQL text
+ */
+static uint32_t profile_hash(const char *sql)
+{
+    uint32_t hash = 2166136261u;
+
+    while (*sql)
+        hash = (hash ^ (uint8_t) *sql++) * 16777619u;
+    return hash;
+}
+
+/**
+ * Find or make the slot of a SQL text, with profile_lock held
+ */
+static profile_slot *profile_find(const char *sql, uint32_t hash)
+{
+    profile_slot *slot;
+
+    for (int i = 0; i < profile_count; i++) {
+        if (profile_slots[i].hash == hash &&
+            strncmp(profile_slots[i].entry.sql, sql, ESP32_PROFILE_SQL - 1) == 0)
+            return &profile_slots[i];
+    }
+    if (profile_count < ESP32_PROFILE_SLOTS) {
+        slot = &profile_slots[profile_count++];
+    } else {
+        slot = &profile_slots[0];
+        for (int i = 1; i < profile_count; i++) {
+            if (profile_slots[i].entry.time_us < slot->entry.time_us)
+                slot = &profile_slots[i];
+        }
+    }
+    memset(slot, 0, sizeof(profile_slot));
+    slot->hash = hash;
+    slot->id = ++profile_ids;
+    strncpy(slot->entry.sql, sql, ESP32_PROFILE_SQL - 1);
+    return slot;
+}
+
+/**
+ * Add the difference of two samples to the statement's entry
+ */
+static void profile_add(sqlite3_stmt *stmt, const profile_sample *before, int run, int row)
+{
+    const char *sql = sqlite3_sql(stmt);
+    profile_stmt *known = &profile_stmts[((uintptr_t) stmt >> 4) % PROFILE_STMTS];
+    profile_sample after;
+    profile_slot *slot = NULL;
+    uint32_t hash = 0, elapsed;
+
+    profile_read(stmt, &after);
+    elapsed = (uint32_t) (after.time_us - before->time_us);
+    if (!sql)
+        return;
+
+    for (;;) {
+        portENTER_CRITICAL(&profile_lock);
+        if (known->stmt == stmt && known->sql == sql && known->slot < profile_count &&
+            profile_slots[known->slot].id == known->id) {
+            slot = &profile_slots[known->slot];
+        } else if (hash) {
+            slot = profile_find(sql, hash);
+            known->stmt = stmt;
+            known->sql = sql;
+            known->slot = (int) (slot - profile_slots);
+            known->id = slot->id;
+        }
+        if (slot)
+            break;
+        portEXIT_CRITICAL(&profile_lock);
+        /* first step of this handle, hashed outside the lock; 0 means not hashed yet */
+        hash = profile_hash(sql) | 1;
+    }
+    slot->entry.runs += run;
+    slot->entry.rows += row;
+    slot->entry.time_us += elapsed;
+    if (elapsed > slot->entry.max_us)
+        slot->entry.max_us = elapsed;
+    slot->entry.reads += after.reads - before->reads;
+    slot->entry.writes += after.writes - before->writes;
+    slot->entry.read_bytes += after.read_bytes - before->read_bytes;
+    slot->entry.write_bytes += after.write_bytes - before->write_bytes;
+    slot->entry.cache_misses += after.cache_misses - before->cache_misses;
+    portEXIT_CRITICAL(&profile_lock);
+}
+
+int esp32_profile_step(sqlite3_stmt *stmt)
+{
+    profile_sample before;
+    int run = !sqlite3_stmt_busy(stmt);
+    int rc;
+
+    profile_read(stmt, &before);
+    rc = sqlite3_step(stmt);
+    profile_add(stmt, &before, run, rc == SQLITE_ROW);
+    return rc;
+}
+
+int esp32_profile_reset(sqlite3_stmt *stmt)
+{
+    profile_sample before;
+    int rc;
+
+    if (!stmt)
+        return SQLITE_OK;
+    profile_read(stmt, &before);
+    rc = sqlite3_reset(stmt);
+    profile_add(stmt, &before, 0, 0);
+    return rc;
+}
+
+static int profile_compare(const void *a, const void *b)
+{
+    uint64_t ta = ((const esp32_profile_entry_t *) a)->time_us;
+    uint64_t tb = ((const esp32_profile_entry_t *) b)->time_us;
+
+    return ta < tb ? 1 : ta > tb ? -1 : 0;
+}
+
+int esp32_profile_top(esp32_profile_entry_t *entries, int count)
+{
+    esp32_profile_entry_t *all;
+    int n;
+
+    all = (esp32_profile_entry_t *) malloc(sizeof(esp32_profile_entry_t) * ESP32_PROFILE_SLOTS);
+    if (!all)
+        return 0;
+    portENTER_CRITICAL(&profile_lock);
+    n = profile_count;
+    for (int i = 0; i < n; i++)
+        all[i] = profile_slots[i].entry;
+    portEXIT_CRITICAL(&profile_lock);
+
+    if (n)
+        qsort(all, n, sizeof(esp32_profile_entry_t), profile_compare);
+    if (n > count)
+        n = count;
+    memcpy(entries, all, sizeof(esp32_profile_entry_t) * n);
+    free(all);
+    return n;
+}
+
+void esp32_profile_dump(int count)
+{
+    esp32_profile_entry_t *top;
+    int n;
+
+    if (count > ESP32_PROFILE_SLOTS)
+        count = ESP32_PROFILE_SLOTS;
+    top = (esp32_profile_entry_t *) malloc(sizeof(esp32_profile_entry_t) * count);
+    if (!top)
+        return;
+    n = esp32_profile_top(top, count);
+    printf("[PROFILE]%d statements\n", n);
+    printf("      time_us     max_us   runs     rows  reads   KiB rd writes   KiB wr misses sql\n");
+    for (int i = 0; i < n; i++) {
+        esp32_profile_entry_t *e = &top[i];
+
+        printf("%13llu %10u %6u %8u %6u %8u %6u %8u %6u %s\n", (unsigned long long) e->time_us,
+               (unsigned) e->max_us, (unsigned) e->runs, (unsigned) e->rows, (unsigned) e->reads,
+               (unsigned) (e->read_bytes >> 10), (unsigned) e->writes, (unsigned) (e->write_bytes >> 10),
+               (unsigned) e->cache_misses, e->sql);
+    }
+    free(top);
+}
+
+void esp32_profile_clear(void)
+{
+    portENTER_CRITICAL(&profile_lock);
+    profile_count = 0;
+    portEXIT_CRITICAL(&profile_lock);
+}
+
+#endif
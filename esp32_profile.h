@@ -0,0 +1,107 @@
+//
+// Statement profiling for builds with SQLITE_OMIT_TRACE (esp32_profile.c)
+//
+// Call esp32_profile_step and esp32_profile_reset where sqlite3_step and
+// sqlite3_reset would be called. With CONFIG_SQLITE_STMT_PROFILE off (the
+// default) they are sqlite3_step and sqlite3_reset, the VFS counters are
+// not compiled into esp32.c and the profile is always empty.
+//
+
+#ifndef SD_CARD_ESP32_PROFILE_H
+#define SD_CARD_ESP32_PROFILE_H
+
+#include <stdint.h>
+#include <sdkconfig.h>
+#include "sqlite3.h"
+
+#ifdef CONFIG_SQLITE_STMT_PROFILE_SLOTS
+#define ESP32_PROFILE_SLOTS CONFIG_SQLITE_STMT_PROFILE_SLOTS
+#else
+#define ESP32_PROFILE_SLOTS 32
+#endif
+
+/* bytes of SQL text kept per statement, including the terminator */
+#define ESP32_PROFILE_SQL 64
+
+/**
+ * Totals of one SQL statement over all its executions
+ */
+typedef struct esp32_profile_entry {
+    char sql[ESP32_PROFILE_SQL];
+    /* executions, counted at the first step after a reset */
+    uint32_t runs;
+    uint32_t rows;
+    uint64_t time_us;
+    /* longest single step or reset */
+    uint32_t max_us;
+    /* esp32 VFS calls made by the statement, journals in RAM excluded */
+    uint32_t reads;
+    uint32_t writes;
+    uint64_t read_bytes;
+    uint64_t write_bytes;
+    uint32_t cache_misses;
+} esp32_profile_entry_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifdef CONFIG_SQLITE_STMT_PROFILE
+
+/* card I/O of the calling task, counted by esp32_Read and esp32_Write */
+extern __thread uint32_t esp32_profile_reads, esp32_profile_writes;
+extern __thread uint64_t esp32_profile_read_bytes, esp32_profile_write_bytes;
+
+#define ESP32_PROFILE_READ(amount) \
+    do { esp32_profile_reads++; esp32_profile_read_bytes += (amount); } while (0)
+#define ESP32_PROFILE_WRITE(amount) \
+    do { esp32_profile_writes++; esp32_profile_write_bytes += (amount); } while (0)
+
+/**
+ * sqlite3_step, adding its time, rows, card I/O and page cache misses to
+ * the entry of the statement's SQL
+ */
+extern int esp32_profile_step(sqlite3_stmt *stmt);
+
+/**
+ * sqlite3_reset, adding its time and I/O to the statement's entry
+ */
+extern int esp32_profile_reset(sqlite3_stmt *stmt);
+
+/**
+ * Copy out the statements that took the most time
+ * @param entries receives at most count entries, slowest first
+ * @param count size of entries
+ * @return entries copied
+ */
+extern int esp32_profile_top(esp32_profile_entry_t *entries, int count);
+
+/**
+ * Print the slowest statements over UART
+ * @param count number of statements, at most ESP32_PROFILE_SLOTS
+ */
+extern void esp32_profile_dump(int count);
+
+/**
+ * Forget all statements
+ */
+extern void esp32_profile_clear(void);
+
+#else
+
+#define ESP32_PROFILE_READ(amount) do { } while (0)
+#define ESP32_PROFILE_WRITE(amount) do { } while (0)
+
+static inline int esp32_profile_step(sqlite3_stmt *stmt) { return sqlite3_step(stmt); }
+static inline int esp32_profile_reset(sqlite3_stmt *stmt) { return sqlite3_reset(stmt); }
+static inline int esp32_profile_top(esp32_profile_entry_t *entries, int count) { return 0; }
+static inline void esp32_profile_dump(int count) {}
+static inline void esp32_profile_clear(void) {}
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //SD_CARD_ESP32_PROFILE_H
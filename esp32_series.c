@@ -0,0 +1,911 @@
+/*
+ * esp32_series.c
+ *
+ * Sensor samples in columnar binary segments. A text log line costs around
+ * 30 bytes per sample and has to be parsed back; here the samples are
+ * collected in RAM and written ESP32_SERIES_BLOCK_SAMPLES at a time as one
+ * block with a column per channel:
+ *
+ *   header   "SER1", channels, block samples
+ *   block    head, column sizes, timestamps, channel 0, ..., footer
+ *   ...
+ *   index    the footers of all blocks again
+ *   trailer  index offset, blocks, "SIDX"
+ *
+ * Timestamps are stored as delta of delta, a steady sample rate costs one
+ * bit per sample. Values are XORed with their predecessor and only the
+ * meaningful bits are kept, a slowly changing float needs a few bits instead
+ * of 32. The footer holds the time range and the min and max of every
+ * channel, so a scan skips blocks outside its time range or value range.
+ *
+ * The index is written on close. A segment that was not closed, after a
+ * reset, is read by walking the blocks; every block is synced on its own,
+ * so the last complete block is never lost.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include "sqlite3.h"
+#include "lfs.h"
+#include "lfs_port.h"
+#include "esp32_series.h"
+
+#define SERIES_MAGIC 0x31524553u    /* "SER1" */
+#define BLOCK_MAGIC  0x4B4C4253u    /* "SBLK" */
+#define INDEX_MAGIC  0x58444953u    /* "SIDX" */
+
+#define HEADER_SIZE  8
+#define HEAD_SIZE    12
+#define TRAILER_SIZE 12
+#define ENTRY_SIZE(channels) (24 + 8 * (channels))
+
+/* worst case bits per sample: a 64 bit timestamp jump, a value with a new window */
+#define TS_COLUMN_MAX    (8 + (ESP32_SERIES_BLOCK_SAMPLES * 68 + 7) / 8)
+#define VALUE_COLUMN_MAX (4 + (ESP32_SERIES_BLOCK_SAMPLES * 44 + 7) / 8)
+#define BLOCK_MAX(channels) (HEAD_SIZE + 4 * ((channels) + 1) + TS_COLUMN_MAX + \
+                             (channels) * VALUE_COLUMN_MAX + ENTRY_SIZE(channels))
+
+typedef struct series_entry {
+    uint32_t offset;
+    uint32_t count;
+    int64_t ts_min;
+    int64_t ts_max;
+} series_entry;
+
+/**
+ * Footers of the blocks in file order, with min and max of every channel
+ * in ranges[2 * channels * block]
+ */
+typedef struct series_index {
+    series_entry *entries;
+    float *ranges;
+    unsigned count;
+    unsigned slots;
+    int channels;
+} series_index;
+
+struct esp32_series_writer {
+    lfs_file_t file;
+    int channels;
+    uint32_t size;
+    int count;
+    int64_t ts[ESP32_SERIES_BLOCK_SAMPLES];
+    float *values;
+    uint8_t *out;
+    series_index index;
+};
+
+struct esp32_series_reader {
+    lfs_file_t file;
+    int channels;
+    uint32_t size;
+    series_index index;
+    esp32_series_filter_t filter;
+    unsigned block;
+    int row;
+    int rows;
+    int done;
+    unsigned blocks_read;
+    unsigned blocks_skipped;
+    int64_t ts[ESP32_SERIES_BLOCK_SAMPLES];
+    float *values;
+    uint8_t *buf;
+};
+
+typedef struct bit_writer {
+    uint8_t *buf;
+    size_t pos;
+} bit_writer;
+
+typedef struct bit_reader {
+    const uint8_t *buf;
+    size_t pos;
+    size_t end;
+    int bad;
+} bit_reader;
+
+static int series_error(int err)
+{
+    switch (err) {
+        case LFS_ERR_NOENT:
+            return SQLITE_NOTFOUND;
+        case LFS_ERR_NOSPC:
+            return SQLITE_FULL;
+        case LFS_ERR_NOMEM:
+            return SQLITE_NOMEM;
+        default:
+            return SQLITE_IOERR;
+    }
+}
+
+static void put32(uint8_t *p, uint32_t v)
+{
+    p[0] = (uint8_t) v;
+    p[1] = (uint8_t) (v >> 8);
+    p[2] = (uint8_t) (v >> 16);
+    p[3] = (uint8_t) (v >> 24);
+}
+
+static uint32_t get32(const uint8_t *p)
+{
+    return (uint32_t) p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+static void put64(uint8_t *p, uint64_t v)
+{
+    put32(p, (uint32_t) v);
+    put32(p + 4, (uint32_t) (v >> 32));
+}
+
+static uint64_t get64(const uint8_t *p)
+{
+    return (uint64_t) get32(p) | (uint64_t) get32(p + 4) << 32;
+}
+
+static uint32_t float_bits(float v)
+{
+    uint32_t bits;
+    memcpy(&bits, &v, sizeof(bits));
+    return bits;
+}
+
+static float bits_float(uint32_t bits)
+{
+    float v;
+    memcpy(&v, &bits, sizeof(v));
+    return v;
+}
+
+/**
+ * Append the low n bits of v, most significant first, to a zeroed buffer
+ */
+static void bits_put(bit_writer *w, uint64_t v, int n)
+{
+    while (n > 0) {
+        int room = 8 - (int) (w->pos & 7);
+        int take = n < room ? n : room;
+        unsigned part = (unsigned) (v >> (n - take)) & ((1u << take) - 1);
+
+        w->buf[w->pos >> 3] |= (uint8_t) (part << (room - take));
+        w->pos += take;
+        n -= take;
+    }
+}
+
+static uint64_t bits_get(bit_reader *r, int n)
+{
+    uint64_t v = 0;
+
+    if (r->pos + n > r->end) {
+        r->bad = 1;
+        return 0;
+    }
+    while (n > 0) {
+        int room = 8 - (int) (r->pos & 7);
+        int take = n < room ? n : room;
+
+        v = v << take | ((r->buf[r->pos >> 3] >> (room - take)) & ((1u << take) - 1));
+        r->pos += take;
+        n -= take;
+    }
+    return v;
+}
+
+/**
+ * Timestamps as delta of delta: 0 for the same interval as before, then
+ * growing classes with a 1 to 4 bit prefix. Arithmetic is unsigned so that
+ * any jump wraps the same way when decoded.
+ */
+static void ts_encode(bit_writer *w, const int64_t *ts, int count)
+{
+    uint64_t prev_delta = 0;
+
+    bits_put(w, (uint64_t) ts[0], 64);
+    for (int i = 1; i < count; i++) {
+        uint64_t delta = (uint64_t) ts[i] - (uint64_t) ts[i - 1];
+        int64_t dod = (int64_t) (delta - prev_delta);
+
+        prev_delta = delta;
+        if (dod == 0) {
+            bits_put(w, 0, 1);
+        } else if (dod >= -63 && dod <= 64) {
+            bits_put(w, 2, 2);
+            bits_put(w, (uint64_t) (dod + 63), 7);
+        } else if (dod >= -255 && dod <= 256) {
+            bits_put(w, 6, 3);
+            bits_put(w, (uint64_t) (dod + 255), 9);
+        } else if (dod >= -2047 && dod <= 2048) {
+            bits_put(w, 14, 4);
+            bits_put(w, (uint64_t) (dod + 2047), 12);
+        } else {
+            bits_put(w, 15, 4);
+            bits_put(w, (uint64_t) dod, 64);
+        }
+    }
+}
+
+static void ts_decode(bit_reader *r, int64_t *ts, int count)
+{
+    uint64_t prev_delta = 0;
+
+    ts[0] = (int64_t) bits_get(r, 64);
+    for (int i = 1; i < count && !r->bad; i++) {
+        uint64_t dod;
+
+        if (!bits_get(r, 1))
+            dod = 0;
+        else if (!bits_get(r, 1))
+            dod = bits_get(r, 7) - 63;
+        else if (!bits_get(r, 1))
+            dod = bits_get(r, 9) - 255;
+        else if (!bits_get(r, 1))
+            dod = bits_get(r, 12) - 2047;
+        else
+            dod = bits_get(r, 64);
+        prev_delta += dod;
+        ts[i] = (int64_t) ((uint64_t) ts[i - 1] + prev_delta);
+    }
+}
+
+/**
+ * Values XORed with their predecessor: 0 for the same value, else the
+ * meaningful bits, inside the previous leading and trailing zero window if
+ * they fit or with a new window of 5 bits leading zeros and 5 bits length.
+ */
+static void value_encode(bit_writer *w, const float *values, int count)
+{
+    uint32_t prev = float_bits(values[0]);
+    int lead = -1, trail = 0;
+
+    bits_put(w, prev, 32);
+    for (int i = 1; i < count; i++) {
+        uint32_t cur = float_bits(values[i]);
+        uint32_t x = cur ^ prev;
+        int l, t;
+
+        prev = cur;
+        if (!x) {
+            bits_put(w, 0, 1);
+            continue;
+        }
+        l = __builtin_clz(x);
+        t = __builtin_ctz(x);
+        if (lead >= 0 && l >= lead && t >= trail) {
+            bits_put(w, 2, 2);
+            bits_put(w, x >> trail, 32 - lead - trail);
+        } else {
+            bits_put(w, 3, 2);
+            bits_put(w, (uint64_t) l, 5);
+            bits_put(w, (uint64_t) (32 - l - t - 1), 5);
+            bits_put(w, x >> t, 32 - l - t);
+            lead = l;
+            trail = t;
+        }
+    }
+}
+
+static void value_decode(bit_reader *r, float *values, int count)
+{
+    uint32_t prev = (uint32_t) bits_get(r, 32);
+    int lead = 0, trail = 0;
+
+    values[0] = bits_float(prev);
+    for (int i = 1; i < count && !r->bad; i++) {
+        if (bits_get(r, 1)) {
+            if (bits_get(r, 1)) {
+                lead = (int) bits_get(r, 5);
+                trail = 32 - lead - (int) bits_get(r, 5) - 1;
+                if (trail < 0) {
+                    r->bad = 1;
+                    break;
+                }
+            }
+            prev ^= (uint32_t) bits_get(r, 32 - lead - trail) << trail;
+        }
+        values[i] = bits_float(prev);
+    }
+}
+
+static void entry_put(uint8_t *p, const series_entry *e, const float *ranges, int channels)
+{
+    put32(p, e->offset);
+    put32(p + 4, e->count);
+    put64(p + 8, (uint64_t) e->ts_min);
+    put64(p + 16, (uint64_t) e->ts_max);
+    for (int i = 0; i < 2 * channels; i++)
+        put32(p + 24 + 4 * i, float_bits(ranges[i]));
+}
+
+static void entry_get(const uint8_t *p, series_entry *e, float *ranges, int channels)
+{
+    e->offset = get32(p);
+    e->count = get32(p + 4);
+    e->ts_min = (int64_t) get64(p + 8);
+    e->ts_max = (int64_t) get64(p + 16);
+    for (int i = 0; i < 2 * channels; i++)
+        ranges[i] = bits_float(get32(p + 24 + 4 * i));
+}
+
+static void index_free(series_index *index)
+{
+    sqlite3_free(index->entries);
+    sqlite3_free(index->ranges);
+    memset(index, 0, sizeof(series_index));
+}
+
+/**
+ * Make room for one more entry
+ */
+static int index_reserve(series_index *index)
+{
+    if (index->count == index->slots) {
+        unsigned slots = index->slots ? 2 * index->slots : 64;
+        series_entry *entries;
+        float *ranges;
+
+        entries = (series_entry *) sqlite3_realloc64(index->entries, slots * sizeof(series_entry));
+        if (!entries)
+            return SQLITE_NOMEM;
+        index->entries = entries;
+        ranges = (float *) sqlite3_realloc64(index->ranges, (sqlite3_uint64) slots * 2 * index->channels * sizeof(float));
+        if (!ranges)
+            return SQLITE_NOMEM;
+        index->ranges = ranges;
+        index->slots = slots;
+    }
+    return SQLITE_OK;
+}
+
+/**
+ * Add a block to the index, returns where its channel ranges go
+ */
+static float *index_add(series_index *index, const series_entry *e)
+{
+    if (index_reserve(index) != SQLITE_OK)
+        return NULL;
+    index->entries[index->count] = *e;
+    return &index->ranges[2 * index->channels * index->count++];
+}
+
+static int file_read_at(lfs_file_t *file, uint32_t offset, void *buf, uint32_t size)
+{
+    lfs_ssize_t got;
+
+    if (lfs_file_seek(&lfs_filesystem, file, offset, LFS_SEEK_SET) != (lfs_soff_t) offset)
+        return SQLITE_IOERR_SEEK;
+    got = lfs_file_read(&lfs_filesystem, file, buf, size);
+    if (got < 0)
+        return series_error(got);
+    return got == (lfs_ssize_t) size ? SQLITE_OK : SQLITE_IOERR_SHORT_READ;
+}
+
+/**
+ * Read the index from the end of a closed segment
+ * @return SQLITE_OK, SQLITE_NOTFOUND if the segment has no index
+ */
+static int index_read(lfs_file_t *file, uint32_t size, series_index *index, uint32_t *end)
+{
+    uint8_t trailer[TRAILER_SIZE], *buf;
+    uint32_t offset, blocks, entry = ENTRY_SIZE(index->channels);
+    int rc;
+
+    if (size < HEADER_SIZE + TRAILER_SIZE)
+        return SQLITE_NOTFOUND;
+    rc = file_read_at(file, size - TRAILER_SIZE, trailer, TRAILER_SIZE);
+    if (rc != SQLITE_OK)
+        return rc;
+    offset = get32(trailer);
+    blocks = get32(trailer + 4);
+    if (get32(trailer + 8) != INDEX_MAGIC || offset < HEADER_SIZE || offset > size - TRAILER_SIZE ||
+        (sqlite3_uint64) blocks * entry != size - TRAILER_SIZE - offset)
+        return SQLITE_NOTFOUND;
+
+    buf = (uint8_t *) sqlite3_malloc64(blocks ? (sqlite3_uint64) blocks * entry : 1);
+    if (!buf)
+        return SQLITE_NOMEM;
+    rc = file_read_at(file, offset, buf, blocks * entry);
+    for (uint32_t i = 0; i < blocks && rc == SQLITE_OK; i++) {
+        series_entry e;
+        float ranges[2 * ESP32_SERIES_CHANNELS_MAX], *slot;
+
+        entry_get(buf + i * entry, &e, ranges, index->channels);
+        slot = index_add(index, &e);
+        if (!slot)
+            rc = SQLITE_NOMEM;
+        else
+            memcpy(slot, ranges, 2 * index->channels * sizeof(float));
+    }
+    sqlite3_free(buf);
+    *end = offset;
+    return rc;
+}
+
+/**
+ * Rebuild the index of a segment that was not closed from the block footers
+ */
+static int index_walk(lfs_file_t *file, uint32_t size, series_index *index, uint32_t *end)
+{
+    uint32_t offset = HEADER_SIZE, entry = ENTRY_SIZE(index->channels);
+    uint32_t least = HEAD_SIZE + 4 * (index->channels + 1) + entry;
+    uint8_t head[HEAD_SIZE], footer[ENTRY_SIZE(ESP32_SERIES_CHANNELS_MAX)];
+    int rc;
+
+    while (offset + least <= size) {
+        uint32_t bytes;
+        series_entry e;
+        float ranges[2 * ESP32_SERIES_CHANNELS_MAX], *slot;
+
+        rc = file_read_at(file, offset, head, HEAD_SIZE);
+        if (rc != SQLITE_OK)
+            return rc;
+        bytes = get32(head + 4);
+        if (get32(head) != BLOCK_MAGIC || bytes < least || bytes > size - offset ||
+            (get32(head + 8) >> 16) != (uint32_t) index->channels)
+            break;
+        rc = file_read_at(file, offset + bytes - entry, footer, entry);
+        if (rc != SQLITE_OK)
+            return rc;
+        entry_get(footer, &e, ranges, index->channels);
+        if (e.offset != offset || e.count != (get32(head + 8) & 0xFFFF))
+            break;
+        slot = index_add(index, &e);
+        if (!slot)
+            return SQLITE_NOMEM;
+        memcpy(slot, ranges, 2 * index->channels * sizeof(float));
+        offset += bytes;
+    }
+    *end = offset;
+    return SQLITE_OK;
+}
+
+/**
+ * Check the segment header and load the index
+ * @param end receives the end of the last complete block
+ */
+static int series_load(lfs_file_t *file, uint32_t size, series_index *index, uint32_t *end)
+{
+    uint8_t header[HEADER_SIZE];
+    int rc;
+
+    if (size < HEADER_SIZE)
+        return SQLITE_CORRUPT;
+    rc = file_read_at(file, 0, header, HEADER_SIZE);
+    if (rc != SQLITE_OK)
+        return rc;
+    index->channels = header[4] | header[5] << 8;
+    if (get32(header) != SERIES_MAGIC || index->channels < 1 || index->channels > ESP32_SERIES_CHANNELS_MAX)
+        return SQLITE_CORRUPT;
+    rc = index_read(file, size, index, end);
+    if (rc == SQLITE_NOTFOUND) {
+        index->count = 0;
+        rc = index_walk(file, size, index, end);
+    }
+    return rc;
+}
+
+int esp32_series_writer_open(const char *path, int channels, esp32_series_writer_t **out)
+{
+    esp32_series_writer_t *w;
+    lfs_soff_t size;
+    int err, rc = SQLITE_OK;
+
+    *out = NULL;
+    if (channels < 1 || channels > ESP32_SERIES_CHANNELS_MAX)
+        return SQLITE_RANGE;
+    w = (esp32_series_writer_t *) sqlite3_malloc(sizeof(esp32_series_writer_t));
+    if (!w)
+        return SQLITE_NOMEM;
+    memset(w, 0, sizeof(esp32_series_writer_t));
+    w->channels = channels;
+    w->index.channels = channels;
+    w->values = (float *) sqlite3_malloc(channels * ESP32_SERIES_BLOCK_SAMPLES * sizeof(float));
+    w->out = (uint8_t *) sqlite3_malloc(BLOCK_MAX(channels));
+    if (!w->values || !w->out) {
+        rc = SQLITE_NOMEM;
+        goto fail;
+    }
+
+    err = lfs_file_open(&lfs_filesystem, &w->file, path, LFS_O_RDWR | LFS_O_CREAT);
+    if (err) {
+        rc = series_error(err);
+        goto fail;
+    }
+    size = lfs_file_size(&lfs_filesystem, &w->file);
+    if (size >= HEADER_SIZE) {
+        /* carry on behind the last complete block, the index is written again on close */
+        rc = series_load(&w->file, (uint32_t) size, &w->index, &w->size);
+        if (rc == SQLITE_OK && w->index.channels != channels)
+            rc = SQLITE_MISMATCH;
+        if (rc == SQLITE_OK && w->size != (uint32_t) size &&
+            (err = lfs_file_truncate(&lfs_filesystem, &w->file, w->size)) < 0)
+            rc = series_error(err);
+        if (rc == SQLITE_OK && lfs_file_seek(&lfs_filesystem, &w->file, w->size, LFS_SEEK_SET) < 0)
+            rc = SQLITE_IOERR_SEEK;
+    } else {
+        uint8_t header[HEADER_SIZE];
+
+        put32(header, SERIES_MAGIC);
+        header[4] = (uint8_t) channels;
+        header[5] = 0;
+        header[6] = (uint8_t) ESP32_SERIES_BLOCK_SAMPLES;
+        header[7] = (uint8_t) (ESP32_SERIES_BLOCK_SAMPLES >> 8);
+        /* an empty file or a header torn by a reset */
+        if (size && lfs_file_truncate(&lfs_filesystem, &w->file, 0) < 0)
+            rc = SQLITE_IOERR_TRUNCATE;
+        else if (lfs_file_seek(&lfs_filesystem, &w->file, 0, LFS_SEEK_SET) < 0)
+            rc = SQLITE_IOERR_SEEK;
+        else if ((err = lfs_file_write(&lfs_filesystem, &w->file, header, HEADER_SIZE)) != HEADER_SIZE)
+            rc = err < 0 ? series_error(err) : SQLITE_IOERR_WRITE;
+        else if ((err = lfs_file_sync(&lfs_filesystem, &w->file)) < 0)
+            rc = series_error(err);
+        w->size = HEADER_SIZE;
+    }
+    if (rc != SQLITE_OK) {
+        lfs_file_close(&lfs_filesystem, &w->file);
+        goto fail;
+    }
+    *out = w;
+    return SQLITE_OK;
+
+fail:
+    index_free(&w->index);
+    sqlite3_free(w->values);
+    sqlite3_free(w->out);
+    sqlite3_free(w);
+    return rc;
+}
+
+/**
+ * Encode the collected samples as one block, write and sync it
+ */
+static int series_write_block(esp32_series_writer_t *w)
+{
+    int channels = w->channels, count = w->count;
+    uint32_t pos = HEAD_SIZE + 4 * (channels + 1);
+    float ranges[2 * ESP32_SERIES_CHANNELS_MAX], *slot;
+    series_entry e;
+    bit_writer bw;
+    lfs_ssize_t written;
+    int err;
+
+    if (!count)
+        return SQLITE_OK;
+    /* grown first: a block on the card without its entry would be written
+     * again at the same offset and break the footer chain */
+    if (index_reserve(&w->index) != SQLITE_OK)
+        return SQLITE_NOMEM;
+    memset(w->out, 0, BLOCK_MAX(channels));
+
+    bw.buf = w->out + pos;
+    bw.pos = 0;
+    ts_encode(&bw, w->ts, count);
+    put32(w->out + HEAD_SIZE, (uint32_t) ((bw.pos + 7) / 8));
+    pos += (uint32_t) ((bw.pos + 7) / 8);
+    for (int c = 0; c < channels; c++) {
+        const float *values = w->values + c * ESP32_SERIES_BLOCK_SAMPLES;
+        float min = INFINITY, max = -INFINITY;
+
+        bw.buf = w->out + pos;
+        bw.pos = 0;
+        value_encode(&bw, values, count);
+        put32(w->out + HEAD_SIZE + 4 * (c + 1), (uint32_t) ((bw.pos + 7) / 8));
+        pos += (uint32_t) ((bw.pos + 7) / 8);
+        /* NAN for a missing reading is left out, it never matches a range */
+        for (int i = 0; i < count; i++) {
+            if (values[i] < min)
+                min = values[i];
+            if (values[i] > max)
+                max = values[i];
+        }
+        ranges[c] = min;
+        ranges[channels + c] = max;
+    }
+
+    e.offset = w->size;
+    e.count = (uint32_t) count;
+    e.ts_min = w->ts[0];
+    e.ts_max = w->ts[count - 1];
+    entry_put(w->out + pos, &e, ranges, channels);
+    pos += ENTRY_SIZE(channels);
+    put32(w->out, BLOCK_MAGIC);
+    put32(w->out + 4, pos);
+    put32(w->out + 8, (uint32_t) count | (uint32_t) channels << 16);
+
+    written = lfs_file_write(&lfs_filesystem, &w->file, w->out, pos);
+    err = written < 0 ? (int) written : lfs_file_sync(&lfs_filesystem, &w->file);
+    if (err < 0 || written != (lfs_ssize_t) pos) {
+        /* drop a partly written block, the samples stay collected */
+        lfs_file_truncate(&lfs_filesystem, &w->file, w->size);
+        lfs_file_seek(&lfs_filesystem, &w->file, w->size, LFS_SEEK_SET);
+        return err < 0 ? series_error(err) : SQLITE_IOERR_WRITE;
+    }
+
+    /* cannot fail, the room was reserved above */
+    slot = index_add(&w->index, &e);
+    memcpy(slot, ranges, 2 * channels * sizeof(float));
+    w->size += pos;
+    w->count = 0;
+    return SQLITE_OK;
+}
+
+int esp32_series_append(esp32_series_writer_t *w, int64_t ts, const float *values)
+{
+    int64_t last;
+
+    if (w->count == ESP32_SERIES_BLOCK_SAMPLES) {
+        /* the previous block could not be written, try again */
+        int rc = series_write_block(w);
+        if (rc != SQLITE_OK)
+            return rc;
+    }
+    if (w->count)
+        last = w->ts[w->count - 1];
+    else
+        last = w->index.count ? w->index.entries[w->index.count - 1].ts_max : INT64_MIN;
+    if (ts < last)
+        return SQLITE_MISUSE;
+
+    w->ts[w->count] = ts;
+    for (int c = 0; c < w->channels; c++)
+        w->values[c * ESP32_SERIES_BLOCK_SAMPLES + w->count] = values[c];
+    if (++w->count == ESP32_SERIES_BLOCK_SAMPLES)
+        return series_write_block(w);
+    return SQLITE_OK;
+}
+
+int esp32_series_flush(esp32_series_writer_t *w)
+{
+    return series_write_block(w);
+}
+
+int esp32_series_writer_close(esp32_series_writer_t *w)
+{
+    uint32_t entry, per_buffer;
+    int rc, err;
+
+    if (!w)
+        return SQLITE_OK;
+    entry = ENTRY_SIZE(w->channels);
+    per_buffer = BLOCK_MAX(w->channels) / entry;
+    rc = series_write_block(w);
+
+    /* the index in pieces through the block buffer, then the trailer */
+    for (unsigned i = 0; rc == SQLITE_OK && i < w->index.count; i += per_buffer) {
+        unsigned n = w->index.count - i < per_buffer ? w->index.count - i : per_buffer;
+
+        for (unsigned k = 0; k < n; k++)
+            entry_put(w->out + k * entry, &w->index.entries[i + k],
+                      &w->index.ranges[2 * w->channels * (i + k)], w->channels);
+        err = lfs_file_write(&lfs_filesystem, &w->file, w->out, n * entry);
+        if (err != (int) (n * entry))
+            rc = err < 0 ? series_error(err) : SQLITE_IOERR_WRITE;
+    }
+    if (rc == SQLITE_OK) {
+        uint8_t trailer[TRAILER_SIZE];
+
+        put32(trailer, w->size);
+        put32(trailer + 4, w->index.count);
+        put32(trailer + 8, INDEX_MAGIC);
+        err = lfs_file_write(&lfs_filesystem, &w->file, trailer, TRAILER_SIZE);
+        if (err != TRAILER_SIZE)
+            rc = err < 0 ? series_error(err) : SQLITE_IOERR_WRITE;
+    }
+    if (rc != SQLITE_OK) {
+        /* no index is fine, readers walk the blocks */
+        lfs_file_truncate(&lfs_filesystem, &w->file, w->size);
+    }
+    err = lfs_file_close(&lfs_filesystem, &w->file);
+    if (rc == SQLITE_OK && err < 0)
+        rc = series_error(err);
+
+    index_free(&w->index);
+    sqlite3_free(w->values);
+    sqlite3_free(w->out);
+    sqlite3_free(w);
+    return rc;
+}
+
+int esp32_series_reader_open(const char *path, esp32_series_reader_t **out)
+{
+    esp32_series_reader_t *r;
+    lfs_soff_t size;
+    uint32_t end;
+    int err, rc;
+
+    *out = NULL;
+    r = (esp32_series_reader_t *) sqlite3_malloc(sizeof(esp32_series_reader_t));
+    if (!r)
+        return SQLITE_NOMEM;
+    memset(r, 0, sizeof(esp32_series_reader_t));
+    err = lfs_file_open(&lfs_filesystem, &r->file, path, LFS_O_RDONLY);
+    if (err) {
+        sqlite3_free(r);
+        return series_error(err);
+    }
+    size = lfs_file_size(&lfs_filesystem, &r->file);
+    r->size = size < 0 ? 0 : (uint32_t) size;
+    rc = series_load(&r->file, r->size, &r->index, &end);
+    if (rc == SQLITE_OK) {
+        r->channels = r->index.channels;
+        r->values = (float *) sqlite3_malloc(r->channels * ESP32_SERIES_BLOCK_SAMPLES * sizeof(float));
+        r->buf = (uint8_t *) sqlite3_malloc(BLOCK_MAX(r->channels));
+        if (!r->values || !r->buf)
+            rc = SQLITE_NOMEM;
+    }
+    if (rc != SQLITE_OK) {
+        esp32_series_reader_close(r);
+        return rc;
+    }
+    esp32_series_scan(r, NULL);
+    *out = r;
+    return SQLITE_OK;
+}
+
+void esp32_series_scan(esp32_series_reader_t *r, const esp32_series_filter_t *filter)
+{
+    unsigned left = 0, right = r->index.count;
+
+    if (filter) {
+        r->filter = *filter;
+    } else {
+        memset(&r->filter, 0, sizeof(r->filter));
+        r->filter.from = INT64_MIN;
+        r->filter.to = INT64_MAX;
+        r->filter.channel = -1;
+    }
+    if (r->filter.channel >= r->channels)
+        r->filter.channel = -1;
+    if (r->filter.columns && r->filter.channel >= 0)
+        r->filter.columns |= 1u << r->filter.channel;
+
+    /* first block that can hold the start of the range */
+    while (left < right) {
+        unsigned mid = left + (right - left) / 2;
+
+        if (r->index.entries[mid].ts_max < r->filter.from)
+            left = mid + 1;
+        else
+            right = mid;
+    }
+    r->blocks_skipped += left;
+    r->block = left;
+    r->row = r->rows = 0;
+    r->done = 0;
+}
+
+/**
+ * Read block n and decode the timestamps and the wanted channels
+ */
+static int series_decode(esp32_series_reader_t *r, unsigned n)
+{
+    const series_entry *e = &r->index.entries[n];
+    uint32_t bytes, pos = HEAD_SIZE + 4 * (r->channels + 1);
+    bit_reader br;
+    int rc;
+
+    if (e->count < 1 || e->count > ESP32_SERIES_BLOCK_SAMPLES)
+        return SQLITE_CORRUPT;
+    if (e->offset > r->size - HEAD_SIZE)
+        return SQLITE_CORRUPT;
+    rc = file_read_at(&r->file, e->offset, r->buf, HEAD_SIZE);
+    if (rc != SQLITE_OK)
+        return rc;
+    bytes = get32(r->buf + 4);
+    if (get32(r->buf) != BLOCK_MAGIC || bytes < pos || bytes > BLOCK_MAX(r->channels))
+        return SQLITE_CORRUPT;
+    rc = file_read_at(&r->file, e->offset + HEAD_SIZE, r->buf + HEAD_SIZE, bytes - HEAD_SIZE);
+    if (rc != SQLITE_OK)
+        return rc;
+
+    for (int c = -1; c < r->channels; c++) {
+        uint32_t size = get32(r->buf + HEAD_SIZE + 4 * (c + 1));
+        float *values = r->values + (c < 0 ? 0 : c) * ESP32_SERIES_BLOCK_SAMPLES;
+
+        if (size > bytes - pos)
+            return SQLITE_CORRUPT;
+        br.buf = r->buf + pos;
+        br.pos = 0;
+        br.end = (size_t) size * 8;
+        br.bad = 0;
+        pos += size;
+        if (c < 0) {
+            ts_decode(&br, r->ts, (int) e->count);
+        } else if (!r->filter.columns || (r->filter.columns & (1u << c))) {
+            value_decode(&br, values, (int) e->count);
+        } else {
+            /* columns not asked for are not decoded at all */
+            for (uint32_t i = 0; i < e->count; i++)
+                values[i] = NAN;
+        }
+        if (br.bad)
+            return SQLITE_CORRUPT;
+    }
+    r->rows = (int) e->count;
+    r->row = 0;
+    r->blocks_read++;
+    return SQLITE_OK;
+}
+
+int esp32_series_next(esp32_series_reader_t *r, int64_t *ts, float *values)
+{
+    const esp32_series_filter_t *f = &r->filter;
+
+    for (;;) {
+        while (r->row < r->rows) {
+            int i = r->row++;
+
+            if (r->ts[i] < f->from)
+                continue;
+            if (r->ts[i] > f->to) {
+                r->done = 1;
+                r->rows = 0;
+                return 0;
+            }
+            if (f->channel >= 0) {
+                float v = r->values[f->channel * ESP32_SERIES_BLOCK_SAMPLES + i];
+
+                if (!(v >= f->min && v <= f->max))
+                    continue;
+            }
+            *ts = r->ts[i];
+            for (int c = 0; c < r->channels; c++)
+                values[c] = r->values[c * ESP32_SERIES_BLOCK_SAMPLES + i];
+            return 1;
+        }
+        if (r->done)
+            return 0;
+
+        /* next block that can hold a match, by its footer alone */
+        while (r->block < r->index.count) {
+            const float *ranges = &r->index.ranges[2 * r->channels * r->block];
+
+            if (r->index.entries[r->block].ts_min > f->to) {
+                r->blocks_skipped += r->index.count - r->block;
+                r->block = r->index.count;
+                break;
+            }
+            if (f->channel < 0 || (ranges[r->channels + f->channel] >= f->min && ranges[f->channel] <= f->max))
+                break;
+            r->blocks_skipped++;
+            r->block++;
+        }
+        if (r->block >= r->index.count) {
+            r->done = 1;
+            return 0;
+        }
+        int rc = series_decode(r, r->block++);
+        if (rc != SQLITE_OK) {
+            r->done = 1;
+            return -rc;
+        }
+    }
+}
+
+void esp32_series_info(esp32_series_reader_t *r, esp32_series_info_t *info)
+{
+    memset(info, 0, sizeof(esp32_series_info_t));
+    info->channels = r->channels;
+    info->blocks = r->index.count;
+    for (unsigned i = 0; i < r->index.count; i++)
+        info->samples += r->index.entries[i].count;
+    if (r->index.count) {
+        info->ts_min = r->index.entries[0].ts_min;
+        info->ts_max = r->index.entries[r->index.count - 1].ts_max;
+    }
+    info->bytes = r->size;
+    info->blocks_read = r->blocks_read;
+    info->blocks_skipped = r->blocks_skipped;
+}
+
+void esp32_series_reader_close(esp32_series_reader_t *r)
+{
+    if (!r)
+        return;
+    lfs_file_close(&lfs_filesystem, &r->file);
+    index_free(&r->index);
+    sqlite3_free(r->values);
+    sqlite3_free(r->buf);
+    sqlite3_free(r);
+}
@@ -0,0 +1,132 @@
+//
+// Columnar binary segments of sensor samples on littlefs (esp32_series.c)
+//
+
+#ifndef SD_CARD_ESP32_SERIES_H
+#define SD_CARD_ESP32_SERIES_H
+
+#include <stdint.h>
+#include "sqlite3.h"
+
+/* samples per block, a block is compressed and written as one piece */
+#define ESP32_SERIES_BLOCK_SAMPLES 512
+/* value channels per sample, besides the timestamp */
+#define ESP32_SERIES_CHANNELS_MAX 16
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct esp32_series_writer esp32_series_writer_t;
+typedef struct esp32_series_reader esp32_series_reader_t;
+
+/**
+ * Which samples a scan returns. Blocks whose time range or whose value
+ * range on the filter channel lies outside are skipped without being read.
+ */
+typedef struct esp32_series_filter {
+    /* time range, inclusive */
+    int64_t from;
+    int64_t to;
+    /* channel the value range applies to, -1 for none */
+    int channel;
+    float min;
+    float max;
+    /* channels to decode as a bit mask, 0 for all; the others read as NAN */
+    uint32_t columns;
+} esp32_series_filter_t;
+
+/**
+ * Size and contents of a segment, see esp32_series_info()
+ */
+typedef struct esp32_series_info {
+    int channels;
+    unsigned blocks;
+    sqlite3_uint64 samples;
+    int64_t ts_min;
+    int64_t ts_max;
+    sqlite3_uint64 bytes;
+    /* blocks decoded and blocks skipped by scans so far */
+    unsigned blocks_read;
+    unsigned blocks_skipped;
+} esp32_series_info_t;
+
+/**
+ * Open a segment for appending, created if it does not exist. The file
+ * stays open, samples are collected in RAM and written a block at a time.
+ * After a reboot the writer continues behind the last complete block.
+ * @param path segment file
+ * @param channels values per sample, 1 to ESP32_SERIES_CHANNELS_MAX, must
+ *        match an existing segment
+ * @param out receives the writer
+ * @return SQLITE_OK on success, SQLITE_MISMATCH for another channel count
+ */
+extern int esp32_series_writer_open(const char *path, int channels, esp32_series_writer_t **out);
+
+/**
+ * Add one sample. Timestamps must not decrease.
+ * @param writer segment writer
+ * @param ts timestamp, in any unit
+ * @param values one value per channel
+ * @return SQLITE_OK on success, SQLITE_FULL when the card is full
+ */
+extern int esp32_series_append(esp32_series_writer_t *writer, int64_t ts, const float *values);
+
+/**
+ * Write the samples collected so far as a short block and sync the file
+ * @param writer segment writer
+ * @return SQLITE_OK on success
+ */
+extern int esp32_series_flush(esp32_series_writer_t *writer);
+
+/**
+ * Flush, write the segment index and close the file
+ * @param writer segment writer, may be NULL
+ * @return SQLITE_OK on success
+ */
+extern int esp32_series_writer_close(esp32_series_writer_t *writer);
+
+/**
+ * Open a segment for reading. The block index is read from the end of the
+ * file, or rebuilt from the block footers of a segment still being written.
+ * @param path segment file
+ * @param out receives the reader
+ * @return SQLITE_OK on success, SQLITE_NOTFOUND if there is no such file,
+ *         SQLITE_CORRUPT if it is no segment
+ */
+extern int esp32_series_reader_open(const char *path, esp32_series_reader_t **out);
+
+/**
+ * Start a scan, the samples come from esp32_series_next in time order
+ * @param reader segment reader
+ * @param filter samples wanted, NULL for all
+ */
+extern void esp32_series_scan(esp32_series_reader_t *reader, const esp32_series_filter_t *filter);
+
+/**
+ * Next sample of the scan
+ * @param reader segment reader
+ * @param ts receives the timestamp
+ * @param values receives one value per channel
+ * @return 1 for a sample, 0 at the end of the scan, negative SQLite error code on failure
+ */
+extern int esp32_series_next(esp32_series_reader_t *reader, int64_t *ts, float *values);
+
+/**
+ * Describe the segment
+ * @param reader segment reader
+ * @param info receives channels, blocks, samples, time range and scan counters
+ */
+extern void esp32_series_info(esp32_series_reader_t *reader, esp32_series_info_t *info);
+
+/**
+ * Close a segment reader
+ * @param reader segment reader, may be NULL
+ */
+extern void esp32_series_reader_close(esp32_series_reader_t *reader);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //SD_CARD_ESP32_SERIES_H
@@ -0,0 +1,169 @@
+/*
+ * esp32_stmt_cache.c
+ *
+ * Prepared statement cache. On the ESP32 tokenizing, parsing and code
+ * generation of a small INSERT take longer than running it, and with
+ * YYSTACKDEPTH 20 and SQLITE_SMALL_STACK every prepare also costs the
+ * caller's stack. Statements are looked up by a hash of their SQL text and
+ * kept prepared up to the capacity of the cache, the least recently used
+ * one is finalized first.
+ *
+ * The cache is small, a linear scan over the hashes is cheaper than a hash
+ * table and keeps the recency order in one tick per entry. The entries are
+ * guarded by a mutex of the cache: with SQLITE_THREADSAFE 2 the connection
+ * mutex is NULL unless the connection was opened with SQLITE_OPEN_FULLMUTEX.
+ * Tasks sharing a cache share its connection, which needs that flag anyway.
+ * Statements are prepared and finalized outside the cache mutex.
+ */
+#include <string.h>
+#include <stdint.h>
+#include <esp_timer.h>
+#include "sqlite3.h"
+#include "esp32_stmt_cache.h"
+
+#define STMT_CACHE_DEFAULT 16
+
+typedef struct stmt_entry {
+    uint32_t hash;
+    uint32_t used;
+    sqlite3_stmt *stmt;
+} stmt_entry;
+
+struct esp32_stmt_cache {
+    sqlite3 *db;
+    sqlite3_mutex *mutex;
+    int capacity;
+    int count;
+    uint32_t tick;
+    esp32_stmt_cache_stats_t stats;
+    stmt_entry entries[];
+};
+
+/**
+ * FNV-1a of the SQL text
+ */
+static uint32_t stmt_hash(const char *sql)
+{
+    uint32_t hash = 2166136261u;
+
+    while (*sql)
+        hash = (hash ^ (uint8_t) *sql++) * 16777619u;
+    return hash;
+}
+
+int esp32_stmt_cache_open(sqlite3 *db, int capacity, esp32_stmt_cache_t **out)
+{
+    esp32_stmt_cache_t *cache;
+
+    *out = NULL;
+    if (!db || capacity < 0)
+        return SQLITE_MISUSE;
+    if (!capacity)
+        capacity = STMT_CACHE_DEFAULT;
+    cache = (esp32_stmt_cache_t *) sqlite3_malloc(sizeof(esp32_stmt_cache_t) + capacity * sizeof(stmt_entry));
+    if (!cache)
+        return SQLITE_NOMEM;
+    memset(cache, 0, sizeof(esp32_stmt_cache_t));
+    cache->mutex = sqlite3_mutex_alloc(SQLITE_MUTEX_FAST);
+    if (!cache->mutex) {
+        sqlite3_free(cache);
+        return SQLITE_NOMEM;
+    }
+    cache->db = db;
+    cache->capacity = capacity;
+    *out = cache;
+    return SQLITE_OK;
+}
+
+int esp32_stmt_cache_get(esp32_stmt_cache_t *cache, const char *sql, sqlite3_stmt **out)
+{
+    sqlite3_mutex *mutex = cache->mutex;
+    uint32_t hash = stmt_hash(sql);
+    int64_t start;
+    int rc;
+
+    sqlite3_mutex_enter(mutex);
+    for (int i = 0; i < cache->count; i++) {
+        stmt_entry *entry = &cache->entries[i];
+
+        if (entry->hash == hash && strcmp(sqlite3_sql(entry->stmt), sql) == 0) {
+            *out = entry->stmt;
+            *entry = cache->entries[--cache->count];
+            cache->stats.hits++;
+            sqlite3_mutex_leave(mutex);
+            return SQLITE_OK;
+        }
+    }
+    cache->stats.misses++;
+    sqlite3_mutex_leave(mutex);
+
+    /* the statement lives as long as the cache, keep it out of lookaside */
+    start = esp_timer_get_time();
+    rc = sqlite3_prepare_v3(cache->db, sql, -1, SQLITE_PREPARE_PERSISTENT, out, NULL);
+    start = esp_timer_get_time() - start;
+    sqlite3_mutex_enter(mutex);
+    cache->stats.prepare_us += start;
+    sqlite3_mutex_leave(mutex);
+    return rc;
+}
+
+void esp32_stmt_cache_put(esp32_stmt_cache_t *cache, sqlite3_stmt *stmt)
+{
+    sqlite3_stmt *evicted = NULL;
+    stmt_entry *entry;
+    uint32_t hash;
+
+    if (!stmt)
+        return;
+    if (sqlite3_db_handle(stmt) != cache->db) {
+        sqlite3_finalize(stmt);
+        return;
+    }
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+
+    hash = stmt_hash(sqlite3_sql(stmt));
+
+    sqlite3_mutex_enter(cache->mutex);
+    if (cache->count < cache->capacity) {
+        entry = &cache->entries[cache->count++];
+    } else {
+        entry = &cache->entries[0];
+        for (int i = 1; i < cache->count; i++) {
+            /* ticks wrap, compare their age */
+            if (cache->tick - cache->entries[i].used > cache->tick - entry->used)
+                entry = &cache->entries[i];
+        }
+        evicted = entry->stmt;
+        cache->stats.evictions++;
+    }
+    entry->hash = hash;
+    entry->used = ++cache->tick;
+    entry->stmt = stmt;
+    sqlite3_mutex_leave(cache->mutex);
+    sqlite3_finalize(evicted);
+}
+
+void esp32_stmt_cache_stats(esp32_stmt_cache_t *cache, esp32_stmt_cache_stats_t *stats, int reset)
+{
+    sqlite3_mutex *mutex = cache->mutex;
+
+    sqlite3_mutex_enter(mutex);
+    cache->stats.cached = cache->count;
+    *stats = cache->stats;
+    if (reset) {
+        cache->stats.hits = cache->stats.misses = cache->stats.evictions = 0;
+        cache->stats.prepare_us = 0;
+    }
+    sqlite3_mutex_leave(mutex);
+}
+
+void esp32_stmt_cache_close(esp32_stmt_cache_t *cache)
+{
+    if (!cache)
+        return;
+    for (int i = 0; i < cache->count; i++)
+        sqlite3_finalize(cache->entries[i].stmt);
+    sqlite3_mutex_free(cache->mutex);
+    sqlite3_free(cache);
+}
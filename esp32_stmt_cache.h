@@ -0,0 +1,80 @@
+//
+// LRU cache of prepared statements of one connection (esp32_stmt_cache.c)
+//
+
+#ifndef SD_CARD_ESP32_STMT_CACHE_H
+#define SD_CARD_ESP32_STMT_CACHE_H
+
+#include "sqlite3.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Counters of a statement cache, see esp32_stmt_cache_stats()
+ */
+typedef struct esp32_stmt_cache_stats {
+    unsigned hits;
+    unsigned misses;
+    /* statements finalized to make room */
+    unsigned evictions;
+    /* statements held by the cache now */
+    unsigned cached;
+    /* time spent in sqlite3_prepare on misses */
+    sqlite3_uint64 prepare_us;
+} esp32_stmt_cache_stats_t;
+
+typedef struct esp32_stmt_cache esp32_stmt_cache_t;
+
+/**
+ * Create a statement cache for a connection. Tasks may share the cache
+ * if they share the connection, which must then be opened with
+ * SQLITE_OPEN_FULLMUTEX.
+ * @param db database connection, must outlive the cache
+ * @param capacity statements kept prepared, 0 for the default of 16
+ * @param out receives the cache
+ * @return SQLITE_OK on success
+ */
+extern int esp32_stmt_cache_open(sqlite3 *db, int capacity, esp32_stmt_cache_t **out);
+
+/**
+ * Take the statement for some SQL out of the cache, or prepare it. The
+ * statement belongs to the caller until esp32_stmt_cache_put, a second get
+ * of the same SQL meanwhile prepares a second copy.
+ * @param cache statement cache
+ * @param sql one SQL statement, compared byte for byte
+ * @param out receives the statement, ready to bind and step
+ * @return SQLITE_OK on success, the prepare error otherwise
+ */
+extern int esp32_stmt_cache_get(esp32_stmt_cache_t *cache, const char *sql, sqlite3_stmt **out);
+
+/**
+ * Reset a statement, clear its bindings and return it to the cache as the
+ * most recently used one. The least recently used statement is finalized
+ * when the cache is full.
+ * @param cache statement cache
+ * @param stmt statement from esp32_stmt_cache_get, may be NULL
+ */
+extern void esp32_stmt_cache_put(esp32_stmt_cache_t *cache, sqlite3_stmt *stmt);
+
+/**
+ * Read the counters
+ * @param cache statement cache
+ * @param stats receives the counters
+ * @param reset clear the counters after reading
+ */
+extern void esp32_stmt_cache_stats(esp32_stmt_cache_t *cache, esp32_stmt_cache_stats_t *stats, int reset);
+
+/**
+ * Finalize the cached statements and free the cache. Statements taken out
+ * and not put back stay with the caller.
+ * @param cache statement cache, may be NULL
+ */
+extern void esp32_stmt_cache_close(esp32_stmt_cache_t *cache);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //SD_CARD_ESP32_STMT_CACHE_H
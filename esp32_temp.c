@@ -0,0 +1,386 @@
+/*
+ * esp32_temp.c
+ *
+ * Temp files of the esp32 VFS. Sorter runs, statement journals and other
+ * files sqlite opens without a name are kept in 64 KiB PSRAM chunks as long
+ * as the budget shared by all temp files lasts. From then on the rest of the
+ * file goes to a scratch littlefs file. The sorter writes its runs front to
+ * back, so the scratch file only ever grows at the end.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sdkconfig.h>
+#include <esp_heap_caps.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include "sqlite3.h"
+#include "lfs.h"
+#include "lfs_port.h"
+#include "esp32_vfs.h"
+#include "esp32_temp.h"
+
+#ifdef CONFIG_SQLITE_TEMP_PSRAM_KB
+#define TEMP_BUDGET (CONFIG_SQLITE_TEMP_PSRAM_KB * 1024)
+#else
+#define TEMP_BUDGET (1024 * 1024)
+#endif
+
+#define TEMP_CHUNK_SIZE 65536
+
+typedef struct temp_file {
+    sqlite3_file base;
+    uint8_t **chunks;
+    int chunk_count;
+    /* chunk_count is final once bytes went past it to the card */
+    int spilled;
+    sqlite3_int64 size;
+    lfs_file_t *spill;
+    char spill_name[24];
+    esp32_file_stats_t stats;
+    sqlite3_int64 read_end;
+    sqlite3_int64 write_end;
+} temp_file;
+
+_Static_assert(sizeof(temp_file) <= ESP32_TEMP_FILE_SIZE, "temp_file must fit ESP32_TEMP_FILE_SIZE");
+
+static struct {
+    int budget_used;
+    unsigned next_id;
+    esp32_temp_stats_t stats;
+} temp_global;
+
+static portMUX_TYPE temp_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static sqlite3_int64 temp_mem_size(temp_file *p)
+{
+    return (sqlite3_int64) p->chunk_count * TEMP_CHUNK_SIZE;
+}
+
+/**
+ * Add one zeroed PSRAM chunk if the budget allows
+ * @return SQLITE_OK, or SQLITE_FULL when the data has to go to the card
+ */
+static int temp_grow(temp_file *p)
+{
+    uint8_t **chunks, *chunk;
+    int granted = 0;
+
+    portENTER_CRITICAL(&temp_lock);
+    if (temp_global.budget_used + TEMP_CHUNK_SIZE <= TEMP_BUDGET) {
+        temp_global.budget_used += TEMP_CHUNK_SIZE;
+        granted = 1;
+    }
+    portEXIT_CRITICAL(&temp_lock);
+    if (!granted)
+        return SQLITE_FULL;
+
+    chunks = (uint8_t **) sqlite3_realloc(p->chunks, (p->chunk_count + 1) * sizeof(uint8_t *));
+    chunk = chunks ? (uint8_t *) heap_caps_calloc(1, TEMP_CHUNK_SIZE, MALLOC_CAP_SPIRAM) : NULL;
+    if (chunks)
+        p->chunks = chunks;
+    portENTER_CRITICAL(&temp_lock);
+    if (!chunk) {
+        temp_global.budget_used -= TEMP_CHUNK_SIZE;
+    } else {
+        temp_global.stats.psram_bytes += TEMP_CHUNK_SIZE;
+        if (temp_global.stats.psram_bytes > temp_global.stats.psram_bytes_high)
+            temp_global.stats.psram_bytes_high = temp_global.stats.psram_bytes;
+    }
+    portEXIT_CRITICAL(&temp_lock);
+    if (!chunk)
+        return SQLITE_FULL;
+
+    p->chunks[p->chunk_count++] = chunk;
+    return SQLITE_OK;
+}
+
+static void temp_shrink(temp_file *p, int count)
+{
+    int freed = p->chunk_count - count;
+
+    if (freed <= 0)
+        return;
+    while (p->chunk_count > count)
+        heap_caps_free(p->chunks[--p->chunk_count]);
+    portENTER_CRITICAL(&temp_lock);
+    temp_global.budget_used -= freed * TEMP_CHUNK_SIZE;
+    temp_global.stats.psram_bytes -= freed * TEMP_CHUNK_SIZE;
+    portEXIT_CRITICAL(&temp_lock);
+}
+
+static void temp_mem_copy(temp_file *p, uint8_t *out, const uint8_t *in, int amount, sqlite3_int64 offset)
+{
+    while (amount > 0) {
+        uint8_t *chunk = p->chunks[offset / TEMP_CHUNK_SIZE];
+        int at = (int) (offset % TEMP_CHUNK_SIZE);
+        int n = TEMP_CHUNK_SIZE - at < amount ? TEMP_CHUNK_SIZE - at : amount;
+
+        if (out) {
+            memcpy(out, chunk + at, n);
+            out += n;
+        } else {
+            memcpy(chunk + at, in, n);
+            in += n;
+        }
+        offset += n;
+        amount -= n;
+    }
+}
+
+static int temp_spill_open(temp_file *p)
+{
+    unsigned id;
+    int rc;
+
+    p->spill = (lfs_file_t *) sqlite3_malloc(sizeof(lfs_file_t));
+    if (!p->spill)
+        return SQLITE_NOMEM;
+    portENTER_CRITICAL(&temp_lock);
+    id = temp_global.next_id++;
+    temp_global.stats.spills++;
+    portEXIT_CRITICAL(&temp_lock);
+
+    /* names repeat after a reboot, a leftover file is simply reused */
+    snprintf(p->spill_name, sizeof(p->spill_name), "sqlite_tmp_%u", id);
+    rc = lfs_file_open(&lfs_filesystem, p->spill, p->spill_name, LFS_O_RDWR | LFS_O_CREAT | LFS_O_TRUNC);
+    if (rc < 0) {
+        sqlite3_free(p->spill);
+        p->spill = NULL;
+        return SQLITE_CANTOPEN;
+    }
+    return SQLITE_OK;
+}
+
+static int temp_Close(sqlite3_file *id)
+{
+    temp_file *p = (temp_file *) id;
+
+    temp_shrink(p, 0);
+    sqlite3_free(p->chunks);
+    if (p->spill) {
+        lfs_file_close(&lfs_filesystem, p->spill);
+        lfs_remove(&lfs_filesystem, p->spill_name);
+        sqlite3_free(p->spill);
+    }
+    portENTER_CRITICAL(&temp_lock);
+    temp_global.stats.files--;
+    portEXIT_CRITICAL(&temp_lock);
+    return SQLITE_OK;
+}
+
+static int temp_read(sqlite3_file *id, void *buffer, int amount, sqlite3_int64 offset)
+{
+    temp_file *p = (temp_file *) id;
+    uint8_t *out = (uint8_t *) buffer;
+    sqlite3_int64 mem = temp_mem_size(p);
+    int avail = offset < p->size ? (int) (p->size - offset < amount ? p->size - offset : amount) : 0;
+    int n;
+
+    if (avail < amount)
+        memset(out + avail, 0, amount - avail);
+
+    n = offset < mem ? (int) (mem - offset < avail ? mem - offset : avail) : 0;
+    if (n)
+        temp_mem_copy(p, out, NULL, n, offset);
+    if (n < avail) {
+        lfs_soff_t at = (lfs_soff_t) (offset + n - mem);
+        lfs_ssize_t got;
+
+        if (!p->spill || lfs_file_seek(&lfs_filesystem, p->spill, at, LFS_SEEK_SET) != at)
+            return SQLITE_IOERR_READ;
+        got = lfs_file_read(&lfs_filesystem, p->spill, out + n, avail - n);
+        if (got < 0)
+            return SQLITE_IOERR_READ;
+        if (got < avail - n)
+            memset(out + n + got, 0, avail - n - got);
+        portENTER_CRITICAL(&temp_lock);
+        temp_global.stats.spill_bytes_read += avail - n;
+        portEXIT_CRITICAL(&temp_lock);
+    }
+    return avail == amount ? SQLITE_OK : SQLITE_IOERR_SHORT_READ;
+}
+
+static int temp_write(sqlite3_file *id, const void *buffer, int amount, sqlite3_int64 offset)
+{
+    temp_file *p = (temp_file *) id;
+    const uint8_t *in = (const uint8_t *) buffer;
+    sqlite3_int64 end = offset + amount, mem;
+    int n, rc;
+
+    while (!p->spilled && end > temp_mem_size(p)) {
+        if (temp_grow(p) != SQLITE_OK)
+            p->spilled = 1;
+    }
+    mem = temp_mem_size(p);
+
+    n = offset < mem ? (int) (mem - offset < amount ? mem - offset : amount) : 0;
+    if (n)
+        temp_mem_copy(p, NULL, in, n, offset);
+    if (n < amount) {
+        lfs_soff_t at = (lfs_soff_t) (offset + n - mem);
+
+        if (!p->spill && (rc = temp_spill_open(p)) != SQLITE_OK)
+            return rc == SQLITE_NOMEM ? rc : SQLITE_IOERR_WRITE;
+        /* littlefs fills a gap before at with zeros */
+        if (lfs_file_seek(&lfs_filesystem, p->spill, at, LFS_SEEK_SET) != at)
+            return SQLITE_IOERR_SEEK;
+        if (lfs_file_write(&lfs_filesystem, p->spill, in + n, amount - n) != amount - n)
+            return SQLITE_IOERR_WRITE;
+        portENTER_CRITICAL(&temp_lock);
+        temp_global.stats.spill_bytes_written += amount - n;
+        portEXIT_CRITICAL(&temp_lock);
+    }
+
+    if (end > p->size)
+        p->size = end;
+    return SQLITE_OK;
+}
+
+static int temp_Read(sqlite3_file *id, void *buffer, int amount, sqlite3_int64 offset)
+{
+    temp_file *p = (temp_file *) id;
+    int64_t start = esp_timer_get_time();
+    int rc = temp_read(id, buffer, amount, offset);
+
+    p->stats.reads++;
+    p->stats.short_reads += rc == SQLITE_IOERR_SHORT_READ;
+    p->stats.seq_reads += offset == p->read_end;
+    p->stats.read_bytes += amount;
+    p->stats.read_us += esp_timer_get_time() - start;
+    p->read_end = offset + amount;
+    return rc;
+}
+
+static int temp_Write(sqlite3_file *id, const void *buffer, int amount, sqlite3_int64 offset)
+{
+    temp_file *p = (temp_file *) id;
+    int64_t start = esp_timer_get_time();
+    int rc = temp_write(id, buffer, amount, offset);
+
+    p->stats.writes++;
+    p->stats.seq_writes += offset == p->write_end;
+    p->stats.write_bytes += amount;
+    p->stats.write_us += esp_timer_get_time() - start;
+    p->write_end = offset + amount;
+    return rc;
+}
+
+static int temp_Truncate(sqlite3_file *id, sqlite3_int64 size)
+{
+    temp_file *p = (temp_file *) id;
+    sqlite3_int64 mem;
+
+    if (size >= p->size)
+        return SQLITE_OK;
+    p->size = size;
+    if (!p->spilled)
+        temp_shrink(p, (int) ((size + TEMP_CHUNK_SIZE - 1) / TEMP_CHUNK_SIZE));
+
+    /* a later write past a gap has to read zeros there */
+    mem = temp_mem_size(p);
+    for (sqlite3_int64 at = size; at < mem; at += TEMP_CHUNK_SIZE - at % TEMP_CHUNK_SIZE)
+        memset(p->chunks[at / TEMP_CHUNK_SIZE] + at % TEMP_CHUNK_SIZE, 0, TEMP_CHUNK_SIZE - at % TEMP_CHUNK_SIZE);
+    if (p->spill && lfs_file_truncate(&lfs_filesystem, p->spill, size > mem ? (lfs_off_t) (size - mem) : 0) < 0)
+        return SQLITE_IOERR_TRUNCATE;
+    return SQLITE_OK;
+}
+
+static int temp_Sync(sqlite3_file *id, int flags)
+{
+    /* nothing survives a reboot, nothing to sync */
+    return SQLITE_OK;
+}
+
+static int temp_FileSize(sqlite3_file *id, sqlite3_int64 *size)
+{
+    *size = ((temp_file *) id)->size;
+    return SQLITE_OK;
+}
+
+static int temp_Lock(sqlite3_file *id, int lock)
+{
+    return SQLITE_OK;
+}
+
+static int temp_CheckReservedLock(sqlite3_file *id, int *result)
+{
+    *result = 0;
+    return SQLITE_OK;
+}
+
+static int temp_FileControl(sqlite3_file *id, int op, void *arg)
+{
+    temp_file *p = (temp_file *) id;
+
+    switch (op) {
+        case ESP32_FCNTL_IO_STATS:
+            *(esp32_file_stats_t *) arg = p->stats;
+            return SQLITE_OK;
+        case ESP32_FCNTL_IO_STATS_RESET:
+            if (arg)
+                *(esp32_file_stats_t *) arg = p->stats;
+            memset(&p->stats, 0, sizeof(esp32_file_stats_t));
+            return SQLITE_OK;
+        default:
+            return SQLITE_NOTFOUND;
+    }
+}
+
+static int temp_SectorSize(sqlite3_file *id)
+{
+    return 512;
+}
+
+static int temp_DeviceCharacteristics(sqlite3_file *id)
+{
+    return SQLITE_IOCAP_POWERSAFE_OVERWRITE;
+}
+
+static const sqlite3_io_methods temp_io_methods = {
+        1,
+        temp_Close,
+        temp_Read,
+        temp_Write,
+        temp_Truncate,
+        temp_Sync,
+        temp_FileSize,
+        temp_Lock,
+        temp_Lock,			// xUnlock
+        temp_CheckReservedLock,
+        temp_FileControl,
+        temp_SectorSize,
+        temp_DeviceCharacteristics
+};
+
+int esp32_temp_open(sqlite3_vfs *vfs, sqlite3_file *file, int flags, int *outflags)
+{
+    temp_file *p = (temp_file *) file;
+
+    memset(p, 0, sizeof(temp_file));
+    p->base.pMethods = &temp_io_methods;
+
+    portENTER_CRITICAL(&temp_lock);
+    if (++temp_global.stats.files > temp_global.stats.files_high)
+        temp_global.stats.files_high = temp_global.stats.files;
+    portEXIT_CRITICAL(&temp_lock);
+    if (outflags)
+        *outflags = flags;
+    return SQLITE_OK;
+}
+
+void esp32_vfs_temp_stats(esp32_temp_stats_t *stats, int reset)
+{
+    portENTER_CRITICAL(&temp_lock);
+    temp_global.stats.psram_budget = TEMP_BUDGET;
+    *stats = temp_global.stats;
+    if (reset) {
+        temp_global.stats.files_high = temp_global.stats.files;
+        temp_global.stats.psram_bytes_high = temp_global.stats.psram_bytes;
+        temp_global.stats.spills = 0;
+        temp_global.stats.spill_bytes_written = 0;
+        temp_global.stats.spill_bytes_read = 0;
+    }
+    portEXIT_CRITICAL(&temp_lock);
+}
@@ -0,0 +1,81 @@
+/*
+ * esp32_trace.c
+ *
+ * RAM ring buffer behind the ESP32_TRACE_* macros of esp32_trace.h. Nothing
+ * is formatted on the hot path, records are decoded by esp32_vfs_trace_dump.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <esp_timer.h>
+#include "esp32_trace.h"
+#include "esp32_vfs.h"
+
+#if ESP32_TRACE_LEVEL > 0
+
+static esp32_trace_record_t trace_ring[ESP32_TRACE_RECORDS];
+static uint32_t trace_head;
+
+static const char *const trace_event_names[ESP32_TRACE_EVENT_COUNT] = {
+        "open", "close", "read", "write", "truncate", "sync", "filesize",
+        "prealloc", "delete", "lock", "unlock", "checklock", "fcntl",
+        "sector", "devchar", "syscall", "wal", "fetch", "shm"
+};
+
+static const char trace_level_names[] = "-EID";
+
+static void trace_print(const esp32_trace_record_t *r)
+{
+    printf("%10u %c %-9s %c%-5u %11d %11d\n",
+           (unsigned) r->time_us, trace_level_names[r->level & 3],
+           r->event < ESP32_TRACE_EVENT_COUNT ? trace_event_names[r->event] : "?",
+           (r->file & ESP32_TRACE_MEMFILE) ? 'm' : 'f',
+           (unsigned) (r->file & ~ESP32_TRACE_MEMFILE), (int) r->arg0, (int) r->arg1);
+}
+
+void esp32_trace_record(uint8_t level, uint8_t event, uint16_t file,
+                        int32_t arg0, int32_t arg1)
+{
+    /* reserve the slot atomically, a reader task may trace concurrently */
+    uint32_t slot = __atomic_fetch_add(&trace_head, 1, __ATOMIC_RELAXED);
+    esp32_trace_record_t *r = &trace_ring[slot % ESP32_TRACE_RECORDS];
+
+    r->time_us = (uint32_t) esp_timer_get_time();
+    r->level = level;
+    r->event = event;
+    r->file = file;
+    r->arg0 = arg0;
+    r->arg1 = arg1;
+
+#ifdef CONFIG_SQLITE_VFS_TRACE_PRINT
+    trace_print(r);
+#endif
+}
+
+void esp32_vfs_trace_dump(void)
+{
+    uint32_t head = __atomic_load_n(&trace_head, __ATOMIC_RELAXED);
+    uint32_t count = head < ESP32_TRACE_RECORDS ? head : ESP32_TRACE_RECORDS;
+
+    printf("[TRACE]%u records, %u dropped\n", (unsigned) count, (unsigned) (head - count));
+    printf("   time_us L event     file          arg0        arg1\n");
+    for (uint32_t i = head - count; i < head; i++)
+        trace_print(&trace_ring[i % ESP32_TRACE_RECORDS]);
+}
+
+void esp32_vfs_trace_clear(void)
+{
+    __atomic_store_n(&trace_head, 0, __ATOMIC_RELAXED);
+}
+
+#else
+
+void esp32_vfs_trace_dump(void)
+{
+    printf("[TRACE]VFS tracing disabled, set CONFIG_SQLITE_VFS_TRACE_LEVEL\n");
+}
+
+void esp32_vfs_trace_clear(void)
+{
+}
+
+#endif
@@ -0,0 +1,262 @@
+//
+// Public helpers of the esp32 sqlite3 VFS (esp32.c)
+//
+
+#ifndef SD_CARD_ESP32_VFS_H
+#define SD_CARD_ESP32_VFS_H
+
+#include "sqlite3.h"
+
+/**
+ * VFS name for static reference databases: the main database is streamed
+ * into PSRAM at open, served read-only from memory and reported immutable,
+ * so lookups cost no SD I/O, locking or journal activity. Open with
+ * sqlite3_open_v2(path, &db, SQLITE_OPEN_READONLY, ESP32_VFS_PRELOAD) or
+ * with the URI file:path?preload=1 on the default VFS.
+ */
+#define ESP32_VFS_PRELOAD "esp32-preload"
+
+/**
+ * VFS name for page compressed databases: every page of the main database
+ * is stored compressed, journals and WAL files are left as they are. Select
+ * the codec for newly written pages with the URI parameter
+ * codec=lzf|shox96|none, the default comes from menuconfig. The page map is
+ * kept per connection, a file is open through one connection at a time and
+ * a second sqlite3_open of it fails with SQLITE_BUSY.
+ */
+#define ESP32_VFS_ZIP "esp32-zip"
+
+/**
+ * VFS name for encrypted databases: pages of the main and temp databases
+ * are encrypted with AES-XTS, journals, WAL and other temp files with
+ * AES-CTR under a random salt that is renewed every time the file starts
+ * over, so these files are 8 bytes longer on the card. The key
+ * comes from the URI parameter hexkey (64 or 128 hex digits) or else from
+ * esp32_vfs_crypt_key().
+ */
+#define ESP32_VFS_CRYPT "esp32-crypt"
+
+/**
+ * VFS name for databases beyond the 2 GiB littlefs file limit: the main
+ * database is striped over chunk files <path>, <path>.001, ... of
+ * CONFIG_SQLITE_CHUNK_FILE_MB each. Use it with journal_mode=WAL, a commit
+ * spanning two chunks is not atomic in rollback mode.
+ */
+#define ESP32_VFS_CHUNK "esp32-chunk"
+
+/**
+ * File control opcodes of the esp32 VFS files, above sqlite's own.
+ * ESP32_FCNTL_IO_STATS copies the I/O counters of a file into the
+ * esp32_file_stats_t the argument points to, ESP32_FCNTL_IO_STATS_RESET
+ * does the same if the argument is not NULL and clears them.
+ */
+#define ESP32_FCNTL_IO_STATS       0x45330001
+#define ESP32_FCNTL_IO_STATS_RESET 0x45330002
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * I/O counters of one open file, see esp32_vfs_file_stats(). Times are
+ * spent in littlefs, or in PSRAM for journals in memory and temp files.
+ */
+typedef struct esp32_file_stats {
+    unsigned reads;
+    /* reads past the end of the file, zero filled */
+    unsigned short_reads;
+    /* reads starting where the previous one ended */
+    unsigned seq_reads;
+    unsigned writes;
+    /* writes starting where the previous one ended */
+    unsigned seq_writes;
+    unsigned syncs;
+    sqlite3_uint64 read_bytes;
+    sqlite3_uint64 write_bytes;
+    sqlite3_uint64 read_us;
+    sqlite3_uint64 write_us;
+    sqlite3_uint64 sync_us;
+} esp32_file_stats_t;
+
+/**
+ * Counters of the PSRAM page cache, see esp32_vfs_pcache_stats()
+ */
+typedef struct esp32_pcache_stats {
+    unsigned hits;
+    unsigned misses;
+    unsigned evictions;
+    unsigned pages;
+    unsigned pages_high;
+    unsigned slabs_used;
+    unsigned slabs_used_high;
+    unsigned slabs_total;
+    unsigned slab_size;
+    unsigned heap_slots;
+} esp32_pcache_stats_t;
+
+/**
+ * Counters of the sqlite memory arena, see esp32_vfs_mem_stats()
+ */
+typedef struct esp32_mem_stats {
+    unsigned bytes_used;
+    unsigned bytes_used_high;
+    unsigned slabs_used;
+    unsigned slabs_used_high;
+    unsigned slabs_total;
+    unsigned slab_size;
+    unsigned heap_allocs;
+    unsigned arena_full;
+} esp32_mem_stats_t;
+
+/**
+ * Counters of the temp file store, see esp32_vfs_temp_stats()
+ */
+typedef struct esp32_temp_stats {
+    unsigned files;
+    unsigned files_high;
+    unsigned psram_bytes;
+    unsigned psram_bytes_high;
+    unsigned psram_budget;
+    unsigned spills;
+    sqlite3_uint64 spill_bytes_written;
+    sqlite3_uint64 spill_bytes_read;
+} esp32_temp_stats_t;
+
+/**
+ * Switch a connection to WAL journal mode with exclusive locking, so that
+ * sqlite keeps the wal-index in its own heap memory instead of mapping it
+ * from the VFS; the -wal file itself is a regular littlefs file. Use
+ * esp32_vfs_wal_enable_shared() for connections that share the database.
+ * @param db sqlite3 connection opened over the esp32 VFS
+ * @param autocheckpoint wal_autocheckpoint in pages, 0 disables automatic
+ *        checkpoints so that esp32_vfs_wal_checkpoint can be run at idle time
+ * @return SQLITE_OK on success
+ */
+extern int esp32_vfs_wal_enable(sqlite3 *db, int autocheckpoint);
+
+/**
+ * Switch a connection to WAL journal mode with normal locking, so that
+ * connections of other tasks can read the database while one of them
+ * writes. The wal-index is shared in memory between the connections of a
+ * file. Every connection to the database has to be switched this way, a
+ * connection left in the default exclusive mode keeps the others out.
+ * @param db sqlite3 connection opened over the esp32 VFS
+ * @param autocheckpoint wal_autocheckpoint in pages
+ * @param busy_ms how long a statement waits for a lock before SQLITE_BUSY
+ * @return SQLITE_OK on success
+ */
+extern int esp32_vfs_wal_enable_shared(sqlite3 *db, int autocheckpoint, int busy_ms);
+
+/**
+ * Copy committed WAL frames back into the database file. Meant to be called
+ * from the owning task when it is otherwise idle, e.g. between ingest bursts.
+ * @param db sqlite3 connection in WAL mode
+ * @param frames_left optional, receives frames still in the WAL after the run
+ * @return SQLITE_OK on success
+ */
+extern int esp32_vfs_wal_checkpoint(sqlite3 *db, int *frames_left);
+
+/**
+ * Choose the page size of a database at runtime. A new, empty database
+ * takes it directly; an existing one is rebuilt with VACUUM, which goes
+ * through a temp database and is not possible in WAL journal mode.
+ * @param db sqlite3 connection
+ * @param page_size power of two between 512 and 65536; 64 KiB pages do not
+ *        fit the PSRAM slabs of esp32_vfs_pcache_install and are cached on
+ *        the heap, PRAGMA cache_size of them
+ * @return SQLITE_OK on success, SQLITE_ERROR if the database kept its page
+ *         size, e.g. in WAL mode
+ */
+extern int esp32_vfs_set_page_size(sqlite3 *db, int page_size);
+
+/**
+ * Set the key used by the esp32-crypt VFS for databases opened without a
+ * hexkey URI parameter. The key is copied.
+ * @param key AES-XTS key: two AES-128 or two AES-256 keys back to back
+ * @param len 32 or 64, 0 clears the key
+ * @return SQLITE_OK on success, SQLITE_MISUSE for other lengths
+ */
+extern int esp32_vfs_crypt_key(const void *key, int len);
+
+/**
+ * Make sqlite allocate from the size class arena of esp32_mem.c instead of
+ * the ESP-IDF heap. Must be called before sqlite3_initialize(), the arena is
+ * allocated there.
+ * @return SQLITE_OK on success, SQLITE_NOMEM if the arena does not fit
+ */
+extern int esp32_vfs_mem_install(void);
+
+/**
+ * Read the memory arena counters
+ * @param stats receives bytes and slabs in use with their high water marks,
+ *        live heap fallback allocations and arena full events
+ * @param reset start the high water marks and the arena full count over
+ */
+extern void esp32_vfs_mem_stats(esp32_mem_stats_t *stats, int reset);
+
+/**
+ * Make sqlite use the page cache on the PSRAM arena. Must be called before
+ * sqlite3_initialize(), the arena is allocated there.
+ * @return SQLITE_OK on success, SQLITE_NOMEM if the board has no PSRAM
+ */
+extern int esp32_vfs_pcache_install(void);
+
+/**
+ * Change the minimum number of pages of every purgeable page cache, at
+ * runtime or before sqlite3_initialize(). PRAGMA cache_size can still raise
+ * it for a connection.
+ * @param pages minimum pages per cache, 0 leaves it to PRAGMA cache_size
+ * @return the previous minimum
+ */
+extern int esp32_vfs_pcache_set_pages(int pages);
+
+/**
+ * Read the page cache counters
+ * @param stats receives hits, misses, evictions, page and slab usage
+ * @param reset start hit, miss and eviction counters and high water marks over
+ */
+extern void esp32_vfs_pcache_stats(esp32_pcache_stats_t *stats, int reset);
+
+/**
+ * Read the temp file counters. Sorter runs and statement journals live in
+ * PSRAM up to CONFIG_SQLITE_TEMP_PSRAM_KB for all temp files together, the
+ * rest is spilled to scratch littlefs files.
+ * @param stats receives open files and PSRAM use with their high water
+ *        marks, files that spilled and the bytes moved to and from the card
+ * @param reset start the high water marks and spill counters over
+ */
+extern void esp32_vfs_temp_stats(esp32_temp_stats_t *stats, int reset);
+
+/**
+ * Read the I/O counters of a database file or its journal. The same
+ * counters are in the virtual table esp32_io_stats of every connection:
+ *   SELECT * FROM esp32_io_stats
+ * lists the database and journal file of main and temp, the WAL file in
+ * place of the journal in WAL mode. Attached schemas cannot be listed with
+ * SQLITE_OMIT_SCHEMA_PRAGMAS, name them: WHERE schema IN ('main', 'hot').
+ * @param db sqlite3 connection
+ * @param schema "main", "temp" or an attached schema, NULL for "main"
+ * @param journal nonzero for the rollback journal or WAL file
+ * @param stats receives the counters
+ * @param reset start the counters of the file over
+ * @return SQLITE_OK, SQLITE_NOTFOUND if the file is not open or not on the esp32 VFS,
+ *         SQLITE_ERROR for an unknown schema
+ */
+extern int esp32_vfs_file_stats(sqlite3 *db, const char *schema, int journal, esp32_file_stats_t *stats, int reset);
+
+/**
+ * Print the VFS trace ring buffer, oldest record first. Records are only
+ * collected when CONFIG_SQLITE_VFS_TRACE_LEVEL is above 0.
+ */
+extern void esp32_vfs_trace_dump(void);
+
+/**
+ * Drop all records from the VFS trace ring buffer
+ */
+extern void esp32_vfs_trace_clear(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //SD_CARD_ESP32_VFS_H
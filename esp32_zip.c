@@ -0,0 +1,809 @@
+/*
+ * esp32_zip.c
+ *
+ * Page compressing VFS shim. The "esp32-zip" VFS stores every page of the
+ * main database compressed in a littlefs file of the esp32 VFS; journals
+ * and WAL files are passed through untouched.
+ *
+ * On-card layout of a compressed database:
+ *   [header 64 B][page records ...][page map]
+ * Rewritten pages are appended at the end of the data area and the page map
+ * (offset, length and codec per page) lives in RAM. xSync appends the map,
+ * rewrites the header and syncs once, littlefs makes that step atomic.
+ * When more than half of the data area is dead records it is compacted in
+ * place during the same sync.
+ *
+ * The page map of a connection would go stale when another connection
+ * rewrites the file, so a compressed database is open through one
+ * connection at a time; a second open of the same file is refused with
+ * SQLITE_BUSY, which keeps every connection in effect in exclusive locking.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sdkconfig.h>
+#include "sqlite3.h"
+#include "shox96_0_2.h"
+#include "esp32_zip.h"
+#include "esp32_trace.h"
+
+#define ZIP_MAGIC "ESP32ZIP"
+#define ZIP_VERSION 1
+#define ZIP_HEADER_SIZE 64
+#define ZIP_COMPACT_MIN 65536
+
+#define LZF_HLOG 10
+#define LZF_MAX_LIT 32
+#define LZF_MAX_OFF 8192
+#define LZF_MAX_REF 264
+
+#ifdef CONFIG_SQLITE_ZIP_CODEC
+#define ZIP_DEFAULT_CODEC CONFIG_SQLITE_ZIP_CODEC
+#else
+#define ZIP_DEFAULT_CODEC ESP32_ZIP_CODEC_LZF
+#endif
+
+typedef struct zip_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t page_size;
+    uint32_t page_count;
+    uint32_t map_offset;
+    uint32_t map_length;
+    uint32_t data_end;
+    uint32_t live_bytes;
+} zip_header_t;
+
+/* codec in the top byte of len_codec, a length of 0 is a page of zeros */
+typedef struct zip_entry {
+    uint32_t offset;
+    uint32_t len_codec;
+} zip_entry_t;
+
+typedef struct zip_file {
+    sqlite3_file base;
+    sqlite3_file *real;
+    /* open main databases, guarded by SQLITE_MUTEX_STATIC_VFS2 */
+    const char *path;
+    struct zip_file *next;
+    int is_main;
+    int codec;
+    int dirty;
+    zip_header_t hdr;
+    zip_entry_t *map;
+    uint32_t map_alloc;
+    uint8_t *page;
+    uint8_t *verify;
+    uint8_t *packed;
+    uint32_t packed_size;
+    uint32_t *lzf_hash;
+} zip_file;
+
+static sqlite3_vfs *zip_base;
+static zip_file *zip_open_files;
+
+#define ENTRY_LEN(e) ((e).len_codec & 0xFFFFFF)
+#define ENTRY_CODEC(e) ((e).len_codec >> 24)
+
+/*
+ * LZF style codec: a control byte below 32 starts a run of ctrl+1 literals,
+ * otherwise it encodes a back reference of length (ctrl >> 5) + 2, extended
+ * by one more byte when that is 7, and a 13 bit distance.
+ */
+static int lzf_compress(const uint8_t *in, int in_len, uint8_t *out, int out_len, uint32_t *htab)
+{
+    int ip = 0, op = 1, lit = 0;
+
+    memset(htab, 0, sizeof(uint32_t) << LZF_HLOG);
+    while (ip + 2 < in_len) {
+        uint32_t h, ref;
+        if (op + 4 > out_len)
+            return 0;
+
+        h = (((uint32_t) in[ip] << 16) | (in[ip + 1] << 8) | in[ip + 2]) * 2654435761u >> (32 - LZF_HLOG);
+        ref = htab[h];
+        htab[h] = ip + 1;
+
+        if (ref && ip - (int) ref < LZF_MAX_OFF &&
+            in[ref - 1] == in[ip] && in[ref] == in[ip + 1] && in[ref + 1] == in[ip + 2]) {
+            int r = ref - 1, off = ip - r - 1, len = 3;
+            int max = in_len - ip < LZF_MAX_REF ? in_len - ip : LZF_MAX_REF;
+
+            while (len < max && in[r + len] == in[ip + len])
+                len++;
+
+            /* close the pending literal run, or drop its unused control byte */
+            if (lit)
+                out[op - lit - 1] = lit - 1;
+            else
+                op--;
+
+            len -= 2;
+            if (len < 7) {
+                out[op++] = (off >> 8) + (len << 5);
+            } else {
+                out[op++] = (off >> 8) + (7 << 5);
+                out[op++] = len - 7;
+            }
+            out[op++] = off & 0xFF;
+
+            lit = 0;
+            op++;
+            ip += len + 2;
+            continue;
+        }
+
+        lit++;
+        out[op++] = in[ip++];
+        if (lit == LZF_MAX_LIT) {
+            out[op - lit - 1] = lit - 1;
+            lit = 0;
+            op++;
+        }
+    }
+
+    while (ip < in_len) {
+        if (op + 2 > out_len)
+            return 0;
+        lit++;
+        out[op++] = in[ip++];
+        if (lit == LZF_MAX_LIT) {
+            out[op - lit - 1] = lit - 1;
+            lit = 0;
+            op++;
+        }
+    }
+
+    if (lit)
+        out[op - lit - 1] = lit - 1;
+    else
+        op--;
+    return op;
+}
+
+static int lzf_decompress(const uint8_t *in, int in_len, uint8_t *out, int out_len)
+{
+    int ip = 0, op = 0;
+
+    while (ip < in_len) {
+        int ctrl = in[ip++];
+
+        if (ctrl < 32) {
+            ctrl++;
+            if (op + ctrl > out_len || ip + ctrl > in_len)
+                return -1;
+            memcpy(out + op, in + ip, ctrl);
+            ip += ctrl;
+            op += ctrl;
+        } else {
+            int len = ctrl >> 5, ref = op - ((ctrl & 0x1F) << 8) - 1;
+
+            if (len == 7) {
+                if (ip >= in_len)
+                    return -1;
+                len += in[ip++];
+            }
+            if (ip >= in_len)
+                return -1;
+            ref -= in[ip++];
+            len += 2;
+            if (ref < 0 || op + len > out_len)
+                return -1;
+            while (len--)
+                out[op++] = out[ref++];
+        }
+    }
+    return op;
+}
+
+/**
+ * Compress one page with the file's codec
+ * @return compressed length in p->packed and its codec in *codec, a page
+ *         that does not shrink is stored raw
+ */
+static uint32_t zip_pack(zip_file *p, const uint8_t *page, int *codec)
+{
+    uint32_t size = p->hdr.page_size;
+    int n = 0;
+
+    if (p->codec == ESP32_ZIP_CODEC_LZF) {
+        n = lzf_compress(page, size, p->packed, size - 1, p->lzf_hash);
+    } else if (p->codec == ESP32_ZIP_CODEC_SHOX96) {
+        /* shox96 is a text codec and drops bytes it has no code for, only
+         * keep its output when it round-trips exactly */
+        n = shox96_0_2_compress((const char *) page, size, (char *) p->packed, NULL);
+        if (n <= 0 || (uint32_t) n >= size ||
+            shox96_0_2_decompress_n((const char *) p->packed, n, (char *) p->verify, size, NULL) != (int) size ||
+            memcmp(page, p->verify, size))
+            n = 0;
+    }
+
+    if (n > 0 && (uint32_t) n < size) {
+        *codec = p->codec;
+        return n;
+    }
+    memcpy(p->packed, page, size);
+    *codec = ESP32_ZIP_CODEC_NONE;
+    return size;
+}
+
+static int zip_unpack(zip_file *p, int codec, uint32_t len, uint8_t *out)
+{
+    int n;
+
+    switch (codec) {
+        case ESP32_ZIP_CODEC_NONE:
+            if (len != p->hdr.page_size)
+                return SQLITE_CORRUPT;
+            memcpy(out, p->packed, len);
+            return SQLITE_OK;
+        case ESP32_ZIP_CODEC_LZF:
+            n = lzf_decompress(p->packed, len, out, p->hdr.page_size);
+            break;
+        case ESP32_ZIP_CODEC_SHOX96:
+            /* a corrupt page must not decode past the page buffer */
+            n = shox96_0_2_decompress_n((const char *) p->packed, len, (char *) out, p->hdr.page_size, NULL);
+            break;
+        default:
+            return SQLITE_CORRUPT;
+    }
+    return n == (int) p->hdr.page_size ? SQLITE_OK : SQLITE_CORRUPT;
+}
+
+/**
+ * Size the scratch buffers once the page size is known
+ */
+static int zip_alloc_buffers(zip_file *p)
+{
+    uint32_t size = p->hdr.page_size;
+
+    /* shox96 can emit several codes for one input byte */
+    p->packed_size = size * 4 + 16;
+    p->page = (uint8_t *) sqlite3_malloc(size);
+    p->verify = (uint8_t *) sqlite3_malloc(size);
+    p->packed = (uint8_t *) sqlite3_malloc(p->packed_size);
+    p->lzf_hash = (uint32_t *) sqlite3_malloc(sizeof(uint32_t) << LZF_HLOG);
+    if (!p->page || !p->verify || !p->packed || !p->lzf_hash)
+        return SQLITE_NOMEM;
+    return SQLITE_OK;
+}
+
+static int zip_map_reserve(zip_file *p, uint32_t count)
+{
+    zip_entry_t *map;
+    uint32_t alloc = p->map_alloc ? p->map_alloc : 64;
+
+    if (count <= p->map_alloc)
+        return SQLITE_OK;
+    while (alloc < count)
+        alloc *= 2;
+    map = (zip_entry_t *) sqlite3_realloc(p->map, alloc * sizeof(zip_entry_t));
+    if (!map)
+        return SQLITE_NOMEM;
+    memset(map + p->map_alloc, 0, (alloc - p->map_alloc) * sizeof(zip_entry_t));
+    p->map = map;
+    p->map_alloc = alloc;
+    return SQLITE_OK;
+}
+
+static int zip_load_page(zip_file *p, uint32_t pgno, uint8_t *out)
+{
+    zip_entry_t e = p->map[pgno];
+    int rc;
+
+    if (ENTRY_LEN(e) == 0) {
+        memset(out, 0, p->hdr.page_size);
+        return SQLITE_OK;
+    }
+    rc = p->real->pMethods->xRead(p->real, p->packed, ENTRY_LEN(e), e.offset);
+    if (rc != SQLITE_OK)
+        return rc;
+    rc = zip_unpack(p, ENTRY_CODEC(e), ENTRY_LEN(e), out);
+    if (rc != SQLITE_OK)
+        ESP32_TRACE_E(ESP32_TRACE_READ, 0, pgno, rc);
+    return rc;
+}
+
+static int zip_store_page(zip_file *p, uint32_t pgno, const uint8_t *page)
+{
+    int codec, rc;
+    uint32_t len = zip_pack(p, page, &codec);
+
+    rc = p->real->pMethods->xWrite(p->real, p->packed, len, p->hdr.data_end);
+    if (rc != SQLITE_OK)
+        return rc;
+    rc = zip_map_reserve(p, pgno + 1);
+    if (rc != SQLITE_OK)
+        return rc;
+
+    p->hdr.live_bytes += len - ENTRY_LEN(p->map[pgno]);
+    p->map[pgno].offset = p->hdr.data_end;
+    p->map[pgno].len_codec = ((uint32_t) codec << 24) | len;
+    p->hdr.data_end += len;
+    if (pgno >= p->hdr.page_count)
+        p->hdr.page_count = pgno + 1;
+    p->dirty = 1;
+
+    ESP32_TRACE_D(ESP32_TRACE_WRITE, 0, pgno, len);
+    return SQLITE_OK;
+}
+
+static int zip_cmp_record(const void *a, const void *b)
+{
+    uint32_t x = ((const uint32_t *) a)[0], y = ((const uint32_t *) b)[0];
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Slide all live records down to the header in file order. Every record is
+ * read before anything at or above its offset is written, and littlefs only
+ * commits the result with the following sync.
+ */
+static int zip_compact(zip_file *p)
+{
+    uint32_t *order, n = 0, i, cursor = ZIP_HEADER_SIZE;
+    int rc = SQLITE_OK;
+
+    order = (uint32_t *) sqlite3_malloc(p->hdr.page_count * 2 * sizeof(uint32_t) + 1);
+    if (!order)
+        return SQLITE_NOMEM;
+    for (i = 0; i < p->hdr.page_count; i++) {
+        if (ENTRY_LEN(p->map[i]) == 0)
+            continue;
+        order[n * 2] = p->map[i].offset;
+        order[n * 2 + 1] = i;
+        n++;
+    }
+    qsort(order, n, 2 * sizeof(uint32_t), zip_cmp_record);
+
+    for (i = 0; i < n && rc == SQLITE_OK; i++) {
+        zip_entry_t *e = &p->map[order[i * 2 + 1]];
+        uint32_t len = ENTRY_LEN(*e);
+
+        if (e->offset != cursor) {
+            rc = p->real->pMethods->xRead(p->real, p->packed, len, e->offset);
+            if (rc == SQLITE_OK)
+                rc = p->real->pMethods->xWrite(p->real, p->packed, len, cursor);
+            e->offset = cursor;
+        }
+        cursor += len;
+    }
+    sqlite3_free(order);
+
+    if (rc == SQLITE_OK) {
+        ESP32_TRACE_I(ESP32_TRACE_TRUNCATE, 0, p->hdr.data_end, cursor);
+        p->hdr.data_end = cursor;
+    }
+    return rc;
+}
+
+/**
+ * Persist map and header: map after the data area, header in front
+ */
+static int zip_flush(zip_file *p)
+{
+    uint8_t header[ZIP_HEADER_SIZE];
+    uint32_t dead = p->hdr.data_end - ZIP_HEADER_SIZE - p->hdr.live_bytes;
+    int rc;
+
+    if (!p->dirty)
+        return SQLITE_OK;
+
+    if (dead > p->hdr.live_bytes && dead > ZIP_COMPACT_MIN) {
+        rc = zip_compact(p);
+        if (rc != SQLITE_OK)
+            return rc;
+    }
+
+    p->hdr.map_offset = p->hdr.data_end;
+    p->hdr.map_length = p->hdr.page_count * sizeof(zip_entry_t);
+    if (p->hdr.map_length) {
+        rc = p->real->pMethods->xWrite(p->real, p->map, p->hdr.map_length, p->hdr.map_offset);
+        if (rc != SQLITE_OK)
+            return rc;
+    }
+
+    memset(header, 0, sizeof(header));
+    memcpy(header, &p->hdr, sizeof(p->hdr));
+    rc = p->real->pMethods->xWrite(p->real, header, sizeof(header), 0);
+    if (rc != SQLITE_OK)
+        return rc;
+
+    /* drop whatever an older, longer layout left behind */
+    rc = p->real->pMethods->xTruncate(p->real, p->hdr.map_offset + p->hdr.map_length);
+    if (rc != SQLITE_OK)
+        return rc;
+
+    p->dirty = 0;
+    return SQLITE_OK;
+}
+
+/**
+ * Register a main database as open, its page map is private to the
+ * connection
+ * @return SQLITE_OK, SQLITE_BUSY if another connection has it open
+ */
+static int zip_claim(zip_file *p, const char *path)
+{
+    sqlite3_mutex *mutex = sqlite3_mutex_alloc(SQLITE_MUTEX_STATIC_VFS2);
+    zip_file *q;
+
+    if (!path)
+        return SQLITE_OK;
+    sqlite3_mutex_enter(mutex);
+    for (q = zip_open_files; q; q = q->next) {
+        if (strcmp(q->path, path) == 0) {
+            sqlite3_mutex_leave(mutex);
+            return SQLITE_BUSY;
+        }
+    }
+    p->path = path;
+    p->next = zip_open_files;
+    zip_open_files = p;
+    sqlite3_mutex_leave(mutex);
+    return SQLITE_OK;
+}
+
+static void zip_release(zip_file *p)
+{
+    sqlite3_mutex *mutex = sqlite3_mutex_alloc(SQLITE_MUTEX_STATIC_VFS2);
+    zip_file **q;
+
+    sqlite3_mutex_enter(mutex);
+    for (q = &zip_open_files; *q; q = &(*q)->next) {
+        if (*q == p) {
+            *q = p->next;
+            break;
+        }
+    }
+    sqlite3_mutex_leave(mutex);
+    p->path = NULL;
+}
+
+static int zip_Close(sqlite3_file *id)
+{
+    zip_file *p = (zip_file *) id;
+    int rc = SQLITE_OK;
+
+    if (p->is_main) {
+        rc = zip_flush(p);
+        sqlite3_free(p->map);
+        sqlite3_free(p->page);
+        sqlite3_free(p->verify);
+        sqlite3_free(p->packed);
+        sqlite3_free(p->lzf_hash);
+    }
+    if (p->path)
+        zip_release(p);
+    if (p->real->pMethods->xClose(p->real) != SQLITE_OK && rc == SQLITE_OK)
+        rc = SQLITE_IOERR_CLOSE;
+    return rc;
+}
+
+static int zip_Read(sqlite3_file *id, void *buffer, int amount, sqlite3_int64 offset)
+{
+    zip_file *p = (zip_file *) id;
+    uint8_t *out = (uint8_t *) buffer;
+    uint32_t size = p->hdr.page_size;
+    int rc;
+
+    if (!p->is_main)
+        return p->real->pMethods->xRead(p->real, buffer, amount, offset);
+
+    while (amount > 0) {
+        uint32_t pgno = size ? (uint32_t) (offset / size) : 0;
+        uint32_t skip = size ? (uint32_t) (offset % size) : 0;
+        uint32_t n;
+
+        if (!size || pgno >= p->hdr.page_count) {
+            memset(out, 0, amount);
+            return SQLITE_IOERR_SHORT_READ;
+        }
+        n = size - skip < (uint32_t) amount ? size - skip : (uint32_t) amount;
+
+        if (n == size) {
+            rc = zip_load_page(p, pgno, out);
+        } else {
+            rc = zip_load_page(p, pgno, p->page);
+            if (rc == SQLITE_OK)
+                memcpy(out, p->page + skip, n);
+        }
+        if (rc != SQLITE_OK)
+            return rc == SQLITE_CORRUPT ? SQLITE_IOERR_READ : rc;
+
+        out += n;
+        offset += n;
+        amount -= n;
+    }
+    return SQLITE_OK;
+}
+
+static int zip_Write(sqlite3_file *id, const void *buffer, int amount, sqlite3_int64 offset)
+{
+    zip_file *p = (zip_file *) id;
+    const uint8_t *in = (const uint8_t *) buffer;
+    int rc;
+
+    if (!p->is_main)
+        return p->real->pMethods->xWrite(p->real, buffer, amount, offset);
+
+    /* sqlite writes whole pages, the first one fixes the page size */
+    if (!p->hdr.page_size) {
+        if (offset != 0 || amount < 512 || amount > 65536 || (amount & (amount - 1)))
+            return SQLITE_IOERR_WRITE;
+        p->hdr.page_size = amount;
+        rc = zip_alloc_buffers(p);
+        if (rc != SQLITE_OK)
+            return rc;
+    }
+
+    while (amount > 0) {
+        uint32_t size = p->hdr.page_size;
+        uint32_t pgno = (uint32_t) (offset / size), skip = (uint32_t) (offset % size);
+        uint32_t n = size - skip < (uint32_t) amount ? size - skip : (uint32_t) amount;
+
+        if (n == size) {
+            rc = zip_store_page(p, pgno, in);
+        } else {
+            rc = zip_map_reserve(p, pgno + 1);
+            if (rc == SQLITE_OK)
+                rc = zip_load_page(p, pgno, p->page);
+            if (rc == SQLITE_OK) {
+                memcpy(p->page + skip, in, n);
+                rc = zip_store_page(p, pgno, p->page);
+            }
+        }
+        if (rc != SQLITE_OK)
+            return rc == SQLITE_CORRUPT ? SQLITE_IOERR_WRITE : rc;
+
+        in += n;
+        offset += n;
+        amount -= n;
+    }
+    return SQLITE_OK;
+}
+
+static int zip_Truncate(sqlite3_file *id, sqlite3_int64 size)
+{
+    zip_file *p = (zip_file *) id;
+    uint32_t count, i;
+
+    if (!p->is_main)
+        return p->real->pMethods->xTruncate(p->real, size);
+    if (!p->hdr.page_size)
+        return SQLITE_OK;
+
+    count = (uint32_t) ((size + p->hdr.page_size - 1) / p->hdr.page_size);
+    for (i = count; i < p->hdr.page_count; i++) {
+        p->hdr.live_bytes -= ENTRY_LEN(p->map[i]);
+        p->map[i].offset = 0;
+        p->map[i].len_codec = 0;
+    }
+    if (count < p->hdr.page_count) {
+        p->hdr.page_count = count;
+        p->dirty = 1;
+    }
+    return SQLITE_OK;
+}
+
+static int zip_Sync(sqlite3_file *id, int flags)
+{
+    zip_file *p = (zip_file *) id;
+
+    if (p->is_main) {
+        int rc = zip_flush(p);
+        if (rc != SQLITE_OK)
+            return rc;
+    }
+    return p->real->pMethods->xSync(p->real, flags);
+}
+
+static int zip_FileSize(sqlite3_file *id, sqlite3_int64 *size)
+{
+    zip_file *p = (zip_file *) id;
+
+    if (!p->is_main)
+        return p->real->pMethods->xFileSize(p->real, size);
+    *size = (sqlite3_int64) p->hdr.page_count * p->hdr.page_size;
+    return SQLITE_OK;
+}
+
+static int zip_Lock(sqlite3_file *id, int lock)
+{
+    zip_file *p = (zip_file *) id;
+    return p->real->pMethods->xLock(p->real, lock);
+}
+
+static int zip_Unlock(sqlite3_file *id, int lock)
+{
+    zip_file *p = (zip_file *) id;
+    return p->real->pMethods->xUnlock(p->real, lock);
+}
+
+static int zip_CheckReservedLock(sqlite3_file *id, int *result)
+{
+    zip_file *p = (zip_file *) id;
+    return p->real->pMethods->xCheckReservedLock(p->real, result);
+}
+
+static int zip_FileControl(sqlite3_file *id, int op, void *arg)
+{
+    zip_file *p = (zip_file *) id;
+
+    /* physical growth of a compressed file has nothing to do with the
+     * logical size sqlite hints at */
+    if (p->is_main && (op == SQLITE_FCNTL_SIZE_HINT || op == SQLITE_FCNTL_CHUNK_SIZE))
+        return SQLITE_OK;
+    return p->real->pMethods->xFileControl(p->real, op, arg);
+}
+
+static int zip_SectorSize(sqlite3_file *id)
+{
+    zip_file *p = (zip_file *) id;
+    return p->real->pMethods->xSectorSize(p->real);
+}
+
+static int zip_DeviceCharacteristics(sqlite3_file *id)
+{
+    zip_file *p = (zip_file *) id;
+    return p->real->pMethods->xDeviceCharacteristics(p->real);
+}
+
+static const sqlite3_io_methods zip_io_methods = {
+        1,
+        zip_Close,
+        zip_Read,
+        zip_Write,
+        zip_Truncate,
+        zip_Sync,
+        zip_FileSize,
+        zip_Lock,
+        zip_Unlock,
+        zip_CheckReservedLock,
+        zip_FileControl,
+        zip_SectorSize,
+        zip_DeviceCharacteristics
+};
+
+/**
+ * Load header and page map of an existing compressed database
+ */
+static int zip_load(zip_file *p)
+{
+    uint8_t header[ZIP_HEADER_SIZE];
+    int rc;
+
+    rc = p->real->pMethods->xRead(p->real, header, sizeof(header), 0);
+    if (rc == SQLITE_IOERR_SHORT_READ) {
+        /* new file, pages start right after the header */
+        memcpy(p->hdr.magic, ZIP_MAGIC, sizeof(p->hdr.magic));
+        p->hdr.version = ZIP_VERSION;
+        p->hdr.data_end = ZIP_HEADER_SIZE;
+        return SQLITE_OK;
+    }
+    if (rc != SQLITE_OK)
+        return rc;
+
+    memcpy(&p->hdr, header, sizeof(p->hdr));
+    if (memcmp(p->hdr.magic, ZIP_MAGIC, sizeof(p->hdr.magic)) || p->hdr.version != ZIP_VERSION ||
+        p->hdr.map_length != p->hdr.page_count * sizeof(zip_entry_t))
+        return SQLITE_NOTADB;
+
+    if (p->hdr.page_size) {
+        rc = zip_alloc_buffers(p);
+        if (rc != SQLITE_OK)
+            return rc;
+    }
+    rc = zip_map_reserve(p, p->hdr.page_count);
+    if (rc == SQLITE_OK && p->hdr.map_length)
+        rc = p->real->pMethods->xRead(p->real, p->map, p->hdr.map_length, p->hdr.map_offset);
+    /* appends reuse the space of the map, it is rewritten on sync */
+    p->hdr.data_end = p->hdr.map_offset;
+    return rc;
+}
+
+static int zip_Open(sqlite3_vfs *vfs, const char *path, sqlite3_file *file, int flags, int *outflags)
+{
+    zip_file *p = (zip_file *) file;
+    const char *codec;
+    int rc;
+
+    memset(p, 0, sizeof(zip_file));
+    p->real = (sqlite3_file *) &p[1];
+    p->is_main = (flags & SQLITE_OPEN_MAIN_DB) != 0;
+
+    rc = zip_base->xOpen(zip_base, path, p->real, flags, outflags);
+    if (rc != SQLITE_OK)
+        return rc;
+    p->base.pMethods = &zip_io_methods;
+    if (!p->is_main)
+        return SQLITE_OK;
+
+    /* file:name.db?codec=lzf|shox96|none selects the codec for new pages */
+    p->codec = ZIP_DEFAULT_CODEC;
+    codec = sqlite3_uri_parameter(path, "codec");
+    if (codec && !sqlite3_stricmp(codec, "none"))
+        p->codec = ESP32_ZIP_CODEC_NONE;
+    else if (codec && !sqlite3_stricmp(codec, "lzf"))
+        p->codec = ESP32_ZIP_CODEC_LZF;
+    else if (codec && !sqlite3_stricmp(codec, "shox96"))
+        p->codec = ESP32_ZIP_CODEC_SHOX96;
+
+    rc = zip_claim(p, path);
+    if (rc == SQLITE_OK)
+        rc = zip_load(p);
+    if (rc != SQLITE_OK) {
+        ESP32_TRACE_E(ESP32_TRACE_OPEN, 0, flags, rc);
+        p->is_main = 0;
+        zip_Close(file);
+        p->base.pMethods = NULL;
+        sqlite3_free(p->map);
+        sqlite3_free(p->page);
+        sqlite3_free(p->verify);
+        sqlite3_free(p->packed);
+        sqlite3_free(p->lzf_hash);
+        return rc;
+    }
+    ESP32_TRACE_I(ESP32_TRACE_OPEN, 0, flags, p->hdr.page_count);
+    return SQLITE_OK;
+}
+
+static int zip_Delete(sqlite3_vfs *vfs, const char *path, int syncDir)
+{
+    return zip_base->xDelete(zip_base, path, syncDir);
+}
+
+static int zip_Access(sqlite3_vfs *vfs, const char *path, int flags, int *result)
+{
+    return zip_base->xAccess(zip_base, path, flags, result);
+}
+
+static int zip_FullPathname(sqlite3_vfs *vfs, const char *path, int len, char *fullpath)
+{
+    return zip_base->xFullPathname(zip_base, path, len, fullpath);
+}
+
+static int zip_Randomness(sqlite3_vfs *vfs, int len, char *buffer)
+{
+    return zip_base->xRandomness(zip_base, len, buffer);
+}
+
+static int zip_Sleep(sqlite3_vfs *vfs, int microseconds)
+{
+    return zip_base->xSleep(zip_base, microseconds);
+}
+
+static int zip_CurrentTime(sqlite3_vfs *vfs, double *result)
+{
+    return zip_base->xCurrentTime(zip_base, result);
+}
+
+static sqlite3_vfs zip_vfs = {
+        1,			// iVersion
+        0,			// szOsFile, set on register
+        0,			// mxPathname, set on register
+        NULL,			// pNext
+        "esp32-zip",		// name
+        NULL,			// pAppData
+        zip_Open,		// xOpen
+        zip_Delete,		// xDelete
+        zip_Access,		// xAccess
+        zip_FullPathname,	// xFullPathname
+        NULL,			// xDlOpen
+        NULL,			// xDlError
+        NULL,			// xDlSym
+        NULL,			// xDlClose
+        zip_Randomness,		// xRandomness
+        zip_Sleep,		// xSleep
+        zip_CurrentTime,	// xCurrentTime
+        NULL			// xGetLastError
+};
+
+int esp32_zip_register(sqlite3_vfs *base)
+{
+    zip_base = base;
+    zip_vfs.szOsFile = sizeof(zip_file) + base->szOsFile;
+    zip_vfs.mxPathname = base->mxPathname;
+    return sqlite3_vfs_register(&zip_vfs, 0);
+}
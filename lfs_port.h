@@ -5,8 +5,21 @@
 #ifndef SD_CARD_LFS_PORT_H
 #define SD_CARD_LFS_PORT_H
 
+#include <sdkconfig.h>
 #include <driver/sdspi_host.h>
 #include "lfs.h"
+
+/* littlefs block size on the card, a multiple of the 512 byte SD sector.
+ * The file cache is one block, so database pages up to this size are read
+ * and programmed with a single multi-sector transfer. Changing it changes
+ * the on-card format. */
+#ifdef CONFIG_LITTLEFS_SD_BLOCK_SIZE
+#define LFS_SD_BLOCK_SIZE CONFIG_LITTLEFS_SD_BLOCK_SIZE
+#else
+#define LFS_SD_BLOCK_SIZE 512
+#endif
+#define LFS_SD_SECTORS_PER_BLOCK (LFS_SD_BLOCK_SIZE / 512)
+
 extern void LittleFS_Mount(sdmmc_card_t *sdCard);
 extern void app_test(sdmmc_card_t *sdCard);
 extern lfs_t lfs_filesystem;
@@ -41,4 +54,26 @@ extern int lfs_deskio_read(const struct lfs_config *c,
  * @return returns ok on success
  */
 extern int lfs_deskio_erase(const struct lfs_config *c, lfs_block_t block);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Take the littlefs lock. littlefs takes it around every call when built
+ * with LFS_THREADSAFE; callers take it as well around sequences that must
+ * not interleave with other tasks, e.g. seek followed by read. Recursive.
+ * @return 0, the lock is waited for
+ */
+extern int lfs_port_lock(void);
+
+/**
+ * Release the littlefs lock taken with lfs_port_lock
+ */
+extern void lfs_port_unlock(void);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif //SD_CARD_LFS_PORT_H
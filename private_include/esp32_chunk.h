@@ -0,0 +1,25 @@
+//
+// Chunked VFS shim on top of the esp32 VFS (esp32_chunk.c)
+//
+
+#ifndef SD_CARD_ESP32_CHUNK_H
+#define SD_CARD_ESP32_CHUNK_H
+
+#include "sqlite3.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Register the "esp32-chunk" VFS
+ * @param base VFS the chunk files are stored through
+ * @return SQLITE_OK on success
+ */
+extern int esp32_chunk_register(sqlite3_vfs *base);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //SD_CARD_ESP32_CHUNK_H
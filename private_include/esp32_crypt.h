@@ -0,0 +1,25 @@
+//
+// Encrypting VFS shim on top of the esp32 VFS (esp32_crypt.c)
+//
+
+#ifndef SD_CARD_ESP32_CRYPT_H
+#define SD_CARD_ESP32_CRYPT_H
+
+#include "sqlite3.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Register the "esp32-crypt" VFS
+ * @param base VFS the encrypted files are stored through
+ * @return SQLITE_OK on success
+ */
+extern int esp32_crypt_register(sqlite3_vfs *base);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //SD_CARD_ESP32_CRYPT_H
@@ -0,0 +1,24 @@
+//
+// Per-file I/O counters as the virtual table esp32_io_stats (esp32_io_stats.c)
+//
+
+#ifndef SD_CARD_ESP32_IO_STATS_H
+#define SD_CARD_ESP32_IO_STATS_H
+
+#include "sqlite3.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Register the eponymous virtual table esp32_io_stats on a connection,
+ * done for every connection by sqlite3_os_init
+ */
+extern int esp32_io_stats_register(sqlite3 *db, const char **errmsg, const struct sqlite3_api_routines *api);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //SD_CARD_ESP32_IO_STATS_H
@@ -0,0 +1,24 @@
+//
+// Virtual table over append-only text logs on littlefs (esp32_logtab.c)
+//
+
+#ifndef SD_CARD_ESP32_LOGTAB_H
+#define SD_CARD_ESP32_LOGTAB_H
+
+#include "sqlite3.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Register the virtual table module esp32_log on a connection, done for
+ * every connection by sqlite3_os_init
+ */
+extern int esp32_logtab_register(sqlite3 *db, const char **errmsg, const struct sqlite3_api_routines *api);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //SD_CARD_ESP32_LOGTAB_H
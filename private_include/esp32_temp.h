@@ -0,0 +1,32 @@
+//
+// PSRAM backed temp files with spill to littlefs (esp32_temp.c)
+//
+
+#ifndef SD_CARD_ESP32_TEMP_H
+#define SD_CARD_ESP32_TEMP_H
+
+#include "sqlite3.h"
+
+/* bytes a temp file handle takes at most, szOsFile of a VFS opening temp files must hold it */
+#define ESP32_TEMP_FILE_SIZE 192
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Open a temp file, sorter runs, statement journals and other files sqlite
+ * opens without a name
+ * @param vfs VFS the file is opened through, szOsFile at least ESP32_TEMP_FILE_SIZE
+ * @param file sqlite3 file to fill in
+ * @param flags sqlite open flags
+ * @param outflags receives the flags, may be NULL
+ * @return SQLITE_OK on success
+ */
+extern int esp32_temp_open(sqlite3_vfs *vfs, sqlite3_file *file, int flags, int *outflags);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //SD_CARD_ESP32_TEMP_H
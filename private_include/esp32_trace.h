@@ -0,0 +1,116 @@
+//
+// Leveled, compile-time gated tracing for the esp32 sqlite3 VFS
+//
+// Trace points record fixed size binary records into a RAM ring buffer
+// instead of formatting text over UART. With CONFIG_SQLITE_VFS_TRACE_LEVEL
+// at 0 (the default) every trace point compiles to nothing; the arguments
+// are cast to void so locals kept only for tracing do not warn, trace
+// arguments must have no side effects.
+//
+
+#ifndef SD_CARD_ESP32_TRACE_H
+#define SD_CARD_ESP32_TRACE_H
+
+#include <stdint.h>
+#include <sdkconfig.h>
+
+#ifdef CONFIG_SQLITE_VFS_TRACE_LEVEL
+#define ESP32_TRACE_LEVEL CONFIG_SQLITE_VFS_TRACE_LEVEL
+#else
+#define ESP32_TRACE_LEVEL 0
+#endif
+
+#ifdef CONFIG_SQLITE_VFS_TRACE_RECORDS
+#define ESP32_TRACE_RECORDS CONFIG_SQLITE_VFS_TRACE_RECORDS
+#else
+#define ESP32_TRACE_RECORDS 256
+#endif
+
+#define ESP32_TRACE_ERROR 1
+#define ESP32_TRACE_INFO  2
+#define ESP32_TRACE_DEBUG 3
+
+/* file tag bit marking files served from the RAM filecache */
+#define ESP32_TRACE_MEMFILE 0x8000
+
+typedef enum {
+    ESP32_TRACE_OPEN = 0,
+    ESP32_TRACE_CLOSE,
+    ESP32_TRACE_READ,
+    ESP32_TRACE_WRITE,
+    ESP32_TRACE_TRUNCATE,
+    ESP32_TRACE_SYNC,
+    ESP32_TRACE_FILESIZE,
+    ESP32_TRACE_PREALLOCATE,
+    ESP32_TRACE_DELETE,
+    ESP32_TRACE_LOCK,
+    ESP32_TRACE_UNLOCK,
+    ESP32_TRACE_CHECKLOCK,
+    ESP32_TRACE_FILECONTROL,
+    ESP32_TRACE_SECTORSIZE,
+    ESP32_TRACE_DEVCHAR,
+    ESP32_TRACE_SYSCALL,
+    ESP32_TRACE_WAL,
+    ESP32_TRACE_FETCH,
+    ESP32_TRACE_SHM,
+    ESP32_TRACE_EVENT_COUNT
+} esp32_trace_event_t;
+
+/**
+ * One trace record, 16 bytes. arg0/arg1 meaning depends on the event,
+ * usually offset/amount for I/O and result code for the rest.
+ */
+typedef struct esp32_trace_record {
+    uint32_t time_us;
+    uint8_t level;
+    uint8_t event;
+    uint16_t file;
+    int32_t arg0;
+    int32_t arg1;
+} esp32_trace_record_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Append a record to the ring buffer, oldest records are overwritten
+ * @param level ESP32_TRACE_ERROR/INFO/DEBUG
+ * @param event esp32_trace_event_t
+ * @param file file tag, 0 when not bound to a file
+ * @param arg0 first event argument
+ * @param arg1 second event argument
+ */
+extern void esp32_trace_record(uint8_t level, uint8_t event, uint16_t file,
+                               int32_t arg0, int32_t arg1);
+
+#ifdef __cplusplus
+}
+#endif
+
+/* a trace point below the level: no record, arguments only marked as used */
+#define ESP32_TRACE_NONE(ev, file, a0, a1) \
+    do { (void) (ev); (void) (file); (void) (a0); (void) (a1); } while (0)
+
+#if ESP32_TRACE_LEVEL >= ESP32_TRACE_ERROR
+#define ESP32_TRACE_E(ev, file, a0, a1) \
+    esp32_trace_record(ESP32_TRACE_ERROR, (ev), (file), (int32_t)(a0), (int32_t)(a1))
+#else
+#define ESP32_TRACE_E(ev, file, a0, a1) ESP32_TRACE_NONE(ev, file, a0, a1)
+#endif
+
+#if ESP32_TRACE_LEVEL >= ESP32_TRACE_INFO
+#define ESP32_TRACE_I(ev, file, a0, a1) \
+    esp32_trace_record(ESP32_TRACE_INFO, (ev), (file), (int32_t)(a0), (int32_t)(a1))
+#else
+#define ESP32_TRACE_I(ev, file, a0, a1) ESP32_TRACE_NONE(ev, file, a0, a1)
+#endif
+
+#if ESP32_TRACE_LEVEL >= ESP32_TRACE_DEBUG
+#define ESP32_TRACE_D(ev, file, a0, a1) \
+    esp32_trace_record(ESP32_TRACE_DEBUG, (ev), (file), (int32_t)(a0), (int32_t)(a1))
+#else
+#define ESP32_TRACE_D(ev, file, a0, a1) ESP32_TRACE_NONE(ev, file, a0, a1)
+#endif
+
+#endif //SD_CARD_ESP32_TRACE_H
@@ -0,0 +1,29 @@
+//
+// Page compressing VFS shim on top of the esp32 VFS (esp32_zip.c)
+//
+
+#ifndef SD_CARD_ESP32_ZIP_H
+#define SD_CARD_ESP32_ZIP_H
+
+#include "sqlite3.h"
+
+#define ESP32_ZIP_CODEC_NONE   0
+#define ESP32_ZIP_CODEC_LZF    1
+#define ESP32_ZIP_CODEC_SHOX96 2
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Register the "esp32-zip" VFS
+ * @param base VFS the compressed files are stored through
+ * @return SQLITE_OK on success
+ */
+extern int esp32_zip_register(sqlite3_vfs *base);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //SD_CARD_ESP32_ZIP_H
@@ -26,4 +26,5 @@ struct lnk_lst {
 
 extern int shox96_0_2_compress(const char *in, int len, char *out, struct lnk_lst *prev_lines);
 extern int shox96_0_2_decompress(const char *in, int len, char *out, struct lnk_lst *prev_lines);
+extern int shox96_0_2_decompress_n(const char *in, int len, char *out, int out_len, struct lnk_lst *prev_lines);
 #endif
@@ -168,6 +168,10 @@ void app_main(void)
 #include "driver/sdspi_host.h"
 #include "sqlite3.h"
 #include "sdmmc_cmd.h"
+#include "esp32_vfs.h"
+#include "vfs_benchmark.h"
+#include "esp32_db.h"
+#include "esp32_profile.h"
 
 
 
@@ -179,17 +183,6 @@ void app_main(void)
 #define PIN_NUM_CLK  14
 #define PIN_NUM_CS   13
 
-const char* data = "Callback function called";
-static int callback(void *data, int argc, char **argv, char **azColName){
-    int i;
-    printf("%s: ", (const char*)data);
-    for (i = 0; i<argc; i++){
-        printf("%s = %s\n", azColName[i], argv[i] ? argv[i] : "NULL");
-    }
-    printf("\n");
-    return 0;
-}
-
 int openDb(const char *filename, sqlite3 **db) {
     int rc = sqlite3_open(filename, db);
     if (rc) {
@@ -201,44 +194,86 @@ int openDb(const char *filename, sqlite3 **db) {
     return rc;
 }
 
-char *zErrMsg = 0;
-int db_exec(sqlite3 *db, const char *sql) {
+// Print the rows of a query straight from sqlite's buffers, numbers are not
+// converted to text and blobs are shown by size. The statement stays
+// prepared in the cache for the next call with the same SQL.
+int db_exec(esp32db::Database &db, esp32_stmt_cache_t *cache, const char *sql) {
     printf("%s\n", sql);
 
-    int rc = sqlite3_exec(db, sql, callback, (void*)data, &zErrMsg);
-    if (rc != SQLITE_OK) {
-        printf("SQL error: %s\n", zErrMsg);
-        sqlite3_free(zErrMsg);
-    } else {
-        printf("Operation done successfully\n");
+    esp32db::Statement stmt(cache, sql);
+    for (esp32db::Row row : stmt) {
+        for (int i = 0; i < row.count(); i++) {
+            switch (row.type(i)) {
+            case SQLITE_INTEGER:
+                printf("%s = %lld\n", row.name(i), (long long) row.int64(i));
+                break;
+            case SQLITE_FLOAT:
+                printf("%s = %g\n", row.name(i), row.real(i));
+                break;
+            case SQLITE_TEXT: {
+                std::string_view text = row.text(i);
+                printf("%s = %.*s\n", row.name(i), (int) text.size(), text.data());
+                break;
+            }
+            case SQLITE_BLOB:
+                printf("%s = <%u bytes>\n", row.name(i), (unsigned) row.blob(i).size);
+                break;
+            default:
+                printf("%s = NULL\n", row.name(i));
+            }
+        }
+        printf("\n");
     }
-
-    return rc;
+    if (stmt.rc() != SQLITE_DONE) {
+        printf("SQL error: %s\n", db.errmsg());
+        return stmt.rc() == SQLITE_OK ? SQLITE_ERROR : stmt.rc();
+    }
+    printf("Operation done successfully\n");
+    return SQLITE_OK;
 }
 
 void app_main2()
 {
     sqlite3 *db1;
+    esp32_stmt_cache_t *cache;
+    esp32_stmt_cache_stats_t cacheStats;
 
     int rc;
 
-
+#ifdef CONFIG_SQLITE_MEM_ARENA
+    if (esp32_vfs_mem_install() != SQLITE_OK)
+        ESP_LOGW(TAG, "No room for the sqlite memory arena, system malloc");
+#endif
+#ifdef CONFIG_SQLITE_PCACHE_PSRAM
+    if (esp32_vfs_pcache_install() != SQLITE_OK)
+        ESP_LOGW(TAG, "No PSRAM, default page cache");
+#endif
     sqlite3_initialize();
 
+#ifdef CONFIG_SQLITE_VFS_BENCHMARK
+    vfs_benchmark_run_all();
+#endif
+
     // Open database 1
     if (openDb("JanStore.db", &db1))
         return;
+    esp32db::Database db(db1);
+    if (esp32_stmt_cache_open(db1, 0, &cache) != SQLITE_OK)
+        return;
 
-
-    rc = db_exec(db1, "SELECT main.Identity.rawData FROM main.Identity");
+    rc = db_exec(db, cache, "SELECT main.Identity.rawData FROM main.Identity");
     if (rc != SQLITE_OK) {
         ESP_LOGI(TAG, "Card unmounted");
-        sqlite3_close(db1);
+        esp32_stmt_cache_close(cache);
         return;
     }
     ESP_LOGI(TAG, "Card unmounted2");
 
-    sqlite3_close(db1);
+    esp32_stmt_cache_stats(cache, &cacheStats, 0);
+    ESP_LOGI(TAG, "Statement cache: %u hits, %u misses, %llu us preparing", cacheStats.hits, cacheStats.misses,
+             (unsigned long long) cacheStats.prepare_us);
+    esp32_stmt_cache_close(cache);
+    esp32_profile_dump(10);
 
 
     // All done, unmount partition and disable SDMMC or SPI peripheral
@@ -6,13 +6,18 @@
  */
 #include <sdmmc_cmd.h>
 #include <driver/sdmmc_defs.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
 #include <freertos/task.h>
 #include "lfs_port.h"
+#include "esp32_logfile.h"
 sdmmc_card_t *sdCardInstance;
 
-static uint8_t read_buffer[512];
-static uint8_t prog_buffer[512];
+static uint8_t read_buffer[LFS_SD_BLOCK_SIZE];
+static uint8_t prog_buffer[LFS_SD_BLOCK_SIZE];
 static uint8_t lookahead_buffer[512];
+static StaticSemaphore_t lfs_lock_buffer;
+static SemaphoreHandle_t lfs_lock_handle;
 lfs_t lfs_filesystem;
 lfs_file_t lfs_file;
 uint8_t rx_buffer[512];
@@ -32,8 +37,8 @@ uint8_t tx_buffer[512];
 #ifdef CONFIG_LITTLE_FS_IO_DEBUG
     printf("[ERASE]block %lu\n",(uint32_t)block);
 #endif
-    esp_err_t err = sdmmc_erase_sectors(sdCardInstance, block,
-                                        1, SDMMC_ERASE_ARG);
+    esp_err_t err = sdmmc_erase_sectors(sdCardInstance, block * LFS_SD_SECTORS_PER_BLOCK,
+                                        LFS_SD_SECTORS_PER_BLOCK, SDMMC_ERASE_ARG);
     if(err != ESP_OK){
 #ifdef CONFIG_LITTLE_FS_IO_DEBUG
         printf("[ERASE]Failed at block %lu, err %d", (uint32_t)block, err);
@@ -54,25 +59,31 @@ uint8_t tx_buffer[512];
  int lfs_deskio_read(const struct lfs_config *c,
                            lfs_block_t block, lfs_off_t off, void *buffer, lfs_size_t size)
 {
-    void* tmp_buf = heap_caps_malloc(512, MALLOC_CAP_DMA);
+    /* off and size are multiples of the 512 byte read_size, so a large
+     * page read maps onto one multi-sector transfer */
+    size_t sector = block * LFS_SD_SECTORS_PER_BLOCK + off / 512;
+    void* tmp_buf = heap_caps_malloc(size, MALLOC_CAP_DMA);
     uint32_t current_tick = xTaskGetTickCount();
 #ifdef CONFIG_LITTLE_FS_IO_DEBUG
     printf("[READ]block addr %d, offset %d, size %d\n",block, off,size);
 #endif
-    esp_err_t ret = sdmmc_read_sectors(sdCardInstance, tmp_buf, block, 1);
+    if(tmp_buf == NULL)
+        return LFS_ERR_NOMEM;
+    esp_err_t ret = sdmmc_read_sectors(sdCardInstance, tmp_buf, sector, size / 512);
     if(ret != ESP_OK){
 #ifdef CONFIG_LITTLE_FS_IO_DEBUG
         printf("[READ]Error on read, code: %d\n", ret);
 #endif
+        free(tmp_buf);
         return LFS_ERR_IO;
     }
 #ifdef CONFIG_LITTLE_FS_IO_DEBUG
     uint32_t elapsed = xTaskGetTickCount() - current_tick;
     elapsed = elapsed * portTICK_PERIOD_MS;
-    printf("[READ]512 byte reading in %d ms\n", elapsed);
+    printf("[READ]%d byte reading in %d ms\n", size, elapsed);
 #endif
 
-    memcpy(buffer,tmp_buf,512);
+    memcpy(buffer,tmp_buf,size);
     free(tmp_buf);
     return LFS_ERR_OK;
 }
@@ -92,7 +103,8 @@ uint8_t tx_buffer[512];
     printf("[WRITE]block %d, offset %d, size %d\n",block,
             off,size);
 #endif
-    esp_err_t ret = sdmmc_write_sectors(sdCardInstance, buffer, block, 1);
+    esp_err_t ret = sdmmc_write_sectors(sdCardInstance, buffer,
+                                        block * LFS_SD_SECTORS_PER_BLOCK + off / 512, size / 512);
     if(ret != ESP_OK){
 #ifdef CONFIG_LITTLE_FS_IO_DEBUG
         printf("[WRITE]Error on write, code: %d\n", ret);
@@ -162,6 +174,33 @@ static int lfs_deskio_sync(const struct lfs_config *c)
 	return LFS_ERR_OK;
 }
 
+int lfs_port_lock(void)
+{
+    /* created in LittleFS_Mount, nothing to guard before that */
+    if (lfs_lock_handle)
+        xSemaphoreTakeRecursive(lfs_lock_handle, portMAX_DELAY);
+    return LFS_ERR_OK;
+}
+
+void lfs_port_unlock(void)
+{
+    if (lfs_lock_handle)
+        xSemaphoreGiveRecursive(lfs_lock_handle);
+}
+
+#ifdef LFS_THREADSAFE
+static int lfs_deskio_lock(const struct lfs_config *c)
+{
+    return lfs_port_lock();
+}
+
+static int lfs_deskio_unlock(const struct lfs_config *c)
+{
+    lfs_port_unlock();
+    return LFS_ERR_OK;
+}
+#endif
+
 
 const struct lfs_config cfg =
 {
@@ -169,12 +208,16 @@ const struct lfs_config cfg =
 	.prog  = lfs_deskio_prog,
 	.erase = lfs_deskio_erase,
 	.sync  = lfs_deskio_sync,
+#ifdef LFS_THREADSAFE
+	.lock  = lfs_deskio_lock,
+	.unlock = lfs_deskio_unlock,
+#endif
 	.read_size = 512,
 	.prog_size = 512,
-	.block_size = 512,
-	.block_count = 30560256,
+	.block_size = LFS_SD_BLOCK_SIZE,
+	.block_count = 30560256 / LFS_SD_SECTORS_PER_BLOCK,
     .block_cycles = 500,
-	.cache_size = 512,
+	.cache_size = LFS_SD_BLOCK_SIZE,
 	.lookahead_size = 512,
 	.read_buffer = read_buffer,
 	.prog_buffer = prog_buffer,
@@ -250,6 +293,8 @@ void Application_Append_File_Text(char file_name[], char buffer[], int size );
 void LittleFS_Mount(sdmmc_card_t *sdCard){
 
     sdCardInstance = sdCard;
+    if (!lfs_lock_handle)
+        lfs_lock_handle = xSemaphoreCreateRecursiveMutexStatic(&lfs_lock_buffer);
 
     int err = lfs_mount(&lfs_filesystem, &cfg);
 
@@ -280,19 +325,13 @@ void LittleFS_Mount(sdmmc_card_t *sdCard){
 
 void Application_Append_File_Text(char file_name[], char buffer[], int size)
 {
-    int file_open = 0;
-    file_open =  lfs_file_open(&lfs_filesystem, &lfs_file,
-                               file_name, LFS_O_APPEND | LFS_O_RDWR |LFS_O_CREAT);
+    sqlite3_int64 file_size;
 
-    if(file_open < 0){
+    /* the file stays open in the log file cache, synced by its policy */
+    if (esp32_logfile_append(file_name, buffer, size) != SQLITE_OK) {
         printf("Cannot open file\n");
-    }else{
-        lfs_file_write(&lfs_filesystem, &lfs_file,
-                       buffer, 	size);
-
-        printf("File size %d\n", lfs_file_size(&lfs_filesystem, &lfs_file));
-
-        lfs_file_close(&lfs_filesystem, &lfs_file);
+    } else if (esp32_logfile_size(file_name, &file_size) == SQLITE_OK) {
+        printf("File size %lld\n", (long long) file_size);
     }
 
 }
@@ -21,6 +21,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <limits.h>
 
 #include "shox96_0_2.h"
 
@@ -363,12 +364,20 @@ int readCount(const char *in, int *bit_no_p, int len) {
   int idx = getCodeIdx(hcode, in, len, bit_no_p);
   if (idx > 6)
     return 0;
+  if (*bit_no_p + bit_len[idx] > len)
+    return -1;
   int count = getNumFromBits(in, *bit_no_p, bit_len[idx]) + adder[idx];
   (*bit_no_p) += bit_len[idx];
   return count;
 }
 
 int shox96_0_2_decompress(const char *in, int len, char *out, struct lnk_lst *prev_lines) {
+  return shox96_0_2_decompress_n(in, len, out, INT_MAX, prev_lines);
+}
+
+// Decompress into at most out_len bytes, -1 if the input is truncated,
+// refers outside what was decoded or would need more room
+int shox96_0_2_decompress_n(const char *in, int len, char *out, int out_len, struct lnk_lst *prev_lines) {
 
   int dstate;
   int bit_no;
@@ -379,7 +388,8 @@ int shox96_0_2_decompress(const char *in, int len, char *out, struct lnk_lst *pr
   is_all_upper = 0;
 
   len <<= 3;
-  out[ol] = 0;
+  if (out_len > 0)
+    out[ol] = 0;
   while (bit_no < len) {
     int h, v;
     char c;
@@ -449,6 +459,8 @@ int shox96_0_2_decompress(const char *in, int len, char *out, struct lnk_lst *pr
       if (h == SHX_SET1B) {
          switch (v) {
            case 6:
+             if (ol >= out_len)
+               return -1;
              out[ol++] = '\r';
              c = '\n';
              break;
@@ -456,24 +468,44 @@ int shox96_0_2_decompress(const char *in, int len, char *out, struct lnk_lst *pr
              c = is_upper ? '\r' : '\n';
              break;
            case 8:
+             if (bit_no >= len)
+               return -1;
              if (getBitVal(in, bit_no++, 0)) {
-               int dict_len = readCount(in, &bit_no, len) + NICE_LEN_FOR_PRIOR;
-               int dist = readCount(in, &bit_no, len) + NICE_LEN_FOR_PRIOR - 1;
-               memcpy(out + ol, out + ol - dist, dict_len);
-               ol += dict_len;
+               int dict_len = readCount(in, &bit_no, len);
+               int dist = readCount(in, &bit_no, len);
+               if (dict_len < 0 || dist < 0)
+                 return -1;
+               dict_len += NICE_LEN_FOR_PRIOR;
+               dist += NICE_LEN_FOR_PRIOR - 1;
+               if (dist > ol || dict_len > out_len - ol)
+                 return -1;
+               // the match may overlap what it produces, copy forward
+               while (dict_len--) {
+                 out[ol] = out[ol - dist];
+                 ol++;
+               }
              } else {
-               int dict_len = readCount(in, &bit_no, len) + NICE_LEN_FOR_OTHER;
+               int dict_len = readCount(in, &bit_no, len);
                int dist = readCount(in, &bit_no, len);
                int ctx = readCount(in, &bit_no, len);
                struct lnk_lst *cur_line = prev_lines;
-               while (ctx--)
+               if (dict_len < 0 || dist < 0 || ctx < 0)
+                 return -1;
+               dict_len += NICE_LEN_FOR_OTHER;
+               if (dict_len > out_len - ol)
+                 return -1;
+               while (cur_line && ctx--)
                  cur_line = cur_line->previous;
+               if (!cur_line)
+                 return -1;
                memmove(out + ol, cur_line->data + dist, dict_len);
                ol += dict_len;
              }
              continue;
            case 9: {
              int count = readCount(in, &bit_no, len);
+             if (count < 0 || ol == 0 || count + 4 > out_len - ol)
+               return -1;
              count += 4;
              char rpt_c = out[ol - 1];
              while (count--)
@@ -485,6 +517,8 @@ int shox96_0_2_decompress(const char *in, int len, char *out, struct lnk_lst *pr
          }
       }
     }
+    if (ol >= out_len)
+      return -1;
     out[ol++] = c;
   }
 
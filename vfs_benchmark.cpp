@@ -0,0 +1,1875 @@
+/*
+ * vfs_benchmark.cpp
+ *
+ * On-target benchmarks for the esp32 sqlite3 VFS. Results are printed over
+ * UART, run them with the VFS debug output disabled.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include "sqlite3.h"
+#include "lfs_port.h"
+#include "esp32_vfs.h"
+#include "esp32_partition.h"
+#include "esp32_blob.h"
+#include "esp32_ingest.h"
+#include "esp32_stmt_cache.h"
+#include "esp32_profile.h"
+#include "esp32_series.h"
+#include "esp32_logfile.h"
+#include "esp32_logring.h"
+#include "vfs_benchmark.h"
+
+/*
+ * Counting shim: a pass-through VFS named "bench" on top of "esp32" that
+ * counts syncs and journal traffic, and can hide the device characteristics
+ * to reproduce the old worst-case reporting (sector 512, iocap 0).
+ */
+typedef struct bench_file {
+    sqlite3_file base;
+    sqlite3_file *real;
+    int flags;
+} bench_file;
+
+typedef struct bench_counters {
+    int syncs;
+    int64_t journal_bytes;
+    int64_t db_bytes;
+} bench_counters;
+
+static sqlite3_vfs *bench_real_vfs;
+static bench_counters bench_io;
+static bool bench_legacy_iocap;
+static int bench_last_iocap;
+
+static int bench_Close(sqlite3_file *id)
+{
+    bench_file *p = (bench_file *) id;
+    return p->real->pMethods->xClose(p->real);
+}
+
+static int bench_Read(sqlite3_file *id, void *buffer, int amount, sqlite3_int64 offset)
+{
+    bench_file *p = (bench_file *) id;
+    return p->real->pMethods->xRead(p->real, buffer, amount, offset);
+}
+
+static int bench_Write(sqlite3_file *id, const void *buffer, int amount, sqlite3_int64 offset)
+{
+    bench_file *p = (bench_file *) id;
+    if (p->flags & (SQLITE_OPEN_MAIN_JOURNAL | SQLITE_OPEN_WAL))
+        bench_io.journal_bytes += amount;
+    else
+        bench_io.db_bytes += amount;
+    return p->real->pMethods->xWrite(p->real, buffer, amount, offset);
+}
+
+static int bench_Truncate(sqlite3_file *id, sqlite3_int64 size)
+{
+    bench_file *p = (bench_file *) id;
+    return p->real->pMethods->xTruncate(p->real, size);
+}
+
+static int bench_Sync(sqlite3_file *id, int flags)
+{
+    bench_file *p = (bench_file *) id;
+    bench_io.syncs++;
+    return p->real->pMethods->xSync(p->real, flags);
+}
+
+static int bench_FileSize(sqlite3_file *id, sqlite3_int64 *size)
+{
+    bench_file *p = (bench_file *) id;
+    return p->real->pMethods->xFileSize(p->real, size);
+}
+
+static int bench_Lock(sqlite3_file *id, int lock)
+{
+    bench_file *p = (bench_file *) id;
+    return p->real->pMethods->xLock(p->real, lock);
+}
+
+static int bench_Unlock(sqlite3_file *id, int lock)
+{
+    bench_file *p = (bench_file *) id;
+    return p->real->pMethods->xUnlock(p->real, lock);
+}
+
+static int bench_CheckReservedLock(sqlite3_file *id, int *result)
+{
+    bench_file *p = (bench_file *) id;
+    return p->real->pMethods->xCheckReservedLock(p->real, result);
+}
+
+static int bench_FileControl(sqlite3_file *id, int op, void *arg)
+{
+    bench_file *p = (bench_file *) id;
+    return p->real->pMethods->xFileControl(p->real, op, arg);
+}
+
+static int bench_SectorSize(sqlite3_file *id)
+{
+    bench_file *p = (bench_file *) id;
+    return bench_legacy_iocap ? 512 : p->real->pMethods->xSectorSize(p->real);
+}
+
+static int bench_DeviceCharacteristics(sqlite3_file *id)
+{
+    bench_file *p = (bench_file *) id;
+    bench_last_iocap = bench_legacy_iocap ? 0 : p->real->pMethods->xDeviceCharacteristics(p->real);
+    return bench_last_iocap;
+}
+
+static const sqlite3_io_methods bench_io_methods = {
+        1,
+        bench_Close,
+        bench_Read,
+        bench_Write,
+        bench_Truncate,
+        bench_Sync,
+        bench_FileSize,
+        bench_Lock,
+        bench_Unlock,
+        bench_CheckReservedLock,
+        bench_FileControl,
+        bench_SectorSize,
+        bench_DeviceCharacteristics
+};
+
+static int bench_Open(sqlite3_vfs *vfs, const char *path, sqlite3_file *file, int flags, int *outflags)
+{
+    bench_file *p = (bench_file *) file;
+    int rc;
+
+    p->real = (sqlite3_file *) &p[1];
+    p->flags = flags;
+    rc = bench_real_vfs->xOpen(bench_real_vfs, path, p->real, flags, outflags);
+    p->base.pMethods = (rc == SQLITE_OK) ? &bench_io_methods : NULL;
+    return rc;
+}
+
+static int bench_Delete(sqlite3_vfs *vfs, const char *path, int syncDir)
+{
+    return bench_real_vfs->xDelete(bench_real_vfs, path, syncDir);
+}
+
+static int bench_Access(sqlite3_vfs *vfs, const char *path, int flags, int *result)
+{
+    return bench_real_vfs->xAccess(bench_real_vfs, path, flags, result);
+}
+
+static int bench_FullPathname(sqlite3_vfs *vfs, const char *path, int len, char *fullpath)
+{
+    return bench_real_vfs->xFullPathname(bench_real_vfs, path, len, fullpath);
+}
+
+static int bench_Randomness(sqlite3_vfs *vfs, int len, char *buffer)
+{
+    return bench_real_vfs->xRandomness(bench_real_vfs, len, buffer);
+}
+
+static int bench_Sleep(sqlite3_vfs *vfs, int microseconds)
+{
+    return bench_real_vfs->xSleep(bench_real_vfs, microseconds);
+}
+
+static int bench_CurrentTime(sqlite3_vfs *vfs, double *result)
+{
+    return bench_real_vfs->xCurrentTime(bench_real_vfs, result);
+}
+
+static sqlite3_vfs bench_vfs = {
+        1,                      // iVersion
+        0,                      // szOsFile, set on register
+        0,                      // mxPathname, set on register
+        NULL,                   // pNext
+        "bench",                // name
+        NULL,                   // pAppData
+        bench_Open,             // xOpen
+        bench_Delete,           // xDelete
+        bench_Access,           // xAccess
+        bench_FullPathname,     // xFullPathname
+        NULL,                   // xDlOpen
+        NULL,                   // xDlError
+        NULL,                   // xDlSym
+        NULL,                   // xDlClose
+        bench_Randomness,       // xRandomness
+        bench_Sleep,            // xSleep
+        bench_CurrentTime,      // xCurrentTime
+        NULL                    // xGetLastError
+};
+
+/**
+ * Register the counting shim once, on top of the esp32 VFS
+ * @return true when the "bench" VFS is usable
+ */
+static bool bench_vfs_register(void)
+{
+    if (bench_real_vfs)
+        return true;
+    bench_real_vfs = sqlite3_vfs_find("esp32");
+    if (!bench_real_vfs)
+        return false;
+    bench_vfs.szOsFile = sizeof(bench_file) + bench_real_vfs->szOsFile;
+    bench_vfs.mxPathname = bench_real_vfs->mxPathname;
+    return sqlite3_vfs_register(&bench_vfs, 0) == SQLITE_OK;
+}
+
+/**
+ * Remove a database and its side files so every run starts from scratch
+ * @param path database path
+ */
+static void bench_remove_db(const char *path)
+{
+    char side[64];
+
+    lfs_remove(&lfs_filesystem, path);
+    snprintf(side, sizeof(side), "%s-wal", path);
+    lfs_remove(&lfs_filesystem, side);
+    snprintf(side, sizeof(side), "%s-journal", path);
+    lfs_remove(&lfs_filesystem, side);
+}
+
+/**
+ * Insert sensor-like rows in batches and report rows per second
+ * @param path database path
+ * @param wal use WAL journal mode instead of the rollback journal
+ * @param rows total rows
+ * @param batch rows per transaction
+ * @param chunk SQLITE_FCNTL_CHUNK_SIZE of the database, 0 to grow page by page
+ * @return rows per second, negative on error
+ */
+static double bench_insert_rate(const char *path, bool wal, int rows, int batch, int chunk)
+{
+    sqlite3 *db;
+    sqlite3_stmt *stmt;
+    int64_t start, elapsed;
+    int rc;
+
+    bench_remove_db(path);
+    if (sqlite3_open(path, &db) != SQLITE_OK) {
+        printf("[BENCH]Cannot open %s: %s\n", path, sqlite3_errmsg(db));
+        sqlite3_close(db);
+        return -1;
+    }
+    if (wal && esp32_vfs_wal_enable(db, 1000) != SQLITE_OK) {
+        printf("[BENCH]Cannot enable WAL on %s\n", path);
+        sqlite3_close(db);
+        return -1;
+    }
+    if (chunk)
+        sqlite3_file_control(db, "main", SQLITE_FCNTL_CHUNK_SIZE, &chunk);
+    sqlite3_exec(db, "CREATE TABLE samples(ts INTEGER, sensor INTEGER, value REAL)",
+                 NULL, NULL, NULL);
+    sqlite3_prepare_v2(db, "INSERT INTO samples VALUES(?1, ?2, ?3)", -1, &stmt, NULL);
+
+    start = esp_timer_get_time();
+    for (int i = 0; i < rows; i += batch) {
+        sqlite3_exec(db, "BEGIN", NULL, NULL, NULL);
+        for (int j = i; j < i + batch && j < rows; j++) {
+            sqlite3_bind_int64(stmt, 1, 1650000000LL + j);
+            sqlite3_bind_int(stmt, 2, j % 8);
+            sqlite3_bind_double(stmt, 3, (j % 1000) * 0.125);
+            rc = sqlite3_step(stmt);
+            sqlite3_reset(stmt);
+            if (rc != SQLITE_DONE) {
+                printf("[BENCH]Insert failed at row %d: %s\n", j, sqlite3_errmsg(db));
+                sqlite3_finalize(stmt);
+                sqlite3_close(db);
+                return -1;
+            }
+        }
+        sqlite3_exec(db, "COMMIT", NULL, NULL, NULL);
+    }
+    if (wal)
+        esp32_vfs_wal_checkpoint(db, NULL);
+    elapsed = esp_timer_get_time() - start;
+
+    sqlite3_finalize(stmt);
+    sqlite3_close(db);
+    bench_remove_db(path);
+
+    return elapsed > 0 ? rows * 1000000.0 / elapsed : 0;
+}
+
+void vfs_benchmark_wal(int rows, int batch)
+{
+    double journal = bench_insert_rate("bench_journal.db", false, rows, batch, 0);
+    double wal = bench_insert_rate("bench_wal.db", true, rows, batch, 0);
+
+    printf("[BENCH]insert %d rows, %d per txn: journal %.1f rows/s, wal %.1f rows/s\n",
+           rows, batch, journal, wal);
+}
+
+/**
+ * Run small update transactions through the counting shim
+ * @param legacy report sector 512 and no iocap flags, as the VFS used to
+ * @param txns number of transactions
+ * @param counters receives the totals
+ * @return 0 on success
+ */
+static int bench_sync_run(bool legacy, int txns, bench_counters *counters)
+{
+    const char *path = "bench_iocap.db";
+    sqlite3 *db;
+    sqlite3_stmt *stmt;
+    int rc = 0;
+
+    bench_remove_db(path);
+    bench_legacy_iocap = legacy;
+    if (sqlite3_open_v2(path, &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, "bench") != SQLITE_OK) {
+        printf("[BENCH]Cannot open %s: %s\n", path, sqlite3_errmsg(db));
+        sqlite3_close(db);
+        return -1;
+    }
+    sqlite3_exec(db, "CREATE TABLE kv(k INTEGER PRIMARY KEY, v INTEGER)", NULL, NULL, NULL);
+    sqlite3_prepare_v2(db, "INSERT INTO kv VALUES(?1, 0)", -1, &stmt, NULL);
+    sqlite3_exec(db, "BEGIN", NULL, NULL, NULL);
+    for (int k = 1; k <= 2000; k++) {
+        sqlite3_bind_int(stmt, 1, k);
+        sqlite3_step(stmt);
+        sqlite3_reset(stmt);
+    }
+    sqlite3_exec(db, "COMMIT", NULL, NULL, NULL);
+    sqlite3_finalize(stmt);
+    sqlite3_prepare_v2(db, "UPDATE kv SET v = v + 1 WHERE k = ?1", -1, &stmt, NULL);
+
+    memset(&bench_io, 0, sizeof(bench_io));
+    for (int i = 0; i < txns; i++) {
+        /* spread the updates so each transaction touches a fresh leaf */
+        sqlite3_bind_int(stmt, 1, 1 + (i * 97) % 2000);
+        if (sqlite3_step(stmt) != SQLITE_DONE) {
+            printf("[BENCH]Update failed: %s\n", sqlite3_errmsg(db));
+            rc = -1;
+            break;
+        }
+        sqlite3_reset(stmt);
+    }
+    *counters = bench_io;
+
+    sqlite3_finalize(stmt);
+    sqlite3_close(db);
+    bench_remove_db(path);
+    bench_legacy_iocap = false;
+    return rc;
+}
+
+void vfs_benchmark_growth(int rows, int batch)
+{
+    double pages = bench_insert_rate("bench_growth.db", false, rows, batch, 0);
+    double chunked = bench_insert_rate("bench_growth.db", false, rows, batch, 8192);
+
+    printf("[BENCH]insert %d rows, %d per txn: page by page %.1f rows/s, 8 KiB chunks %.1f rows/s\n",
+           rows, batch, pages, chunked);
+}
+
+void vfs_benchmark_iocap(int txns)
+{
+    bench_counters legacy, reported;
+
+    if (txns <= 0 || !bench_vfs_register()) {
+        printf("[BENCH]Counting VFS unavailable\n");
+        return;
+    }
+    if (bench_sync_run(true, txns, &legacy) || bench_sync_run(false, txns, &reported))
+        return;
+
+    printf("[BENCH]%d txns, iocap 0: %.2f syncs/txn, %lld journal B/txn, %lld db B/txn\n",
+           txns, (double) legacy.syncs / txns, legacy.journal_bytes / txns, legacy.db_bytes / txns);
+    printf("[BENCH]%d txns, iocap 0x%x: %.2f syncs/txn, %lld journal B/txn, %lld db B/txn\n",
+           txns, bench_last_iocap,
+           (double) reported.syncs / txns, reported.journal_bytes / txns, reported.db_bytes / txns);
+}
+
+/**
+ * First column of the first row of a query as an integer, -1 on error
+ */
+static sqlite3_int64 bench_query_int(sqlite3 *db, const char *sql)
+{
+    sqlite3_stmt *stmt;
+    sqlite3_int64 value = -1;
+
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK)
+        return -1;
+    if (sqlite3_step(stmt) == SQLITE_ROW)
+        value = sqlite3_column_int64(stmt, 0);
+    sqlite3_finalize(stmt);
+    return value;
+}
+
+void vfs_benchmark_io_stats(int rows)
+{
+    const char *path = "bench_io.db", *aux = "bench_io_aux.db";
+    sqlite3 *db;
+    sqlite3_stmt *stmt;
+    sqlite3_int64 listed, named, aux_writes;
+
+    bench_remove_db(path);
+    bench_remove_db(aux);
+    if (sqlite3_open(path, &db) != SQLITE_OK) {
+        printf("[BENCH]Cannot open %s: %s\n", path, sqlite3_errmsg(db));
+        sqlite3_close(db);
+        return;
+    }
+    sqlite3_exec(db, "ATTACH 'bench_io_aux.db' AS aux;"
+                     "CREATE TABLE samples(ts INTEGER, value REAL);"
+                     "CREATE TABLE aux.samples(ts INTEGER, value REAL)", NULL, NULL, NULL);
+    sqlite3_exec(db, "BEGIN", NULL, NULL, NULL);
+    sqlite3_prepare_v2(db, "INSERT INTO samples VALUES(?1, ?2)", -1, &stmt, NULL);
+    for (int i = 0; i < rows; i++) {
+        sqlite3_bind_int64(stmt, 1, 1650000000LL + i);
+        sqlite3_bind_double(stmt, 2, i * 0.5);
+        sqlite3_step(stmt);
+        sqlite3_reset(stmt);
+    }
+    sqlite3_finalize(stmt);
+    sqlite3_exec(db, "INSERT INTO aux.samples SELECT * FROM samples; COMMIT", NULL, NULL, NULL);
+
+    listed = bench_query_int(db, "SELECT count(*) FROM esp32_io_stats");
+    named = bench_query_int(db, "SELECT count(*) FROM esp32_io_stats WHERE schema IN ('main', 'aux')");
+    aux_writes = bench_query_int(db, "SELECT sum(writes) FROM esp32_io_stats WHERE schema = 'aux' AND file = 'db'");
+
+    sqlite3_close(db);
+    bench_remove_db(path);
+    bench_remove_db(aux);
+
+    printf("[BENCH]io_stats %d rows: %lld files of main and temp, %lld of main and aux, %lld writes to aux%s\n",
+           rows, (long long) listed, (long long) named, (long long) aux_writes,
+           listed >= 1 && named >= 2 && aux_writes > 0 ? "" : " FAILED");
+}
+
+/**
+ * One row of the page size matrix: insert, point lookup and range scan
+ * @param page_size database page size
+ * @param rows rows in the table
+ */
+static void bench_page_size_row(int page_size, int rows)
+{
+    const char *path = "bench_page.db";
+    const int lookups = 1000, scans = 10;
+    sqlite3 *db;
+    sqlite3_stmt *stmt;
+    int64_t start, insert_us, lookup_us, scan_us;
+    int64_t scanned = 0;
+    uint32_t seed = 12345;
+    struct lfs_info info;
+
+    bench_remove_db(path);
+    if (sqlite3_open(path, &db) != SQLITE_OK || esp32_vfs_set_page_size(db, page_size) != SQLITE_OK) {
+        printf("[BENCH]%5d: cannot open %s: %s\n", page_size, path, sqlite3_errmsg(db));
+        sqlite3_close(db);
+        return;
+    }
+    sqlite3_exec(db, "CREATE TABLE samples(id INTEGER PRIMARY KEY, ts INTEGER, value REAL, tag TEXT);"
+                     "CREATE INDEX samples_ts ON samples(ts)", NULL, NULL, NULL);
+
+    sqlite3_prepare_v2(db, "INSERT INTO samples VALUES(?1, ?2, ?3, 'sensor')", -1, &stmt, NULL);
+    start = esp_timer_get_time();
+    sqlite3_exec(db, "BEGIN", NULL, NULL, NULL);
+    for (int i = 1; i <= rows; i++) {
+        sqlite3_bind_int(stmt, 1, i);
+        sqlite3_bind_int64(stmt, 2, 1650000000LL + i * 10);
+        sqlite3_bind_double(stmt, 3, (i % 1000) * 0.125);
+        sqlite3_step(stmt);
+        sqlite3_reset(stmt);
+        if (i % 500 == 0)
+            sqlite3_exec(db, "COMMIT; BEGIN", NULL, NULL, NULL);
+    }
+    sqlite3_exec(db, "COMMIT", NULL, NULL, NULL);
+    insert_us = esp_timer_get_time() - start;
+    sqlite3_finalize(stmt);
+
+    sqlite3_prepare_v2(db, "SELECT value FROM samples WHERE id = ?1", -1, &stmt, NULL);
+    start = esp_timer_get_time();
+    for (int i = 0; i < lookups; i++) {
+        seed = seed * 1103515245u + 12345u;
+        sqlite3_bind_int(stmt, 1, 1 + (int) ((seed >> 8) % rows));
+        sqlite3_step(stmt);
+        sqlite3_reset(stmt);
+    }
+    lookup_us = esp_timer_get_time() - start;
+    sqlite3_finalize(stmt);
+
+    sqlite3_prepare_v2(db, "SELECT value FROM samples WHERE ts BETWEEN ?1 AND ?2", -1, &stmt, NULL);
+    start = esp_timer_get_time();
+    for (int i = 0; i < scans; i++) {
+        int64_t from = 1650000000LL + (int64_t) (i * rows / scans) * 10;
+        sqlite3_bind_int64(stmt, 1, from);
+        sqlite3_bind_int64(stmt, 2, from + (rows / scans) * 10);
+        while (sqlite3_step(stmt) == SQLITE_ROW)
+            scanned++;
+        sqlite3_reset(stmt);
+    }
+    scan_us = esp_timer_get_time() - start;
+    sqlite3_finalize(stmt);
+    sqlite3_close(db);
+
+    memset(&info, 0, sizeof(info));
+    lfs_stat(&lfs_filesystem, path, &info);
+    bench_remove_db(path);
+
+    printf("[BENCH]%5d | %10.1f | %10.1f | %10.1f | %8u\n", page_size,
+           insert_us > 0 ? rows * 1000000.0 / insert_us : 0,
+           (double) lookup_us / lookups,
+           scan_us > 0 ? scanned * 1000000.0 / scan_us : 0,
+           (unsigned) info.size);
+}
+
+/**
+ * Rebuild a filled database from 4096 to 1024 byte pages and check that
+ * every row survived
+ * @param rows rows in the table
+ */
+static void bench_page_size_rebuild(int rows)
+{
+    const char *path = "bench_page.db";
+    sqlite3 *db;
+    sqlite3_stmt *stmt;
+    int64_t start, rebuild_us;
+    int rc, page_size = 0, count = 0;
+
+    bench_remove_db(path);
+    if (sqlite3_open(path, &db) != SQLITE_OK || esp32_vfs_set_page_size(db, 4096) != SQLITE_OK) {
+        printf("[BENCH]rebuild: cannot open %s: %s\n", path, sqlite3_errmsg(db));
+        sqlite3_close(db);
+        return;
+    }
+    sqlite3_exec(db, "CREATE TABLE samples(id INTEGER PRIMARY KEY, ts INTEGER, value REAL, tag TEXT)", NULL, NULL, NULL);
+    sqlite3_prepare_v2(db, "INSERT INTO samples VALUES(?1, ?2, ?3, 'sensor')", -1, &stmt, NULL);
+    sqlite3_exec(db, "BEGIN", NULL, NULL, NULL);
+    for (int i = 1; i <= rows; i++) {
+        sqlite3_bind_int(stmt, 1, i);
+        sqlite3_bind_int64(stmt, 2, 1650000000LL + i * 10);
+        sqlite3_bind_double(stmt, 3, (i % 1000) * 0.125);
+        sqlite3_step(stmt);
+        sqlite3_reset(stmt);
+    }
+    sqlite3_exec(db, "COMMIT", NULL, NULL, NULL);
+    sqlite3_finalize(stmt);
+    sqlite3_close(db);
+
+    /* reopened, so the database is an existing, non-empty one */
+    sqlite3_open(path, &db);
+    start = esp_timer_get_time();
+    rc = esp32_vfs_set_page_size(db, 1024);
+    rebuild_us = esp_timer_get_time() - start;
+    sqlite3_prepare_v2(db, "PRAGMA page_size", -1, &stmt, NULL);
+    if (sqlite3_step(stmt) == SQLITE_ROW)
+        page_size = sqlite3_column_int(stmt, 0);
+    sqlite3_finalize(stmt);
+    sqlite3_prepare_v2(db, "SELECT count(*) FROM samples", -1, &stmt, NULL);
+    if (sqlite3_step(stmt) == SQLITE_ROW)
+        count = sqlite3_column_int(stmt, 0);
+    sqlite3_finalize(stmt);
+    sqlite3_close(db);
+    bench_remove_db(path);
+
+    printf("[BENCH]rebuild 4096 -> %d: rc %d, %d/%d rows, %lld ms%s\n", page_size, rc, count, rows,
+           (long long) (rebuild_us / 1000), rc == SQLITE_OK && page_size == 1024 && count == rows ? "" : " FAILED");
+}
+
+void vfs_benchmark_page_size(int rows)
+{
+    printf("[BENCH] page | insert r/s | lookup us  |  scan r/s  |  file B\n");
+    for (int page_size = 512; page_size <= 8192; page_size <<= 1)
+        bench_page_size_row(page_size, rows);
+    bench_page_size_rebuild(rows);
+}
+
+/**
+ * One row of the compression table: bulk insert, full scan and the size on
+ * the card for a codec of the esp32-zip VFS
+ * @param codec codec URI parameter, NULL for the plain esp32 VFS
+ * @param rows rows in the table
+ */
+static void bench_zip_row(const char *codec, int rows)
+{
+    const char *path = "bench_zip.db";
+    char uri[64];
+    sqlite3 *db;
+    sqlite3_stmt *stmt;
+    int64_t start, insert_us, scan_us, scanned = 0;
+    sqlite3_int64 logical = 0;
+    struct lfs_info info;
+
+    bench_remove_db(path);
+    snprintf(uri, sizeof(uri), "file:%s?codec=%s", path, codec ? codec : "none");
+    if (sqlite3_open_v2(uri, &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_URI,
+                        codec ? ESP32_VFS_ZIP : NULL) != SQLITE_OK) {
+        printf("[BENCH]%-6s: cannot open %s: %s\n", codec ? codec : "plain", path, sqlite3_errmsg(db));
+        sqlite3_close(db);
+        return;
+    }
+    sqlite3_exec(db, "CREATE TABLE samples(id INTEGER PRIMARY KEY, ts INTEGER, sensor INTEGER, "
+                     "value REAL, tag TEXT)", NULL, NULL, NULL);
+
+    sqlite3_prepare_v2(db, "INSERT INTO samples VALUES(?1, ?2, ?3, ?4, ?5)", -1, &stmt, NULL);
+    start = esp_timer_get_time();
+    sqlite3_exec(db, "BEGIN", NULL, NULL, NULL);
+    for (int i = 1; i <= rows; i++) {
+        sqlite3_bind_int(stmt, 1, i);
+        sqlite3_bind_int64(stmt, 2, 1650000000LL + i * 10);
+        sqlite3_bind_int(stmt, 3, i % 8);
+        sqlite3_bind_double(stmt, 4, 20.0 + (i % 200) * 0.05);
+        sqlite3_bind_text(stmt, 5, i % 8 < 4 ? "temperature" : "humidity", -1, SQLITE_STATIC);
+        sqlite3_step(stmt);
+        sqlite3_reset(stmt);
+        if (i % 500 == 0)
+            sqlite3_exec(db, "COMMIT; BEGIN", NULL, NULL, NULL);
+    }
+    sqlite3_exec(db, "COMMIT", NULL, NULL, NULL);
+    insert_us = esp_timer_get_time() - start;
+    sqlite3_finalize(stmt);
+
+    sqlite3_prepare_v2(db, "SELECT sum(value) FROM samples", -1, &stmt, NULL);
+    start = esp_timer_get_time();
+    sqlite3_step(stmt);
+    scan_us = esp_timer_get_time() - start;
+    sqlite3_finalize(stmt);
+
+    sqlite3_prepare_v2(db, "SELECT count(*) FROM samples", -1, &stmt, NULL);
+    if (sqlite3_step(stmt) == SQLITE_ROW)
+        scanned = sqlite3_column_int64(stmt, 0);
+    sqlite3_finalize(stmt);
+
+    sqlite3_prepare_v2(db, "SELECT page_count * page_size FROM pragma_page_count, pragma_page_size",
+                       -1, &stmt, NULL);
+    if (sqlite3_step(stmt) == SQLITE_ROW)
+        logical = sqlite3_column_int64(stmt, 0);
+    sqlite3_finalize(stmt);
+    sqlite3_close(db);
+
+    memset(&info, 0, sizeof(info));
+    lfs_stat(&lfs_filesystem, path, &info);
+    bench_remove_db(path);
+
+    printf("[BENCH]%-6s | %10.1f | %10.1f | %9lld | %9u | %5.2f\n", codec ? codec : "plain",
+           insert_us > 0 ? rows * 1000000.0 / insert_us : 0,
+           scan_us > 0 ? scanned * 1000000.0 / scan_us : 0,
+           (long long) logical, (unsigned) info.size,
+           info.size ? (double) logical / info.size : 0);
+}
+
+void vfs_benchmark_zip(int rows)
+{
+    printf("[BENCH]codec  | insert r/s |  scan r/s  | logical B |  file B   | ratio\n");
+    bench_zip_row(NULL, rows);
+    bench_zip_row("none", rows);
+    bench_zip_row("lzf", rows);
+    bench_zip_row("shox96", rows);
+}
+
+/**
+ * Write, sync and read back a main database file page by page straight
+ * through a VFS, below the pager, so only VFS cost is measured
+ * @param vfs_name VFS to measure
+ * @param pages number of pages
+ * @param page_size bytes per page
+ * @param write_us receives the write and sync time
+ * @param read_us receives the read time
+ * @return 0 on success
+ */
+static int bench_crypt_run(const char *vfs_name, int pages, int page_size, int64_t *write_us, int64_t *read_us)
+{
+    /* double nul: the VFS may look for URI parameters after the name */
+    static const char path[] = "bench_crypt.db\0";
+    const int flags = SQLITE_OPEN_MAIN_DB | SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE;
+    sqlite3_vfs *vfs = sqlite3_vfs_find(vfs_name);
+    sqlite3_file *file;
+    unsigned char *page;
+    int64_t start;
+    int rc = SQLITE_OK;
+
+    if (!vfs)
+        return -1;
+    file = (sqlite3_file *) sqlite3_malloc(vfs->szOsFile);
+    page = (unsigned char *) sqlite3_malloc(page_size);
+    if (!file || !page || vfs->xOpen(vfs, path, file, flags, NULL) != SQLITE_OK) {
+        sqlite3_free(file);
+        sqlite3_free(page);
+        return -1;
+    }
+
+    start = esp_timer_get_time();
+    for (int i = 0; i < pages && rc == SQLITE_OK; i++) {
+        memset(page, i, page_size);
+        rc = file->pMethods->xWrite(file, page, page_size, (sqlite3_int64) i * page_size);
+    }
+    if (rc == SQLITE_OK)
+        rc = file->pMethods->xSync(file, SQLITE_SYNC_NORMAL);
+    *write_us = esp_timer_get_time() - start;
+
+    start = esp_timer_get_time();
+    for (int i = 0; i < pages && rc == SQLITE_OK; i++) {
+        rc = file->pMethods->xRead(file, page, page_size, (sqlite3_int64) i * page_size);
+        if (rc == SQLITE_OK && (page[0] != (unsigned char) i || page[page_size - 1] != (unsigned char) i))
+            rc = SQLITE_CORRUPT;
+    }
+    *read_us = esp_timer_get_time() - start;
+
+    file->pMethods->xClose(file);
+    sqlite3_free(file);
+    sqlite3_free(page);
+    bench_remove_db("bench_crypt.db");
+    return rc == SQLITE_OK ? 0 : -1;
+}
+
+/**
+ * Write the same frame to the same WAL offset before and after a restart
+ * of the WAL through the esp32-crypt VFS; the ciphertext on the card must
+ * differ and both must read back as the plaintext
+ * @param page_size bytes per frame
+ * @return 0 on success
+ */
+static int bench_crypt_wal_rewrite(int page_size)
+{
+    static const char path[] = "bench_crypt.db-wal\0";
+    const int flags = SQLITE_OPEN_WAL | SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE;
+    sqlite3_vfs *vfs = sqlite3_vfs_find(ESP32_VFS_CRYPT);
+    sqlite3_file *file;
+    unsigned char header[32], *page, *cipher[2];
+    lfs_file_t raw;
+    int rc = SQLITE_OK;
+
+    if (!vfs)
+        return -1;
+    file = (sqlite3_file *) sqlite3_malloc(vfs->szOsFile);
+    page = (unsigned char *) sqlite3_malloc(page_size);
+    cipher[0] = (unsigned char *) sqlite3_malloc(page_size);
+    cipher[1] = (unsigned char *) sqlite3_malloc(page_size);
+    if (!file || !page || !cipher[0] || !cipher[1] || vfs->xOpen(vfs, path, file, flags, NULL) != SQLITE_OK) {
+        sqlite3_free(file);
+        sqlite3_free(page);
+        sqlite3_free(cipher[0]);
+        sqlite3_free(cipher[1]);
+        return -1;
+    }
+
+    memset(header, 0x37, sizeof(header));
+    for (int round = 0; round < 2 && rc == SQLITE_OK; round++) {
+        /* the WAL header at offset 0 is written again after each checkpoint */
+        memset(page, 0xA5, page_size);
+        rc = file->pMethods->xWrite(file, header, sizeof(header), 0);
+        if (rc == SQLITE_OK)
+            rc = file->pMethods->xWrite(file, page, page_size, sizeof(header));
+        if (rc == SQLITE_OK)
+            rc = file->pMethods->xSync(file, SQLITE_SYNC_NORMAL);
+        if (rc == SQLITE_OK)
+            rc = file->pMethods->xRead(file, page, page_size, sizeof(header));
+        if (rc == SQLITE_OK && (page[0] != 0xA5 || page[page_size - 1] != 0xA5))
+            rc = SQLITE_CORRUPT;
+
+        /* the frame is the tail of the file on the card */
+        if (rc == SQLITE_OK && lfs_file_open(&lfs_filesystem, &raw, "bench_crypt.db-wal", LFS_O_RDONLY) >= 0) {
+            lfs_file_seek(&lfs_filesystem, &raw, -page_size, LFS_SEEK_END);
+            if (lfs_file_read(&lfs_filesystem, &raw, cipher[round], page_size) != page_size)
+                rc = SQLITE_IOERR;
+            lfs_file_close(&lfs_filesystem, &raw);
+        } else if (rc == SQLITE_OK) {
+            rc = SQLITE_IOERR;
+        }
+    }
+    if (rc == SQLITE_OK && memcmp(cipher[0], cipher[1], page_size) == 0)
+        rc = SQLITE_ERROR;
+
+    file->pMethods->xClose(file);
+    sqlite3_free(file);
+    sqlite3_free(page);
+    sqlite3_free(cipher[0]);
+    sqlite3_free(cipher[1]);
+    bench_remove_db("bench_crypt.db");
+    return rc == SQLITE_OK ? 0 : -1;
+}
+
+void vfs_benchmark_crypt(int pages, int page_size)
+{
+    static const unsigned char key[32] = {
+            0x10, 0x32, 0x54, 0x76, 0x98, 0xba, 0xdc, 0xfe, 0x01, 0x23, 0x45, 0x67, 0x89, 0xab, 0xcd, 0xef,
+            0xef, 0xcd, 0xab, 0x89, 0x67, 0x45, 0x23, 0x01, 0xfe, 0xdc, 0xba, 0x98, 0x76, 0x54, 0x32, 0x10};
+    int64_t plain_w, plain_r, crypt_w, crypt_r;
+    double mb = (double) pages * page_size / (1024.0 * 1024.0);
+
+    esp32_vfs_crypt_key(key, sizeof(key));
+    if (bench_crypt_run("esp32", pages, page_size, &plain_w, &plain_r) ||
+        bench_crypt_run(ESP32_VFS_CRYPT, pages, page_size, &crypt_w, &crypt_r)) {
+        printf("[BENCH]crypt: run failed\n");
+        esp32_vfs_crypt_key(NULL, 0);
+        return;
+    }
+    printf("[BENCH]crypt WAL frame rewritten after a restart: %s\n",
+           bench_crypt_wal_rewrite(page_size) ? "same ciphertext FAILED" : "new ciphertext");
+    esp32_vfs_crypt_key(NULL, 0);
+
+    printf("[BENCH]crypt %d x %d B: write %.2f -> %.2f MB/s (%+.1f%%), read %.2f -> %.2f MB/s (%+.1f%%), target < 10%%\n",
+           pages, page_size,
+           mb * 1000000.0 / plain_w, mb * 1000000.0 / crypt_w, 100.0 * (crypt_w - plain_w) / plain_w,
+           mb * 1000000.0 / plain_r, mb * 1000000.0 / crypt_r, 100.0 * (crypt_r - plain_r) / plain_r);
+}
+
+void vfs_benchmark_pcache(int rows)
+{
+    const char *path = "bench_pcache.db";
+    const int lookups = 2000;
+    static const int sizes[] = {16, 64, 256, 1024};
+    esp32_pcache_stats_t stats;
+    sqlite3 *db;
+    sqlite3_stmt *stmt;
+    int min_pages;
+
+    esp32_vfs_pcache_stats(&stats, 0);
+    if (!stats.slabs_total) {
+        printf("[BENCH]pcache: PSRAM page cache not installed\n");
+        return;
+    }
+
+    bench_remove_db(path);
+    if (sqlite3_open(path, &db) != SQLITE_OK) {
+        printf("[BENCH]Cannot open %s: %s\n", path, sqlite3_errmsg(db));
+        sqlite3_close(db);
+        return;
+    }
+    sqlite3_exec(db, "CREATE TABLE samples(id INTEGER PRIMARY KEY, ts INTEGER, value REAL, tag TEXT)",
+                 NULL, NULL, NULL);
+    sqlite3_prepare_v2(db, "INSERT INTO samples VALUES(?1, ?2, ?3, 'sensor')", -1, &stmt, NULL);
+    sqlite3_exec(db, "BEGIN", NULL, NULL, NULL);
+    for (int i = 1; i <= rows; i++) {
+        sqlite3_bind_int(stmt, 1, i);
+        sqlite3_bind_int64(stmt, 2, 1650000000LL + i * 10);
+        sqlite3_bind_double(stmt, 3, (i % 1000) * 0.125);
+        sqlite3_step(stmt);
+        sqlite3_reset(stmt);
+    }
+    sqlite3_exec(db, "COMMIT", NULL, NULL, NULL);
+    sqlite3_finalize(stmt);
+
+    min_pages = esp32_vfs_pcache_set_pages(0);
+    printf("[BENCH]pages | hit %%  | lookup us | evictions | slabs\n");
+    sqlite3_prepare_v2(db, "SELECT value FROM samples WHERE id = ?1", -1, &stmt, NULL);
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        uint32_t seed = 12345;
+        int64_t start, elapsed;
+
+        esp32_vfs_pcache_set_pages(sizes[s]);
+        sqlite3_exec(db, "PRAGMA cache_size = 1", NULL, NULL, NULL);
+        esp32_vfs_pcache_stats(&stats, 1);
+
+        start = esp_timer_get_time();
+        for (int i = 0; i < lookups; i++) {
+            /* skewed keys: most lookups hit the newest tenth of the table */
+            seed = seed * 1103515245u + 12345u;
+            int id = (seed >> 8) % 4 ? rows - (int) ((seed >> 10) % (rows / 10)) : 1 + (int) ((seed >> 10) % rows);
+            sqlite3_bind_int(stmt, 1, id);
+            sqlite3_step(stmt);
+            sqlite3_reset(stmt);
+        }
+        elapsed = esp_timer_get_time() - start;
+        esp32_vfs_pcache_stats(&stats, 0);
+
+        printf("[BENCH]%5d | %5.1f | %9.1f | %9u | %2u/%u\n", sizes[s],
+               stats.hits + stats.misses ? 100.0 * stats.hits / (stats.hits + stats.misses) : 0,
+               (double) elapsed / lookups, stats.evictions, stats.slabs_used_high, stats.slabs_total);
+    }
+    sqlite3_finalize(stmt);
+    sqlite3_close(db);
+    bench_remove_db(path);
+    esp32_vfs_pcache_set_pages(min_pages);
+}
+
+void vfs_benchmark_mem(int iterations)
+{
+    const char *path = "bench_mem.db";
+    esp32_mem_stats_t stats;
+    sqlite3 *db;
+    sqlite3_stmt *stmt;
+    int64_t start, elapsed;
+
+    bench_remove_db(path);
+    if (sqlite3_open(path, &db) != SQLITE_OK) {
+        printf("[BENCH]Cannot open %s: %s\n", path, sqlite3_errmsg(db));
+        sqlite3_close(db);
+        return;
+    }
+    sqlite3_exec(db, "CREATE TABLE samples(id INTEGER PRIMARY KEY, ts INTEGER, value REAL, tag TEXT);"
+                     "INSERT INTO samples VALUES(1, 1650000000, 21.5, 'sensor')", NULL, NULL, NULL);
+    esp32_vfs_mem_stats(&stats, 1);
+
+    /* parse, run and free a statement each time: allocator bound work */
+    start = esp_timer_get_time();
+    for (int i = 0; i < iterations; i++) {
+        sqlite3_prepare_v2(db, "SELECT id, value, upper(tag) FROM samples WHERE ts > ?1 AND value < ?2 "
+                               "ORDER BY ts DESC LIMIT 10", -1, &stmt, NULL);
+        sqlite3_bind_int64(stmt, 1, 1600000000LL + i);
+        sqlite3_bind_double(stmt, 2, 100.0);
+        while (sqlite3_step(stmt) == SQLITE_ROW)
+            ;
+        sqlite3_finalize(stmt);
+    }
+    elapsed = esp_timer_get_time() - start;
+    esp32_vfs_mem_stats(&stats, 0);
+
+    sqlite3_close(db);
+    bench_remove_db(path);
+
+    printf("[BENCH]mem: %d prepare/step/finalize in %.1f us each, high water %u B, slabs %u/%u, "
+           "heap fallbacks %u, arena full %u\n", iterations, (double) elapsed / iterations,
+           stats.bytes_used_high, stats.slabs_used_high, stats.slabs_total, stats.heap_allocs, stats.arena_full);
+}
+
+/* reader side of vfs_benchmark_concurrent, runs on core 1 */
+typedef struct bench_reader {
+    const char *path;
+    volatile bool stop;
+    int queries;
+    int busy;
+    TaskHandle_t owner;
+} bench_reader;
+
+static void bench_reader_task(void *arg)
+{
+    bench_reader *r = (bench_reader *) arg;
+    sqlite3 *db;
+    sqlite3_stmt *stmt = NULL;
+
+    if (sqlite3_open(r->path, &db) == SQLITE_OK && esp32_vfs_wal_enable_shared(db, 1000, 1000) == SQLITE_OK)
+        sqlite3_prepare_v2(db, "SELECT count(*), max(ts) FROM samples WHERE ts > ?1", -1, &stmt, NULL);
+    while (stmt && !r->stop) {
+        sqlite3_bind_int64(stmt, 1, 1650000000LL);
+        if (sqlite3_step(stmt) == SQLITE_ROW)
+            r->queries++;
+        else
+            r->busy++;
+        sqlite3_reset(stmt);
+    }
+    sqlite3_finalize(stmt);
+    sqlite3_close(db);
+    xTaskNotifyGive(r->owner);
+    vTaskDelete(NULL);
+}
+
+/**
+ * Insert rate of one writer connection
+ * @return rows per second, 0 on error
+ */
+static double bench_concurrent_write(sqlite3 *db, int rows, int batch, int first)
+{
+    sqlite3_stmt *stmt;
+    int64_t start, elapsed;
+
+    if (sqlite3_prepare_v2(db, "INSERT INTO samples VALUES(?1, ?2, ?3, 'sensor')", -1, &stmt, NULL) != SQLITE_OK)
+        return 0;
+    start = esp_timer_get_time();
+    for (int i = 0; i < rows; i++) {
+        if (i % batch == 0)
+            sqlite3_exec(db, "BEGIN", NULL, NULL, NULL);
+        sqlite3_bind_int(stmt, 1, first + i);
+        sqlite3_bind_int64(stmt, 2, 1650000000LL + (first + i) * 10);
+        sqlite3_bind_double(stmt, 3, (i % 1000) * 0.125);
+        sqlite3_step(stmt);
+        sqlite3_reset(stmt);
+        if (i % batch == batch - 1 || i == rows - 1)
+            sqlite3_exec(db, "COMMIT", NULL, NULL, NULL);
+    }
+    elapsed = esp_timer_get_time() - start;
+    sqlite3_finalize(stmt);
+    return rows * 1000000.0 / elapsed;
+}
+
+void vfs_benchmark_concurrent(int rows, int batch)
+{
+    const char *path = "bench_concurrent.db";
+    bench_reader reader = {path, false, 0, 0, xTaskGetCurrentTaskHandle()};
+    double alone, shared;
+    int64_t start;
+    sqlite3 *db;
+
+    bench_remove_db(path);
+    if (sqlite3_open(path, &db) != SQLITE_OK || esp32_vfs_wal_enable_shared(db, 1000, 1000) != SQLITE_OK) {
+        printf("[BENCH]Cannot open %s: %s\n", path, sqlite3_errmsg(db));
+        sqlite3_close(db);
+        return;
+    }
+    sqlite3_exec(db, "CREATE TABLE samples(id INTEGER PRIMARY KEY, ts INTEGER, value REAL, tag TEXT)",
+                 NULL, NULL, NULL);
+
+    alone = bench_concurrent_write(db, rows, batch, 0);
+
+    /* the caller writes on core 0, the reader queries from core 1 */
+    if (xTaskCreatePinnedToCore(bench_reader_task, "bench_reader", 6144, &reader, 5, NULL, 1) != pdPASS) {
+        printf("[BENCH]concurrent: cannot start reader task\n");
+        sqlite3_close(db);
+        return;
+    }
+    start = esp_timer_get_time();
+    shared = bench_concurrent_write(db, rows, batch, rows);
+    reader.stop = true;
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+    sqlite3_close(db);
+    bench_remove_db(path);
+
+    printf("[BENCH]concurrent %d rows/%d: writer alone %.0f rows/s, with reader %.0f rows/s, "
+           "reader %.1f queries/s, %d busy\n", rows, batch, alone, shared,
+           reader.queries * 1000000.0 / (esp_timer_get_time() - start), reader.busy);
+}
+
+void vfs_benchmark_sort(int rows)
+{
+    const char *path = "bench_sort.db";
+    /* PRAGMA cache_size in KiB, the sorter's run size when above the PMASZ floor */
+    static const int cache_kib[] = {64, 256, 1024};
+    esp32_temp_stats_t stats;
+    sqlite3 *db;
+    sqlite3_stmt *stmt;
+    uint32_t seed = 12345;
+    char sql[40];
+
+    bench_remove_db(path);
+    if (sqlite3_open(path, &db) != SQLITE_OK) {
+        printf("[BENCH]Cannot open %s: %s\n", path, sqlite3_errmsg(db));
+        sqlite3_close(db);
+        return;
+    }
+    sqlite3_exec(db, "CREATE TABLE samples(id INTEGER PRIMARY KEY, value INTEGER, tag TEXT)", NULL, NULL, NULL);
+    sqlite3_prepare_v2(db, "INSERT INTO samples(value, tag) VALUES(?1, 'sensor')", -1, &stmt, NULL);
+    for (int i = 0; i < rows; i++) {
+        if (i % 10000 == 0)
+            sqlite3_exec(db, "BEGIN", NULL, NULL, NULL);
+        seed = seed * 1103515245u + 12345u;
+        sqlite3_bind_int(stmt, 1, (int) (seed >> 1));
+        sqlite3_step(stmt);
+        sqlite3_reset(stmt);
+        if (i % 10000 == 9999 || i == rows - 1)
+            sqlite3_exec(db, "COMMIT", NULL, NULL, NULL);
+    }
+    sqlite3_finalize(stmt);
+
+#ifdef CONFIG_SQLITE_SORTER_PMASZ
+    printf("[BENCH]sort %d rows, PMASZ %d pages\n", rows, CONFIG_SQLITE_SORTER_PMASZ);
+#else
+    printf("[BENCH]sort %d rows\n", rows);
+#endif
+    printf("[BENCH]cache KiB | rows/s  | temp PSRAM KiB | spilled KiB | read back KiB\n");
+    for (size_t c = 0; c < sizeof(cache_kib) / sizeof(cache_kib[0]); c++) {
+        int64_t start, elapsed;
+        int count = 0, last = -1, unsorted = 0;
+
+        snprintf(sql, sizeof(sql), "PRAGMA cache_size = -%d", cache_kib[c]);
+        sqlite3_exec(db, sql, NULL, NULL, NULL);
+        esp32_vfs_temp_stats(&stats, 1);
+
+        start = esp_timer_get_time();
+        sqlite3_prepare_v2(db, "SELECT value, id FROM samples ORDER BY value", -1, &stmt, NULL);
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            int value = sqlite3_column_int(stmt, 0);
+            unsorted += value < last;
+            last = value;
+            count++;
+        }
+        sqlite3_finalize(stmt);
+        elapsed = esp_timer_get_time() - start;
+        esp32_vfs_temp_stats(&stats, 0);
+
+        if (count != rows || unsorted)
+            printf("[BENCH]sort: %d of %d rows, %d out of order: %s\n", count, rows, unsorted, sqlite3_errmsg(db));
+        printf("[BENCH]%9d | %7.0f | %14u | %11llu | %13llu\n", cache_kib[c], count * 1000000.0 / elapsed,
+               stats.psram_bytes_high / 1024, (unsigned long long) (stats.spill_bytes_written / 1024),
+               (unsigned long long) (stats.spill_bytes_read / 1024));
+    }
+
+    sqlite3_close(db);
+    bench_remove_db(path);
+}
+
+/**
+ * Insert one period of rows at the given time base into an open statement
+ */
+static int64_t bench_partition_fill(sqlite3 *db, sqlite3_stmt *stmt, int64_t base, int rows, int period_s)
+{
+    int64_t start = esp_timer_get_time();
+
+    sqlite3_exec(db, "BEGIN", NULL, NULL, NULL);
+    for (int i = 0; i < rows; i++) {
+        sqlite3_bind_int64(stmt, 1, base + (int64_t) i * period_s / rows);
+        sqlite3_bind_double(stmt, 2, i * 0.5);
+        sqlite3_step(stmt);
+        sqlite3_reset(stmt);
+    }
+    sqlite3_exec(db, "COMMIT", NULL, NULL, NULL);
+    return esp_timer_get_time() - start;
+}
+
+void vfs_benchmark_partition(int periods, int rows, int retain)
+{
+    const char *path = "bench_part.db";
+    const int period_s = 86400;
+    esp32_partition_config_t config = {"bench_part", "readings", "ts INTEGER NOT NULL, value REAL", "ts",
+                                       period_s, retain};
+    esp32_partition_t *part;
+    sqlite3 *db;
+    sqlite3_stmt *stmt;
+    int64_t insert_us = 0, retire_us = 0, worst_us = 0;
+    char sql[80];
+
+    /* baseline: one database, retention by DELETE */
+    bench_remove_db(path);
+    if (sqlite3_open(path, &db) != SQLITE_OK) {
+        printf("[BENCH]Cannot open %s: %s\n", path, sqlite3_errmsg(db));
+        sqlite3_close(db);
+        return;
+    }
+    sqlite3_exec(db, "CREATE TABLE readings(ts INTEGER NOT NULL, value REAL); CREATE INDEX readings_idx ON readings(ts)",
+                 NULL, NULL, NULL);
+    sqlite3_prepare_v2(db, "INSERT INTO readings VALUES(?1, ?2)", -1, &stmt, NULL);
+    for (int d = 0; d < periods; d++) {
+        int64_t start;
+
+        insert_us += bench_partition_fill(db, stmt, (int64_t) d * period_s, rows, period_s);
+        start = esp_timer_get_time();
+        snprintf(sql, sizeof(sql), "DELETE FROM readings WHERE ts < %lld",
+                 (long long) (d - retain + 1) * period_s);
+        sqlite3_exec(db, sql, NULL, NULL, NULL);
+        start = esp_timer_get_time() - start;
+        retire_us += start;
+        worst_us = start > worst_us ? start : worst_us;
+    }
+    sqlite3_finalize(stmt);
+    sqlite3_close(db);
+    bench_remove_db(path);
+
+    printf("[BENCH]partition %d periods of %d rows, %d kept\n", periods, rows, retain);
+    printf("[BENCH]layout    | rows/s  | retire avg ms | retire max ms\n");
+    printf("[BENCH]DELETE    | %7.0f | %13.1f | %13.1f\n", (double) periods * rows * 1000000.0 / insert_us,
+           retire_us / 1000.0 / periods, worst_us / 1000.0);
+
+    /* one file per period, retention by lfs_remove in rotate */
+    insert_us = retire_us = worst_us = 0;
+    if (esp32_partition_open(&config, 0, &part) != SQLITE_OK) {
+        printf("[BENCH]Cannot open partitions\n");
+        return;
+    }
+    db = esp32_partition_db(part);
+    sqlite3_prepare_v2(db, "INSERT INTO " ESP32_PARTITION_HOT ".readings VALUES(?1, ?2)", -1, &stmt, NULL);
+    for (int d = 0; d < periods; d++) {
+        int64_t start = esp_timer_get_time();
+
+        esp32_partition_rotate(part, (int64_t) d * period_s);
+        start = esp_timer_get_time() - start;
+        retire_us += start;
+        worst_us = start > worst_us ? start : worst_us;
+        insert_us += bench_partition_fill(db, stmt, (int64_t) d * period_s, rows, period_s);
+    }
+    sqlite3_finalize(stmt);
+    printf("[BENCH]partition | %7.0f | %13.1f | %13.1f\n", (double) periods * rows * 1000000.0 / insert_us,
+           retire_us / 1000.0 / periods, worst_us / 1000.0);
+
+    /* clean up: a rotation far ahead expires every partition file */
+    esp32_partition_rotate(part, (int64_t) (periods + retain) * period_s);
+    esp32_partition_close(part);
+    snprintf(sql, sizeof(sql), "bench_part_%lld.db", (long long) (periods + retain) * period_s);
+    bench_remove_db(sql);
+}
+
+/**
+ * Fill a table of 1 KiB rows through one VFS, then time random lookups
+ * with a cache too small to hold the table
+ */
+static void bench_chunk_row(const char *vfs_name, int rows)
+{
+    const char *path = "bench_chunk.db";
+    const int lookups = 1000;
+    sqlite3_vfs *vfs = sqlite3_vfs_find(vfs_name);
+    sqlite3 *db;
+    sqlite3_stmt *stmt;
+    sqlite3_int64 size = 0;
+    uint32_t seed = 12345;
+    int64_t start, insert_us, lookup_us;
+
+    if (!vfs) {
+        printf("[BENCH]%s VFS not registered\n", vfs_name);
+        return;
+    }
+    vfs->xDelete(vfs, path, 0);
+    if (sqlite3_open_v2(path, &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, vfs_name) != SQLITE_OK) {
+        printf("[BENCH]Cannot open %s: %s\n", path, sqlite3_errmsg(db));
+        sqlite3_close(db);
+        return;
+    }
+    sqlite3_exec(db, "PRAGMA journal_mode = WAL; CREATE TABLE blobs(id INTEGER PRIMARY KEY, data BLOB)",
+                 NULL, NULL, NULL);
+    sqlite3_prepare_v2(db, "INSERT INTO blobs(data) VALUES(zeroblob(1000))", -1, &stmt, NULL);
+    start = esp_timer_get_time();
+    for (int i = 0; i < rows; i++) {
+        if (i % 1000 == 0)
+            sqlite3_exec(db, "BEGIN", NULL, NULL, NULL);
+        sqlite3_step(stmt);
+        sqlite3_reset(stmt);
+        if (i % 1000 == 999 || i == rows - 1)
+            sqlite3_exec(db, "COMMIT", NULL, NULL, NULL);
+    }
+    sqlite3_finalize(stmt);
+    sqlite3_exec(db, "PRAGMA wal_checkpoint(TRUNCATE)", NULL, NULL, NULL);
+    insert_us = esp_timer_get_time() - start;
+
+    sqlite3_exec(db, "PRAGMA cache_size = 16", NULL, NULL, NULL);
+    sqlite3_prepare_v2(db, "SELECT length(data) FROM blobs WHERE id = ?1", -1, &stmt, NULL);
+    start = esp_timer_get_time();
+    for (int i = 0; i < lookups; i++) {
+        seed = seed * 1103515245u + 12345u;
+        sqlite3_bind_int(stmt, 1, 1 + (int) ((seed >> 8) % rows));
+        sqlite3_step(stmt);
+        sqlite3_reset(stmt);
+    }
+    lookup_us = esp_timer_get_time() - start;
+    sqlite3_finalize(stmt);
+    sqlite3_prepare_v2(db, "PRAGMA page_count", -1, &stmt, NULL);
+    if (sqlite3_step(stmt) == SQLITE_ROW)
+        size = sqlite3_column_int64(stmt, 0);
+    sqlite3_finalize(stmt);
+    sqlite3_prepare_v2(db, "PRAGMA page_size", -1, &stmt, NULL);
+    if (sqlite3_step(stmt) == SQLITE_ROW)
+        size *= sqlite3_column_int64(stmt, 0);
+    sqlite3_finalize(stmt);
+    sqlite3_close(db);
+    vfs->xDelete(vfs, path, 0);
+
+    printf("[BENCH]%-11s | %8lld | %7.0f | %9.1f\n", vfs_name, size / 1024,
+           rows * 1000000.0 / insert_us, (double) lookup_us / lookups);
+}
+
+void vfs_benchmark_chunk(int rows)
+{
+#ifdef CONFIG_SQLITE_CHUNK_FILE_MB
+    printf("[BENCH]chunk %d rows of 1 KiB, chunk files of %d MiB\n", rows, CONFIG_SQLITE_CHUNK_FILE_MB);
+#else
+    printf("[BENCH]chunk %d rows of 1 KiB\n", rows);
+#endif
+    printf("[BENCH]VFS         | size KiB | rows/s  | lookup us\n");
+    bench_chunk_row("esp32", rows);
+    bench_chunk_row(ESP32_VFS_CHUNK, rows);
+}
+
+void vfs_benchmark_blob(int count, int size_kib)
+{
+    const char *path = "bench_blob.db";
+    const int total = size_kib * 1024;
+    const int piece = total < 4096 ? total : 4096;
+    uint8_t *buffer;
+    sqlite3 *db;
+    sqlite3_stmt *stmt;
+    sqlite3_int64 db_size[2] = {0, 0};
+    int64_t write_us[2] = {0, 0}, read_us[2] = {0, 0};
+    int64_t start;
+
+    buffer = (uint8_t *) sqlite3_malloc(size_kib * 1024);
+    if (!buffer) {
+        printf("[BENCH]blob: no memory for a %d KiB capture\n", size_kib);
+        return;
+    }
+    for (int i = 0; i < size_kib * 1024; i++)
+        buffer[i] = (uint8_t) (i * 7);
+
+    bench_remove_db(path);
+    if (sqlite3_open(path, &db) != SQLITE_OK) {
+        printf("[BENCH]Cannot open %s: %s\n", path, sqlite3_errmsg(db));
+        sqlite3_close(db);
+        sqlite3_free(buffer);
+        return;
+    }
+    sqlite3_exec(db, "CREATE TABLE inline(id INTEGER PRIMARY KEY, data BLOB);"
+                     "CREATE TABLE external(id INTEGER PRIMARY KEY, blob INTEGER)", NULL, NULL, NULL);
+
+    /* inline: the whole capture is bound, stored as an overflow chain and read back whole */
+    sqlite3_prepare_v2(db, "INSERT INTO inline(data) VALUES(?1)", -1, &stmt, NULL);
+    start = esp_timer_get_time();
+    for (int i = 0; i < count; i++) {
+        sqlite3_bind_blob(stmt, 1, buffer, size_kib * 1024, SQLITE_STATIC);
+        sqlite3_step(stmt);
+        sqlite3_reset(stmt);
+    }
+    write_us[0] = esp_timer_get_time() - start;
+    sqlite3_finalize(stmt);
+    sqlite3_prepare_v2(db, "SELECT data FROM inline", -1, &stmt, NULL);
+    start = esp_timer_get_time();
+    while (sqlite3_step(stmt) == SQLITE_ROW)
+        sqlite3_column_blob(stmt, 0);
+    read_us[0] = esp_timer_get_time() - start;
+    sqlite3_finalize(stmt);
+
+    /* external: streamed in 4 KiB pieces, the row only keeps the id */
+    sqlite3_prepare_v2(db, "INSERT INTO external(blob) VALUES(?1)", -1, &stmt, NULL);
+    start = esp_timer_get_time();
+    for (int i = 0; i < count; i++) {
+        esp32_blob_t *blob;
+        sqlite3_int64 id;
+
+        if (esp32_blob_create(&id, &blob) != SQLITE_OK)
+            break;
+        for (int done = 0; done < total; done += piece)
+            esp32_blob_write(blob, buffer + done, total - done < piece ? total - done : piece);
+        esp32_blob_close(blob);
+        sqlite3_bind_int64(stmt, 1, id);
+        sqlite3_step(stmt);
+        sqlite3_reset(stmt);
+    }
+    write_us[1] = esp_timer_get_time() - start;
+    sqlite3_finalize(stmt);
+    sqlite3_prepare_v2(db, "SELECT blob FROM external", -1, &stmt, NULL);
+    start = esp_timer_get_time();
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        esp32_blob_t *blob;
+
+        if (esp32_blob_open(sqlite3_column_int64(stmt, 0), &blob) != SQLITE_OK)
+            continue;
+        for (sqlite3_int64 offset = 0; esp32_blob_read(blob, buffer, piece, offset) == piece; offset += piece)
+            ;
+        esp32_blob_close(blob);
+    }
+    read_us[1] = esp_timer_get_time() - start;
+    sqlite3_finalize(stmt);
+
+    sqlite3_prepare_v2(db, "SELECT sum(length(data)) FROM inline", -1, &stmt, NULL);
+    if (sqlite3_step(stmt) == SQLITE_ROW)
+        db_size[0] = sqlite3_column_int64(stmt, 0);
+    sqlite3_finalize(stmt);
+    sqlite3_exec(db, "SELECT blob_remove(blob) FROM external; DELETE FROM external", NULL, NULL, NULL);
+    sqlite3_close(db);
+    bench_remove_db(path);
+    sqlite3_free(buffer);
+
+    printf("[BENCH]blob %d captures of %d KiB, %lld KiB inline\n", count, size_kib, (long long) (db_size[0] / 1024));
+    printf("[BENCH]storage  | write KiB/s | read KiB/s | peak buffer KiB\n");
+    printf("[BENCH]inline   | %11.0f | %10.0f | %15d\n", count * size_kib * 1000000.0 / write_us[0],
+           count * size_kib * 1000000.0 / read_us[0], size_kib);
+    printf("[BENCH]external | %11.0f | %10.0f | %15d\n", count * size_kib * 1000000.0 / write_us[1],
+           count * size_kib * 1000000.0 / read_us[1], (piece + 1023) / 1024);
+}
+
+typedef struct bench_sample {
+    int64_t ts;
+    int32_t channel;
+    float value;
+} bench_sample;
+
+static int bench_bind_sample(sqlite3_stmt *stmt, const void *record)
+{
+    const bench_sample *sample = (const bench_sample *) record;
+
+    sqlite3_bind_int64(stmt, 1, sample->ts);
+    sqlite3_bind_int(stmt, 2, sample->channel);
+    sqlite3_bind_double(stmt, 3, sample->value);
+    return SQLITE_OK;
+}
+
+void vfs_benchmark_ingest(int rows)
+{
+    const char *path = "bench_ingest.db";
+    esp32_ingest_config_t config = {NULL, "INSERT INTO samples VALUES(?1, ?2, ?3)", bench_bind_sample,
+                                    sizeof(bench_sample), 4096, 512, 200, 1, 0};
+    esp32_ingest_stats_t stats;
+    esp32_ingest_t *ingest;
+    sqlite3 *db;
+    sqlite3_stmt *stmt;
+    int64_t start, autocommit_us, ingest_us;
+    int autocommit_rows = rows / 100 > 0 ? rows / 100 : 1;
+
+    bench_remove_db(path);
+    if (sqlite3_open(path, &db) != SQLITE_OK) {
+        printf("[BENCH]Cannot open %s: %s\n", path, sqlite3_errmsg(db));
+        sqlite3_close(db);
+        return;
+    }
+    sqlite3_exec(db, "CREATE TABLE samples(ts INTEGER, channel INTEGER, value REAL)", NULL, NULL, NULL);
+
+    /* baseline: one autocommit transaction per row, on a sample of the rows */
+    sqlite3_prepare_v2(db, "INSERT INTO samples VALUES(?1, ?2, ?3)", -1, &stmt, NULL);
+    start = esp_timer_get_time();
+    for (int i = 0; i < autocommit_rows; i++) {
+        bench_sample sample = {1650000000LL + i, i % 8, i * 0.25f};
+
+        bench_bind_sample(stmt, &sample);
+        sqlite3_step(stmt);
+        sqlite3_reset(stmt);
+    }
+    autocommit_us = esp_timer_get_time() - start;
+    sqlite3_finalize(stmt);
+
+    /* the caller produces on core 0 as fast as the ring takes it, the writer runs on core 1 */
+    config.db = db;
+    if (esp32_ingest_start(&config, &ingest) != SQLITE_OK) {
+        printf("[BENCH]ingest: cannot start the pipeline: %s\n", sqlite3_errmsg(db));
+        sqlite3_close(db);
+        return;
+    }
+    start = esp_timer_get_time();
+    for (int i = 0; i < rows; i++) {
+        bench_sample sample = {1650000000LL + i, i % 8, i * 0.25f};
+
+        while (!esp32_ingest_push(ingest, &sample))
+            vTaskDelay(1);
+    }
+    esp32_ingest_stats(ingest, &stats, 0);
+    esp32_ingest_stop(ingest);
+    ingest_us = esp_timer_get_time() - start;
+
+    sqlite3_close(db);
+    bench_remove_db(path);
+
+    printf("[BENCH]ingest %d rows: autocommit %.0f rows/s, pipeline %.0f rows/s, %llu batches, "
+           "ring high %u, full %u times, commit max %u us\n", rows, autocommit_rows * 1000000.0 / autocommit_us,
+           rows * 1000000.0 / ingest_us, (unsigned long long) stats.batches, stats.queued_high, stats.dropped,
+           stats.commit_us_max);
+}
+
+static const char *const bench_stmt_sql[] = {
+        "INSERT INTO samples VALUES(?1, ?2, ?3)",
+        "SELECT value FROM samples WHERE rowid = ?1",
+        "UPDATE samples SET value = value + 1 WHERE rowid = ?1",
+};
+
+/**
+ * Rotate through the statements of bench_stmt_sql, prepared every time or
+ * taken from a cache
+ */
+static int64_t bench_stmt_run(sqlite3 *db, esp32_stmt_cache_t *cache, int rows)
+{
+    int64_t start = esp_timer_get_time();
+    sqlite3_stmt *stmt;
+
+    sqlite3_exec(db, "BEGIN", NULL, NULL, NULL);
+    for (int i = 0; i < rows; i++) {
+        const char *sql = bench_stmt_sql[i % 3];
+
+        if (cache)
+            esp32_stmt_cache_get(cache, sql, &stmt);
+        else
+            sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+        if (i % 3 == 0) {
+            sqlite3_bind_int64(stmt, 1, 1650000000LL + i);
+            sqlite3_bind_int(stmt, 2, i % 8);
+            sqlite3_bind_double(stmt, 3, i * 0.25);
+        } else {
+            sqlite3_bind_int64(stmt, 1, i / 3 + 1);
+        }
+        sqlite3_step(stmt);
+        if (cache)
+            esp32_stmt_cache_put(cache, stmt);
+        else
+            sqlite3_finalize(stmt);
+    }
+    sqlite3_exec(db, "COMMIT", NULL, NULL, NULL);
+    return esp_timer_get_time() - start;
+}
+
+void vfs_benchmark_stmt_cache(int rows)
+{
+    const char *path = "bench_stmt.db";
+    esp32_stmt_cache_stats_t stats;
+    esp32_stmt_cache_t *cache;
+    sqlite3 *db;
+    int64_t prepare_us, cached_us;
+
+    bench_remove_db(path);
+    if (sqlite3_open(path, &db) != SQLITE_OK) {
+        printf("[BENCH]Cannot open %s: %s\n", path, sqlite3_errmsg(db));
+        sqlite3_close(db);
+        return;
+    }
+    sqlite3_exec(db, "CREATE TABLE samples(ts INTEGER, channel INTEGER, value REAL)", NULL, NULL, NULL);
+    if (esp32_stmt_cache_open(db, 0, &cache) != SQLITE_OK) {
+        sqlite3_close(db);
+        return;
+    }
+
+    prepare_us = bench_stmt_run(db, NULL, rows);
+    cached_us = bench_stmt_run(db, cache, rows);
+    esp32_stmt_cache_stats(cache, &stats, 0);
+    esp32_stmt_cache_close(cache);
+
+    sqlite3_close(db);
+    bench_remove_db(path);
+
+    printf("[BENCH]stmt cache %d statements: prepare each %.1f us/stmt, cached %.1f us/stmt, "
+           "%u hits, %u misses, %llu us preparing\n", rows, (double) prepare_us / rows, (double) cached_us / rows,
+           stats.hits, stats.misses, (unsigned long long) stats.prepare_us);
+}
+
+/**
+ * Run the statements of bench_stmt_sql, prepared once, through the given
+ * step and reset
+ */
+static int64_t bench_profile_run(sqlite3_stmt **stmts, int rows, int (*step)(sqlite3_stmt *),
+                                 int (*reset)(sqlite3_stmt *))
+{
+    sqlite3 *db = sqlite3_db_handle(stmts[0]);
+    int64_t start = esp_timer_get_time();
+
+    sqlite3_exec(db, "BEGIN", NULL, NULL, NULL);
+    for (int i = 0; i < rows; i++) {
+        sqlite3_stmt *stmt = stmts[i % 3];
+
+        if (i % 3 == 0) {
+            sqlite3_bind_int64(stmt, 1, 1650000000LL + i);
+            sqlite3_bind_int(stmt, 2, i % 8);
+            sqlite3_bind_double(stmt, 3, i * 0.25);
+        } else {
+            sqlite3_bind_int64(stmt, 1, i / 3 + 1);
+        }
+        step(stmt);
+        reset(stmt);
+    }
+    sqlite3_exec(db, "COMMIT", NULL, NULL, NULL);
+    return esp_timer_get_time() - start;
+}
+
+void vfs_benchmark_profile(int rows)
+{
+    const char *path = "bench_profile.db";
+    const int rounds = 10;
+    sqlite3_stmt *stmts[3] = {NULL, NULL, NULL};
+    esp32_profile_entry_t top[3];
+    sqlite3 *db;
+    int64_t plain_us = 0, profiled_us = 0;
+    int n, round;
+
+    bench_remove_db(path);
+    if (sqlite3_open(path, &db) != SQLITE_OK) {
+        printf("[BENCH]Cannot open %s: %s\n", path, sqlite3_errmsg(db));
+        sqlite3_close(db);
+        return;
+    }
+    sqlite3_exec(db, "CREATE TABLE samples(ts INTEGER, channel INTEGER, value REAL)", NULL, NULL, NULL);
+    for (int i = 0; i < 3; i++)
+        sqlite3_prepare_v2(db, bench_stmt_sql[i], -1, &stmts[i], NULL);
+
+    /* both grow the table: alternate short rounds, and which one goes first,
+     * so they see the same table sizes */
+    round = rows / rounds / 3 * 3;
+    if (round < 3)
+        round = 3;
+    rows = 0;
+    esp32_profile_clear();
+    for (int r = 0; r < rounds; r++) {
+        if (r & 1) {
+            profiled_us += bench_profile_run(stmts, round, esp32_profile_step, esp32_profile_reset);
+            plain_us += bench_profile_run(stmts, round, sqlite3_step, sqlite3_reset);
+        } else {
+            plain_us += bench_profile_run(stmts, round, sqlite3_step, sqlite3_reset);
+            profiled_us += bench_profile_run(stmts, round, esp32_profile_step, esp32_profile_reset);
+        }
+        rows += round;
+    }
+    n = esp32_profile_top(top, 3);
+
+    for (int i = 0; i < 3; i++)
+        sqlite3_finalize(stmts[i]);
+    sqlite3_close(db);
+    bench_remove_db(path);
+
+#ifdef CONFIG_SQLITE_STMT_PROFILE
+    printf("[BENCH]profile %d statements: plain %.1f us/stmt, profiled %.1f us/stmt, %.1f us overhead, "
+           "%d entries\n", rows, (double) plain_us / rows, (double) profiled_us / rows,
+           (double) (profiled_us - plain_us) / rows, n);
+#else
+    printf("[BENCH]profile %d statements: plain %.1f us/stmt, CONFIG_SQLITE_STMT_PROFILE is off, "
+           "esp32_profile_step is sqlite3_step (%.1f us/stmt, %d entries)\n", rows, (double) plain_us / rows,
+           (double) profiled_us / rows, n);
+#endif
+}
+
+void vfs_benchmark_logtab(int days, int rows_per_day)
+{
+    const char *dir = "bench_logs";
+    char name[48], line[64], sql[160];
+    sqlite3 *db;
+    sqlite3_stmt *stmt;
+    int64_t start, scan_us, range_us;
+    int64_t ts = 1650000000LL, first_day;
+    int step = 86400 / rows_per_day, scan_rows = 0, range_rows = 0;
+
+    lfs_mkdir(&lfs_filesystem, dir);
+    for (int d = 0; d < days; d++) {
+        lfs_file_t file;
+
+        snprintf(name, sizeof(name), "%s/%04d.txt", dir, d);
+        if (lfs_file_open(&lfs_filesystem, &file, name, LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC) < 0) {
+            printf("[BENCH]Cannot create %s\n", name);
+            return;
+        }
+        for (int i = 0; i < rows_per_day; i++, ts += step) {
+            int n = snprintf(line, sizeof(line), "%lld,%.2f,%d\n", (long long) ts, 20 + (i % 100) * 0.1, 40 + i % 7);
+            lfs_file_write(&lfs_filesystem, &file, line, n);
+        }
+        lfs_file_close(&lfs_filesystem, &file);
+    }
+
+    sqlite3_open(":memory:", &db);
+    snprintf(sql, sizeof(sql), "CREATE VIRTUAL TABLE temp.climate USING esp32_log('%s', ts INTEGER, temp REAL, hum INTEGER)",
+             dir);
+    if (sqlite3_exec(db, sql, NULL, NULL, NULL) != SQLITE_OK) {
+        printf("[BENCH]logtab: %s\n", sqlite3_errmsg(db));
+        sqlite3_close(db);
+        return;
+    }
+
+    /* one hour from the middle of the log, ts + 0 hides the bound from xBestIndex */
+    first_day = 1650000000LL + (int64_t) (days / 2) * 86400 + 43200;
+    sqlite3_prepare_v2(db, "SELECT count(*) FROM climate WHERE ts + 0 BETWEEN ?1 AND ?2", -1, &stmt, NULL);
+    sqlite3_bind_int64(stmt, 1, first_day);
+    sqlite3_bind_int64(stmt, 2, first_day + 3599);
+    start = esp_timer_get_time();
+    if (sqlite3_step(stmt) == SQLITE_ROW)
+        scan_rows = sqlite3_column_int(stmt, 0);
+    scan_us = esp_timer_get_time() - start;
+    sqlite3_finalize(stmt);
+
+    sqlite3_prepare_v2(db, "SELECT count(*) FROM climate WHERE ts BETWEEN ?1 AND ?2", -1, &stmt, NULL);
+    sqlite3_bind_int64(stmt, 1, first_day);
+    sqlite3_bind_int64(stmt, 2, first_day + 3599);
+    start = esp_timer_get_time();
+    if (sqlite3_step(stmt) == SQLITE_ROW)
+        range_rows = sqlite3_column_int(stmt, 0);
+    range_us = esp_timer_get_time() - start;
+    sqlite3_finalize(stmt);
+    sqlite3_close(db);
+
+    for (int d = 0; d < days; d++) {
+        snprintf(name, sizeof(name), "%s/%04d.txt", dir, d);
+        lfs_remove(&lfs_filesystem, name);
+    }
+    lfs_remove(&lfs_filesystem, dir);
+
+    printf("[BENCH]logtab %d days x %d lines, one hour: full scan %lld ms, time range pushed down %lld ms, "
+           "%d/%d rows\n", days, rows_per_day, (long long) (scan_us / 1000), (long long) (range_us / 1000),
+           scan_rows, range_rows);
+}
+
+void vfs_benchmark_series(int samples)
+{
+    const char *text_path = "bench_series.txt", *path = "bench_series.bin";
+    char line[80];
+    lfs_file_t file;
+    esp32_series_writer_t *writer;
+    esp32_series_reader_t *reader;
+    esp32_series_info_t info;
+    esp32_series_filter_t filter;
+    float values[4];
+    int64_t start, text_us, series_us, range_us, value_us, ts;
+    lfs_soff_t text_bytes;
+    int range_rows = 0, value_rows = 0, rc;
+    unsigned range_blocks;
+
+    lfs_remove(&lfs_filesystem, path);
+    if (lfs_file_open(&lfs_filesystem, &file, text_path, LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC) < 0) {
+        printf("[BENCH]Cannot create %s\n", text_path);
+        return;
+    }
+    start = esp_timer_get_time();
+    for (int i = 0; i < samples; i++) {
+        int n = snprintf(line, sizeof(line), "%lld,%.2f,%d,%.3f,%d\n", 1650000000LL + i, 20 + (i / 60 % 100) * 0.1,
+                         40 + i % 7, 1013 + (i / 600 % 50) * 0.125, i / 3600);
+        lfs_file_write(&lfs_filesystem, &file, line, n);
+    }
+    lfs_file_close(&lfs_filesystem, &file);
+    text_us = esp_timer_get_time() - start;
+
+    if (esp32_series_writer_open(path, 4, &writer) != SQLITE_OK) {
+        printf("[BENCH]Cannot create %s\n", path);
+        lfs_remove(&lfs_filesystem, text_path);
+        return;
+    }
+    start = esp_timer_get_time();
+    for (int i = 0; i < samples; i++) {
+        values[0] = 20 + (i / 60 % 100) * 0.1f;
+        values[1] = (float) (40 + i % 7);
+        values[2] = 1013 + (i / 600 % 50) * 0.125f;
+        values[3] = (float) (i / 3600);
+        esp32_series_append(writer, 1650000000LL + i, values);
+    }
+    rc = esp32_series_writer_close(writer);
+    series_us = esp_timer_get_time() - start;
+    lfs_file_open(&lfs_filesystem, &file, text_path, LFS_O_RDONLY);
+    text_bytes = lfs_file_size(&lfs_filesystem, &file);
+    lfs_file_close(&lfs_filesystem, &file);
+    lfs_remove(&lfs_filesystem, text_path);
+
+    if (rc != SQLITE_OK || esp32_series_reader_open(path, &reader) != SQLITE_OK) {
+        printf("[BENCH]series: cannot write or read %s\n", path);
+        lfs_remove(&lfs_filesystem, path);
+        return;
+    }
+
+    /* one hour from the middle, then the samples of one hour by value */
+    memset(&filter, 0, sizeof(filter));
+    filter.from = 1650000000LL + samples / 2;
+    filter.to = filter.from + 3599;
+    filter.channel = -1;
+    start = esp_timer_get_time();
+    esp32_series_scan(reader, &filter);
+    while (esp32_series_next(reader, &ts, values) == 1)
+        range_rows++;
+    range_us = esp_timer_get_time() - start;
+    esp32_series_info(reader, &info);
+    range_blocks = info.blocks_read;
+
+    filter.from = INT64_MIN;
+    filter.to = INT64_MAX;
+    filter.channel = 3;
+    filter.min = filter.max = (float) (samples / 7200);
+    filter.columns = 1u << 3;
+    start = esp_timer_get_time();
+    esp32_series_scan(reader, &filter);
+    while (esp32_series_next(reader, &ts, values) == 1)
+        value_rows++;
+    value_us = esp_timer_get_time() - start;
+    esp32_series_info(reader, &info);
+    esp32_series_reader_close(reader);
+    lfs_remove(&lfs_filesystem, path);
+
+    printf("[BENCH]series %d samples: text %.1f B/sample %lld ms, series %.1f B/sample %lld ms, "
+           "one hour by time %d rows %u blocks %lld ms, by value %d rows %u blocks %lld ms, %u of %u blocks skipped\n",
+           samples, (double) text_bytes / samples, (long long) (text_us / 1000), (double) info.bytes / samples,
+           (long long) (series_us / 1000), range_rows, range_blocks, (long long) (range_us / 1000), value_rows,
+           info.blocks_read - range_blocks, (long long) (value_us / 1000), info.blocks_skipped, 2 * info.blocks);
+}
+
+void vfs_benchmark_logfile(int lines)
+{
+    const char *path = "bench_append.txt";
+    char line[64];
+    lfs_file_t file;
+    esp32_logfile_stats_t stats;
+    int64_t start, open_us, cached_us;
+
+    lfs_remove(&lfs_filesystem, path);
+    start = esp_timer_get_time();
+    for (int i = 0; i < lines; i++) {
+        int n = snprintf(line, sizeof(line), "%lld,%.2f,%d\n", 1650000000LL + i, 20 + (i % 100) * 0.1, 40 + i % 7);
+
+        if (lfs_file_open(&lfs_filesystem, &file, path, LFS_O_WRONLY | LFS_O_CREAT | LFS_O_APPEND) < 0) {
+            printf("[BENCH]Cannot open %s\n", path);
+            return;
+        }
+        lfs_file_write(&lfs_filesystem, &file, line, n);
+        lfs_file_close(&lfs_filesystem, &file);
+    }
+    open_us = esp_timer_get_time() - start;
+    lfs_remove(&lfs_filesystem, path);
+
+    esp32_logfile_stats(&stats, 1);
+    start = esp_timer_get_time();
+    for (int i = 0; i < lines; i++) {
+        int n = snprintf(line, sizeof(line), "%lld,%.2f,%d\n", 1650000000LL + i, 20 + (i % 100) * 0.1, 40 + i % 7);
+
+        if (esp32_logfile_append(path, line, n) != SQLITE_OK) {
+            printf("[BENCH]Cannot append to %s\n", path);
+            break;
+        }
+    }
+    esp32_logfile_close(path);
+    cached_us = esp_timer_get_time() - start;
+    esp32_logfile_stats(&stats, 0);
+    lfs_remove(&lfs_filesystem, path);
+
+    printf("[BENCH]logfile %d lines: open/write/close %.1f us/line, cached handle %.1f us/line, %u syncs\n",
+           lines, (double) open_us / lines, (double) cached_us / lines, stats.syncs);
+}
+
+void vfs_benchmark_logring(int lines, int segments)
+{
+    const char *dir = "bench_ring", *files_dir = "bench_files";
+    const unsigned segment_bytes = 16 * 1024;
+    char line[64], name[48];
+    esp32_logring_t *ring;
+    esp32_logring_info_t info;
+    int64_t start, files_us, ring_us, remove_us = 0;
+    unsigned bytes = 0, first = 0, last = 0;
+
+    /* the old way: a new file per segment, the oldest one removed */
+    lfs_mkdir(&lfs_filesystem, files_dir);
+    start = esp_timer_get_time();
+    for (int i = 0; i < lines; i++) {
+        int n = snprintf(line, sizeof(line), "%lld,%.2f,%d\n", 1650000000LL + i, 20 + (i % 100) * 0.1, 40 + i % 7);
+
+        if (bytes + n > segment_bytes) {
+            snprintf(name, sizeof(name), "%s/%08u.log", files_dir, last);
+            esp32_logfile_close(name);
+            last++;
+            bytes = 0;
+            if (last - first >= (unsigned) segments) {
+                int64_t removing = esp_timer_get_time();
+
+                snprintf(name, sizeof(name), "%s/%08u.log", files_dir, first++);
+                lfs_remove(&lfs_filesystem, name);
+                remove_us += esp_timer_get_time() - removing;
+            }
+        }
+        snprintf(name, sizeof(name), "%s/%08u.log", files_dir, last);
+        esp32_logfile_append(name, line, n);
+        bytes += n;
+    }
+    esp32_logfile_close(NULL);
+    files_us = esp_timer_get_time() - start;
+    for (unsigned seq = first; seq <= last; seq++) {
+        snprintf(name, sizeof(name), "%s/%08u.log", files_dir, seq);
+        lfs_remove(&lfs_filesystem, name);
+    }
+    lfs_remove(&lfs_filesystem, files_dir);
+
+    if (esp32_logring_open(dir, segments, segment_bytes, &ring) != SQLITE_OK) {
+        printf("[BENCH]Cannot open log ring %s\n", dir);
+        return;
+    }
+    start = esp_timer_get_time();
+    for (int i = 0; i < lines; i++) {
+        int n = snprintf(line, sizeof(line), "%lld,%.2f,%d\n", 1650000000LL + i, 20 + (i % 100) * 0.1, 40 + i % 7);
+
+        if (esp32_logring_append(ring, line, n) != SQLITE_OK) {
+            printf("[BENCH]Cannot append to log ring %s\n", dir);
+            break;
+        }
+    }
+    esp32_logring_info(ring, &info);
+    esp32_logring_close(ring);
+    ring_us = esp_timer_get_time() - start;
+
+    for (int age = 0; age < info.live; age++) {
+        snprintf(name, sizeof(name), "%s/%08u.log", dir, info.first_seq + age);
+        lfs_remove(&lfs_filesystem, name);
+    }
+    lfs_remove(&lfs_filesystem, dir);
+    snprintf(name, sizeof(name), "%s.manifest", dir);
+    lfs_remove(&lfs_filesystem, name);
+
+    printf("[BENCH]logring %d lines, %d x %u B segments: new files %.1f us/line (%lld ms removing), "
+           "ring %.1f us/line, %u rotations %.1f ms each\n", lines, segments, segment_bytes,
+           (double) files_us / lines, (long long) (remove_us / 1000), (double) ring_us / lines, info.rotations,
+           info.rotations ? (double) info.rotate_us / info.rotations / 1000 : 0.0);
+}
+
+void vfs_benchmark_run_all(void)
+{
+    vfs_benchmark_wal(2000, 1);
+    vfs_benchmark_wal(10000, 100);
+    vfs_benchmark_growth(10000, 100);
+    vfs_benchmark_iocap(200);
+    vfs_benchmark_io_stats(2000);
+    vfs_benchmark_page_size(20000);
+    vfs_benchmark_zip(20000);
+    vfs_benchmark_crypt(256, 4096);
+    vfs_benchmark_pcache(20000);
+    vfs_benchmark_mem(2000);
+    vfs_benchmark_concurrent(5000, 50);
+    vfs_benchmark_sort(1000000);
+    vfs_benchmark_partition(30, 2000, 7);
+    vfs_benchmark_chunk(100000);
+    vfs_benchmark_blob(20, 256);
+    vfs_benchmark_ingest(100000);
+    vfs_benchmark_stmt_cache(30000);
+    vfs_benchmark_profile(30000);
+    vfs_benchmark_logtab(30, 8640);
+    vfs_benchmark_series(86400);
+    vfs_benchmark_logfile(5000);
+    vfs_benchmark_logring(50000, 8);
+}
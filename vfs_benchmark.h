@@ -0,0 +1,175 @@
+//
+// On-target benchmarks for the esp32 sqlite3 VFS over littlefs
+//
+
+#ifndef SD_CARD_VFS_BENCHMARK_H
+#define SD_CARD_VFS_BENCHMARK_H
+
+/**
+ * Sustained insert rate with the RAM rollback journal versus WAL journal mode
+ * @param rows total rows to insert per run
+ * @param batch rows per explicit transaction
+ */
+extern void vfs_benchmark_wal(int rows, int batch);
+
+/**
+ * Insert rate of a database growing page by page against one zero-filled
+ * in 8 KiB chunks (SQLITE_FCNTL_CHUNK_SIZE); run it on the card before
+ * setting CONFIG_SQLITE_VFS_CHUNK_SIZE
+ * @param rows total rows to insert per run
+ * @param batch rows per explicit transaction
+ */
+extern void vfs_benchmark_growth(int rows, int batch);
+
+/**
+ * Syncs and journal bytes per small update transaction, with the device
+ * characteristics hidden (old worst-case reporting) and as now reported
+ * @param txns number of single-row update transactions per run
+ */
+extern void vfs_benchmark_iocap(int txns);
+
+/**
+ * Check that esp32_io_stats returns rows: the files of main and temp
+ * without a constraint, an attached schema when it is named
+ * @param rows rows written to main and to the attached database
+ */
+extern void vfs_benchmark_io_stats(int rows);
+
+/**
+ * Insert rate, point lookup latency and range scan rate for page sizes from
+ * 512 to 8192 bytes, printed as one matrix row per page size, then the
+ * rebuild of an existing database to another page size
+ * @param rows rows in the benchmark table
+ */
+extern void vfs_benchmark_page_size(int rows);
+
+/**
+ * Insert rate, full scan rate and compression ratio of the esp32-zip VFS per
+ * codec, next to the plain esp32 VFS
+ * @param rows rows in the benchmark table
+ */
+extern void vfs_benchmark_zip(int rows);
+
+/**
+ * Page write and read throughput of the esp32-crypt VFS against the plain
+ * esp32 VFS, measured directly on the VFS methods, and a check that a WAL
+ * frame rewritten after a WAL restart gets a new ciphertext
+ * @param pages pages to write and read back
+ * @param page_size bytes per page
+ */
+extern void vfs_benchmark_crypt(int pages, int page_size);
+
+/**
+ * Hit ratio and point lookup latency of the PSRAM page cache for a range of
+ * cache sizes, with a skewed key distribution
+ * @param rows rows in the benchmark table
+ */
+extern void vfs_benchmark_pcache(int rows);
+
+/**
+ * Cost of statement prepare, step and finalize cycles and the high water
+ * marks of the sqlite memory arena. With CONFIG_SQLITE_MEM_ARENA off the
+ * timing is the system malloc baseline and the arena counters stay 0.
+ * @param iterations statement cycles to run
+ */
+extern void vfs_benchmark_mem(int iterations);
+
+/**
+ * Insert rate of a writer task on core 0, alone and with a reader task on
+ * core 1 querying the same database, both in shared WAL mode
+ * @param rows rows inserted per run
+ * @param batch rows per explicit transaction
+ */
+extern void vfs_benchmark_concurrent(int rows, int batch);
+
+/**
+ * ORDER BY over an unindexed column for a range of sorter run sizes, with
+ * the temp file PSRAM use and the bytes spilled to the card
+ * @param rows rows to sort, 1000000 for the reference figure
+ */
+extern void vfs_benchmark_sort(int rows);
+
+/**
+ * Daily retention of a sensor table, one database purged with DELETE
+ * against one partition file per day dropped with lfs_remove
+ * @param periods days to simulate
+ * @param rows rows inserted per day
+ * @param retain days kept, 1 to 10
+ */
+extern void vfs_benchmark_partition(int periods, int rows, int retain);
+
+/**
+ * Insert rate and random lookup latency of a large database through the
+ * plain esp32 VFS and striped over chunk files by esp32-chunk
+ * @param rows 1 KiB rows to insert, 100000 for a database of about 100 MiB
+ */
+extern void vfs_benchmark_chunk(int rows);
+
+/**
+ * Write and read throughput of large captures stored inline as overflow
+ * pages against blob files streamed in 4 KiB pieces
+ * @param count captures to store
+ * @param size_kib size of one capture
+ */
+extern void vfs_benchmark_blob(int count, int size_kib);
+
+/**
+ * Rows per second of one autocommit INSERT per row against the ingest
+ * pipeline with batches of 512 rows, and how full its ring got
+ * @param rows rows pushed through the pipeline
+ */
+extern void vfs_benchmark_ingest(int rows);
+
+/**
+ * Time per statement of a mix of INSERT, SELECT and UPDATE prepared for
+ * every execution against the same statements from esp32_stmt_cache
+ * @param rows statements executed per run
+ */
+extern void vfs_benchmark_stmt_cache(int rows);
+
+/**
+ * Time per statement of the same mix, prepared once, stepped with
+ * sqlite3_step against esp32_profile_step, the cost of the statement
+ * profile when CONFIG_SQLITE_STMT_PROFILE is on. The two runs alternate in
+ * ten rounds, so both see the same table sizes.
+ * @param rows statements executed per run, rounded down to whole rounds
+ */
+extern void vfs_benchmark_profile(int rows);
+
+/**
+ * Query one hour of text logs through the esp32_log virtual table, with
+ * the time range bisected in the files against a scan of every line
+ * @param days log files, one per day
+ * @param rows_per_day lines per file
+ */
+extern void vfs_benchmark_logtab(int days, int rows_per_day);
+
+/**
+ * Bytes per sample and write time of sensor samples as CSV text lines
+ * against an esp32_series segment, and one hour read back from the segment
+ * by time range and by value range
+ * @param samples samples of four channels, one per second
+ */
+extern void vfs_benchmark_series(int samples);
+
+/**
+ * Time per appended log line when the file is opened, written and closed
+ * for every line against esp32_logfile_append with its sync policy
+ * @param lines lines appended per run
+ */
+extern void vfs_benchmark_logfile(int lines);
+
+/**
+ * Time per line and per rotation of an esp32_logring against new files
+ * created per segment with the oldest file removed
+ * @param lines lines appended per run
+ * @param segments segments kept, of 16 KiB each
+ */
+extern void vfs_benchmark_logring(int lines, int segments);
+
+/**
+ * Run every VFS benchmark with its default parameters
+ */
+extern void vfs_benchmark_run_all(void);
+
+#endif //SD_CARD_VFS_BENCHMARK_H